@@ -0,0 +1,330 @@
+/* This file is in the public domain. */
+
+/*
+ *	Parallel batch editing.
+ *
+ * "mg -b script file ..." runs the script once against every file
+ * named on the command line or listed in the file given with -l
+ * ("-" reads the list from stdin).  Arguments containing glob
+ * characters are expanded here, so patterns may be quoted to avoid
+ * the shell's argument limit.
+ *
+ * The parent forks -j workers (default: one per online CPU) which
+ * pull file indices off a shared counter, so a few large files do not
+ * stall a whole shard.  Each worker is a complete editor with its own
+ * pty and buffer list: it reads a file into a fresh buffer, evaluates
+ * the script with that buffer current and, if the buffer was changed,
+ * writes it to a temporary file in the same directory which is then
+ * renamed over the original.  The script is re-read per file but the
+ * interpreter's program cache means each form is only compiled once
+ * per worker.
+ *
+ * Workers report per-file results through a shared mapping; the
+ * parent prints one status line per file on stdout, a summary on
+ * stderr, and exits non-zero if any file failed or a worker died.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <err.h>
+#include <errno.h>
+#include <glob.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "def.h"
+
+#define BATCH_PENDING	0	/* not (yet) processed		*/
+#define BATCH_UNCHANGED	1	/* script ran, buffer untouched */
+#define BATCH_MODIFIED	2	/* script ran, file rewritten	*/
+#define BATCH_FAILED	3	/* read, script or write error	*/
+
+struct bshared {
+	volatile unsigned int	 bs_next;	/* next file to hand out */
+	volatile unsigned char	 bs_status[1];	/* one per file		 */
+};
+
+static int	 batchadd(const char *);
+static void	 batchappend(const char *);
+static int	 batchlist(const char *);
+static int	 batchfile(FILE *, const char *, const char *);
+static int	 batchwrite(struct buffer *);
+static int	 batchreport(int);
+
+static char		**bfiles;	/* files to process		*/
+static unsigned int	  nbfiles;
+static unsigned int	  szbfiles;
+static struct bshared	 *bshared;	/* shared with the workers	*/
+
+/*
+ * Collect the files, fork the workers and wait for them.  Returns
+ * TRUE in each worker, which should then finish initialising the
+ * editor and call batchrun().  The parent never returns.
+ */
+int
+batchstart(const char *list, int argc, char **argv, int jobs)
+{
+	pid_t	pid;
+	size_t	sz;
+	int	i, status, bad = 0;
+
+	for (i = 0; i < argc; i++)
+		if (batchadd(argv[i]) == FALSE)
+			exit(1);
+	if (list != NULL && batchlist(list) == FALSE)
+		exit(1);
+	if (nbfiles == 0) {
+		fprintf(stderr, "%s: no files to process\n", PACKAGE_NAME);
+		exit(1);
+	}
+	if ((unsigned int)jobs > nbfiles)
+		jobs = nbfiles;
+
+	sz = sizeof(struct bshared) + nbfiles;
+	bshared = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_ANON | MAP_SHARED,
+	    -1, 0);
+	if (bshared == MAP_FAILED)
+		err(1, "mmap");
+
+	fflush(stdout);
+	fflush(stderr);
+	for (i = 0; i < jobs; i++) {
+		if ((pid = fork()) == -1) {
+			warn("fork");
+			/* Carry on with the workers we have. */
+			if (i > 0)
+				break;
+			exit(1);
+		}
+		if (pid == 0)
+			return (TRUE);
+	}
+	for (;;) {
+		if (wait(&status) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			bad++;
+	}
+	exit(batchreport(bad));
+}
+
+/*
+ * Worker main loop.  Returns the process exit status.
+ */
+int
+batchrun(const char *script)
+{
+	FILE		*ffp;
+	unsigned int	 i;
+
+	if (ffropen(&ffp, script, NULL) != FIOSUC)
+		return (1);
+	undo_enable(FFRAND, 0);		/* nobody will ever undo */
+	while ((i = __sync_fetch_and_add(&bshared->bs_next, 1)) < nbfiles) {
+		rewind(ffp);
+		bshared->bs_status[i] = batchfile(ffp, script, bfiles[i]);
+	}
+	ffclose(ffp, NULL);
+	return (0);
+}
+
+/*
+ * Run the script on one file.
+ */
+static int
+batchfile(FILE *ffp, const char *script, const char *fn)
+{
+	struct buffer	*bp, *obp;
+	struct stat	 sb, nsb;
+	char		 fname[NFILEN], *adjf;
+	int		 s;
+
+	if ((adjf = adjustname(fn, FALSE)) == NULL ||
+	    stat(adjf, &sb) == -1 || !S_ISREG(sb.st_mode))
+		return (BATCH_FAILED);
+	(void)strlcpy(fname, adjf, sizeof(fname));
+	if ((bp = findbuffer(fname)) == NULL)
+		return (BATCH_FAILED);
+	curbp = bp;
+	if (showbuffer(bp, curwp, WFFULL) != TRUE ||
+	    readin(fname) != TRUE) {
+		bp->b_flag &= ~BFCHG;
+		killbuffer(bp);
+		return (BATCH_FAILED);
+	}
+
+	s = load(ffp, script) == TRUE ? BATCH_UNCHANGED : BATCH_FAILED;
+
+	/* The script may have killed or switched away from the buffer. */
+	for (obp = bheadp; obp != NULL && obp != bp; obp = obp->b_bufp)
+		;
+	if (obp == NULL)
+		return (BATCH_FAILED);
+	if (s == BATCH_UNCHANGED && (bp->b_flag & BFCHG)) {
+		/* Compressed files are read through a pipe; leave them. */
+		if ((bp->b_flag & BFIGNDIRTY) || batchwrite(bp) != TRUE)
+			s = BATCH_FAILED;
+		else
+			s = BATCH_MODIFIED;
+	}
+	/* The script may have saved the buffer itself. */
+	if (s == BATCH_UNCHANGED && stat(fname, &nsb) == 0 &&
+	    (nsb.st_ino != sb.st_ino || nsb.st_size != sb.st_size ||
+	    nsb.st_mtim.tv_sec != sb.st_mtim.tv_sec ||
+	    nsb.st_mtim.tv_nsec != sb.st_mtim.tv_nsec))
+		s = BATCH_MODIFIED;
+	bp->b_flag &= ~BFCHG;
+	killbuffer(bp);
+	return (s);
+}
+
+/*
+ * Write the buffer to a temporary file next to the original and
+ * rename it into place, so readers only ever see the old or the new
+ * contents.  The buffer name has had symbolic links resolved by
+ * adjustname(), so links are followed rather than replaced.
+ */
+static int
+batchwrite(struct buffer *bp)
+{
+	FILE	*ffp;
+	char	 tmp[NFILEN];
+	int	 fd;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.mgXXXXXX", bp->b_fname) >=
+	    (int)sizeof(tmp))
+		return (FALSE);
+	if ((fd = mkstemp(tmp)) == -1)
+		return (FALSE);
+	if ((ffp = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		(void)unlink(tmp);
+		return (FALSE);
+	}
+	if (bp->b_fi.fi_mode) {
+		(void)fchmod(fd, bp->b_fi.fi_mode & 07777);
+		(void)fchown(fd, bp->b_fi.fi_uid, bp->b_fi.fi_gid);
+	}
+	if (ffputbuf(ffp, bp, FALSE) != FIOSUC) {
+		(void)fclose(ffp);
+		(void)unlink(tmp);
+		return (FALSE);
+	}
+	if (ffclose(ffp, NULL) != FIOSUC || rename(tmp, bp->b_fname) == -1) {
+		(void)unlink(tmp);
+		return (FALSE);
+	}
+	return (TRUE);
+}
+
+/*
+ * Add a file name, or the files matching a glob pattern.
+ */
+static int
+batchadd(const char *pat)
+{
+	glob_t	 g;
+	size_t	 i;
+
+	if (strpbrk(pat, "*?[") == NULL) {
+		batchappend(pat);
+		return (TRUE);
+	}
+	memset(&g, 0, sizeof(g));
+	if (glob(pat, GLOB_NOCHECK, NULL, &g) != 0) {
+		fprintf(stderr, "%s: %s: bad pattern\n", PACKAGE_NAME, pat);
+		globfree(&g);
+		return (FALSE);
+	}
+	for (i = 0; i < g.gl_pathc; i++)
+		batchappend(g.gl_pathv[i]);
+	globfree(&g);
+	return (TRUE);
+}
+
+static void
+batchappend(const char *fn)
+{
+	char	**nf;
+
+	if (nbfiles == szbfiles) {
+		nf = reallocarray(bfiles, szbfiles + 256, sizeof(*bfiles));
+		if (nf == NULL)
+			err(1, NULL);
+		bfiles = nf;
+		szbfiles += 256;
+	}
+	if ((bfiles[nbfiles++] = strdup(fn)) == NULL)
+		err(1, NULL);
+}
+
+/*
+ * Read file names (or patterns), one per line.
+ */
+static int
+batchlist(const char *list)
+{
+	FILE	*fp;
+	char	*line = NULL;
+	size_t	 linesize = 0;
+	ssize_t	 len;
+	int	 s = TRUE;
+
+	if (strcmp(list, "-") == 0)
+		fp = stdin;
+	else if ((fp = fopen(list, "r")) == NULL) {
+		warn("%s", list);
+		return (FALSE);
+	}
+	while (s == TRUE && (len = getline(&line, &linesize, fp)) != -1) {
+		if (len > 0 && line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (len > 0)
+			s = batchadd(line);
+	}
+	free(line);
+	if (ferror(fp)) {
+		warn("%s", list);
+		s = FALSE;
+	}
+	if (fp != stdin)
+		fclose(fp);
+	return (s);
+}
+
+/*
+ * Print the per-file results and a summary, and return the exit status.
+ */
+static int
+batchreport(int bad)
+{
+	static const char *const names[] = {
+		"skipped", "unchanged", "modified", "failed"
+	};
+	unsigned int	 i, count[4];
+
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < nbfiles; i++) {
+		count[bshared->bs_status[i]]++;
+		printf("%s\t%s\n", names[bshared->bs_status[i]], bfiles[i]);
+	}
+	fflush(stdout);
+	fprintf(stderr, "%s: %u files: %u modified, %u unchanged, %u failed",
+	    PACKAGE_NAME, nbfiles, count[BATCH_MODIFIED],
+	    count[BATCH_UNCHANGED], count[BATCH_FAILED]);
+	if (count[BATCH_PENDING])
+		fprintf(stderr, ", %u skipped", count[BATCH_PENDING]);
+	if (bad)
+		fprintf(stderr, " (%d worker%s failed)", bad,
+		    bad == 1 ? "" : "s");
+	fputc('\n', stderr);
+	return (count[BATCH_FAILED] || count[BATCH_PENDING] || bad);
+}
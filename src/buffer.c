@@ -21,6 +21,9 @@
 
 static struct buffer  *makelist(void);
 static struct buffer *bnew(const char *);
+static void	bcleared(struct buffer *);
+static void	brecount(struct buffer *);
+static int	clonebuf(int);
 
 static int usebufname(const char *);
 
@@ -215,9 +218,30 @@ killbuffer(struct buffer *bp)
 	struct buffer *bp1;
 	struct buffer *bp2;
 	struct mgwin  *wp;
+	struct line   *lp;
 	int s;
 	struct undo_rec *rec;
 
+	/* An indirect buffer leaves the text to the others sharing it. */
+	if (bp->b_base != NULL) {
+		if ((lp = lalloc(0)) == NULL)
+			return (FALSE);
+		lp->l_fp = lp->l_bp = lp;
+		bp->b_headp = bp->b_dotp = lp;
+		bp->b_markp = NULL;
+		bp->b_flag &= ~BFCHG;
+		bp->b_base = NULL;
+	}
+	/* Indirect buffers go when the buffer they show is killed. */
+	for (bp1 = bheadp; bp1 != NULL; ) {
+		if (bp1->b_base == bp) {
+			if ((s = killbuffer(bp1)) != TRUE)
+				return (s);
+			bp1 = bheadp;
+		} else
+			bp1 = bp1->b_bufp;
+	}
+
 	/*
 	 * Find some other buffer to display. Try the alternate buffer,
 	 * then the first different buffer in the buffer list.  If there's
@@ -286,6 +310,7 @@ killbuffer(struct buffer *bp)
 		free_undo_record(rec);
 	}
 
+	free(bp->b_lidx);			/* Release line index	 */
 	free(bp->b_bname);			/* Release name block	 */
 	free(bp);				/* Release buffer block */
 
@@ -509,7 +534,7 @@ addlinef(struct buffer *bp, char *fmt, ...)
 	lp->l_bp = bp->b_headp->l_bp;
 	bp->b_headp->l_bp = lp;
 	lp->l_fp = bp->b_headp;
-	bp->b_lines++;
+	lcount(bp, 1);
 
 	return (TRUE);
 }
@@ -656,6 +681,8 @@ bnew(const char *bname)
 int
 bclear(struct buffer *bp)
 {
+	struct buffer	*obp;
+	struct mgwin	*wp;
 	struct line	*lp;
 	int		 s;
 
@@ -663,17 +690,83 @@ bclear(struct buffer *bp)
 	if (!(bp->b_flag & BFIGNDIRTY) && (bp->b_flag & BFCHG) != 0 &&
 	    (s = eyesno("Buffer modified; kill anyway")) != TRUE)
 		return (s);
-	bp->b_flag &= ~BFCHG;	/* Not changed		 */
+	bwiden(bp);
 	while ((lp = lforw(bp->b_headp)) != bp->b_headp)
 		lfree(lp);
+	/* Buffers sharing the text are left empty too. */
+	for (obp = bheadp; obp != NULL; obp = obp->b_bufp) {
+		if (obp->b_headp != bp->b_headp || obp == bp)
+			continue;
+		bcleared(obp);
+		for (wp = wheadp; wp != NULL; wp = wp->w_wndp) {
+			if (wp->w_bufp != obp)
+				continue;
+			wp->w_dotp = wp->w_linep = obp->b_headp;
+			wp->w_doto = 0;
+			wp->w_markp = NULL;
+			wp->w_marko = 0;
+			wp->w_dotline = wp->w_markline = 1;
+			wp->w_rflag |= WFFULL | WFMODE;
+		}
+	}
+	bcleared(bp);
+
+	return (TRUE);
+}
+
+/*
+ * Reset what bclear() leaves behind in a buffer whose lines are gone.
+ */
+static void
+bcleared(struct buffer *bp)
+{
+	bp->b_flag &= ~BFCHG;	/* Not changed		 */
+	if (bp->b_freedata != NULL)	/* Describes the old lines */
+		(*bp->b_freedata)(bp);
+	bp->b_data = NULL;
+	bp->b_freedata = NULL;
+	bp->b_editline = 0;
+	bp->b_lidxvalid = 0;
 	bp->b_dotp = bp->b_headp;	/* Fix dot */
 	bp->b_doto = 0;
 	bp->b_markp = NULL;	/* Invalidate "mark"	 */
 	bp->b_marko = 0;
 	bp->b_dotline = bp->b_markline = 1;
 	bp->b_lines = 1;
+}
 
-	return (TRUE);
+/*
+ * Return TRUE if another buffer shares the text of bp.
+ */
+int
+bsharing(struct buffer *bp)
+{
+	struct buffer	*obp;
+
+	for (obp = bheadp; obp != NULL; obp = obp->b_bufp)
+		if (obp->b_headp == bp->b_headp && obp != bp)
+			return (TRUE);
+	return (FALSE);
+}
+
+/*
+ * Mark bp as unchanged, along with the buffers sharing its text unless
+ * they are visiting some other file.
+ */
+void
+bunchanged(struct buffer *bp)
+{
+	struct buffer	*obp;
+	struct mgwin	*wp;
+
+	bp->b_flag &= ~BFCHG;
+	for (obp = bheadp; obp != NULL; obp = obp->b_bufp)
+		if (obp->b_headp == bp->b_headp && (obp->b_fname[0] == '\0' ||
+		    strcmp(obp->b_fname, bp->b_fname) == 0))
+			obp->b_flag &= ~BFCHG;
+	for (wp = wheadp; wp != NULL; wp = wp->w_wndp)
+		if (wp->w_bufp->b_headp == bp->b_headp)
+			wp->w_rflag |= WFMODE;
 }
 
 /*
@@ -709,6 +802,8 @@ showbuffer(struct buffer *bp, struct mgwin *wp, int flags)
 	wp->w_bufp = bp;
 
 	if (bp->b_nwnd++ == 0) {	/* First use.		 */
+		if (bsharing(bp))
+			brecount(bp);
 		wp->w_dotp = bp->b_dotp;
 		wp->w_doto = bp->b_doto;
 		wp->w_markp = bp->b_markp;
@@ -732,6 +827,27 @@ showbuffer(struct buffer *bp, struct mgwin *wp, int flags)
 	return (TRUE);
 }
 
+/*
+ * Recount the line numbers of dot and mark.  Lines added or removed
+ * through a buffer sharing the text move b_dotp and b_markp along,
+ * but not the line numbers kept with them while bp was not shown.
+ */
+static void
+brecount(struct buffer *bp)
+{
+	struct line	*lp;
+	int		 n;
+
+	for (lp = bfirstlp(bp), n = 1; ; lp = lforw(lp), n++) {
+		if (lp == bp->b_dotp)
+			bp->b_dotline = n;
+		if (lp == bp->b_markp)
+			bp->b_markline = n;
+		if (lp == bp->b_headp)
+			break;
+	}
+}
+
 /*
  * Augment a buffer name with a number, if necessary
  *
@@ -1111,3 +1227,95 @@ findbuffer(char *fn)
 	bp = bfind(bname, TRUE);
 	return (bp);
 }
+
+/*
+ * Show the text of the current buffer in a new buffer, in another
+ * window.  The lines themselves are shared, so a change made in either
+ * buffer shows up in both and the new one costs no more than its
+ * header; dot, mark and modes are its own.
+ */
+int
+cloneindirect(int f, int n)
+{
+	return (clonebuf(TRUE));
+}
+
+/*
+ * Copy the current buffer to a new buffer, in another window.  The two
+ * are independent, but their lines share text until one of them is
+ * changed, so only the lines that are edited are ever copied.
+ */
+int
+clonebuffer(int f, int n)
+{
+	return (clonebuf(FALSE));
+}
+
+static int
+clonebuf(int indirect)
+{
+	struct buffer	*bp;
+	struct line	*lp, *nlp;
+	struct mgwin	*wp;
+	char		 name[NBUFN], bname[NBUFN], *cp;
+	size_t		 len;
+	int		 i;
+
+	if (curbp->b_narrow != NULL)
+		return (dobeep_msg("Buffer is narrowed"));
+	if (curbp->b_nmodes > 0 && curbp->b_modes[1] == name_mode("dired"))
+		return (dobeep_msg("Can't clone a dired buffer"));
+
+	/* Clones of "foo" and of "foo<2>" are both "foo<n>". */
+	(void)strlcpy(name, curbp->b_bname, sizeof(name));
+	if ((cp = strrchr(name, '<')) != NULL && cp > name &&
+	    (len = strspn(cp + 1, "0123456789")) > 0 &&
+	    strcmp(cp + 1 + len, ">") == 0)
+		*cp = '\0';
+	if (augbname(bname, name, sizeof(bname)) == FALSE ||
+	    (bp = bfind(bname, TRUE)) == NULL)
+		return (FALSE);
+
+	if (indirect) {
+		free(bp->b_headp);
+		bp->b_headp = curbp->b_headp;
+		bp->b_base = curbp->b_base != NULL ? curbp->b_base : curbp;
+		bp->b_dotp = curwp->w_dotp;
+		bp->b_markp = curwp->w_markp;
+	} else {
+		for (lp = bfirstlp(curbp); lp != curbp->b_headp;
+		    lp = lforw(lp)) {
+			if ((nlp = lclone(lp)) == NULL) {
+				(void)killbuffer(bp);
+				return (dobeep_msg("Out of memory"));
+			}
+			nlp->l_bp = lback(bp->b_headp);
+			nlp->l_fp = bp->b_headp;
+			lback(bp->b_headp)->l_fp = nlp;
+			bp->b_headp->l_bp = nlp;
+			if (lp == curwp->w_dotp)
+				bp->b_dotp = nlp;
+			if (lp == curwp->w_markp)
+				bp->b_markp = nlp;
+		}
+	}
+	bp->b_doto = curwp->w_doto;
+	bp->b_marko = curwp->w_marko;
+	bp->b_dotline = curwp->w_dotline;
+	bp->b_markline = curwp->w_markline;
+	bp->b_lines = curbp->b_lines;
+	bp->b_flag = curbp->b_flag & ~(BFBAK | BFDIRTY);
+	bp->b_nmodes = curbp->b_nmodes;
+	for (i = 0; i <= curbp->b_nmodes; i++)
+		bp->b_modes[i] = curbp->b_modes[i];
+	bp->b_tabw = curbp->b_tabw;
+	bp->b_nlseq = curbp->b_nlseq;
+	bp->b_nlchr = curbp->b_nlchr;
+	(void)strlcpy(bp->b_cwd, curbp->b_cwd, sizeof(bp->b_cwd));
+
+	if ((wp = popbuf(bp, WNONE)) == NULL)
+		return (FALSE);
+	curbp = bp;
+	curwp = wp;
+	return (TRUE);
+}
@@ -0,0 +1,1160 @@
+/* This file is in the public domain. */
+
+/*
+ *	Built-in C symbol index.
+ *
+ * find-tag works without ctags(1): when no tags file is loaded and
+ * there is no "tags" file to offer, the current buffer's project is
+ * indexed and the index is used as a tags file.  The project root is
+ * the nearest directory up from the buffer holding an index or a
+ * version control directory.  Without one, the user is asked before
+ * the buffer's own directory is indexed.
+ *
+ * The index, CIDXFN in the root, is an ordinary sorted tags(5) file
+ * with extension fields, so tags.c binary searches it in place and
+ * jumps straight to the recorded line.  It also lists every indexed
+ * file with its modification time and size, so a refresh only parses
+ * the files that changed.
+ *
+ * Indexing runs in a child process which forks one worker per CPU to
+ * parse files, merges their output with the unchanged part of the old
+ * index and renames the result into place.  The editor only learns
+ * that it finished: tags.c maps the new file before its next lookup.
+ * The first build of a project is waited for; later refreshes, one
+ * when the index is first used and one for each C file saved under
+ * the root, run in the background.
+ *
+ * Definitions are found by a small scanner that knows enough C to skip
+ * comments, literals, preprocessor lines, function bodies and all but
+ * the first branch of a conditional: functions, macros, structures,
+ * unions, enumerations and typedefs.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "def.h"
+
+#define CIFILE		"!_MG_FILE"	/* pseudo-tag recording a file	  */
+#define CIMAXWORKERS	16
+#define CIMAXIF		32		/* #if nesting we keep track of	  */
+
+/* Tokens. */
+#define CT_EOF		0
+#define CT_IDENT	1
+#define CT_PUNCT	2
+#define CT_OTHER	3		/* number, string or character	  */
+
+/* States of an #if level. */
+#define CI_ACTIVE	0		/* this branch is being read	  */
+#define CI_ZERO		1		/* in "#if 0"			  */
+#define CI_DONE		2		/* a branch was read; skip rest	  */
+
+/* Indexed files. */
+#define CF_KEEP		0		/* unchanged, keep its tags	  */
+#define CF_PARSE	1		/* new or changed		  */
+#define CF_DROP		2		/* gone				  */
+
+struct ctok {
+	int		 ct_type;
+	int		 ct_c;		/* the character, for CT_PUNCT	*/
+	const char	*ct_s;		/* the text, for CT_IDENT	*/
+	size_t		 ct_len;
+	int		 ct_line;
+	const char	*ct_bol;	/* start of its line		*/
+};
+
+struct cscan {
+	const char	*cs_p;
+	const char	*cs_end;
+	const char	*cs_bol;
+	int		 cs_line;
+	int		 cs_linestart;	/* only blanks so far on line	*/
+	int		 cs_nif;	/* #if nesting			*/
+	unsigned char	 cs_if[CIMAXIF];
+	const char	*cs_path;
+	FILE		*cs_out;
+};
+
+struct cfile {
+	char		*cf_path;	/* relative to the root		*/
+	time_t		 cf_sec;
+	long		 cf_nsec;
+	off_t		 cf_size;
+	int		 cf_state;
+};
+
+struct cline {
+	const char	*cl_p;
+	size_t		 cl_len;
+};
+
+static int	 ciproject(const char *, char *, size_t);
+static int	 cistart(const char *, const char *);
+static void	 ciinput(int);
+static int	 ciend(void);
+static int	 ciwait(void);
+static __dead void ciindexer(const char *, const char *, int);
+static void	 ciwalk(const char *);
+static void	 ciaddfile(const char *, const struct stat *, int);
+static void	 cisetfile(struct cfile *, const struct stat *, int);
+static int	 cistale(void);
+static void	 ciparseall(int);
+static void	 ciparsefile(const char *, FILE *);
+static void	 ciaddlines(const char *, size_t);
+static void	 ciaddline(const char *, size_t);
+static int	 ciwrite(void);
+static int	 cifilecmp(const void *, const void *);
+static int	 cilinecmp(const void *, const void *);
+static struct cfile *cifind(const char *, size_t);
+static void	*cigrow(void *, size_t *, size_t, size_t);
+static void	 cscan(struct cscan *);
+static int	 ctoken(struct cscan *, struct ctok *);
+static void	 cskip(struct cscan *);
+static void	 cppline(struct cscan *);
+static int	 cskipping(const struct cscan *);
+static int	 cnotname(const struct ctok *);
+static int	 ciskw(const struct ctok *, const char *);
+static void	 cemit(struct cscan *, const struct ctok *, int);
+
+/* The running indexer, as seen by the editor. */
+static pid_t		 cipid = -1;
+static int		 cifd = -1;
+static int		 cicount;		/* files parsed so far	*/
+static int		 cidone;		/* ... by the last run	*/
+static char		 ciroot[NFILEN];	/* root it is indexing	*/
+static char		 cipending[NFILEN];	/* root to refresh next	*/
+static char		 cirefreshed[NFILEN];	/* refreshed this session */
+
+/* The indexer's state. */
+static struct cfile	*cifiles;
+static size_t		 cinfiles, cszfiles;
+static size_t		 cinsorted;		/* sorted part of cifiles */
+static struct cline	*cilines;
+static size_t		 cinlines, cszlines;
+static int		 cichanged;
+
+/*
+ * Find or build the index for the current buffer's project and copy
+ * its name to idx.  A missing index is built while the user waits;
+ * an existing one is used at once and refreshed in the background,
+ * once per session.
+ */
+int
+cindex(char *idx, size_t len)
+{
+	struct stat	 sb;
+	char		 dir[NFILEN], root[NFILEN], prompt[NFILEN + 32];
+	int		 s;
+
+	if (getbufcwd(dir, sizeof(dir)) == FALSE)
+		return (dobeep_msg("No directory to index"));
+	if (ciproject(dir, root, sizeof(root)) == FALSE) {
+		if (root[0] == '\0')
+			return (dobeep_msg("Path too long"));
+		/* Don't index a whole home directory unasked. */
+		(void)snprintf(prompt, sizeof(prompt),
+		    "No project root found, index %s", root);
+		if ((s = eyorn(prompt)) != TRUE)
+			return (s);
+	}
+	if (snprintf(idx, len, "%s/%s", root, CIDXFN) >= (int)len)
+		return (dobeep_msg("Path too long"));
+
+	if (stat(idx, &sb) == 0) {
+		if (strcmp(cirefreshed, root) == 0)
+			return (TRUE);
+		if (cipid == -1)
+			(void)cistart(root, NULL);
+		else if (strcmp(ciroot, root) != 0)
+			(void)strlcpy(cipending, root, sizeof(cipending));
+		return (TRUE);
+	}
+
+	/* Let a refresh of some other project finish first. */
+	while (cipid != -1 && strcmp(ciroot, root) != 0)
+		if ((s = ciwait()) != TRUE)
+			return (s);
+	if (cipid == -1 && (s = cistart(root, NULL)) != TRUE)
+		return (s);
+	if (cipid != -1 && (s = ciwait()) != TRUE)
+		return (s);
+	if (stat(idx, &sb) == -1)
+		return (dobeep_msgs("Indexing failed:", root));
+	ewprintf("Indexed %d file%s in %s", cidone, cidone == 1 ? "" : "s",
+	    root);
+	return (TRUE);
+}
+
+/*
+ * A file was written.  If it is a C file in an indexed project, bring
+ * its entries up to date.
+ */
+void
+cindexsaved(const char *fn)
+{
+	struct stat	 sb;
+	char		 dir[NFILEN], root[NFILEN], idx[NFILEN];
+	size_t		 len;
+
+	if (fnmatch("*.[chy]", fn, 0) != 0 ||
+	    xdirname(dir, fn, sizeof(dir)) >= sizeof(dir) || dir[0] == '\0' ||
+	    ciproject(dir, root, sizeof(root)) == FALSE ||
+	    snprintf(idx, sizeof(idx), "%s/%s", root, CIDXFN) >=
+	    (int)sizeof(idx) || stat(idx, &sb) == -1)
+		return;
+	len = strlen(root);
+	if (strncmp(fn, root, len) != 0 || fn[len] != '/')
+		return;
+	if (cipid != -1) {
+		/* A full refresh afterwards will catch this file. */
+		(void)strlcpy(cipending, root, sizeof(cipending));
+		return;
+	}
+	(void)cistart(root, fn + len + 1);
+}
+
+/*
+ * The root of the project containing directory dir: the nearest
+ * directory up from it with an index or a version control directory.
+ * If there is none, returns FALSE with dir itself in root, or an
+ * empty root if a name is too long.
+ */
+static int
+ciproject(const char *dir, char *root, size_t len)
+{
+	static const char *const marks[] = {
+		CIDXFN, ".git", ".got", ".hg", ".svn", NULL
+	};
+	char		 path[NFILEN], probe[NFILEN];
+	char		*cp;
+	int		 i;
+
+	if (strlcpy(root, dir, len) >= len ||
+	    strlcpy(path, dir, sizeof(path)) >= sizeof(path)) {
+		root[0] = '\0';
+		return (FALSE);
+	}
+	/* getbufcwd() leaves a trailing slash. */
+	for (cp = root + strlen(root); cp > root + 1 && cp[-1] == '/'; cp--)
+		cp[-1] = '\0';
+	for (cp = path + strlen(path); cp > path + 1 && cp[-1] == '/'; cp--)
+		cp[-1] = '\0';
+	for (;;) {
+		for (i = 0; marks[i] != NULL; i++) {
+			if (snprintf(probe, sizeof(probe), "%s/%s",
+			    path[1] == '\0' ? "" : path, marks[i]) >=
+			    (int)sizeof(probe))
+				continue;
+			if (access(probe, F_OK) == 0)
+				return (strlcpy(root, path, len) < len);
+		}
+		if ((cp = strrchr(path, '/')) == NULL || cp == path)
+			break;
+		*cp = '\0';
+	}
+	return (FALSE);
+}
+
+/*
+ * Start indexing root: the whole tree, or just file if it is not NULL.
+ */
+static int
+cistart(const char *root, const char *file)
+{
+	int	fds[2];
+
+	if (pipe(fds) == -1)
+		return (dobeep_msgs("Can't create pipe:", strerror(errno)));
+	if ((cipid = fork()) == -1) {
+		close(fds[0]);
+		close(fds[1]);
+		return (dobeep_msg("Can't fork"));
+	}
+	if (cipid == 0) {
+		close(fds[0]);
+		ciindexer(root, file, fds[1]);
+	}
+	close(fds[1]);
+	(void)fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	(void)fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL, 0) | O_NONBLOCK);
+	cifd = fds[0];
+	cicount = 0;
+	(void)strlcpy(ciroot, root, sizeof(ciroot));
+	if (file == NULL)
+		(void)strlcpy(cirefreshed, root, sizeof(cirefreshed));
+	/* With no slot free, wait for it now. */
+	if (ttwatch(cifd, ciinput) == FALSE)
+		return (ciwait());
+	return (TRUE);
+}
+
+/*
+ * The indexer writes a byte for every file parsed and closes the pipe
+ * when it is done.
+ */
+static void
+ciinput(int fd)
+{
+	char	buf[512];
+	ssize_t	n;
+
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		cicount += n;
+	if (n == 0 || (errno != EAGAIN && errno != EINTR))
+		(void)ciend();
+}
+
+/*
+ * Collect the indexer and start any refresh that was put off.
+ * Returns TRUE if it succeeded.
+ */
+static int
+ciend(void)
+{
+	char	root[NFILEN];
+	int	status = 0, s = TRUE;
+
+	(void)ttwatch(cifd, NULL);
+	close(cifd);
+	while (waitpid(cipid, &status, 0) == -1 && errno == EINTR)
+		;
+	cipid = -1;
+	cifd = -1;
+	cidone = cicount;
+	/* Report on this run before a pending one replaces ciroot. */
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		s = dobeep_msgs("Indexing failed:", ciroot);
+	if (cipending[0] != '\0') {
+		(void)strlcpy(root, cipending, sizeof(root));
+		cipending[0] = '\0';
+		(void)cistart(root, NULL);
+	}
+	return (s);
+}
+
+/*
+ * Wait for the indexer, showing progress.  C-g stops it.
+ */
+static int
+ciwait(void)
+{
+	struct pollfd	 pfd[2];
+	struct timespec	 now, last = { 0, 0 };
+	char		 root[NFILEN];
+	int		 c, nfds = 2;
+
+	(void)strlcpy(root, ciroot, sizeof(root));
+	pfd[0].fd = cifd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = STDIN_FILENO;
+	pfd[1].events = POLLIN;
+	while (cipid != -1 && strcmp(ciroot, root) == 0) {
+		if (poll(pfd, nfds, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			return (dobeep_msg("poll error"));
+		}
+		/* Keep any other key, and only the first; see d_runjobs(). */
+		if (nfds == 2 && (pfd[1].revents & POLLIN)) {
+			nfds = 1;
+			if ((c = getkey(FALSE)) != CCHR('G'))
+				ungetkey(c);
+			else {
+				/* The indexer leads a group with its workers */
+				(void)kill(-cipid, SIGTERM);
+				cipending[0] = '\0';
+				(void)ciend();
+				ewprintf("Indexing stopped");
+				return (ABORT);
+			}
+		}
+		if (pfd[0].revents & (POLLIN | POLLHUP)) {
+			ciinput(cifd);
+			pfd[0].fd = cifd;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if ((now.tv_sec - last.tv_sec) * 1000 +
+		    (now.tv_nsec - last.tv_nsec) / 1000000 >= 100) {
+			ewprintf("Indexing %s: %d files (C-g to stop)", root,
+			    cicount);
+			last = now;
+		}
+	}
+	return (TRUE);
+}
+
+/*
+ * The indexer process.  It must not touch the display.
+ */
+static __dead void
+ciindexer(const char *root, const char *file, int fd)
+{
+	struct stat	 sb;
+	struct cfile	*cf;
+	size_t		 i;
+	int		 idx;
+
+	(void)setpgid(0, 0);
+	/* Finish even if the editor goes away. */
+	(void)signal(SIGPIPE, SIG_IGN);
+	if (chdir(root) == -1)
+		_exit(1);
+
+	/* Read the old index, if any; the lines point into it. */
+	if ((idx = open(CIDXFN, O_RDONLY | O_CLOEXEC)) != -1) {
+		char	*buf;
+		ssize_t	 n;
+		size_t	 off = 0;
+
+		if (fstat(idx, &sb) == -1 ||
+		    (buf = malloc(sb.st_size + 1)) == NULL)
+			_exit(1);
+		while (off < (size_t)sb.st_size &&
+		    (n = read(idx, buf + off, sb.st_size - off)) > 0)
+			off += n;
+		close(idx);
+		ciaddlines(buf, off);
+	} else
+		cichanged = 1;
+	qsort(cifiles, cinfiles, sizeof(*cifiles), cifilecmp);
+	cinsorted = cinfiles;
+
+	if (file == NULL) {
+		/* Take the files from the tree, not the old index. */
+		for (i = 0; i < cinfiles; i++)
+			cifiles[i].cf_state = CF_DROP;
+		ciwalk(".");
+	} else if ((cf = cifind(file, strlen(file))) != NULL) {
+		if (lstat(file, &sb) == -1 || !S_ISREG(sb.st_mode))
+			cf->cf_state = CF_DROP;
+		else
+			cisetfile(cf, &sb, CF_PARSE);
+	} else if (lstat(file, &sb) == 0 && S_ISREG(sb.st_mode))
+		ciaddfile(file, &sb, CF_PARSE);
+	qsort(cifiles, cinfiles, sizeof(*cifiles), cifilecmp);
+	cinsorted = cinfiles;
+
+	if (cistale())
+		ciparseall(fd);
+	if (cichanged && ciwrite() == FALSE)
+		_exit(1);
+	_exit(0);
+}
+
+/*
+ * Split the text of an index or a worker's output into lines.  File
+ * records become entries in cifiles, marked to be kept.
+ */
+static void
+ciaddlines(const char *buf, size_t len)
+{
+	struct stat	 sb;
+	const char	*p, *q, *end = buf + len, *t1, *t2;
+	char		*path, *ep;
+
+	for (p = buf; p < end; p = q + 1) {
+		if ((q = memchr(p, '\n', end - p)) == NULL)
+			q = end;
+		if (q == p || strncmp(p, "!_TAG_", 6) == 0)
+			continue;
+		if (strncmp(p, CIFILE "\t", sizeof(CIFILE)) != 0) {
+			ciaddline(p, q - p);
+			continue;
+		}
+		/* !_MG_FILE path sec.nsec size */
+		t1 = p + sizeof(CIFILE);
+		if ((t2 = memchr(t1, '\t', q - t1)) == NULL ||
+		    (path = strndup(t1, t2 - t1)) == NULL)
+			continue;
+		memset(&sb, 0, sizeof(sb));
+		sb.st_mtim.tv_sec = strtoll(t2 + 1, &ep, 10);
+		if (*ep == '.')
+			sb.st_mtim.tv_nsec = strtol(ep + 1, &ep, 10);
+		if (*ep == '\t')
+			sb.st_size = strtoll(ep + 1, &ep, 10);
+		ciaddfile(path, &sb, CF_KEEP);
+		free(path);
+	}
+}
+
+static void
+ciaddline(const char *p, size_t len)
+{
+	cilines = cigrow(cilines, &cszlines, cinlines, sizeof(*cilines));
+	cilines[cinlines].cl_p = p;
+	cilines[cinlines++].cl_len = len;
+}
+
+/*
+ * Record a file not yet known.
+ */
+static void
+ciaddfile(const char *path, const struct stat *sb, int state)
+{
+	cifiles = cigrow(cifiles, &cszfiles, cinfiles, sizeof(*cifiles));
+	if ((cifiles[cinfiles].cf_path = strdup(path)) == NULL)
+		_exit(1);
+	cisetfile(&cifiles[cinfiles++], sb, state);
+}
+
+static void
+cisetfile(struct cfile *cf, const struct stat *sb, int state)
+{
+	cf->cf_sec = sb->st_mtim.tv_sec;
+	cf->cf_nsec = sb->st_mtim.tv_nsec;
+	cf->cf_size = sb->st_size;
+	cf->cf_state = state;
+}
+
+/*
+ * Find a file among those sorted so far.
+ */
+static struct cfile *
+cifind(const char *path, size_t len)
+{
+	struct cfile	 key;
+	char		 buf[NFILEN];
+
+	if (len >= sizeof(buf) || cinsorted == 0)
+		return (NULL);
+	memcpy(buf, path, len);
+	buf[len] = '\0';
+	key.cf_path = buf;
+	return (bsearch(&key, cifiles, cinsorted, sizeof(*cifiles),
+	    cifilecmp));
+}
+
+/*
+ * Add the C files below dir, skipping hidden names and symbolic links.
+ */
+static void
+ciwalk(const char *dir)
+{
+	struct stat	 sb;
+	struct dirent	*dp;
+	struct cfile	*cf;
+	DIR		*dirp;
+	char		 path[NFILEN];
+	int		 isdir;
+
+	if ((dirp = opendir(dir)) == NULL)
+		return;
+	while ((dp = readdir(dirp)) != NULL) {
+		if (dp->d_name[0] == '.' || strpbrk(dp->d_name, "\t\n"))
+			continue;
+		if (snprintf(path, sizeof(path), "%s/%s", dir, dp->d_name) >=
+		    (int)sizeof(path))
+			continue;
+#ifdef DT_DIR
+		if (dp->d_type == DT_LNK)
+			continue;
+		isdir = dp->d_type == DT_DIR;
+		if (dp->d_type != DT_UNKNOWN && !isdir &&
+		    fnmatch("*.[chy]", dp->d_name, 0) != 0)
+			continue;
+#endif
+		if (lstat(path, &sb) == -1)
+			continue;
+		isdir = S_ISDIR(sb.st_mode);
+		if (isdir) {
+			ciwalk(path);
+			continue;
+		}
+		if (!S_ISREG(sb.st_mode) ||
+		    fnmatch("*.[chy]", dp->d_name, 0) != 0)
+			continue;
+		/* Drop the leading "./". */
+		if ((cf = cifind(path + 2, strlen(path + 2))) == NULL)
+			ciaddfile(path + 2, &sb, CF_PARSE);
+		else if (cf->cf_sec == sb.st_mtim.tv_sec &&
+		    cf->cf_nsec == sb.st_mtim.tv_nsec &&
+		    cf->cf_size == sb.st_size)
+			cf->cf_state = CF_KEEP;
+		else
+			cisetfile(cf, &sb, CF_PARSE);
+	}
+	closedir(dirp);
+}
+
+/*
+ * Drop the lines of files that are gone or will be parsed again.
+ * Returns TRUE if there is anything to parse.
+ */
+static int
+cistale(void)
+{
+	struct cfile	*cf;
+	const char	*t1, *t2, *end;
+	size_t		 i, n;
+	int		 parse = 0;
+
+	for (i = 0; i < cinfiles; i++)
+		if (cifiles[i].cf_state != CF_KEEP) {
+			cichanged = 1;
+			parse |= cifiles[i].cf_state == CF_PARSE;
+		}
+	if (!cichanged)
+		return (FALSE);
+	for (i = n = 0; i < cinlines; i++) {
+		end = cilines[i].cl_p + cilines[i].cl_len;
+		if ((t1 = memchr(cilines[i].cl_p, '\t', end -
+		    cilines[i].cl_p)) == NULL)
+			continue;
+		t1++;
+		if ((t2 = memchr(t1, '\t', end - t1)) == NULL)
+			continue;
+		if ((cf = cifind(t1, t2 - t1)) == NULL ||
+		    cf->cf_state != CF_KEEP)
+			continue;
+		cilines[n++] = cilines[i];
+	}
+	cinlines = n;
+	return (parse);
+}
+
+/*
+ * Parse the changed files in a few worker processes.  Each writes to
+ * its own temporary file, which is read back once all are done, and
+ * writes a byte to fd for each file it finishes.
+ */
+static void
+ciparseall(int fd)
+{
+	volatile unsigned int	*next;
+	FILE			*out[CIMAXWORKERS];
+	pid_t			 pids[CIMAXWORKERS];
+	struct stat		 sb;
+	char			*buf;
+	size_t			 i, nparse;
+	long			 ncpu;
+	int			 nw, w, status;
+
+	for (i = nparse = 0; i < cinfiles; i++)
+		nparse += cifiles[i].cf_state == CF_PARSE;
+	if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		ncpu = 1;
+	nw = (size_t)ncpu < nparse ? ncpu : (int)nparse;
+	if (nw > CIMAXWORKERS)
+		nw = CIMAXWORKERS;
+	next = mmap(NULL, sizeof(*next), PROT_READ | PROT_WRITE,
+	    MAP_ANON | MAP_SHARED, -1, 0);
+	if (next == MAP_FAILED)
+		_exit(1);
+	*next = 0;
+
+	for (w = 0; w < nw; w++) {
+		if ((out[w] = tmpfile()) == NULL)
+			_exit(1);
+		if ((pids[w] = fork()) == -1)
+			_exit(1);
+		if (pids[w] != 0)
+			continue;
+		while ((i = __sync_fetch_and_add(next, 1)) < cinfiles) {
+			if (cifiles[i].cf_state != CF_PARSE)
+				continue;
+			ciparsefile(cifiles[i].cf_path, out[w]);
+			(void)write(fd, "", 1);
+		}
+		_exit(fflush(out[w]) == 0 ? 0 : 1);
+	}
+	for (w = 0; w < nw; w++) {
+		while (waitpid(pids[w], &status, 0) == -1)
+			if (errno != EINTR)
+				_exit(1);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			_exit(1);
+		/* The worker wrote through its own copy of the stream. */
+		if (fstat(fileno(out[w]), &sb) == -1 ||
+		    (buf = malloc(sb.st_size + 1)) == NULL ||
+		    pread(fileno(out[w]), buf, sb.st_size, 0) != sb.st_size)
+			_exit(1);
+		ciaddlines(buf, sb.st_size);
+	}
+}
+
+/*
+ * Write the definitions in one file to out.
+ */
+static void
+ciparsefile(const char *path, FILE *out)
+{
+	struct cscan	 cs;
+	struct stat	 sb;
+	char		*buf;
+	ssize_t		 n;
+	size_t		 off = 0;
+	int		 fd;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		return;
+	if (fstat(fd, &sb) == -1 || (buf = malloc(sb.st_size + 1)) == NULL) {
+		close(fd);
+		return;
+	}
+	while (off < (size_t)sb.st_size &&
+	    (n = read(fd, buf + off, sb.st_size - off)) > 0)
+		off += n;
+	close(fd);
+
+	memset(&cs, 0, sizeof(cs));
+	cs.cs_p = cs.cs_bol = buf;
+	cs.cs_end = buf + off;
+	cs.cs_line = 1;
+	cs.cs_linestart = 1;
+	cs.cs_path = path;
+	cs.cs_out = out;
+	cscan(&cs);
+	free(buf);
+}
+
+/*
+ * Write the new index next to the old one and rename it into place, so
+ * an editor mapping the old one never sees a partial file.
+ */
+static int
+ciwrite(void)
+{
+	static const char *const cihead[] = {
+		"!_TAG_FILE_FORMAT\t2\t/extended format/",
+		"!_TAG_FILE_SORTED\t1\t/0=unsorted, 1=sorted/",
+		"!_TAG_PROGRAM_NAME\tmg\t//",
+		NULL
+	};
+	FILE	*fp;
+	char	 tmp[] = CIDXFN ".XXXXXX", *rec;
+	size_t	 i;
+	int	 fd, len;
+
+	for (i = 0; cihead[i] != NULL; i++)
+		ciaddline(cihead[i], strlen(cihead[i]));
+	for (i = 0; i < cinfiles; i++) {
+		if (cifiles[i].cf_state == CF_DROP)
+			continue;
+		if ((len = asprintf(&rec, "%s\t%s\t%lld.%09ld\t%lld", CIFILE,
+		    cifiles[i].cf_path, (long long)cifiles[i].cf_sec,
+		    cifiles[i].cf_nsec, (long long)cifiles[i].cf_size)) == -1)
+			return (FALSE);
+		ciaddline(rec, len);
+	}
+	qsort(cilines, cinlines, sizeof(*cilines), cilinecmp);
+
+	if ((fd = mkstemp(tmp)) == -1)
+		return (FALSE);
+	if ((fp = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		(void)unlink(tmp);
+		return (FALSE);
+	}
+	(void)fchmod(fd, 0644);
+	for (i = 0; i < cinlines; i++) {
+		(void)fwrite(cilines[i].cl_p, 1, cilines[i].cl_len, fp);
+		(void)putc('\n', fp);
+	}
+	if (fclose(fp) == EOF || rename(tmp, CIDXFN) == -1) {
+		(void)unlink(tmp);
+		return (FALSE);
+	}
+	return (TRUE);
+}
+
+static int
+cifilecmp(const void *a, const void *b)
+{
+	return (strcmp(((const struct cfile *)a)->cf_path,
+	    ((const struct cfile *)b)->cf_path));
+}
+
+/*
+ * Sort lines in byte order, which puts the pseudo-tags first and keeps
+ * the definitions of a tag in order of file.
+ */
+static int
+cilinecmp(const void *a, const void *b)
+{
+	const struct cline	*la = a, *lb = b;
+	int			 r;
+
+	r = memcmp(la->cl_p, lb->cl_p, la->cl_len < lb->cl_len ?
+	    la->cl_len : lb->cl_len);
+	if (r != 0)
+		return (r);
+	return (la->cl_len < lb->cl_len ? -1 : la->cl_len > lb->cl_len);
+}
+
+static void *
+cigrow(void *p, size_t *sz, size_t n, size_t elsize)
+{
+	if (n < *sz)
+		return (p);
+	*sz = *sz ? *sz * 2 : 1024;
+	if ((p = reallocarray(p, *sz, elsize)) == NULL)
+		_exit(1);
+	return (p);
+}
+
+/*
+ * Find the definitions at file level.  A '{' opens a function body if
+ * the statement so far has a name followed by a parameter list, and
+ * no '=': "int f(void) {", including old-style definitions with their
+ * parameter declarations.  "struct x {" names a structure; typedef
+ * names come before the ',' or ';' that ends them, or after "(*" for
+ * pointers to functions.
+ */
+static void
+cscan(struct cscan *cs)
+{
+	struct ctok	t, prev, prev2, cand, name, fpname;
+	int		depth = 0, pdepth = 0, body = 0;
+	int		hascand = 0, closed = 0, eq = 0, tdef = 0;
+	int		hasname = 0, hasfp = 0;
+
+	memset(&prev, 0, sizeof(prev));
+	prev2 = prev;
+	while (ctoken(cs, &t) != CT_EOF) {
+		if (depth > 0) {
+			if (t.ct_type == CT_PUNCT && t.ct_c == '{')
+				depth++;
+			else if (t.ct_type == CT_PUNCT && t.ct_c == '}' &&
+			    --depth == 0 && body) {
+				body = hascand = closed = eq = tdef = 0;
+				hasname = hasfp = 0;
+			}
+			goto next;
+		}
+		if (t.ct_type == CT_IDENT) {
+			if (pdepth == 0) {
+				if (ciskw(&t, "typedef"))
+					tdef = 1;
+				else if (!cnotname(&t)) {
+					name = t;
+					hasname = 1;
+				}
+			} else if (pdepth == 1 && !hasfp &&
+			    prev.ct_type == CT_PUNCT && prev.ct_c == '*' &&
+			    prev2.ct_type == CT_PUNCT && prev2.ct_c == '(') {
+				fpname = t;
+				hasfp = 1;
+			}
+			goto next;
+		}
+		if (t.ct_type != CT_PUNCT)
+			goto next;
+		switch (t.ct_c) {
+		case '(':
+		case '[':
+			if (t.ct_c == '(' && pdepth == 0 &&
+			    prev.ct_type == CT_IDENT && !cnotname(&prev)) {
+				cand = prev;
+				hascand = 1;
+				closed = 0;
+			}
+			pdepth++;
+			break;
+		case ')':
+		case ']':
+			if (pdepth > 0 && --pdepth == 0 && t.ct_c == ')' &&
+			    hascand)
+				closed = 1;
+			break;
+		case '=':
+			if (pdepth == 0)
+				eq = 1;
+			break;
+		case ',':
+		case ';':
+			if (pdepth != 0)
+				break;
+			if (tdef && (hasfp || hasname))
+				cemit(cs, hasfp ? &fpname : &name, 't');
+			hasname = hasfp = 0;
+			if (t.ct_c == ',')
+				break;
+			/* Keep old-style parameter declarations going. */
+			if (!tdef && !eq && hascand && closed &&
+			    !(prev.ct_type == CT_PUNCT && prev.ct_c == ')'))
+				break;
+			hascand = closed = eq = tdef = 0;
+			break;
+		case '{':
+			body = 0;
+			if (prev.ct_type == CT_OTHER && ciskw(&prev2, "extern"))
+				goto next;	/* extern "C" { */
+			if (prev.ct_type == CT_IDENT &&
+			    (ciskw(&prev2, "struct") ||
+			    ciskw(&prev2, "union") || ciskw(&prev2, "enum")))
+				cemit(cs, &prev, prev2.ct_s[0] == 's' ? 's' :
+				    prev2.ct_s[0] == 'u' ? 'u' : 'g');
+			else if (hascand && closed && !eq && !tdef &&
+			    pdepth == 0 && prev.ct_type == CT_PUNCT &&
+			    (prev.ct_c == ')' || prev.ct_c == ';')) {
+				cemit(cs, &cand, 'f');
+				body = 1;
+			}
+			depth++;
+			break;
+		}
+next:
+		prev2 = prev;
+		prev = t;
+	}
+}
+
+/*
+ * Names that are followed by parentheses without being declarators.
+ */
+static int
+cnotname(const struct ctok *t)
+{
+	static const char *const kw[] = {
+		"__asm", "__asm__", "__attribute", "__attribute__",
+		"__declspec", "__typeof__", "_Alignas", "_Pragma",
+		"_Static_assert", "alignas", "asm", "sizeof",
+		"static_assert", "typeof", NULL
+	};
+	int	i;
+
+	for (i = 0; kw[i] != NULL; i++)
+		if (ciskw(t, kw[i]))
+			return (TRUE);
+	return (FALSE);
+}
+
+static int
+ciskw(const struct ctok *t, const char *kw)
+{
+	return (t->ct_type == CT_IDENT && strlen(kw) == t->ct_len &&
+	    memcmp(t->ct_s, kw, t->ct_len) == 0);
+}
+
+/*
+ * Write a tags line: name, file, the whole source line as a search
+ * pattern, the kind and the line number.
+ */
+static void
+cemit(struct cscan *cs, const struct ctok *t, int kind)
+{
+	const char	*p, *eol;
+
+	if ((eol = memchr(t->ct_bol, '\n', cs->cs_end - t->ct_bol)) == NULL)
+		eol = cs->cs_end;
+	if (eol > t->ct_bol && eol[-1] == '\r')
+		eol--;
+	(void)fwrite(t->ct_s, 1, t->ct_len, cs->cs_out);
+	(void)fprintf(cs->cs_out, "\t%s\t/^", cs->cs_path);
+	for (p = t->ct_bol; p < eol; p++) {
+		if (*p == '\\' || *p == '/')
+			(void)putc('\\', cs->cs_out);
+		(void)putc(*p, cs->cs_out);
+	}
+	(void)fprintf(cs->cs_out, "$/;\"\t%c\tline:%d\n", kind, t->ct_line);
+}
+
+/*
+ * Return the next token outside comments and preprocessor lines, and
+ * outside conditional branches that are skipped.
+ */
+static int
+ctoken(struct cscan *cs, struct ctok *t)
+{
+	const char	*p;
+	int		 c;
+
+	while (cs->cs_p < cs->cs_end) {
+		c = (unsigned char)*cs->cs_p;
+		if (c == '\n') {
+			cs->cs_p++;
+			cs->cs_line++;
+			cs->cs_bol = cs->cs_p;
+			cs->cs_linestart = 1;
+			continue;
+		}
+		if (isspace(c)) {
+			cs->cs_p++;
+			continue;
+		}
+		if (c == '\\' && cs->cs_p + 1 < cs->cs_end &&
+		    cs->cs_p[1] == '\n') {
+			cs->cs_p += 2;
+			cs->cs_line++;
+			cs->cs_bol = cs->cs_p;
+			continue;
+		}
+		if (c == '/' && cs->cs_p + 1 < cs->cs_end &&
+		    (cs->cs_p[1] == '*' || cs->cs_p[1] == '/')) {
+			cskip(cs);
+			continue;
+		}
+		if (c == '#' && cs->cs_linestart) {
+			cppline(cs);
+			continue;
+		}
+		cs->cs_linestart = 0;
+
+		t->ct_line = cs->cs_line;
+		t->ct_bol = cs->cs_bol;
+		t->ct_s = p = cs->cs_p;
+		if (isalpha(c) || c == '_') {
+			while (++p < cs->cs_end &&
+			    (isalnum((unsigned char)*p) || *p == '_'))
+				;
+			t->ct_type = CT_IDENT;
+		} else if (isdigit(c) || (c == '.' && p + 1 < cs->cs_end &&
+		    isdigit((unsigned char)p[1]))) {
+			while (++p < cs->cs_end &&
+			    (isalnum((unsigned char)*p) || *p == '.' ||
+			    *p == '_' || *p == '\'' ||
+			    ((*p == '+' || *p == '-') &&
+			    strchr("eEpP", p[-1]) != NULL)))
+				;
+			t->ct_type = CT_OTHER;
+		} else if (c == '"' || c == '\'') {
+			while (++p < cs->cs_end && *p != c && *p != '\n')
+				if (*p == '\\' && p + 1 < cs->cs_end &&
+				    p[1] != '\n')
+					p++;
+			if (p < cs->cs_end && *p == c)
+				p++;
+			t->ct_type = CT_OTHER;
+		} else {
+			p++;
+			t->ct_type = CT_PUNCT;
+			t->ct_c = c;
+		}
+		t->ct_len = p - cs->cs_p;
+		cs->cs_p = p;
+		if (!cskipping(cs))
+			return (t->ct_type);
+	}
+	t->ct_type = CT_EOF;
+	return (CT_EOF);
+}
+
+/*
+ * Skip a comment.
+ */
+static void
+cskip(struct cscan *cs)
+{
+	const char	*p = cs->cs_p + 2;
+
+	if (cs->cs_p[1] == '/') {
+		while (p < cs->cs_end && *p != '\n')
+			p++;
+		cs->cs_p = p;
+		return;
+	}
+	for (; p < cs->cs_end; p++) {
+		if (*p == '\n') {
+			cs->cs_line++;
+			cs->cs_bol = p + 1;
+		} else if (*p == '*' && p + 1 < cs->cs_end && p[1] == '/') {
+			p += 2;
+			break;
+		}
+	}
+	cs->cs_p = p;
+}
+
+/*
+ * Handle a preprocessor line: note macro definitions and conditionals,
+ * then skip to its end.
+ */
+static void
+cppline(struct cscan *cs)
+{
+	struct ctok	 t;
+	const char	*p = cs->cs_p + 1, *d, *end = cs->cs_end;
+	size_t		 len;
+	int		 i, zero = 0;
+
+	while (p < end && (*p == ' ' || *p == '\t'))
+		p++;
+	for (d = p; p < end && isalpha((unsigned char)*p); p++)
+		;
+	len = p - d;
+	while (p < end && (*p == ' ' || *p == '\t'))
+		p++;
+
+	for (i = 0; i < cs->cs_nif && i < CIMAXIF; i++)
+		zero |= cs->cs_if[i] == CI_ZERO;
+	if (len == 6 && strncmp(d, "define", 6) == 0 && !zero &&
+	    p < end && (isalpha((unsigned char)*p) || *p == '_')) {
+		t.ct_s = p;
+		while (++p < end && (isalnum((unsigned char)*p) || *p == '_'))
+			;
+		t.ct_len = p - t.ct_s;
+		t.ct_line = cs->cs_line;
+		t.ct_bol = cs->cs_bol;
+		cemit(cs, &t, 'd');
+	} else if ((len == 2 && strncmp(d, "if", 2) == 0) ||
+	    (len == 5 && strncmp(d, "ifdef", 5) == 0) ||
+	    (len == 6 && strncmp(d, "ifndef", 6) == 0)) {
+		if (cs->cs_nif < CIMAXIF)
+			cs->cs_if[cs->cs_nif] = (len == 2 && p < end &&
+			    *p == '0' && (p + 1 == end ||
+			    !isalnum((unsigned char)p[1]))) ? CI_ZERO :
+			    CI_ACTIVE;
+		cs->cs_nif++;
+	} else if ((len == 4 && (strncmp(d, "else", 4) == 0 ||
+	    strncmp(d, "elif", 4) == 0)) ||
+	    (len == 7 && (strncmp(d, "elifdef", 7) == 0))) {
+		i = cs->cs_nif - 1;
+		if (i >= 0 && i < CIMAXIF)
+			cs->cs_if[i] = cs->cs_if[i] == CI_ZERO ? CI_ACTIVE :
+			    CI_DONE;
+	} else if (len == 5 && strncmp(d, "endif", 5) == 0) {
+		if (cs->cs_nif > 0)
+			cs->cs_nif--;
+	}
+
+	/* Skip to the end of the line, including continuations. */
+	while (p < end && *p != '\n') {
+		if (*p == '\\' && p + 1 < end && p[1] == '\n') {
+			p += 2;
+			cs->cs_line++;
+			cs->cs_bol = p;
+		} else if (*p == '/' && p + 1 < end && p[1] == '*') {
+			cs->cs_p = p;
+			cskip(cs);
+			p = cs->cs_p;
+		} else if (*p == '"' || *p == '\'') {
+			for (i = *p++; p < end && *p != i && *p != '\n'; p++)
+				if (*p == '\\' && p + 1 < end && p[1] != '\n')
+					p++;
+			if (p < end && *p == i)
+				p++;
+		} else
+			p++;
+	}
+	cs->cs_p = p;
+}
+
+/*
+ * Is the current conditional branch skipped?
+ */
+static int
+cskipping(const struct cscan *cs)
+{
+	int	i;
+
+	for (i = 0; i < cs->cs_nif && i < CIMAXIF; i++)
+		if (cs->cs_if[i] != CI_ACTIVE)
+			return (TRUE);
+	return (FALSE);
+}
@@ -11,8 +11,11 @@
  */
 
 #include <ctype.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "def.h"
 #include "funmap.h"
@@ -23,6 +26,44 @@ extern int changemode(int, int, char *);
 
 static int cc_strip_trailp = TRUE;	/* Delete Trailing space? */
 
+/*
+ * Lexical state at the start of each line, kept in the buffer's b_data
+ * so indenting and bracket matching do not rescan the lines above dot.
+ * Lines before cl_valid are up to date; an edit only moves that back
+ * to the line it changed, and it is brought forward again on demand.
+ */
+struct cclex {
+	int	cx_depth[2];		/* brace, paren and bracket depth */
+	int	cx_min[2];		/* lowest depths within the line */
+	int	cx_flags;
+};
+#define CX_BRACE	0
+#define CX_PAREN	1
+
+#define CX_COMMENT	0x01		/* starts inside a comment	*/
+#define CX_STRING	0x02		/* starts inside a string	*/
+#define CX_CHAR		0x04		/* starts inside a char literal	*/
+#define CX_CPP		0x08		/* continues a preprocessor line */
+#define CX_CODE		0x10		/* has code outside comments	*/
+
+/* Where a bracket took a depth from co_level to co_level + 1. */
+struct ccopen {
+	int	co_which;		/* CX_BRACE or CX_PAREN		*/
+	int	co_level;
+	int	co_off;			/* -1 if nowhere		*/
+};
+
+struct cclines {
+	struct cclex	*cl_lex;	/* indexed by line number	*/
+	int		 cl_size;
+	int		 cl_valid;
+};
+
+static struct cclex *cc_lex(struct line *, int);
+static void cc_lexline(const struct line *, int, struct cclex *,
+    struct cclex *, struct ccopen *);
+static void cc_freelex(struct buffer *);
+static struct line *cc_prevcode(struct line *, int, const struct cclex *);
 static int getmatch(int, int);
 static int getindent(const struct line *, int *);
 static int in_whitespace(struct line *, int);
@@ -162,6 +203,7 @@ cc_indent(int f, int n)
 	int pi, mi;			/* Previous indents (mi is ignored) */
 	int ci;				/* current indent */
 	struct line *lp;
+	struct cclex *cx;
 	int ret;
 
 	if (n < 0)
@@ -175,8 +217,10 @@ cc_indent(int f, int n)
 	 * Search backwards for a non-blank, non-preprocessor,
 	 * non-comment line
 	 */
-
-	lp = findnonblank(curwp->w_dotp);
+	if ((cx = cc_lex(curwp->w_dotp, curwp->w_dotline)) != NULL)
+		lp = cc_prevcode(curwp->w_dotp, curwp->w_dotline, cx);
+	else
+		lp = findnonblank(curwp->w_dotp);
 
 	pi = getindent(lp, &mi);
 
@@ -210,6 +254,260 @@ cc_lfindent(int f, int n)
 	return (cc_indent(FFRAND, n));
 }
 
+/*
+ * Return the lexical state of line lp, line number n of the current
+ * buffer, lexing forward from the last line known to be up to date.
+ * The states of the lines before it are valid too.  Returns NULL if
+ * the buffer's mode data belongs to someone else or n is wrong.
+ */
+static struct cclex *
+cc_lex(struct line *lp, int n)
+{
+	struct cclines	*cl;
+	struct cclex	*nlex;
+	struct line	*tlp;
+	int		 i, from, nsize;
+
+	if (curbp->b_freedata != cc_freelex) {
+		if (curbp->b_data != NULL || curbp->b_freedata != NULL)
+			return (NULL);
+		if ((cl = calloc(1, sizeof(*cl))) == NULL)
+			return (NULL);
+		curbp->b_data = cl;
+		curbp->b_freedata = cc_freelex;
+	}
+	cl = curbp->b_data;
+	if (n < 1 || n == INT_MAX)
+		return (NULL);
+	if (cl->cl_valid > curbp->b_editline)
+		cl->cl_valid = curbp->b_editline;
+	curbp->b_editline = INT_MAX;
+	if (n < cl->cl_valid)
+		return (&cl->cl_lex[n]);
+
+	if (n + 1 >= cl->cl_size) {
+		nsize = cl->cl_size ? cl->cl_size : 1024;
+		while (nsize <= n + 1 && nsize < INT_MAX / 2)
+			nsize *= 2;
+		if (nsize <= n + 1 || (nlex = reallocarray(cl->cl_lex, nsize,
+		    sizeof(*nlex))) == NULL)
+			return (NULL);
+		cl->cl_lex = nlex;
+		cl->cl_size = nsize;
+	}
+
+	/* Back up to the last line whose starting state is known. */
+	from = cl->cl_valid > 1 ? cl->cl_valid - 1 : 1;
+	for (tlp = lp, i = n; i > from; i--)
+		if ((tlp = lback(tlp)) == curbp->b_headp)
+			return (NULL);
+	if (from == 1) {
+		if (lback(tlp) != curbp->b_headp)
+			return (NULL);
+		memset(&cl->cl_lex[1], 0, sizeof(cl->cl_lex[1]));
+	}
+	for (i = from; i <= n; i++, tlp = lforw(tlp)) {
+		if (tlp == curbp->b_headp)
+			return (NULL);
+		cc_lexline(tlp, -1, &cl->cl_lex[i], &cl->cl_lex[i + 1], NULL);
+	}
+	cl->cl_valid = n + 1;
+	return (&cl->cl_lex[n]);
+}
+
+/*
+ * Lex one line from its starting state: note whether it has any code
+ * and the lowest depths in it, and work out the state the next line
+ * starts in.  With a limit other than -1, stop there instead and put
+ * the state at that offset in next.  If op is not NULL, note the last
+ * bracket raising its depth to op->co_level + 1.  Brackets are counted
+ * outside comments, literals and preprocessor lines.
+ */
+static void
+cc_lexline(const struct line *lp, int limit, struct cclex *cx,
+    struct cclex *next, struct ccopen *op)
+{
+	int	i, c, len, w, first = TRUE;
+	int	fl = cx->cx_flags & ~CX_CODE;
+
+	for (w = CX_BRACE; w <= CX_PAREN; w++)
+		next->cx_depth[w] = next->cx_min[w] = cx->cx_depth[w];
+	if (op != NULL)
+		op->co_off = -1;
+	len = llength(lp);
+	if (limit >= 0 && limit < len)
+		len = limit;
+	for (i = 0; i < len; i++) {
+		c = lgetc(lp, i);
+		if (fl & CX_COMMENT) {
+			if (c == '*' && i + 1 < len &&
+			    lgetc(lp, i + 1) == '/') {
+				fl &= ~CX_COMMENT;
+				i++;
+			}
+			continue;
+		}
+		if (fl & (CX_STRING | CX_CHAR)) {
+			if (c == '\\')
+				i++;
+			else if (c == ((fl & CX_STRING) ? '"' : '\''))
+				fl &= ~(CX_STRING | CX_CHAR);
+			continue;
+		}
+		if (isspace(c))
+			continue;
+		if (c == '/' && i + 1 < len && lgetc(lp, i + 1) == '*') {
+			fl |= CX_COMMENT;
+			i++;
+			continue;
+		}
+		if (c == '/' && i + 1 < len && lgetc(lp, i + 1) == '/') {
+			/* The rest of the line is a comment. */
+			if (limit >= 0)
+				fl |= CX_COMMENT;
+			break;
+		}
+		if (first && c == '#')
+			fl |= CX_CPP;
+		first = FALSE;
+		if (fl & CX_CPP) {
+			if (c == '"')
+				fl |= CX_STRING;
+			else if (c == '\'')
+				fl |= CX_CHAR;
+			continue;
+		}
+		fl |= CX_CODE;
+		switch (c) {
+		case '"':
+			fl |= CX_STRING;
+			continue;
+		case '\'':
+			fl |= CX_CHAR;
+			continue;
+		case '{':
+		case '}':
+			w = CX_BRACE;
+			break;
+		case '(':
+		case ')':
+		case '[':
+		case ']':
+			w = CX_PAREN;
+			break;
+		default:
+			continue;
+		}
+		if (c == '{' || c == '(' || c == '[') {
+			if (op != NULL && op->co_which == w &&
+			    op->co_level == next->cx_depth[w])
+				op->co_off = i;
+			next->cx_depth[w]++;
+		} else if (next->cx_depth[w] > 0 &&
+		    --next->cx_depth[w] < next->cx_min[w])
+			next->cx_min[w] = next->cx_depth[w];
+	}
+	if (limit >= 0) {
+		next->cx_flags = fl;
+		return;
+	}
+	cx->cx_flags = (cx->cx_flags & ~CX_CODE) | (fl & CX_CODE);
+	for (w = CX_BRACE; w <= CX_PAREN; w++)
+		cx->cx_min[w] = next->cx_min[w];
+
+	/* Only a backslash carries literals and directives over. */
+	if (len == 0 || lgetc(lp, len - 1) != '\\' || i < len)
+		fl &= ~(CX_STRING | CX_CHAR | CX_CPP);
+	next->cx_flags = fl & ~CX_CODE;
+}
+
+static void
+cc_freelex(struct buffer *bp)
+{
+	struct cclines	*cl = bp->b_data;
+
+	free(cl->cl_lex);
+	free(cl);
+}
+
+/*
+ * Find the line to indent line lp, number n, relative to: the nearest
+ * line above with code on it, or inside a comment, the nearest one
+ * that is not blank.
+ */
+static struct line *
+cc_prevcode(struct line *lp, int n, const struct cclex *cx)
+{
+	const struct cclex	*lex = cx - n;	/* indexed by line number */
+
+	if (cx->cx_flags & CX_COMMENT) {
+		while ((lp = lback(lp)) != curbp->b_headp)
+			if (isnonblank(lp, llength(lp)))
+				break;
+		return (lp);
+	}
+	while ((lp = lback(lp)) != curbp->b_headp)
+		if (lex[--n].cx_flags & CX_CODE)
+			break;
+	return (lp);
+}
+
+/*
+ * Find the bracket matching the closing one at offset off in line lp,
+ * line number n of the current buffer.  The line holding it is found
+ * from the cached lowest depth of each line, without reading the text
+ * in between.  Returns TRUE and sets *mlp and *mo if found, FALSE if
+ * the bracket is unbalanced or mismatched, and ABORT if the buffer is
+ * not in c-mode or the bracket is not in code.
+ */
+int
+cc_match(struct line *lp, int n, int off, struct line **mlp, int *mo)
+{
+	struct cclex	*cx, *lex, st;
+	struct ccopen	 op;
+	int		 i, c, o;
+
+	for (i = 1; i <= curbp->b_nmodes; i++)
+		if (curbp->b_modes[i]->p_map == (KEYMAP *)&cmodemap)
+			break;
+	if (i > curbp->b_nmodes || off >= llength(lp) ||
+	    (cx = cc_lex(lp, n)) == NULL)
+		return (ABORT);
+	c = lgetc(lp, off);
+	if (c == '}')
+		op.co_which = CX_BRACE;
+	else if (c == ')' || c == ']')
+		op.co_which = CX_PAREN;
+	else
+		return (ABORT);
+
+	cc_lexline(lp, off, cx, &st, NULL);
+	if (st.cx_flags & (CX_COMMENT | CX_STRING | CX_CHAR | CX_CPP))
+		return (ABORT);
+	if (st.cx_depth[op.co_which] == 0)
+		return (FALSE);
+	op.co_level = st.cx_depth[op.co_which] - 1;
+
+	/* Skip lines that never drop below the bracket's depth. */
+	lex = cx - n;			/* indexed by line number */
+	cc_lexline(lp, off, cx, &st, &op);
+	while (op.co_off == -1) {
+		if (--n < 1)
+			return (FALSE);
+		lp = lback(lp);
+		if (lex[n].cx_min[op.co_which] <= op.co_level)
+			cc_lexline(lp, -1, &lex[n], &st, &op);
+	}
+
+	o = lgetc(lp, op.co_off);
+	if ((c == '}' && o != '{') || (c == ')' && o != '(') ||
+	    (c == ']' && o != '['))
+		return (FALSE);
+	*mlp = lp;
+	*mo = op.co_off;
+	return (TRUE);
+}
+
 /*
  * Get the level of indentation after line lp is processed
  * Note getindent has two returns:
@@ -6,13 +6,16 @@
  * Author: Sunil Nimmagadda <sunil@openbsd.org>
  */
 
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <fnmatch.h>
 #include <limits.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -20,6 +23,7 @@
 #include <unistd.h>
 
 #include "def.h"
+#include "macro.h"
 
 #define CSSYMBOL      0
 #define CSDEFINITION  1
@@ -30,6 +34,9 @@
 #define CSFINDFILE    7
 #define CSINCLUDES    8
 
+#define CSDB          "cscope.out"
+#define CSRULE        "-------------------------------------------------------------------------------"
+
 struct cstokens {
 	const char *fname;
 	const char *function;
@@ -53,6 +60,22 @@ static struct csrecord *addentryr;
 static struct csrecord *currecord;
 static struct csmatch  *curmatch;
 static const char      *addentryfn;
+
+/*
+ * A single "cscope -l" child answers all queries, so its database is
+ * read once rather than once per query.  Its answers are read by
+ * csinput() as they arrive, while the editor is idle.
+ */
+static pid_t		 cspid = -1;
+static int		 csfd = -1;
+static int		 csready;	/* child has prompted at least once */
+static int		 csbusy;	/* a query is outstanding */
+static int		 csleft;	/* results to come, -1 if unknown */
+static int		 csnores;
+static char		*csin;		/* partial line read from child */
+static size_t		 cslen, cssize;
+static char		 cscwd[NFILEN];	/* where the child was started */
+static struct stat	 csdb;		/* CSDB once the child was ready */
 static const char      *csprompt[] = {
 	"Find this symbol: ",
 	"Find this global definition: ",
@@ -66,7 +89,13 @@ static const char      *csprompt[] = {
 };
 
 static int  addentry(struct buffer *, char *);
+static void csdone(struct buffer *, const char *);
 static void csflush(void);
+static void csinput(int);
+static void csline(char *);
+static int  csstart(void);
+static void csstop(void);
+static int  cswait(void);
 static int  do_cscope(int);
 static int  csexists(const char *);
 static int  getattr(char *, struct cstokens *);
@@ -183,6 +212,9 @@ cscreatelist(int f, int n)
 	if (csexists("cscope-indexer") == FALSE)
 		return(dobeep_msg("no such file or directory, cscope-indexer"));
 
+	/* Results of a running query would land in the indexer's output. */
+	csstop();
+
 	clen = snprintf(cmd, sizeof(cmd), "cscope-indexer -v %s", dir);
 	if (clen < 0 || clen >= (int)sizeof(cmd))
 		return (FALSE);
@@ -354,24 +386,19 @@ jumptomatch(void)
 }
 
 /*
- * Ask for the symbol, construct cscope commandline with the symbol
- * and passed in index. Popen cscope, read the output into *cscope*
- * buffer and pop it.
+ * Ask for the symbol and send it with the passed in index to the
+ * cscope child, starting one if needed.  The results are added to
+ * the *cscope* buffer by csinput() as they come in.
  */
 int
 do_cscope(int i)
 {
 	struct buffer *bp;
-	FILE *fpipe;
-	char pattern[MAX_TOKEN], cmd[BUFSIZ], title[BUFSIZ];
-	char *p, *buf;
-	int clen, nores = 0;
-	size_t sz;
+	char pattern[MAX_TOKEN], cmd[MAX_TOKEN + 3];
+	char *p;
+	int clen;
 	ssize_t len;
 
-	buf = NULL;
-	sz = 0;
-
 	/* If current buffer isn't a source file just return */
 	if (fnmatch("*.[chy]", curbp->b_fname, 0) != 0)
 		return(dobeep_msg("C-c s not defined"));
@@ -387,47 +414,262 @@ do_cscope(int i)
 	if (csexists("cscope") == FALSE)
 		return(dobeep_msg("no such file or directory, cscope"));
 
-	csflush();
-	clen = snprintf(cmd, sizeof(cmd), "cscope -L -%d %s 2>/dev/null",
-	    i, pattern);
-	if (clen < 0 || clen >= (int)sizeof(cmd))
+	/* Let an earlier query finish before its buffer is reused. */
+	if (csbusy && cswait() == FALSE)
+		return (FALSE);
+	if (csstart() == FALSE)
 		return (FALSE);
 
-	if ((fpipe = popen(cmd, "r")) == NULL)
-		return(dobeep_msg("problem opening pipe"));
+	clen = snprintf(cmd, sizeof(cmd), "%d%s\n", i, pattern);
+	if (clen < 0 || clen >= (int)sizeof(cmd))
+		return (FALSE);
 
+	csflush();
 	bp = bfind("*cscope*", TRUE);
-	if (bclear(bp) != TRUE) {
-		pclose(fpipe);
+	if (bclear(bp) != TRUE)
 		return (FALSE);
-	}
 	bp->b_flag |= BFREADONLY;
 
-	clen = snprintf(title, sizeof(title), "%s%s", csprompt[i], pattern);
-	if (clen < 0 || clen >= (int)sizeof(title)) {
-		pclose(fpipe);
-		return (FALSE);
-	}
-	addline(bp, title);
+	addlinef(bp, "%s%s", csprompt[i], pattern);
 	addline(bp, "");
-	addline(bp, "-------------------------------------------------------------------------------");
-	while ((len = getline(&buf, &sz, fpipe)) != -1) {
-		if (buf[len - 1] == *bp->b_nlchr)
-			buf[len - 1] = '\0';
-		if (addentry(bp, buf) != TRUE) {
-			free(buf);
-			return (FALSE);
+	addline(bp, CSRULE);
+
+	while ((len = send(csfd, cmd, clen, MSG_NOSIGNAL)) == -1 &&
+	    errno == EINTR)
+		;
+	if (len != clen) {
+		csstop();
+		return(dobeep_msg("problem writing to cscope"));
+	}
+	csbusy = 1;
+	csleft = -1;
+	csnores = 1;
+
+	/* Keyboard macros expect the results to be there. */
+	if (inmacro || batch)
+		(void)cswait();
+	return (popbuftop(bp, WNONE));
+}
+
+/*
+ * Make sure a cscope child is running in the current directory on an
+ * up to date database, restarting it if cscope.out has been rebuilt
+ * since it started.
+ */
+int
+csstart(void)
+{
+	struct stat sb;
+	char cwd[NFILEN];
+	int s[2];
+
+	if (getcwd(cwd, sizeof(cwd)) == NULL)
+		return(dobeep_msgs("getcwd:", strerror(errno)));
+	if (cspid != -1 && strcmp(cwd, cscwd) != 0)
+		csstop();
+	if (cspid != -1 && csready) {
+		if (stat(CSDB, &sb) == -1)
+			memset(&sb, 0, sizeof(sb));
+		if (sb.st_dev != csdb.st_dev || sb.st_ino != csdb.st_ino ||
+		    sb.st_size != csdb.st_size ||
+		    sb.st_mtim.tv_sec != csdb.st_mtim.tv_sec ||
+		    sb.st_mtim.tv_nsec != csdb.st_mtim.tv_nsec)
+			csstop();
+	}
+	if (cspid != -1)
+		return (TRUE);
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC, s) == -1)
+		return(dobeep_msg("socketpair error"));
+
+	switch ((cspid = fork())) {
+	case -1:
+		close(s[0]);
+		close(s[1]);
+		return(dobeep_msg("Can't fork"));
+	case 0:
+		/* Child process */
+		close(s[0]);
+		if (dup2(s[1], STDIN_FILENO) == -1 ||
+		    dup2(s[1], STDOUT_FILENO) == -1)
+			_exit(1);
+		if (s[1] > STDOUT_FILENO)
+			close(s[1]);
+		close(STDERR_FILENO);
+		(void)open("/dev/null", O_WRONLY);
+		execlp("cscope", "cscope", "-l", (char *)NULL);
+		_exit(1);
+	}
+	/* Parent process */
+	close(s[1]);
+	(void)fcntl(s[0], F_SETFD, FD_CLOEXEC);
+	(void)fcntl(s[0], F_SETFL, fcntl(s[0], F_GETFL, 0) | O_NONBLOCK);
+	csfd = s[0];
+	csready = 0;
+	cslen = 0;
+	(void)strlcpy(cscwd, cwd, sizeof(cscwd));
+	if (ttwatch(csfd, csinput) == FALSE) {
+		csstop();
+		return(dobeep_msg("Too many descriptors watched"));
+	}
+	return (TRUE);
+}
+
+/*
+ * Shut the cscope child down, ending any query in progress.
+ */
+void
+csstop(void)
+{
+	struct buffer *bp;
+
+	if (cspid == -1)
+		return;
+	(void)ttwatch(csfd, NULL);
+	close(csfd);
+	(void)kill(cspid, SIGTERM);
+	while (waitpid(cspid, NULL, 0) == -1 && errno == EINTR)
+		;
+	cspid = -1;
+	csfd = -1;
+	if (csbusy && (bp = bfind("*cscope*", FALSE)) != NULL)
+		csdone(bp, "cscope exited");
+	csbusy = 0;
+}
+
+/*
+ * Read the rest of the current query's results.
+ */
+int
+cswait(void)
+{
+	struct pollfd pfd[1];
+
+	pfd[0].fd = csfd;
+	pfd[0].events = POLLIN;
+	while (csbusy) {
+		if (poll(pfd, 1, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			csstop();
+			return(dobeep_msg("poll error"));
 		}
-		nores = 1;
+		csinput(csfd);
 	}
-	free(buf);
-	if (ferror(fpipe))
-		ewprintf("Problem reading pipe");
-	pclose(fpipe);
-	addline(bp, "-------------------------------------------------------------------------------");
-	if (nores == 0)
+	return (TRUE);
+}
+
+/*
+ * Read what the cscope child has written, a bounded amount at a time
+ * so that long answers are shown as they grow, and handle each
+ * complete line.  The child prompts with ">> " and no newline when it
+ * is ready for the next query.
+ */
+void
+csinput(int fd)
+{
+	struct buffer *bp;
+	struct mgwin *wp;
+	char *nl, *cp, *ncp;
+	ssize_t n;
+	size_t nsize;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		if (cssize - cslen < BUFSIZ) {
+			nsize = cssize + BUFSIZ;
+			if ((ncp = realloc(csin, nsize)) == NULL) {
+				csstop();
+				(void)dobeep_msg("Out of memory");
+				return;
+			}
+			csin = ncp;
+			cssize = nsize;
+		}
+		if ((n = read(fd, csin + cslen, cssize - cslen - 1)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+		}
+		if (n <= 0) {
+			csstop();
+			return;
+		}
+		cslen += n;
+		csin[cslen] = '\0';
+		for (cp = csin; (nl = strchr(cp, '\n')) != NULL; cp = nl + 1) {
+			*nl = '\0';
+			csline(cp);
+		}
+		cslen -= cp - csin;
+		memmove(csin, cp, cslen);
+	}
+	if (cslen == 3 && strncmp(csin, ">> ", 3) == 0) {
+		cslen = 0;
+		if (!csready) {
+			/* Any rebuild the child did at startup is over. */
+			if (stat(CSDB, &csdb) == -1)
+				memset(&csdb, 0, sizeof(csdb));
+			csready = 1;
+		}
+	}
+
+	if ((bp = bfind("*cscope*", FALSE)) == NULL)
+		return;
+	for (wp = wheadp; wp != NULL; wp = wp->w_wndp)
+		if (wp->w_bufp == bp)
+			wp->w_rflag |= WFFULL;
+}
+
+/*
+ * Handle one line of output from cscope: a result count, which starts
+ * the answer to a query, or one of the results.
+ */
+void
+csline(char *line)
+{
+	struct buffer *bp;
+	const char *errstr;
+	char *p;
+
+	while (strncmp(line, ">> ", 3) == 0)
+		line += 3;
+	if (!csbusy || (bp = bfind("*cscope*", TRUE)) == NULL)
+		return;
+	if (csleft == -1) {
+		if (strncmp(line, "cscope: ", 8) != 0 ||
+		    (p = strchr(line + 8, ' ')) == NULL ||
+		    strcmp(p, " lines") != 0) {
+			csdone(bp, line);
+			return;
+		}
+		*p = '\0';
+		csleft = strtonum(line + 8, 0, INT_MAX, &errstr);
+		if (errstr != NULL)
+			csdone(bp, "Bad reply from cscope");
+		else if (csleft == 0)
+			csdone(bp, NULL);
+		return;
+	}
+	if (addentry(bp, line) == TRUE)
+		csnores = 0;
+	if (--csleft == 0)
+		csdone(bp, NULL);
+}
+
+/*
+ * The current query has been answered.
+ */
+void
+csdone(struct buffer *bp, const char *msg)
+{
+	csbusy = 0;
+	addline(bp, CSRULE);
+	if (msg != NULL)
+		ewprintf("%s", msg);
+	else if (csnores)
 		ewprintf("No matches were found.");
-	return (popbuftop(bp, WNONE));
 }
 
 /*
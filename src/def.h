@@ -214,6 +214,29 @@ struct region {
 	RSIZE		 r_size;	/* Length in characters.	 */
 };
 
+/*
+ * Where a line starts, kept per buffer by line number so the size of
+ * a region can be found without walking it.
+ */
+struct lineidx {
+	struct line	*li_lp;		/* The line			 */
+	long		 li_off;	/* Characters before it		 */
+};
+
+/*
+ * A narrowed buffer has its visible lines hung off a header of their
+ * own.  This keeps what is needed to put them back.
+ */
+struct narrow {
+	struct line	*n_headp;	/* Header of the visible lines	 */
+	struct line	*n_wide;	/* The buffer's own header	 */
+	struct line	*n_before;	/* Line before the visible ones	 */
+	struct line	*n_after;	/* Line after them		 */
+	int		 n_lines;	/* Lines not visible		 */
+	int		 n_lineno;	/* Lines before the visible ones */
+	long		 n_pos;		/* Characters before them	 */
+};
+
 
 /*
  * All text is kept in circularly linked
@@ -230,7 +253,7 @@ struct region {
 struct line {
 	struct line	*l_fp;		/* Link to the next line	 */
 	struct line	*l_bp;		/* Link to the previous line	 */
-	int		 l_size;	/* Allocated size		 */
+	int		 l_size;	/* Allocated size, < 0 if shared */
 	int		 l_used;	/* Used size			 */
 	char		*l_text;	/* Content of the line		 */
 };
@@ -250,6 +273,13 @@ struct line {
 #define llength(lp)	((lp)->l_used)
 #define ltext(lp)	((lp)->l_text)
 
+/*
+ * A line transform, for ltransform().  It writes its replacement for
+ * the text of line "lp" from offset "start" to "end" to "dst" and
+ * returns the new length.
+ */
+typedef int	(*LTF)(char *, const struct line *, int, int, void *);
+
 /*
  * All repeated structures are kept as linked lists of structures.
  * All of these start with a LIST structure (except lines, which
@@ -320,18 +350,6 @@ struct mgwin {
 #define WFMODE	0x10			/* Update mode line.		 */
 #define WFSAVE	0x20			/* Don't reframe even if cursor off-screen */
 
-/*
- * Variable structure.
- */
-struct varentry {
-	SLIST_ENTRY(varentry) entry;
-	char	 v_buf[BUFSIZE];
-	char	*v_name;
-	char	*v_vals;
-	int	 v_count;
-};
-SLIST_HEAD(vhead, varentry);
-
 /*
  * Window flags
  */
@@ -385,6 +403,14 @@ struct buffer {
 	int		 b_dotline;	/* Line number of dot */
 	int		 b_markline;	/* Line number of mark */
 	int		 b_lines;	/* Number of lines in file	*/
+	void		*b_data;	/* Mode data about the lines	 */
+	void	       (*b_freedata)(struct buffer *); /* Release b_data */
+	int		 b_editline;	/* First line changed, for b_data */
+	struct lineidx	*b_lidx;	/* Line starts, by line number	 */
+	int		 b_lidxsize;
+	int		 b_lidxvalid;	/* Entries below this are good	 */
+	struct narrow	*b_narrow;	/* Set if narrowed		 */
+	struct buffer	*b_base;	/* Buffer whose text we show	 */
 };
 #define b_bufp	b_list.l_p.x_bp
 #define b_bname b_list.l_name
@@ -411,7 +437,8 @@ struct undo_rec {
 		DELETE,
 		BOUNDARY,
 		MODIFIED,
-		DELREG
+		DELREG,
+		PERMUTE
 	} type;
 	struct region	 region;
 	int		 pos;
@@ -449,6 +476,8 @@ void		 ttflush(void);
 int		 ttgetc(void);
 int		 ttwait(int);
 int		 charswaiting(void);
+int		 ttwatch(int, void (*)(int));
+int		 ttidle(void);
 
 /* dir.c */
 void		 dirinit(void);
@@ -480,16 +509,24 @@ int		 reqnewline(int, int);
 int		 writeout(FILE **, struct buffer *, char *);
 void		 upmodes(struct buffer *);
 size_t		 xbasename(char *, const char *, size_t);
+size_t		 xdirname(char *, const char *, size_t);
 int		 do_filevisitalt(char *);
 
 /* line.c X */
 struct line	*lalloc(int);
 int		 lrealloc(struct line *, int);
+struct line	*lclone(struct line *);
+int		 lwritable(struct line *);
 void		 lfree(struct line *);
 void		 lchange(int);
+void		 ledited(struct buffer *, int);
+void		 lcount(struct buffer *, int);
 int		 linsert(int, int);
 int		 lnewline_at(struct line *, int);
 int		 lnewline(void);
+int		 linsertblock(const char *, int);
+int		 ltransform(struct region *, int, LTF, void *);
+int		 lpermute(struct line *, int, int, const int *);
 int		 ldelete(RSIZE, int);
 int		 ldelnewline(void);
 int		 lreplace(RSIZE, char *);
@@ -502,6 +539,7 @@ void		 kdelete(void);
 int		 kinsert(int, int);
 int		 kremove(int);
 int		 kchunk(char *, RSIZE, int);
+int		 kregion(struct region *);
 int		 killline(int, int);
 int		 yank(int, int);
 
@@ -532,6 +570,8 @@ int		 addlinef(struct buffer *, char *, ...);
 #define	 addline(bp, text)	addlinef(bp, "%s", text)
 int		 anycb(int);
 int		 bclear(struct buffer *);
+int		 bsharing(struct buffer *);
+void		 bunchanged(struct buffer *);
 int		 showbuffer(struct buffer *, struct mgwin *, int);
 int		 augbname(char *, const char *, size_t);
 struct mgwin    *popbuf(struct buffer *, int);
@@ -545,6 +585,8 @@ int		 revertbuffer(int, int);
 int		 dorevert(void);
 int		 diffbuffer(int, int);
 struct buffer	*findbuffer(char *);
+int		 clonebuffer(int, int);
+int		 cloneindirect(int, int);
 
 /* display.c */
 int		 vtresize(int, int, int);
@@ -577,7 +619,6 @@ int		 ffgetline(FILE *, char *, int, int *);
 int		 fbackupfile(const char *);
 char		*adjustname(const char *, int);
 FILE		*startupfile(char *, char *, char *, size_t);
-int		 copy(char *, char *);
 struct list	*make_file_list(char *);
 #ifndef fisdir
 int		 fisdir(const char *);
@@ -593,6 +634,7 @@ int		 do_meta(int, int);
 int		 bsmap(int, int);
 void		 ungetkey(int);
 int		 getkey(int);
+void		 keywait(void);
 int		 doin(void);
 int		 rescan(int, int);
 int		 universal_argument(int, int);
@@ -601,11 +643,16 @@ int		 negative_argument(int, int);
 int		 ask_selfinsert(int, int);
 int		 selfinsert(int, int);
 int		 quote(int, int);
+int		 mgwrap(PF, int, int);
 
 /* main.c */
 int		 ctrlg(int, int);
 int		 quit(int, int);
 
+/* batch.c */
+int		 batchstart(const char *, int, char **, int);
+int		 batchrun(const char *);
+
 /* ttyio.c */
 void		 panic(char *);
 
@@ -647,6 +694,7 @@ int		 justone(int, int);
 int		 delwhite(int, int);
 int		 delleadwhite(int, int);
 int		 deltrailwhite(int, int);
+int		 cleanwhite(int, int);
 int		 lfindent(int, int);
 int		 indent(int, int);
 int		 forwdel(int, int);
@@ -661,6 +709,11 @@ int 		 poptag(int, int);
 int		 tagsvisit(int, int);
 int		 curtoken(int, int, char *);
 
+/* cindex.c X */
+#define CIDXFN		".mgtags"	/* index file in a project root	*/
+int		 cindex(char *, size_t);
+void		 cindexsaved(const char *);
+
 /* cscope.c */
 int		 cssymbol(int, int);
 int		 csdefinition(int, int);
@@ -689,6 +742,8 @@ int		 evalbuffer(int, int);
 int		 evalfile(int, int);
 int		 load(FILE *, const char *);
 int		 excline(char *, int, int);
+int		 excargs(PF, int, int, char * const [], const int [], int);
+int		 excescape(char **);
 char		*skipwhite(char *);
 
 /* help.c X */
@@ -727,6 +782,18 @@ int		 killregion(int, int);
 int		 copyregion(int, int);
 int		 lowerregion(int, int);
 int		 upperregion(int, int);
+int		 lt_downcase(char *, const struct line *, int, int, void *);
+int		 lt_upcase(char *, const struct line *, int, int, void *);
+int		 tabifyregion(int, int);
+int		 untabifyregion(int, int);
+int		 sortlines(int, int);
+int		 sortnumfields(int, int);
+int		 reverseregion(int, int);
+int		 deldupelines(int, int);
+int		 narrowregion(int, int);
+int		 widen(int, int);
+void		 narrowlink(struct buffer *, int);
+void		 bwiden(struct buffer *);
 int		 prefixregion(int, int);
 int		 setprefix(int, int);
 int		 region_get_data(struct region *, char *, int);
@@ -797,6 +864,7 @@ int		 cntnonmatchlines(int, int);
 /* undo.c X */
 void		 free_undo_record(struct undo_rec *);
 int		 undo_dump(int, int);
+unsigned int	 undo_count(void);
 int		 undo_enabled(void);
 int		 undo_enable(int, int);
 int		 undo_add_boundary(int, int);
@@ -805,6 +873,7 @@ int		 undo_add_insert(struct line *, int, int);
 int		 undo_add_delete(struct line *, int, int, int);
 int		 undo_boundary_enable(int, int);
 int		 undo_add_change(struct line *, int, int);
+int		 undo_add_permute(struct line *, int, const int *);
 int		 undo(int, int);
 
 /* autoexec.c X */
@@ -819,6 +888,7 @@ int		 cc_char(int, int);
 int		 cc_tab(int, int);
 int		 cc_indent(int, int);
 int		 cc_lfindent(int, int);
+int		 cc_match(struct line *, int, int, struct line **, int *);
 
 /* grep.c X */
 #ifdef ENABLE_COMPILE_GREP
@@ -839,8 +909,16 @@ int		 dobeep_msgs(const char *, const char *);
 int		 dobeep_msg(const char *);
 void		 dobeep(void);
 
+#ifdef TRACE
+/* trace.c X */
+void		 traceinit(void);
+int		 tracecmd(PF, int, int);
+int		 tracedump(int, int);
+#endif	/* TRACE */
+
 /* interpreter.c */
 int		 foundparen(char *, int, int);
+int		 parenpending(void);
 void		 cleanup(void);
 
 /*
@@ -850,7 +928,6 @@ extern struct buffer	*bheadp;
 extern struct buffer	*curbp;
 extern struct mgwin	*curwp;
 extern struct mgwin	*wheadp;
-extern struct vhead	 varhead;
 extern int		 thisflag;
 extern int		 lastflag;
 extern int		 curgoal;
@@ -6,27 +6,129 @@
  * by Robert A. Larson
  */
 
+#include <sys/mman.h>
 #include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <ctype.h>
+#include <dirent.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <grp.h>
 #include <limits.h>
+#include <poll.h>
+#include <pwd.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "def.h"
 #include "funmap.h"
 #include "kbd.h"
 
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+#ifdef HAVE_SYS_SYSMACROS_H
+#include <sys/sysmacros.h>	/* major(), minor() */
+#endif
+
+/*
+ * A directory entry, as listed on one line of a dired buffer.  The
+ * listing is read with readdir(3) and stat'ed directly, and the
+ * buffer's b_data keeps a struct dlist mapping each line back to its
+ * entry, so file names never have to be parsed out of the text.
+ */
+struct dentry {
+	struct dentry	*de_next;	/* hash chain			*/
+	RB_ENTRY(dentry) de_node;	/* tree by name			*/
+	struct ddir	*de_dir;	/* directory it is in		*/
+	struct ddir	*de_sub;	/* its own listing, if expanded */
+	struct line	*de_lp;		/* line listing this entry	*/
+	char		*de_link;	/* symbolic link target		*/
+	struct timespec	 de_mtime;
+	off_t		 de_size;
+	long long	 de_blocks;	/* 512 byte blocks		*/
+	dev_t		 de_rdev;
+	nlink_t		 de_nlink;
+	uid_t		 de_uid;
+	gid_t		 de_gid;
+	mode_t		 de_mode;
+	unsigned int	 de_gen;	/* see d_resync()		*/
+	int		 de_off;	/* offset of the name in line	*/
+	char		 de_name[1];	/* file name, without directory */
+};
+
+/*
+ * A directory shown in a dired buffer: the buffer's own, or one
+ * expanded inline under its entry.  Each keeps its entries in a tree
+ * by name.  An expansion's lines follow its entry's line, so the
+ * buffer is in the order of a depth-first walk of the trees, and a
+ * single entry can be found, added or removed without walking lines.
+ */
+struct ddir {
+	LIST_ENTRY(ddir) dd_link;	/* directories of a buffer	*/
+	RB_HEAD(dtree, dentry) dd_tree;	/* entries, by name		*/
+	struct dentry	*dd_parent;	/* entry expanded, or NULL	*/
+	char		*dd_path;	/* relative to the buffer's	*/
+	int		 dd_depth;
+	int		 dd_dfd;	/* the directory		*/
+	int		 dd_wd;		/* its inotify watch, or -1	*/
+};
+
+struct dlist {
+	LIST_HEAD(, ddir) dl_dirs;
+	struct ddir	 *dl_top;	/* the buffer's directory	*/
+	struct dentry	**dl_hash;	/* entries, hashed by line	*/
+	size_t		  dl_hashmask;
+	size_t		  dl_count;
+	int		  dl_dirty;	/* changed by d_notify()	*/
+	unsigned int	  dl_gen;	/* see d_resync()		*/
+	long long	  dl_blocks;	/* for the "total" line		*/
+	int		  dl_wnlink;	/* column widths		*/
+	int		  dl_wuser;
+	int		  dl_wgroup;
+	int		  dl_wsize;
+};
+
+/*
+ * A file operation for the worker processes started by d_runjobs().
+ */
+struct djob {
+	struct dentry	*dj_de;		/* entry acted upon		*/
+	char		*dj_from;	/* path of the entry		*/
+	char		*dj_to;		/* destination, if any		*/
+	int		 dj_op;		/* DJ_* below			*/
+	int		 dj_err;	/* errno; 0 done, -1 not done	*/
+};
+
+#define DJ_DELETE	0
+#define DJ_RMDIR	1
+#define DJ_COPY		2
+#define DJ_RENAME	3
+
+/* What a worker sends back after each job. */
+struct djres {
+	int		 dr_idx;
+	int		 dr_err;
+};
+
+#define DJMAXWORKERS	8
+#define DJCHUNK		(8 * 1024 * 1024) /* copy between stop checks	*/
+
+#define DLHASH(dl, lp)	((((uintptr_t)(lp)) >> 4) & (dl)->dl_hashmask)
+#define DWATCHMASK	(IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+			IN_MODIFY | IN_MOVED_FROM | IN_MOVED_TO)
+#define HALFYEAR	15778476	/* ls(1) shows the year beyond this */
+
 void		 dired_init(void);
 static int	 dired(int, int);
 static int	 d_otherwindow(int, int);
@@ -43,7 +145,7 @@ static int	 d_exec(int, struct buffer *, const char *, const char *, ...);
 static int	 d_shell_command(int, int);
 static int	 d_create_directory(int, int);
 static int	 d_makename(struct line *, char *, size_t);
-static int	 d_warpdot(struct line *, int *);
+static int	 d_warpdot(struct buffer *, struct line *, int *);
 static int	 d_forwpage(int, int);
 static int	 d_backpage(int, int);
 static int	 d_forwline(int, int);
@@ -57,12 +159,71 @@ static int	 gotofile(char*);
 static struct buffer	*refreshbuffer(struct buffer *);
 static int	 createlist(struct buffer *);
 static void	 redelete(struct buffer *);
-static char 	 *findfname(struct line *, char *);
+static char	*findfname(struct buffer *, struct line *);
+static int	 d_list(struct buffer *, const char *);
+static struct dentry *d_statent(int, const char *);
+static int	 d_namecmp(struct dentry *, struct dentry *);
+static struct dentry *d_find(struct ddir *, const char *);
+static struct ddir *d_newdir(struct dlist *, struct dentry *, const char *);
+static DIR	*d_opendir(struct ddir *);
+static int	 d_readdir(struct ddir *);
+static void	 d_freedir(struct dlist *, struct ddir *);
+static void	 d_hashadd(struct dlist *, struct dentry *);
+static int	 d_format(struct dlist *, struct dentry *, char *, size_t);
+static void	 d_modestr(mode_t, char *);
+static int	 d_sizestr(struct dentry *, char *, size_t);
+static void	 d_timestr(struct timespec *, char *, size_t);
+static const char *d_idname(unsigned int, int);
+static struct dentry *d_entry(struct buffer *, struct line *);
+static void	 d_delentry(struct buffer *, struct dentry *);
+static void	 d_freelist(struct buffer *);
+static void	 d_rmline(struct buffer *, struct dentry *);
+static void	 d_settotal(struct buffer *);
+static int	 d_addentry(struct buffer *, struct ddir *, const char *);
+static struct line *d_after(struct buffer *, struct dentry *);
+static int	 d_order(struct dentry *, struct dentry *);
+static int	 d_expand(struct buffer *, struct dentry *);
+static void	 d_collapse(struct buffer *, struct dentry *);
+static struct dentry *d_lookup(struct dlist *, const char *);
+static int	 d_insertsubdir(int, int);
+static int	 d_togglesubdir(int, int);
+static int	 d_subdir(struct dentry *);
+static int	 d_setline(struct buffer *, struct dentry *);
+static int	 d_widths(struct dlist *, struct dentry *);
+static void	 d_relayout(struct buffer *);
+static void	 d_shift(struct buffer *, struct dentry *, int);
+static int	 d_before(struct buffer *, struct dentry *, struct line *);
+static void	 d_fixdot(struct buffer *);
+static void	 d_resync(struct buffer *, struct ddir *);
+static int	 d_watching(struct buffer *);
+#ifdef HAVE_SYS_INOTIFY_H
+static void	 d_notify(int);
+static int	 d_wdshared(struct ddir *);
+static void	 d_event(struct buffer *, struct ddir *,
+		    struct inotify_event *);
+#endif
+static int	 d_transfer(int, int);
+static int	 d_runjobs(struct buffer *, struct djob *, int, const char *);
+static __dead void d_worker(struct djob *, int, volatile unsigned int *, int);
+static void	 d_jobterm(int);
+static int	 d_dojob(struct djob *);
+static int	 d_copyfile(const char *, const char *);
+static void	 d_jobdone(struct buffer *, struct djob *);
+static void	 d_jobsunder(struct djob *, int, struct dentry *);
+static void	 d_freejobs(struct djob *, int);
 
 extern struct keymap_s helpmap, cXmap, metamap;
 
 const char DDELCHAR = 'D';
 
+static volatile sig_atomic_t d_jobstop;	/* worker told to stop */
+
+#ifdef HAVE_SYS_INOTIFY_H
+static int	 d_ifd = -1;		/* inotify, for all listings */
+#endif
+
+RB_GENERATE_STATIC(dtree, dentry, de_node, d_namecmp);
+
 /*
  * Structure which holds a linked list of file names marked for
  * deletion. Used to maintain dired buffer 'state' between refreshes.
@@ -73,6 +234,7 @@ struct delentry {
 };
 SLIST_HEAD(slisthead, delentry) delhead = SLIST_HEAD_INITIALIZER(delhead);
 
+
 static PF dirednul[] = {
 	setmark,		/* ^@ */
 	gotobol,		/* ^A */
@@ -83,6 +245,7 @@ static PF dirednul[] = {
 	forwchar,		/* ^F */
 	ctrlg,			/* ^G */
 	NULL,			/* ^H */
+	d_togglesubdir,		/* ^I */
 };
 
 static PF diredcl[] = {
@@ -135,7 +298,7 @@ static PF direda[] = {
 	d_findfile,		/* f */
 	d_refreshbuffer,	/* g */
 	rescan,			/* h */
-	rescan,			/* i */
+	d_insertsubdir,		/* i */
 	d_gotofile		/* j */
 };
 
@@ -182,7 +345,7 @@ static struct KEYMAPE (8) diredmap = {
 	rescan,
 	{
 		{
-			CCHR('@'), CCHR('H'), dirednul, (KEYMAP *) & helpmap
+			CCHR('@'), CCHR('I'), dirednul, (KEYMAP *) & helpmap
 		},
 		{
 			CCHR('L'), CCHR('X'), diredcl, (KEYMAP *) & cXmap
@@ -221,6 +384,7 @@ dired_init(void)
 	funmap_add(d_ffotherwindow, "dired-find-file-other-window", 1);
 	funmap_add(d_del, "dired-flag-file-deletion", 0);
 	funmap_add(d_gotofile, "dired-goto-file", 1);
+	funmap_add(d_insertsubdir, "dired-maybe-insert-subdir", 0);
 	funmap_add(d_forwline, "dired-next-line", 0);
 	funmap_add(d_otherwindow, "dired-other-window", 0);
 	funmap_add(d_backline, "dired-previous-line", 0);
@@ -228,6 +392,7 @@ dired_init(void)
 	funmap_add(d_backpage, "dired-scroll-down", 0);
 	funmap_add(d_forwpage, "dired-scroll-up", 0);
 	funmap_add(d_shell_command, "dired-shell-command", 1);
+	funmap_add(d_togglesubdir, "dired-toggle-subdir", 0);
 	funmap_add(d_undel, "dired-unmark", 0);
 	funmap_add(d_undelbak, "dired-unmark-backward", 0);
 	funmap_add(d_killbuffer_cmd, "quit-window", 0);
@@ -301,7 +466,7 @@ d_del(int f, int n)
 	if (n < 0)
 		return (FALSE);
 	while (n--) {
-		if (d_warpdot(curwp->w_dotp, &curwp->w_doto) == TRUE) {
+		if (d_warpdot(curbp, curwp->w_dotp, &curwp->w_doto) == TRUE) {
 			lputc(curwp->w_dotp, 0, DDELCHAR);
 			curbp->b_flag |= BFDIREDDEL;
 		}
@@ -311,7 +476,7 @@ d_del(int f, int n)
 		}
 	}
 	curwp->w_rflag |= WFEDIT | WFMOVE;
-	return (d_warpdot(curwp->w_dotp, &curwp->w_doto));
+	return (d_warpdot(curbp, curwp->w_dotp, &curwp->w_doto));
 }
 
 int
@@ -328,7 +493,7 @@ d_undel(int f, int n)
 		}
 	}
 	curwp->w_rflag |= WFEDIT | WFMOVE;
-	return (d_warpdot(curwp->w_dotp, &curwp->w_doto));
+	return (d_warpdot(curbp, curwp->w_dotp, &curwp->w_doto));
 }
 
 int
@@ -345,7 +510,7 @@ d_undelbak(int f, int n)
 			lputc(curwp->w_dotp, 0, ' ');
 	}
 	curwp->w_rflag |= WFEDIT | WFMOVE;
-	return (d_warpdot(curwp->w_dotp, &curwp->w_doto));
+	return (d_warpdot(curbp, curwp->w_dotp, &curwp->w_doto));
 }
 
 int
@@ -417,177 +582,486 @@ d_ffotherwindow(int f, int n)
 int
 d_expunge(int f, int n)
 {
-	struct line	*lp, *nlp;
-	char		 fname[NFILEN], sname[NFILEN];
-	int		 tmp;
-
-	tmp = curwp->w_dotline;
-	curwp->w_dotline = 0;
+	struct djob	*jobs = NULL, *nj;
+	struct dentry	*de;
+	struct line	*lp;
+	char		 fname[NFILEN];
+	int		 s, njobs = 0, szjobs = 0;
 
-	for (lp = bfirstlp(curbp); lp != curbp->b_headp; lp = nlp) {
-		curwp->w_dotline++;
-		nlp = lforw(lp);
-		if (llength(lp) && lgetc(lp, 0) == 'D') {
-			switch (d_makename(lp, fname, sizeof(fname))) {
-			case ABORT:
-				dobeep();
-				ewprintf("Bad line in dired buffer");
-				curwp->w_dotline = tmp;
-				return (FALSE);
-			case FALSE:
-				if (unlink(fname) == -1) {
-					(void)xbasename(sname, fname, NFILEN);
-					dobeep();
-					ewprintf("Could not delete '%s'", sname);
-					curwp->w_dotline = tmp;
-					return (FALSE);
-				}
-				break;
-			case TRUE:
-				if (rmdir(fname) == -1) {
-					(void)xbasename(sname, fname, NFILEN);
-					dobeep();
-					ewprintf("Could not delete directory "
-					    "'%s'", sname);
-					curwp->w_dotline = tmp;
-					return (FALSE);
-				}
-				break;
+	for (lp = bfirstlp(curbp); lp != curbp->b_headp; lp = lforw(lp)) {
+		if (llength(lp) == 0 || lgetc(lp, 0) != DDELCHAR)
+			continue;
+		if ((s = d_makename(lp, fname, sizeof(fname))) == ABORT) {
+			dobeep();
+			ewprintf("Bad line in dired buffer");
+			d_freejobs(jobs, njobs);
+			return (FALSE);
+		}
+		if (njobs == szjobs) {
+			szjobs = szjobs ? szjobs * 2 : 16;
+			if ((nj = reallocarray(jobs, szjobs, sizeof(*jobs)))
+			    == NULL) {
+				d_freejobs(jobs, njobs);
+				return (dobeep_msg("Out of memory"));
 			}
-			lfree(lp);
-			curwp->w_bufp->b_lines--;
-			if (tmp > curwp->w_dotline)
-				tmp--;
-			curwp->w_rflag |= WFFULL;
+			jobs = nj;
+		}
+		de = d_entry(curbp, lp);
+		nj = &jobs[njobs];
+		nj->dj_de = de;
+		nj->dj_op = (s == TRUE) ? DJ_RMDIR : DJ_DELETE;
+		nj->dj_to = NULL;
+		if ((nj->dj_from = strdup(fname)) == NULL) {
+			d_freejobs(jobs, njobs);
+			return (dobeep_msg("Out of memory"));
 		}
+		njobs++;
+	}
+	if (njobs == 0) {
+		curbp->b_flag &= ~BFDIREDDEL;
+		return (TRUE);
 	}
-	curwp->w_dotline = tmp;
-	d_warpdot(curwp->w_dotp, &curwp->w_doto);
-
-	/* we have deleted all items successfully, remove del flag */
-	curbp->b_flag &= ~BFDIREDDEL;
 
-	return (TRUE);
+	s = d_runjobs(curbp, jobs, njobs, "Deleting");
+	if (s == TRUE) {
+		/* we have deleted all items successfully, remove del flag */
+		curbp->b_flag &= ~BFDIREDDEL;
+		ewprintf("Deleted %d file%s", njobs, njobs == 1 ? "" : "s");
+	}
+	d_freejobs(jobs, njobs);
+	return (s);
 }
 
 int
 d_copy(int f, int n)
 {
-	struct stat      statbuf;
+	return (d_transfer(n, DJ_COPY));
+}
+
+int
+d_rename(int f, int n)
+{
+	return (d_transfer(n, DJ_RENAME));
+}
+
+/*
+ * Copy or rename the file on the current line or, with an argument,
+ * the next n files.  Several files must go to a directory.
+ */
+static int
+d_transfer(int n, int op)
+{
+	struct stat	 statbuf;
+	struct djob	*jobs;
+	struct line	*lp;
 	char		 frname[NFILEN], toname[NFILEN], sname[NFILEN];
 	char		*topath, *bufp;
-	int		 ret;
+	const char	*verb = (op == DJ_COPY) ? "Copy" : "Rename";
+	int		 i, ret, todir, njobs = 0;
 	size_t		 off;
-	struct buffer	*bp;
 
-	if (d_makename(curwp->w_dotp, frname, sizeof(frname)) != FALSE) {
-		dobeep();
-		ewprintf("Not a file");
-		return (FALSE);
+	if (n < 1)
+		n = 1;
+	if ((jobs = calloc(n, sizeof(*jobs))) == NULL)
+		return (dobeep_msg("Out of memory"));
+	for (i = 0, lp = curwp->w_dotp; i < n && lp != curbp->b_headp;
+	    i++, lp = lforw(lp)) {
+		/* Directories and other lines are skipped. */
+		if (d_makename(lp, frname, sizeof(frname)) != FALSE)
+			continue;
+		jobs[njobs].dj_de = d_entry(curbp, lp);
+		jobs[njobs].dj_op = op;
+		if ((jobs[njobs++].dj_from = strdup(frname)) == NULL) {
+			d_freejobs(jobs, njobs);
+			return (dobeep_msg("Out of memory"));
+		}
 	}
+	if (njobs == 0) {
+		free(jobs);
+		return (dobeep_msg("Not a file"));
+	}
+
 	off = strlcpy(toname, curbp->b_fname, sizeof(toname));
 	if (off >= sizeof(toname) - 1) {	/* can't happen, really */
-		dobeep();
-		ewprintf("Directory name too long");
-		return (FALSE);
+		d_freejobs(jobs, njobs);
+		return (dobeep_msg("Directory name too long"));
+	}
+	(void)xbasename(sname, jobs[0].dj_from, NFILEN);
+	if (njobs == 1)
+		bufp = eread("%s %s to: ", toname, sizeof(toname),
+		    EFDEF | EFNEW | EFCR, verb, sname);
+	else
+		bufp = eread("%s %d files to: ", toname, sizeof(toname),
+		    EFDEF | EFNEW | EFCR, verb, njobs);
+	if (bufp == NULL || bufp[0] == '\0') {
+		d_freejobs(jobs, njobs);
+		return (bufp == NULL ? ABORT : FALSE);
 	}
-	(void)xbasename(sname, frname, NFILEN);
-	bufp = eread("Copy %s to: ", toname, sizeof(toname),
-	    EFDEF | EFNEW | EFCR, sname);
-	if (bufp == NULL)
-		return (ABORT);
-	else if (bufp[0] == '\0')
-		return (FALSE);
 
 	topath = adjustname(toname, TRUE);
-	if (topath && stat(topath, &statbuf) == 0) {
-		if (S_ISDIR(statbuf.st_mode)) {
-			ret = snprintf(toname, sizeof(toname), "%s/%s",
-			    topath, sname);
-			if (ret < 0 || ret >= (int)sizeof(toname) - 1) {
-				dobeep();
-				ewprintf("Directory name too long");
-				return (FALSE);
+	todir = topath != NULL && stat(topath, &statbuf) == 0 &&
+	    S_ISDIR(statbuf.st_mode);
+	if (topath == NULL || (njobs > 1 && !todir)) {
+		d_freejobs(jobs, njobs);
+		return (dobeep_msg(topath == NULL ? "Bad file name" :
+		    "Target must be a directory"));
+	}
+	(void)strlcpy(toname, topath, sizeof(toname));
+	for (i = 0; i < njobs; i++) {
+		if (todir) {
+			(void)xbasename(sname, jobs[i].dj_from, NFILEN);
+			ret = snprintf(frname, sizeof(frname), "%s/%s",
+			    toname, sname);
+			if (ret < 0 || ret >= (int)sizeof(frname) - 1) {
+				d_freejobs(jobs, njobs);
+				return (dobeep_msg("Directory name too long"));
 			}
-			topath = adjustname(toname, TRUE);
+			topath = frname;
+		} else
+			topath = toname;
+		if (strcmp(jobs[i].dj_from, topath) == 0) {
+			ewprintf("Cannot %s to same file: %s",
+			    op == DJ_COPY ? "copy" : "move", topath);
+			d_freejobs(jobs, njobs);
+			return (TRUE);
+		}
+		if ((jobs[i].dj_to = strdup(topath)) == NULL) {
+			d_freejobs(jobs, njobs);
+			return (dobeep_msg("Out of memory"));
 		}
 	}
 
-	if (topath == NULL)
+	ret = d_runjobs(curbp, jobs, njobs, op == DJ_COPY ? "Copying" :
+	    "Moving");
+	if (ret == TRUE)
+		ewprintf("%s: %d file%s", op == DJ_COPY ? "Copy" : "Move",
+		    njobs, njobs == 1 ? "" : "s");
+	d_freejobs(jobs, njobs);
+	return (ret);
+}
+
+/*
+ * Run a batch of file operations in a few worker processes.  Results
+ * come back over a pipe and are applied to the listing as they
+ * arrive, while the echo line shows progress and C-g stops the
+ * workers.  Returns TRUE if every operation succeeded.
+ */
+static int
+d_runjobs(struct buffer *bp, struct djob *jobs, int njobs, const char *verb)
+{
+	struct pollfd		 pfd[2];
+	struct djres		 res[64];
+	struct timespec		 now, last = { 0, 0 };
+	volatile unsigned int	*next;
+	pid_t			 pids[DJMAXWORKERS];
+	ssize_t			 len;
+	long			 ncpu;
+	int			 fds[2], i, nw, done = 0, failed = 0;
+	int			 c, nfds = 2, stop = FALSE;
+	const char		*ferr = NULL;
+
+	for (i = 0; i < njobs; i++)
+		jobs[i].dj_err = -1;
+	next = mmap(NULL, sizeof(*next), PROT_READ | PROT_WRITE,
+	    MAP_ANON | MAP_SHARED, -1, 0);
+	if (next == MAP_FAILED)
+		return (dobeep_msg("Out of memory"));
+	*next = 0;
+	if (pipe(fds) == -1) {
+		munmap((void *)next, sizeof(*next));
+		dobeep();
+		ewprintf("Can't create pipe : %s", strerror(errno));
 		return (FALSE);
+	}
 
-	if (strcmp(frname, topath) == 0) {
-		ewprintf("Cannot copy to same file: %s", frname);
-		return (TRUE);
+	if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		ncpu = 1;
+	nw = njobs < ncpu ? njobs : ncpu;
+	if (nw > DJMAXWORKERS)
+		nw = DJMAXWORKERS;
+	for (i = 0; i < nw; i++) {
+		if ((pids[i] = fork()) == -1) {
+			nw = i;
+			break;
+		}
+		if (pids[i] == 0) {
+			close(fds[0]);
+			d_worker(jobs, njobs, next, fds[1]);
+		}
 	}
-	ret = (copy(frname, topath) >= 0) ? TRUE : FALSE;
-	if (ret != TRUE)
-		return (ret);
-	if ((bp = refreshbuffer(curbp)) == NULL)
+	close(fds[1]);
+	if (nw == 0) {
+		close(fds[0]);
+		munmap((void *)next, sizeof(*next));
+		return (dobeep_msg("Can't fork"));
+	}
+
+	pfd[0].fd = fds[0];
+	pfd[0].events = POLLIN;
+	pfd[1].fd = STDIN_FILENO;
+	pfd[1].events = POLLIN;
+	for (;;) {
+		if (poll(pfd, nfds, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		/*
+		 * Any other key is kept for afterwards.  Only one can be
+		 * pushed back, so stop reading keys once there is one.
+		 */
+		if (nfds == 2 && (pfd[1].revents & POLLIN)) {
+			nfds = 1;
+			if ((c = getkey(FALSE)) != CCHR('G'))
+				ungetkey(c);
+			else {
+				stop = TRUE;
+				for (i = 0; i < nw; i++)
+					(void)kill(pids[i], SIGTERM);
+				ewprintf("%s: stopping", verb);
+			}
+		}
+		if ((pfd[0].revents & (POLLIN | POLLHUP)) == 0)
+			continue;
+		if ((len = read(fds[0], res, sizeof(res))) == -1 &&
+		    errno == EINTR)
+			continue;
+		if (len <= 0)
+			break;		/* all workers are gone */
+		for (i = 0; i < len / (ssize_t)sizeof(res[0]); i++) {
+			jobs[res[i].dr_idx].dj_err = res[i].dr_err;
+			if (res[i].dr_err != 0) {
+				if (failed++ == 0)
+					ferr = jobs[res[i].dr_idx].dj_from;
+			} else {
+				d_jobsunder(jobs, njobs,
+				    jobs[res[i].dr_idx].dj_de);
+				d_jobdone(bp, &jobs[res[i].dr_idx]);
+			}
+			done++;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (!stop && (now.tv_sec - last.tv_sec) * 1000 +
+		    (now.tv_nsec - last.tv_nsec) / 1000000 >= 100) {
+			ewprintf("%s: %d of %d (C-g to stop)", verb, done,
+			    njobs);
+			last = now;
+		}
+	}
+	close(fds[0]);
+	for (i = 0; i < nw; i++)
+		while (waitpid(pids[i], NULL, 0) == -1 && errno == EINTR)
+			;
+	munmap((void *)next, sizeof(*next));
+
+	d_fixdot(bp);
+	if (stop) {
+		ewprintf("%s: stopped after %d of %d", verb, done, njobs);
+		return (ABORT);
+	}
+	if (failed) {
+		for (i = 0; i < njobs; i++)
+			if (jobs[i].dj_from == ferr)
+				break;
+		dobeep();
+		ewprintf("%s: %d failed; %s: %s", verb, failed, ferr,
+		    strerror(jobs[i].dj_err));
 		return (FALSE);
+	}
+	return (TRUE);
+}
 
-	ewprintf("Copy: 1 file");
-	return (showbuffer(bp, curwp, WFFULL | WFMODE));
+/*
+ * Worker process: take jobs off the shared counter until none are
+ * left or we are told to stop.
+ */
+static __dead void
+d_worker(struct djob *jobs, int njobs, volatile unsigned int *next, int fd)
+{
+	struct sigaction	 sa;
+	struct djres		 r;
+	unsigned int		 i;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = d_jobterm;
+	(void)sigaction(SIGTERM, &sa, NULL);
+	while (!d_jobstop &&
+	    (i = __sync_fetch_and_add(next, 1)) < (unsigned int)njobs) {
+		r.dr_idx = i;
+		r.dr_err = d_dojob(&jobs[i]);
+		if (write(fd, &r, sizeof(r)) != sizeof(r))
+			break;
+	}
+	_exit(0);
 }
 
-int
-d_rename(int f, int n)
+static void
+d_jobterm(int signo)
 {
-	struct stat      statbuf;
-	char		 frname[NFILEN], toname[NFILEN];
-	char		*topath, *bufp;
-	int		 ret;
-	size_t		 off;
-	struct buffer	*bp;
-	char		 sname[NFILEN];
+	d_jobstop = 1;
+}
 
-	if (d_makename(curwp->w_dotp, frname, sizeof(frname)) != FALSE) {
-		dobeep();
-		ewprintf("Not a file");
-		return (FALSE);
+/*
+ * Carry out one job in a worker.  Returns 0 or an errno value; must
+ * not touch the display.
+ */
+static int
+d_dojob(struct djob *dj)
+{
+	int	err;
+
+	switch (dj->dj_op) {
+	case DJ_DELETE:
+		return (unlink(dj->dj_from) == -1 ? errno : 0);
+	case DJ_RMDIR:
+		return (rmdir(dj->dj_from) == -1 ? errno : 0);
+	case DJ_COPY:
+		return (d_copyfile(dj->dj_from, dj->dj_to));
+	case DJ_RENAME:
+		if (rename(dj->dj_from, dj->dj_to) == 0)
+			return (0);
+		if (errno != EXDEV)
+			return (errno);
+		/* Across file systems: copy, then remove the original. */
+		if ((err = d_copyfile(dj->dj_from, dj->dj_to)) != 0)
+			return (err);
+		return (unlink(dj->dj_from) == -1 ? errno : 0);
 	}
-	off = strlcpy(toname, curbp->b_fname, sizeof(toname));
-	if (off >= sizeof(toname) - 1) {	/* can't happen, really */
-		dobeep();
-		ewprintf("Directory name too long");
-		return (FALSE);
+	return (EINVAL);
+}
+
+/*
+ * Copy a file's data, mode and (when permitted) owner.  The data
+ * is moved in chunks so a stopped worker can remove a partial copy
+ * it created.
+ */
+static int
+d_copyfile(const char *from, const char *to)
+{
+	struct stat	 sb;
+	char		 buf[65536];
+	ssize_t		 n = 1, w, r;
+	int		 ifd, ofd, created = 1, err = 0;
+
+	if ((ifd = open(from, O_RDONLY)) == -1)
+		return (errno);
+	if (fstat(ifd, &sb) == -1) {
+		err = errno;
+		close(ifd);
+		return (err);
 	}
-	(void)xbasename(sname, frname, NFILEN);
-	bufp = eread("Rename %s to: ", toname,
-	    sizeof(toname), EFDEF | EFNEW | EFCR, sname);
-	if (bufp == NULL)
-		return (ABORT);
-	else if (bufp[0] == '\0')
-		return (FALSE);
+	/* Only a file made here is removed if the copy fails. */
+	if ((ofd = open(to, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR))
+	    == -1 && errno == EEXIST) {
+		created = 0;
+		ofd = open(to, O_WRONLY | O_TRUNC);
+	}
+	if (ofd == -1) {
+		err = errno;
+		close(ifd);
+		return (err);
+	}
+#ifdef HAVE_COPY_FILE_RANGE
+	/* Let the kernel (or file system) do the copy. */
+	while (!d_jobstop &&
+	    (n = copy_file_range(ifd, NULL, ofd, NULL, DJCHUNK, 0)) > 0)
+		;
+	/* Not supported for this pair of files; copy by hand. */
+	if (n == -1 && (errno == EXDEV || errno == EINVAL ||
+	    errno == ENOSYS || errno == EOPNOTSUPP))
+		n = 1;
+#endif
+	while (n > 0 && !d_jobstop && (n = read(ifd, buf, sizeof(buf))) > 0) {
+		for (w = 0; w < n; w += r)
+			if ((r = write(ofd, buf + w, n - w)) == -1)
+				break;
+		if (w < n)
+			n = -1;
+	}
+	if (n == -1)
+		err = errno;
+	else if (d_jobstop)
+		err = EINTR;
+	if (err == 0) {
+		if (fchmod(ofd, sb.st_mode & 07777) == -1)
+			err = errno;
+		/* Changing the owner will usually fail; that's fine. */
+		(void)fchown(ofd, sb.st_uid, sb.st_gid);
+	}
+	close(ifd);
+	if (close(ofd) == -1 && err == 0)
+		err = errno;
+	if (err != 0 && created)
+		(void)unlink(to);
+	return (err);
+}
 
-	topath = adjustname(toname, TRUE);
-	if (topath && stat(topath, &statbuf) == 0) {
-		if (S_ISDIR(statbuf.st_mode)) {
-			ret = snprintf(toname, sizeof(toname), "%s/%s",
-			    topath, sname);
-			if (ret < 0 || ret >= (int)sizeof(toname) - 1) {
-				dobeep();
-				ewprintf("Directory name too long");
-				return (FALSE);
-			}
-			topath = adjustname(toname, TRUE);
+/*
+ * A job finished successfully; bring the affected lines up to date.
+ */
+static void
+d_jobdone(struct buffer *bp, struct djob *dj)
+{
+	struct dlist	*dl = bp->b_data;
+	struct ddir	*dd;
+	char		 dname[NFILEN], fname[NFILEN], path[NFILEN];
+
+	if (dj->dj_op != DJ_COPY) {
+		d_rmline(bp, dj->dj_de);
+		dj->dj_de = NULL;
+	}
+	if (dj->dj_to == NULL)
+		return;
+	/* The copy or new name may appear in this listing. */
+	(void)xdirname(dname, dj->dj_to, sizeof(dname));
+	(void)strlcat(dname, "/", sizeof(dname));
+	LIST_FOREACH(dd, &dl->dl_dirs, dd_link) {
+		(void)snprintf(path, sizeof(path), "%s%s", bp->b_fname,
+		    dd->dd_path);
+		if (strcmp(dname, path) == 0) {
+			(void)xbasename(fname, dj->dj_to, sizeof(fname));
+			(void)d_addentry(bp, dd, fname);
+			break;
 		}
 	}
-	if (topath == NULL)
-		return (FALSE);
+}
 
-	if (strcmp(frname, topath) == 0) {
-		ewprintf("Cannot move to same file: %s", frname);
-		return (TRUE);
+/*
+ * Entry de is about to be removed along with its expansion, which
+ * frees the entries in it; forget them in the jobs still to finish.
+ * Results come back in any order, so emptying a directory can let its
+ * own rmdir finish before the unlinks inside it are seen.
+ */
+static void
+d_jobsunder(struct djob *jobs, int njobs, struct dentry *de)
+{
+	struct ddir	*dd;
+	int		 i;
+
+	if (de == NULL || de->de_sub == NULL)
+		return;
+	for (i = 0; i < njobs; i++) {
+		if (jobs[i].dj_de == NULL)
+			continue;
+		for (dd = jobs[i].dj_de->de_dir; dd->dd_parent != NULL;
+		    dd = dd->dd_parent->de_dir)
+			if (dd->dd_parent == de) {
+				jobs[i].dj_de = NULL;
+				break;
+			}
 	}
-	ret = (rename(frname, topath) >= 0) ? TRUE : FALSE;
-	if (ret != TRUE)
-		return (ret);
-	if ((bp = refreshbuffer(curbp)) == NULL)
-		return (FALSE);
+}
 
-	ewprintf("Move: 1 file");
-	return (showbuffer(bp, curwp, WFFULL | WFMODE));
+static void
+d_freejobs(struct djob *jobs, int njobs)
+{
+	int	i;
+
+	for (i = 0; i < njobs; i++) {
+		free(jobs[i].dj_from);
+		free(jobs[i].dj_to);
+	}
+	free(jobs);
 }
 
 void
@@ -788,12 +1262,15 @@ d_refreshbuffer(int f, int n)
  * Kill then re-open the requested dired buffer.
  * If required, take a note of any files marked for deletion. Then once
  * the buffer has been re-opened, remark the same files as deleted.
+ * Subdirectories that were expanded are expanded again.
  */
 struct buffer *
 refreshbuffer(struct buffer *bp)
 {
-	char		*tmp_b_fname;
-	int	 	 i, tmp_w_dotline, ddel = 0;
+	struct dentry	*de;
+	struct line	*lp;
+	char		*tmp_b_fname, **subs = NULL, **nsubs;
+	int	 	 i, tmp_w_dotline, ddel = 0, nsub = 0;
 
 	/* remember directory path to open later */
 	tmp_b_fname = strdup(bp->b_fname);
@@ -808,15 +1285,40 @@ refreshbuffer(struct buffer *bp)
 	if (bp->b_flag & BFDIREDDEL)
 		ddel = createlist(bp);
 
+	/* and of expansions, parents first */
+	for (lp = bfirstlp(bp); lp != bp->b_headp; lp = lforw(lp)) {
+		if ((de = d_entry(bp, lp)) == NULL || de->de_sub == NULL)
+			continue;
+		if ((nsubs = reallocarray(subs, nsub + 1, sizeof(*subs))) ==
+		    NULL)
+			break;
+		subs = nsubs;
+		if ((subs[nsub] = strdup(findfname(bp, lp))) == NULL)
+			break;
+		nsub++;
+	}
+
 	killbuffer(bp);
 
 	/* dired_() uses findbuffer() to create new buffer */
 	if ((bp = dired_(tmp_b_fname)) == NULL) {
 		free(tmp_b_fname);
+		for (i = 0; i < nsub; i++)
+			free(subs[i]);
+		free(subs);
 		return (NULL);
 	}
 	free(tmp_b_fname);
 
+	for (i = 0; i < nsub; i++) {
+		/* Directories since removed are just left out. */
+		if ((de = d_lookup(bp->b_data, subs[i])) != NULL &&
+		    S_ISDIR(de->de_mode) && de->de_sub == NULL)
+			(void)d_expand(bp, de);
+		free(subs[i]);
+	}
+	free(subs);
+
 	/* remark any previously deleted files with a 'D' */
 	if (ddel)
 		redelete(bp);		
@@ -830,7 +1332,7 @@ refreshbuffer(struct buffer *bp)
 
 	bp->b_dotline = i;
 	bp->b_doto = 0;
-	d_warpdot(bp->b_dotp, &bp->b_doto);
+	d_warpdot(bp, bp->b_dotp, &bp->b_doto);
 
 	curbp = bp;
 
@@ -840,77 +1342,63 @@ refreshbuffer(struct buffer *bp)
 static int
 d_makename(struct line *lp, char *fn, size_t len)
 {
-	int	 start, nlen, ret;
-	char	*namep;
+	struct dentry	*de;
+	int		 ret;
 
-	if (d_warpdot(lp, &start) == FALSE)
+	if ((de = d_entry(curbp, lp)) == NULL)
 		return (ABORT);
-	namep = &lp->l_text[start];
-	nlen = llength(lp) - start;
 
-	ret = snprintf(fn, len, "%s%.*s", curbp->b_fname, nlen, namep);
+	ret = snprintf(fn, len, "%s%s%s", curbp->b_fname, de->de_dir->dd_path,
+	    de->de_name);
 	if (ret < 0 || ret >= (int)len)
 		return (ABORT); /* Name is too long. */
 
 	/* Return TRUE if the entry is a directory. */
-	return ((lgetc(lp, 2) == 'd') ? TRUE : FALSE);
+	return (S_ISDIR(de->de_mode) ? TRUE : FALSE);
 }
 
-#define NAME_FIELD	9
-
+/*
+ * Find the byte offset to the filename on a dired line.
+ */
 static int
-d_warpdot(struct line *dotp, int *doto)
+d_warpdot(struct buffer *bp, struct line *dotp, int *doto)
 {
-	char *tp = dotp->l_text;
-	int off = 0, field = 0, len;
+	struct dentry	*de;
 
-	/*
-	 * Find the byte offset to the (space-delimited) filename
-	 * field in formatted ls output.
-	 */
-	len = llength(dotp);
-	while (off < len) {
-		if (tp[off++] == ' ') {
-			if (++field == NAME_FIELD) {
-				*doto = off;
-				return (TRUE);
-			}
-			/* Skip the space. */
-			while (off < len && tp[off] == ' ')
-				off++;
-		}
+	if ((de = d_entry(bp, dotp)) == NULL) {
+		*doto = 0;
+		return (FALSE);
 	}
-	/* We didn't find the field. */
-	*doto = 0;
-	return (FALSE);
+	*doto = de->de_off;
+	return (TRUE);
 }
 
 static int
 d_forwpage(int f, int n)
 {
 	forwpage(f | FFRAND, n);
-	return (d_warpdot(curwp->w_dotp, &curwp->w_doto));
+	return (d_warpdot(curbp, curwp->w_dotp, &curwp->w_doto));
 }
 
 static int
 d_backpage (int f, int n)
 {
 	backpage(f | FFRAND, n);
-	return (d_warpdot(curwp->w_dotp, &curwp->w_doto));
+	return (d_warpdot(curbp, curwp->w_dotp, &curwp->w_doto));
 }
 
 static int
 d_forwline (int f, int n)
 {
 	forwline(f | FFRAND, n);
-	return (d_warpdot(curwp->w_dotp, &curwp->w_doto));
+	return (d_warpdot(curbp, curwp->w_dotp, &curwp->w_doto));
 }
 
 static int
 d_backline (int f, int n)
 {
 	backline(f | FFRAND, n);
-	return (d_warpdot(curwp->w_dotp, &curwp->w_doto));
+	return (d_warpdot(curbp, curwp->w_dotp, &curwp->w_doto));
 }
 
 int
@@ -924,6 +1412,64 @@ d_filevisitalt (int f, int n)
 	return(do_filevisitalt(fname));
 }
 
+/*
+ * Expand the directory on the current line, if it is not already, and
+ * move to its first entry.
+ */
+static int
+d_insertsubdir(int f, int n)
+{
+	struct dentry	*de;
+
+	if ((de = d_entry(curbp, curwp->w_dotp)) == NULL || !d_subdir(de))
+		return (dobeep_msg("Not a subdirectory"));
+	if (de->de_sub == NULL && d_expand(curbp, de) != TRUE)
+		return (FALSE);
+	d_fixdot(curbp);
+	if (RB_EMPTY(&de->de_sub->dd_tree))
+		return (TRUE);
+	return (d_forwline(FFRAND, 1));
+}
+
+/*
+ * Expand or collapse the directory on the current line.  On any other
+ * line of an expansion, collapse it and move to its directory.
+ */
+static int
+d_togglesubdir(int f, int n)
+{
+	struct dentry	*de, *pde;
+	struct line	*lp;
+
+	if ((de = d_entry(curbp, curwp->w_dotp)) == NULL)
+		return (dobeep_msg("Not a subdirectory"));
+	if (de->de_sub != NULL)
+		d_collapse(curbp, de);
+	else if (d_subdir(de)) {
+		if (d_expand(curbp, de) != TRUE)
+			return (FALSE);
+	} else if ((pde = de->de_dir->dd_parent) != NULL) {
+		for (lp = curwp->w_dotp; lp != pde->de_lp; lp = lback(lp))
+			curwp->w_dotline--;
+		curwp->w_dotp = lp;
+		d_collapse(curbp, pde);
+		(void)d_warpdot(curbp, lp, &curwp->w_doto);
+	} else
+		return (dobeep_msg("Not a subdirectory"));
+	d_fixdot(curbp);
+	return (TRUE);
+}
+
+/*
+ * Can entry de be expanded?
+ */
+static int
+d_subdir(struct dentry *de)
+{
+	return (S_ISDIR(de->de_mode) && strcmp(de->de_name, ".") != 0 &&
+	    strcmp(de->de_name, "..") != 0);
+}
+
 /*
  * XXX dname needs to have enough place to store an additional '/'.
  */
@@ -931,7 +1477,8 @@ struct buffer *
 dired_(char *dname)
 {
 	struct buffer	*bp;
-	int		 i;
+	struct line	*lp;
+	char		*p;
 	size_t		 len;
 
 	if ((dname = adjustname(dname, TRUE)) == NULL) {
@@ -957,7 +1504,10 @@ dired_(char *dname)
 	}
 	for (bp = bheadp; bp != NULL; bp = bp->b_bufp) {
 		if (strcmp(bp->b_fname, dname) == 0) {
-			if (fchecktime(bp) != TRUE)
+			/* A watched listing is kept up to date. */
+			if (d_watching(bp))
+				(void)fupdstat(bp);
+			else if (fchecktime(bp) != TRUE)
 				ewprintf("Directory has changed on disk;"
 				    " type g to update Dired");
 			return (bp);
@@ -967,27 +1517,21 @@ dired_(char *dname)
 	bp = bfind(dname, TRUE);
 	bp->b_flag |= BFREADONLY | BFIGNDIRTY;
 
-	if ((d_exec(2, bp, NULL, "ls", "-al", dname, NULL)) != TRUE)
+	if (d_list(bp, dname) != TRUE)
 		return (NULL);
 
-	/* Find the line with ".." on it. */
+	/* We want dot on the entry right after "..", if possible. */
 	bp->b_dotp = bfirstlp(bp);
-	bp->b_dotline = 1;
-	for (i = 0; i < bp->b_lines; i++) {
-		bp->b_dotp = lforw(bp->b_dotp);
-		bp->b_dotline++;
-		if (d_warpdot(bp->b_dotp, &bp->b_doto) == FALSE)
+	for (lp = bfirstlp(bp); lp != bp->b_headp; lp = lforw(lp)) {
+		if ((p = findfname(bp, lp)) == NULL || strcmp(p, "..") != 0)
 			continue;
-		if (strcmp(ltext(bp->b_dotp) + bp->b_doto, "..") == 0)
-			break;
+		bp->b_dotp = lforw(lp) != bp->b_headp ? lforw(lp) : lp;
+		break;
 	}
-
-	/* We want dot on the entry right after "..", if possible. */
-	if (++i < bp->b_lines - 2) {
-		bp->b_dotp = lforw(bp->b_dotp);
+	bp->b_dotline = 1;
+	for (lp = bfirstlp(bp); lp != bp->b_dotp; lp = lforw(lp))
 		bp->b_dotline++;
-	}
-	d_warpdot(bp->b_dotp, &bp->b_doto);
+	d_warpdot(bp, bp->b_dotp, &bp->b_doto);
 
 	(void)strlcpy(bp->b_fname, dname, sizeof(bp->b_fname));
 	(void)strlcpy(bp->b_cwd, dname, sizeof(bp->b_cwd));
@@ -1014,8 +1558,7 @@ redelete(struct buffer *bp)
 {
 	struct delentry	*dt, *d1 = NULL;
 	struct line	*lp, *nlp;
-	char		 fname[NFILEN];
-	char		*p = fname;
+	char		*p;
 	size_t		 plen, fnlen;
 	int		 finished = 0;
 
@@ -1024,7 +1567,7 @@ redelete(struct buffer *bp)
 
 	for (lp = bfirstlp(bp); lp != bp->b_headp; lp = nlp) {	
 		bp->b_dotp = lp;
-		if ((p = findfname(lp, p)) == NULL) {
+		if ((p = findfname(bp, lp)) == NULL) {
 			nlp = lforw(lp);
 			continue;
 		}
@@ -1063,8 +1606,7 @@ createlist(struct buffer *bp)
 {
 	struct delentry	*d1 = NULL, *d2;
 	struct line	*lp, *nlp;
-	char		 fname[NFILEN];
-	char		*p = fname;
+	char		*p;
 	int		 ret = FALSE;
 
 	for (lp = bfirstlp(bp); lp != bp->b_headp; lp = nlp) {
@@ -1073,7 +1615,7 @@ createlist(struct buffer *bp)
 		 * filename can be extracted from it.
 		 */
 		if (((lp->l_text[0] != DDELCHAR)) ||
-		    ((p = findfname(lp, p)) == NULL)) {
+		    ((p = findfname(bp, lp)) == NULL)) {
 			nlp = lforw(lp);
 			continue;
 		}
@@ -1191,14 +1733,14 @@ gotofile(char *fpth)
 	tmp = 0;
 	for (lp = bfirstlp(curbp); lp != curbp->b_headp; lp = nlp) {
 		tmp++;
-		if ((p = findfname(lp, p)) == NULL) {
+		if ((p = findfname(curbp, lp)) == NULL) {
 			nlp = lforw(lp);
 			continue;
 		}
 		if (strcmp(fname, p) == 0) {
 			curwp->w_dotp = lp;
 			curwp->w_dotline = tmp;
-			(void)d_warpdot(curwp->w_dotp, &curwp->w_doto);
+			(void)d_warpdot(curbp, curwp->w_dotp, &curwp->w_doto);
 			tmp--;
 			break;
 		}
@@ -1214,16 +1756,1019 @@ gotofile(char *fpth)
 }
 
 /*
- * Look for and extract a file name on a dired buffer line.
+ * Look up the file name listed on a dired buffer line.  Files in
+ * expanded subdirectories are named relative to the buffer's directory.
  */
 char *
-findfname(struct line *lp, char *fn)
+findfname(struct buffer *bp, struct line *lp)
+{
+	static char	 path[NFILEN];
+	struct dentry	*de;
+
+	if ((de = d_entry(bp, lp)) == NULL)
+		return (NULL);
+	if (de->de_dir->dd_parent == NULL)
+		return (de->de_name);
+	(void)snprintf(path, sizeof(path), "%s%s", de->de_dir->dd_path,
+	    de->de_name);
+	return (path);
+}
+
+/*
+ * Read directory dname into the empty dired buffer bp, in the format
+ * of "ls -al".  Where inotify(7) is available the directory is watched
+ * from here on and d_notify() keeps the listing current.
+ */
+static int
+d_list(struct buffer *bp, const char *dname)
+{
+	struct dlist	*dl;
+	struct ddir	*dd;
+	struct dentry	*de;
+	char		 buf[NFILEN * 2];
+
+	tzset();
+	if ((dl = calloc(1, sizeof(*dl))) == NULL)
+		return (dobeep_msg("Out of memory"));
+	LIST_INIT(&dl->dl_dirs);
+	bp->b_data = dl;
+	bp->b_freedata = d_freelist;
+	if ((dl->dl_hash = calloc(16, sizeof(*dl->dl_hash))) == NULL)
+		return (dobeep_msg("Out of memory"));
+	dl->dl_hashmask = 15;
+	if ((dd = d_newdir(dl, NULL, dname)) == NULL || d_readdir(dd) == FALSE)
+		return (dobeep_msgs("Can't read directory :", strerror(errno)));
+	dl->dl_top = dd;
+
+	/* Size the columns so they line up, as ls(1) does. */
+	RB_FOREACH(de, dtree, &dd->dd_tree) {
+		dl->dl_blocks += de->de_blocks;
+		(void)d_widths(dl, de);
+	}
+
+	if (addlinef(bp, "  total %lld", (dl->dl_blocks + 1) / 2) == FALSE)
+		return (dobeep_msg("Out of memory"));
+	RB_FOREACH(de, dtree, &dd->dd_tree) {
+		d_format(dl, de, buf, sizeof(buf));
+		if (addlinef(bp, "%s", buf) == FALSE)
+			return (dobeep_msg("Out of memory"));
+		de->de_lp = blastlp(bp);
+		d_hashadd(dl, de);
+	}
+	return (TRUE);
+}
+
+/*
+ * Start listing directory path, either the buffer's own or, if parent
+ * is not NULL, the expansion of that entry.  The directory is kept
+ * open and, where inotify(7) is available, watched.
+ */
+static struct ddir *
+d_newdir(struct dlist *dl, struct dentry *parent, const char *path)
 {
-	int start;
+	struct ddir	*dd;
+	char		 rel[NFILEN];
+	int		 n;
 
-	(void)d_warpdot(lp, &start);
-	if (start < 1)
-		return NULL;
-	fn = &lp->l_text[start];
-	return fn;
+	if ((dd = calloc(1, sizeof(*dd))) == NULL)
+		return (NULL);
+	RB_INIT(&dd->dd_tree);
+	dd->dd_parent = parent;
+	dd->dd_wd = -1;
+	rel[0] = '\0';
+	if (parent != NULL) {
+		dd->dd_depth = parent->de_dir->dd_depth + 1;
+		n = snprintf(rel, sizeof(rel), "%s%s/", parent->de_dir->dd_path,
+		    parent->de_name);
+		if (n < 0 || (size_t)n >= sizeof(rel)) {
+			free(dd);
+			errno = ENAMETOOLONG;
+			return (NULL);
+		}
+	}
+	if ((dd->dd_path = strdup(rel)) == NULL) {
+		free(dd);
+		return (NULL);
+	}
+	if ((dd->dd_dfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) ==
+	    -1) {
+		free(dd->dd_path);
+		free(dd);
+		return (NULL);
+	}
+	LIST_INSERT_HEAD(&dl->dl_dirs, dd, dd_link);
+#ifdef HAVE_SYS_INOTIFY_H
+	/* Watch before reading, so no change can fall in between. */
+	if (d_ifd == -1 &&
+	    (d_ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) != -1 &&
+	    ttwatch(d_ifd, d_notify) == FALSE) {
+		close(d_ifd);
+		d_ifd = -1;
+	}
+	if (d_ifd != -1)
+		dd->dd_wd = inotify_add_watch(d_ifd, path, DWATCHMASK);
+#endif
+	return (dd);
+}
+
+/*
+ * Open the directory for reading from the start.
+ */
+static DIR *
+d_opendir(struct ddir *dd)
+{
+	DIR	*dirp;
+	int	 fd;
+
+	if ((fd = dup(dd->dd_dfd)) == -1)
+		return (NULL);
+	if ((dirp = fdopendir(fd)) == NULL) {
+		close(fd);
+		return (NULL);
+	}
+	rewinddir(dirp);
+	return (dirp);
+}
+
+/*
+ * Read the entries of dd into its tree.  Expansions leave out "." and
+ * "..", which are only listed for the buffer's own directory.
+ */
+static int
+d_readdir(struct ddir *dd)
+{
+	struct dentry	*de;
+	struct dirent	*dp;
+	DIR		*dirp;
+
+	if ((dirp = d_opendir(dd)) == NULL)
+		return (FALSE);
+	while ((dp = readdir(dirp)) != NULL) {
+		if (dd->dd_parent != NULL && (strcmp(dp->d_name, ".") == 0 ||
+		    strcmp(dp->d_name, "..") == 0))
+			continue;
+		/* Entries removed while we read are just skipped. */
+		if ((de = d_statent(dd->dd_dfd, dp->d_name)) != NULL) {
+			de->de_dir = dd;
+			RB_INSERT(dtree, &dd->dd_tree, de);
+		} else if (errno == ENOMEM) {
+			closedir(dirp);
+			return (FALSE);
+		}
+	}
+	closedir(dirp);
+	return (TRUE);
+}
+
+/*
+ * Free a directory's remaining entries and stop watching it.  Entries
+ * that have lines must have been removed with d_rmline() first.
+ */
+static void
+d_freedir(struct dlist *dl, struct ddir *dd)
+{
+	struct dentry	*de, *nde;
+
+	for (de = RB_MIN(dtree, &dd->dd_tree); de != NULL; de = nde) {
+		nde = RB_NEXT(dtree, &dd->dd_tree, de);
+		RB_REMOVE(dtree, &dd->dd_tree, de);
+		free(de->de_link);
+		free(de);
+	}
+	LIST_REMOVE(dd, dd_link);
+	if (dl->dl_top == dd)
+		dl->dl_top = NULL;
+#ifdef HAVE_SYS_INOTIFY_H
+	if (dd->dd_wd != -1 && !d_wdshared(dd))
+		(void)inotify_rm_watch(d_ifd, dd->dd_wd);
+#endif
+	close(dd->dd_dfd);
+	free(dd->dd_path);
+	free(dd);
+}
+
+/*
+ * Enter an entry whose line is set into the line hash, growing the
+ * table as subdirectories are expanded.
+ */
+static void
+d_hashadd(struct dlist *dl, struct dentry *de)
+{
+	struct dentry	**ohash = dl->dl_hash, **nhash, *e, *ne;
+	size_t		  i, omask = dl->dl_hashmask;
+
+	if (dl->dl_count > omask &&
+	    (nhash = calloc((omask + 1) * 2, sizeof(*nhash))) != NULL) {
+		dl->dl_hash = nhash;
+		dl->dl_hashmask = omask * 2 + 1;
+		for (i = 0; i <= omask; i++) {
+			for (e = ohash[i]; e != NULL; e = ne) {
+				ne = e->de_next;
+				e->de_next = nhash[DLHASH(dl, e->de_lp)];
+				nhash[DLHASH(dl, e->de_lp)] = e;
+			}
+		}
+		free(ohash);
+	}
+	de->de_next = dl->dl_hash[DLHASH(dl, de->de_lp)];
+	dl->dl_hash[DLHASH(dl, de->de_lp)] = de;
+	dl->dl_count++;
+}
+
+/*
+ * Stat a directory entry without following symbolic links.
+ */
+static struct dentry *
+d_statent(int dfd, const char *name)
+{
+	struct dentry	*de;
+	char		 link[PATH_MAX];
+	size_t		 len;
+	ssize_t		 llen;
+#ifdef HAVE_STATX
+	struct statx	 stx;
+
+	/* Ask for just what is shown; don't trigger automounts. */
+	if (statx(dfd, name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT,
+	    STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID | STATX_GID |
+	    STATX_MTIME | STATX_SIZE | STATX_BLOCKS, &stx) == -1)
+		return (NULL);
+#else
+	struct stat	 sb;
+
+	if (fstatat(dfd, name, &sb, AT_SYMLINK_NOFOLLOW) == -1)
+		return (NULL);
+#endif
+	len = strlen(name);
+	if ((de = calloc(1, sizeof(*de) + len)) == NULL)
+		return (NULL);
+	memcpy(de->de_name, name, len + 1);
+#ifdef HAVE_STATX
+	de->de_mode = stx.stx_mode;
+	de->de_nlink = stx.stx_nlink;
+	de->de_uid = stx.stx_uid;
+	de->de_gid = stx.stx_gid;
+	de->de_size = stx.stx_size;
+	de->de_blocks = stx.stx_blocks;
+	de->de_rdev = makedev(stx.stx_rdev_major, stx.stx_rdev_minor);
+	de->de_mtime.tv_sec = stx.stx_mtime.tv_sec;
+	de->de_mtime.tv_nsec = stx.stx_mtime.tv_nsec;
+#else
+	de->de_mode = sb.st_mode;
+	de->de_nlink = sb.st_nlink;
+	de->de_uid = sb.st_uid;
+	de->de_gid = sb.st_gid;
+	de->de_size = sb.st_size;
+	de->de_blocks = sb.st_blocks;
+	de->de_rdev = sb.st_rdev;
+	de->de_mtime = sb.st_mtim;
+#endif
+	if (S_ISLNK(de->de_mode) &&
+	    (llen = readlinkat(dfd, name, link, sizeof(link) - 1)) != -1) {
+		link[llen] = '\0';
+		if ((de->de_link = strdup(link)) == NULL) {
+			free(de);
+			return (NULL);
+		}
+	}
+	return (de);
+}
+
+static int
+d_namecmp(struct dentry *a, struct dentry *b)
+{
+	return (strcmp(a->de_name, b->de_name));
+}
+
+/*
+ * Find the entry called name in directory dd.
+ */
+static struct dentry *
+d_find(struct ddir *dd, const char *name)
+{
+	struct dentry	*de = RB_ROOT(&dd->dd_tree);
+	int		 c;
+
+	while (de != NULL) {
+		if ((c = strcmp(name, de->de_name)) == 0)
+			break;
+		de = c < 0 ? RB_LEFT(de, de_node) : RB_RIGHT(de, de_node);
+	}
+	return (de);
+}
+
+/*
+ * Find an entry by its path relative to the buffer's directory.  Only
+ * expanded directories are searched.
+ */
+static struct dentry *
+d_lookup(struct dlist *dl, const char *path)
+{
+	struct ddir	*dd = dl->dl_top;
+	struct dentry	*de = NULL;
+	char		 name[NFILEN];
+	const char	*p;
+	size_t		 len;
+
+	while (dd != NULL) {
+		if ((p = strchr(path, '/')) == NULL)
+			return (d_find(dd, path));
+		if ((len = p - path) >= sizeof(name))
+			return (NULL);
+		memcpy(name, path, len);
+		name[len] = '\0';
+		if ((de = d_find(dd, name)) == NULL)
+			return (NULL);
+		dd = de->de_sub;
+		path = p + 1;
+	}
+	return (NULL);
+}
+
+/*
+ * Format an entry like "ls -al" does, indented two spaces for the
+ * deletion mark.  Names in expansions are indented by depth.
+ */
+static int
+d_format(struct dlist *dl, struct dentry *de, char *buf, size_t len)
+{
+	char	 mode[11], size[32], mtime[16];
+	int	 n;
+
+	d_modestr(de->de_mode, mode);
+	(void)d_sizestr(de, size, sizeof(size));
+	d_timestr(&de->de_mtime, mtime, sizeof(mtime));
+	n = snprintf(buf, len, "  %s %*lu %-*s %-*s %*s %s %*s", mode,
+	    dl->dl_wnlink, (unsigned long)de->de_nlink,
+	    dl->dl_wuser, d_idname(de->de_uid, FALSE),
+	    dl->dl_wgroup, d_idname(de->de_gid, TRUE),
+	    dl->dl_wsize, size, mtime, de->de_dir->dd_depth * 2, "");
+	if (n < 0 || (size_t)n >= len)
+		n = 0;
+	de->de_off = n;
+	if (de->de_link != NULL)
+		(void)snprintf(buf + n, len - n, "%s -> %s", de->de_name,
+		    de->de_link);
+	else
+		(void)strlcpy(buf + n, de->de_name, len - n);
+	return (n);
+}
+
+static void
+d_modestr(mode_t m, char *p)
+{
+	switch (m & S_IFMT) {
+	case S_IFDIR:	*p++ = 'd'; break;
+	case S_IFLNK:	*p++ = 'l'; break;
+	case S_IFCHR:	*p++ = 'c'; break;
+	case S_IFBLK:	*p++ = 'b'; break;
+	case S_IFIFO:	*p++ = 'p'; break;
+	case S_IFSOCK:	*p++ = 's'; break;
+	default:	*p++ = '-'; break;
+	}
+	*p++ = (m & S_IRUSR) ? 'r' : '-';
+	*p++ = (m & S_IWUSR) ? 'w' : '-';
+	if (m & S_ISUID)
+		*p++ = (m & S_IXUSR) ? 's' : 'S';
+	else
+		*p++ = (m & S_IXUSR) ? 'x' : '-';
+	*p++ = (m & S_IRGRP) ? 'r' : '-';
+	*p++ = (m & S_IWGRP) ? 'w' : '-';
+	if (m & S_ISGID)
+		*p++ = (m & S_IXGRP) ? 's' : 'S';
+	else
+		*p++ = (m & S_IXGRP) ? 'x' : '-';
+	*p++ = (m & S_IROTH) ? 'r' : '-';
+	*p++ = (m & S_IWOTH) ? 'w' : '-';
+	if (m & S_ISVTX)
+		*p++ = (m & S_IXOTH) ? 't' : 'T';
+	else
+		*p++ = (m & S_IXOTH) ? 'x' : '-';
+	*p = '\0';
+}
+
+/*
+ * The size column holds the device numbers for device nodes.
+ */
+static int
+d_sizestr(struct dentry *de, char *buf, size_t len)
+{
+	if (S_ISCHR(de->de_mode) || S_ISBLK(de->de_mode))
+		return (snprintf(buf, len, "%u, %u",
+		    (unsigned int)major(de->de_rdev),
+		    (unsigned int)minor(de->de_rdev)));
+	return (snprintf(buf, len, "%lld", (long long)de->de_size));
+}
+
+static void
+d_timestr(struct timespec *ts, char *buf, size_t len)
+{
+	struct tm	 tm;
+	const char	*fmt = "%b %e %H:%M";
+	time_t		 now = time(NULL);
+
+	if (ts->tv_sec > now || ts->tv_sec < now - HALFYEAR)
+		fmt = "%b %e  %Y";
+	/* localtime_r() doesn't recheck the time zone on every call. */
+	if (localtime_r(&ts->tv_sec, &tm) == NULL ||
+	    strftime(buf, len, fmt, &tm) == 0)
+		(void)strlcpy(buf, "?", len);
+}
+
+/*
+ * Map a user or group id to its name.  Directories are usually owned
+ * by a handful of ids, so remember the recent ones.
+ */
+static const char *
+d_idname(unsigned int id, int group)
+{
+	static struct idcache {
+		int		 ic_valid;
+		unsigned int	 ic_id;
+		char		 ic_name[32];
+	} cache[2][16];
+	struct idcache	*ic;
+	struct passwd	*pw;
+	struct group	*gr;
+	const char	*name = NULL;
+
+	ic = &cache[group ? 1 : 0][id & 15];
+	if (ic->ic_valid && ic->ic_id == id)
+		return (ic->ic_name);
+	if (group) {
+		if ((gr = getgrgid(id)) != NULL)
+			name = gr->gr_name;
+	} else if ((pw = getpwuid(id)) != NULL)
+		name = pw->pw_name;
+	if (name != NULL)
+		(void)strlcpy(ic->ic_name, name, sizeof(ic->ic_name));
+	else
+		(void)snprintf(ic->ic_name, sizeof(ic->ic_name), "%u", id);
+	ic->ic_id = id;
+	ic->ic_valid = 1;
+	return (ic->ic_name);
+}
+
+/*
+ * Find the entry listed on line lp of dired buffer bp.
+ */
+static struct dentry *
+d_entry(struct buffer *bp, struct line *lp)
+{
+	struct dlist	*dl;
+	struct dentry	*de;
+
+	if (bp->b_freedata != d_freelist || (dl = bp->b_data) == NULL ||
+	    dl->dl_hash == NULL)
+		return (NULL);
+	for (de = dl->dl_hash[DLHASH(dl, lp)]; de != NULL; de = de->de_next)
+		if (de->de_lp == lp)
+			return (de);
+	return (NULL);
+}
+
+/*
+ * Forget an entry whose line is about to be freed.
+ */
+static void
+d_delentry(struct buffer *bp, struct dentry *de)
+{
+	struct dlist	 *dl = bp->b_data;
+	struct dentry	**dep;
+
+	if (de == NULL)
+		return;
+	for (dep = &dl->dl_hash[DLHASH(dl, de->de_lp)]; *dep != NULL;
+	    dep = &(*dep)->de_next) {
+		if (*dep == de) {
+			*dep = de->de_next;
+			break;
+		}
+	}
+	RB_REMOVE(dtree, &de->de_dir->dd_tree, de);
+	dl->dl_count--;
+	free(de->de_link);
+	free(de);
+}
+
+/*
+ * Release the listing when the buffer is cleared or killed.
+ */
+static void
+d_freelist(struct buffer *bp)
+{
+	struct dlist	*dl = bp->b_data;
+	struct ddir	*dd;
+
+	if (dl == NULL)
+		return;
+	while ((dd = LIST_FIRST(&dl->dl_dirs)) != NULL)
+		d_freedir(dl, dd);
+	free(dl->dl_hash);
+	free(dl);
+}
+
+/*
+ * Remove an entry's line, and those of its expansion, from the listing.
+ */
+static void
+d_rmline(struct buffer *bp, struct dentry *de)
+{
+	struct dlist	*dl = bp->b_data;
+	struct line	*lp;
+
+	if (de == NULL)
+		return;
+	if (de->de_sub != NULL)
+		d_collapse(bp, de);
+	lp = de->de_lp;
+	d_shift(bp, de, -1);
+	if (de->de_dir == dl->dl_top)
+		dl->dl_blocks -= de->de_blocks;
+	d_delentry(bp, de);
+	lfree(lp);
+	bp->b_lines--;
+	ledited(bp, 1);
+	d_settotal(bp);
+}
+
+/*
+ * Update the "total" line at the top of the listing.
+ */
+static void
+d_settotal(struct buffer *bp)
+{
+	struct dlist	*dl = bp->b_data;
+	struct line	*lp = bfirstlp(bp);
+	char		 buf[64];
+	int		 len;
+
+	if (lp == bp->b_headp || d_entry(bp, lp) != NULL)
+		return;
+	len = snprintf(buf, sizeof(buf), "  total %lld",
+	    (dl->dl_blocks + 1) / 2);
+	if (lrealloc(lp, len) == FALSE)
+		return;
+	memcpy(lp->l_text, buf, len);
+	lp->l_used = len;
+	ledited(bp, 1);
+}
+
+/*
+ * Stat file name in directory dd of the listing and insert its line
+ * in order, or re-render the line if it is already listed.
+ */
+static int
+d_addentry(struct buffer *bp, struct ddir *dd, const char *name)
+{
+	struct dlist	*dl = bp->b_data;
+	struct dentry	*de, *ode;
+	struct line	*lp, *nlp;
+
+	if (bp->b_freedata != d_freelist || dl == NULL || dl->dl_hash == NULL)
+		return (FALSE);
+	if ((de = d_statent(dd->dd_dfd, name)) == NULL)
+		return (FALSE);
+	de->de_dir = dd;
+	de->de_gen = dl->dl_gen;
+
+	if ((ode = d_find(dd, name)) != NULL) {
+		/* Update it in place; a pending job may point at it. */
+		if (ode->de_sub != NULL && !S_ISDIR(de->de_mode))
+			d_collapse(bp, ode);
+		if (dd == dl->dl_top)
+			dl->dl_blocks += de->de_blocks - ode->de_blocks;
+		free(ode->de_link);
+		ode->de_link = de->de_link;
+		ode->de_mtime = de->de_mtime;
+		ode->de_size = de->de_size;
+		ode->de_blocks = de->de_blocks;
+		ode->de_rdev = de->de_rdev;
+		ode->de_nlink = de->de_nlink;
+		ode->de_uid = de->de_uid;
+		ode->de_gid = de->de_gid;
+		ode->de_mode = de->de_mode;
+		ode->de_gen = de->de_gen;
+		free(de);
+		de = ode;
+	} else {
+		if ((nlp = lalloc(0)) == NULL) {
+			free(de->de_link);
+			free(de);
+			return (FALSE);
+		}
+		RB_INSERT(dtree, &dd->dd_tree, de);
+		lp = d_after(bp, de);
+		nlp->l_bp = lp->l_bp;
+		nlp->l_fp = lp;
+		lp->l_bp->l_fp = nlp;
+		lp->l_bp = nlp;
+		bp->b_lines++;
+		ledited(bp, 1);
+		de->de_lp = nlp;
+		d_hashadd(dl, de);
+		if (dd == dl->dl_top)
+			dl->dl_blocks += de->de_blocks;
+		d_shift(bp, de, 1);
+	}
+	d_settotal(bp);
+	if (d_widths(dl, de))
+		d_relayout(bp);
+	else
+		d_setline(bp, de);
+	return (TRUE);
+}
+
+/*
+ * The line following entry de and its expansion, if any.
+ */
+static struct line *
+d_after(struct buffer *bp, struct dentry *de)
+{
+	struct dentry	*nde;
+
+	for (; de != NULL; de = de->de_dir->dd_parent)
+		if ((nde = RB_NEXT(dtree, &de->de_dir->dd_tree, de)) != NULL)
+			return (nde->de_lp);
+	return (bp->b_headp);
+}
+
+/*
+ * Compare the positions of the lines of two entries: an entry comes
+ * before its expansion, which comes before its next sibling.
+ */
+static int
+d_order(struct dentry *a, struct dentry *b)
+{
+	int	da = a->de_dir->dd_depth, db = b->de_dir->dd_depth;
+
+	for (; da > db; da--)
+		if ((a = a->de_dir->dd_parent) == b)
+			return (1);
+	for (; db > da; db--)
+		if ((b = b->de_dir->dd_parent) == a)
+			return (-1);
+	while (a->de_dir != b->de_dir) {
+		a = a->de_dir->dd_parent;
+		b = b->de_dir->dd_parent;
+	}
+	return (strcmp(a->de_name, b->de_name));
+}
+
+/*
+ * List the subdirectory of entry de under its line.
+ */
+static int
+d_expand(struct buffer *bp, struct dentry *de)
+{
+	struct dlist	*dl = bp->b_data;
+	struct ddir	*dd;
+	struct dentry	*sde;
+	struct line	*lp, *nlp;
+	char		 path[NFILEN];
+	int		 n, grew = FALSE;
+
+	n = snprintf(path, sizeof(path), "%s%s%s", bp->b_fname,
+	    de->de_dir->dd_path, de->de_name);
+	if (n < 0 || (size_t)n >= sizeof(path))
+		return (dobeep_msg("Directory name too long"));
+	if ((dd = d_newdir(dl, de, path)) == NULL)
+		return (dobeep_msgs("Can't read directory :", strerror(errno)));
+	de->de_sub = dd;
+	if (d_readdir(dd) == FALSE) {
+		d_collapse(bp, de);
+		return (dobeep_msgs("Can't read directory :", strerror(errno)));
+	}
+	lp = lforw(de->de_lp);
+	RB_FOREACH(sde, dtree, &dd->dd_tree) {
+		if ((nlp = lalloc(0)) == NULL) {
+			d_collapse(bp, de);
+			return (dobeep_msg("Out of memory"));
+		}
+		nlp->l_bp = lp->l_bp;
+		nlp->l_fp = lp;
+		lp->l_bp->l_fp = nlp;
+		lp->l_bp = nlp;
+		bp->b_lines++;
+		ledited(bp, 1);
+		sde->de_lp = nlp;
+		d_hashadd(dl, sde);
+		d_shift(bp, sde, 1);
+		if (d_widths(dl, sde))
+			grew = TRUE;
+	}
+	if (grew)
+		d_relayout(bp);
+	else
+		RB_FOREACH(sde, dtree, &dd->dd_tree)
+			(void)d_setline(bp, sde);
+	return (TRUE);
+}
+
+/*
+ * Remove the expansion of entry de, and any within it, and free it.
+ */
+static void
+d_collapse(struct buffer *bp, struct dentry *de)
+{
+	struct ddir	*dd = de->de_sub;
+	struct dentry	*sde, *nde;
+
+	if (dd == NULL)
+		return;
+	for (sde = RB_MIN(dtree, &dd->dd_tree); sde != NULL; sde = nde) {
+		nde = RB_NEXT(dtree, &dd->dd_tree, sde);
+		if (sde->de_lp != NULL)
+			d_rmline(bp, sde);
+	}
+	de->de_sub = NULL;
+	d_freedir(bp->b_data, dd);
+}
+
+/*
+ * Render an entry into its line, keeping any deletion mark.
+ */
+static int
+d_setline(struct buffer *bp, struct dentry *de)
+{
+	struct line	*lp = de->de_lp;
+	char		 buf[NFILEN * 2];
+	int		 len, mark = ' ';
+
+	if (llength(lp) > 0)
+		mark = lgetc(lp, 0);
+	d_format(bp->b_data, de, buf, sizeof(buf));
+	len = strlen(buf);
+	if (lrealloc(lp, len) == FALSE)
+		return (FALSE);
+	memcpy(lp->l_text, buf, len);
+	lp->l_used = len;
+	lputc(lp, 0, mark);
+	ledited(bp, 1);
+	return (TRUE);
+}
+
+/*
+ * Widen the columns for an entry.  Returns TRUE if any grew.
+ */
+static int
+d_widths(struct dlist *dl, struct dentry *de)
+{
+	char	 buf[32];
+	int	 w, grew = FALSE;
+
+	w = snprintf(buf, sizeof(buf), "%lu", (unsigned long)de->de_nlink);
+	if (w > dl->dl_wnlink) {
+		dl->dl_wnlink = w;
+		grew = TRUE;
+	}
+	w = strlen(d_idname(de->de_uid, FALSE));
+	if (w > dl->dl_wuser) {
+		dl->dl_wuser = w;
+		grew = TRUE;
+	}
+	w = strlen(d_idname(de->de_gid, TRUE));
+	if (w > dl->dl_wgroup) {
+		dl->dl_wgroup = w;
+		grew = TRUE;
+	}
+	w = d_sizestr(de, buf, sizeof(buf));
+	if (w > dl->dl_wsize) {
+		dl->dl_wsize = w;
+		grew = TRUE;
+	}
+	return (grew);
+}
+
+/*
+ * Re-render every line after the columns changed width.
+ */
+static void
+d_relayout(struct buffer *bp)
+{
+	struct dentry	*de;
+	struct line	*lp;
+
+	for (lp = bfirstlp(bp); lp != bp->b_headp; lp = lforw(lp))
+		if ((de = d_entry(bp, lp)) != NULL)
+			(void)d_setline(bp, de);
+}
+
+/*
+ * Adjust the dot and mark line numbers of the windows showing bp for
+ * the line of entry de, just added (delta 1) or about to be removed
+ * (delta -1).  The lines are in name order, so comparing names tells
+ * which side of dot the line is on without counting lines.
+ */
+static void
+d_shift(struct buffer *bp, struct dentry *de, int delta)
+{
+	struct mgwin	*wp;
+
+	if (bp->b_nwnd == 0) {
+		if (d_before(bp, de, bp->b_dotp))
+			bp->b_dotline += delta;
+		if (d_before(bp, de, bp->b_markp))
+			bp->b_markline += delta;
+		return;
+	}
+	for (wp = wheadp; wp != NULL; wp = wp->w_wndp) {
+		if (wp->w_bufp != bp)
+			continue;
+		if (d_before(bp, de, wp->w_dotp))
+			wp->w_dotline += delta;
+		if (d_before(bp, de, wp->w_markp))
+			wp->w_markline += delta;
+	}
+}
+
+/*
+ * Is the line of entry de before line lp?
+ */
+static int
+d_before(struct buffer *bp, struct dentry *de, struct line *lp)
+{
+	struct dentry	*lde;
+
+	if (lp == NULL)
+		return (FALSE);
+	if (lp == bp->b_headp)
+		return (TRUE);
+	/* The only line without an entry is "total", at the top. */
+	if ((lde = d_entry(bp, lp)) == NULL)
+		return (FALSE);
+	return (d_order(de, lde) < 0);
+}
+
+/*
+ * After lines were added or removed, keep dot on a file name and have
+ * the windows showing bp redrawn.
+ */
+static void
+d_fixdot(struct buffer *bp)
+{
+	struct mgwin	*wp;
+
+	for (wp = wheadp; wp != NULL; wp = wp->w_wndp) {
+		if (wp->w_bufp != bp)
+			continue;
+		if (wp->w_dotp == bp->b_headp && lback(bp->b_headp) !=
+		    bp->b_headp) {
+			wp->w_dotp = lback(bp->b_headp);
+			wp->w_dotline--;
+			wp->w_doto = 0;
+		}
+		/* Lines that were freed left dot at the start of the next. */
+		if (wp->w_doto == 0 || wp->w_doto > llength(wp->w_dotp))
+			(void)d_warpdot(bp, wp->w_dotp, &wp->w_doto);
+		wp->w_rflag |= WFFULL | WFMODE;
+	}
+	if (bp->b_nwnd == 0 && bp->b_dotp == bp->b_headp &&
+	    lback(bp->b_headp) != bp->b_headp) {
+		bp->b_dotp = lback(bp->b_headp);
+		bp->b_dotline--;
+		bp->b_doto = 0;
+	}
+}
+
+/*
+ * Bring directory dd of the listing, and the expansions within it, up
+ * to date: re-stat every file, list new ones and drop the ones that
+ * are gone.  Used when inotify events were lost.
+ */
+static void
+d_resync(struct buffer *bp, struct ddir *dd)
+{
+	struct dlist	*dl = bp->b_data;
+	struct dentry	*de, *nde;
+	struct dirent	*dp;
+	DIR		*dirp;
+
+	if ((dirp = d_opendir(dd)) == NULL)
+		return;
+	dl->dl_gen++;
+	while ((dp = readdir(dirp)) != NULL) {
+		if (dd->dd_parent != NULL && (strcmp(dp->d_name, ".") == 0 ||
+		    strcmp(dp->d_name, "..") == 0))
+			continue;
+		(void)d_addentry(bp, dd, dp->d_name);
+	}
+	closedir(dirp);
+	for (de = RB_MIN(dtree, &dd->dd_tree); de != NULL; de = nde) {
+		nde = RB_NEXT(dtree, &dd->dd_tree, de);
+		if (de->de_gen != dl->dl_gen)
+			d_rmline(bp, de);
+	}
+	RB_FOREACH(de, dtree, &dd->dd_tree)
+		if (de->de_sub != NULL)
+			d_resync(bp, de->de_sub);
+}
+
+/*
+ * Is the listing in bp kept up to date by d_notify()?
+ */
+static int
+d_watching(struct buffer *bp)
+{
+	struct dlist	*dl = bp->b_data;
+
+	return (bp->b_freedata == d_freelist && dl != NULL &&
+	    dl->dl_top != NULL && dl->dl_top->dd_wd != -1);
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+/*
+ * Called from the idle loop when the watched directories changed.
+ * Only the entries named in the events are looked at.  One read's
+ * worth is handled per call so that a busy directory cannot hold off
+ * the keyboard.
+ */
+static void
+d_notify(int fd)
+{
+	union {
+		struct inotify_event	ev;
+		char			buf[16384];
+	} u;
+	struct inotify_event	*ev;
+	struct buffer		*bp;
+	struct dlist		*dl;
+	struct ddir		*dd;
+	char			*p;
+	ssize_t			 n;
+
+	if ((n = read(fd, u.buf, sizeof(u.buf))) <= 0)
+		return;
+	for (p = u.buf; p < u.buf + n; p += sizeof(*ev) + ev->len) {
+		ev = (struct inotify_event *)p;
+		for (bp = bheadp; bp != NULL; bp = bp->b_bufp) {
+			if (bp->b_freedata != d_freelist ||
+			    (dl = bp->b_data) == NULL || dl->dl_top == NULL)
+				continue;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				d_resync(bp, dl->dl_top);
+				dl->dl_dirty = TRUE;
+				continue;
+			}
+			LIST_FOREACH(dd, &dl->dl_dirs, dd_link)
+				if (dd->dd_wd == ev->wd)
+					break;
+			if (dd == NULL)
+				continue;
+			/* This may free expansions, so stop looking. */
+			d_event(bp, dd, ev);
+			dl->dl_dirty = TRUE;
+		}
+	}
+	for (bp = bheadp; bp != NULL; bp = bp->b_bufp) {
+		if (bp->b_freedata != d_freelist ||
+		    (dl = bp->b_data) == NULL || !dl->dl_dirty)
+			continue;
+		dl->dl_dirty = FALSE;
+		/* The directory's own size and time change too. */
+		if (dl->dl_top != NULL)
+			(void)d_addentry(bp, dl->dl_top, ".");
+		d_fixdot(bp);
+	}
+}
+
+/*
+ * Is dd's watch also used for another listing of the same directory?
+ */
+static int
+d_wdshared(struct ddir *dd)
+{
+	struct buffer	*bp;
+	struct dlist	*dl;
+	struct ddir	*odd;
+
+	for (bp = bheadp; bp != NULL; bp = bp->b_bufp) {
+		if (bp->b_freedata != d_freelist || (dl = bp->b_data) == NULL)
+			continue;
+		LIST_FOREACH(odd, &dl->dl_dirs, dd_link)
+			if (odd != dd && odd->dd_wd == dd->dd_wd)
+				return (TRUE);
+	}
+	return (FALSE);
+}
+
+/*
+ * Apply one event to directory dd of the listing in bp.
+ */
+static void
+d_event(struct buffer *bp, struct ddir *dd, struct inotify_event *ev)
+{
+	if (ev->mask & IN_IGNORED) {
+		/* The directory is gone, or on a file system unmounted. */
+		dd->dd_wd = -1;
+		return;
+	}
+	if (ev->len == 0)
+		return;
+	if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+		d_rmline(bp, d_find(dd, ev->name));
+	else
+		/* If it is already gone again, its deletion follows. */
+		(void)d_addentry(bp, dd, ev->name);
 }
+#endif /* HAVE_SYS_INOTIFY_H */
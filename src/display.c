@@ -1040,6 +1040,8 @@ modeline(struct mgwin *wp, int modelinecolor)
 		n += vtputs(" def", wp);
 	if (globalwd())
 		n += vtputs(" gwd", wp);
+	if (bp->b_narrow != NULL)
+		n += vtputs(" Narrow", wp);
 	vtputc(')', wp);
 	++n;
 
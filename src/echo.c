@@ -749,9 +749,9 @@ complt_list(int flags, char *buf, int cpos)
 
 	/*
 	 * Sort the list, since users expect to see it in alphabetic
-	 * order.
+	 * order.  Function and file names already come sorted.
 	 */
-	lh2 = lh;
+	lh2 = (flags & (EFFUNC | EFFILE)) != 0 ? NULL : lh;
 	while (lh2 != NULL) {
 		lh3 = lh2->l_next;
 		while (lh3 != NULL) {
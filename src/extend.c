@@ -572,7 +572,7 @@ int
 evalexpr(int f, int n)
 {
 	char	 exbuf[BUFSIZE], *bufp;
-	int	 llen;
+	int	 llen, s;
 
 	if ((bufp = eread("Eval: ", exbuf, sizeof(exbuf),
 	    EFNEW | EFCR)) == NULL)
@@ -581,7 +581,10 @@ evalexpr(int f, int n)
 		return (FALSE);
 	llen = strlen(bufp);
 
-	return (excline(exbuf, llen, 1));
+	if ((s = excline(exbuf, llen, 1)) == TRUE && parenpending())
+		s = dobeep_msg("Opening and closing parentheses error");
+	cleanup();
+	return (s);
 }
 
 /*
@@ -610,6 +613,11 @@ evalbuffer(int f, int n)
 			return (s);
 		}
 	}
+	if (parenpending()) {
+		cleanup();
+		return (dobeep_num("Opening and closing parentheses error "
+		    "line:", lnum));
+	}
 	cleanup();
 	return (TRUE);
 }
@@ -672,8 +680,17 @@ load(FILE *ffp, const char *fname)
 		}
 	}
 	excbuf[nbytes] = '\0';
-	if (s != FIOEOF || (nbytes && excline(excbuf, nbytes, ++line) != TRUE))
+	if (s != FIOEOF ||
+	    (nbytes && excline(excbuf, nbytes, ++line) != TRUE)) {
+		cleanup();
+		return (FALSE);
+	}
+	if (parenpending()) {
+		cleanup();
+		dobeep();
+		ewprintf("Unterminated expression in file %s", fname);
 		return (FALSE);
+	}
 	return (TRUE);
 }
 
@@ -707,7 +724,7 @@ excline(char *line, int llen, int lnum)
 	funcp = skipwhite(line);
 	if (*funcp == '\0')
 		return (TRUE);	/* No error on blank lines */
-	if (*funcp == '(')
+	if (*funcp == '(' || parenpending())
 		return (foundparen(funcp, llen, lnum));
 	line = parsetoken(funcp);
 	if (*line != '\0') {
@@ -781,71 +798,8 @@ excline(char *line, int llen, int lnum)
 				}
 				if (*argp != '\\')
 					c = *argp++;
-				else {
-					switch (*++argp) {
-					case 't':
-					case 'T':
-						c = CCHR('I');
-						break;
-					case 'n':
-					case 'N':
-						c = CCHR('J');
-						break;
-					case 'r':
-					case 'R':
-						c = CCHR('M');
-						break;
-					case 'e':
-					case 'E':
-						c = CCHR('[');
-						break;
-					case '^':
-						/*
-						 * split into two statements
-						 * due to bug in OSK cpp
-						 */
-						if (*++argp == '\\')
-							++argp;
-						c = CHARMASK(*argp);
-						c = ISLOWER(c) ?
-						    CCHR(TOUPPER(c)) : CCHR(c);
-						break;
-					case '0':
-					case '1':
-					case '2':
-					case '3':
-					case '4':
-					case '5':
-					case '6':
-					case '7':
-						c = *argp - '0';
-						if (argp[1] <= '7' &&
-						    argp[1] >= '0') {
-							c <<= 3;
-							c += *++argp - '0';
-							if (argp[1] <= '7' &&
-							    argp[1] >= '0') {
-								c <<= 3;
-								c += *++argp
-								    - '0';
-							}
-						}
-						break;
-					case 'f':
-					case 'F':
-						c = *++argp - '0';
-						if (ISDIGIT(argp[1])) {
-							c *= 10;
-							c += *++argp - '0';
-						}
-						c += KFIRST;
-						break;
-					default:
-						c = CHARMASK(*argp);
-						break;
-					}
-					argp++;
-				}
+				else
+					c = excescape(&argp);
 				if (bind == BINDARG)
 					key.k_chars[key.k_count++] = c;
 				else
@@ -913,6 +867,125 @@ cleanup:
 	return (status);
 }
 
+/*
+ * excargs - run a command with its string arguments already split out,
+ * the way excline() runs one once it has parsed a line: the arguments
+ * are queued up to answer the command's eread() prompts in turn.
+ */
+int
+excargs(PF fp, int f, int n, char * const argv[], const int argl[], int argc)
+{
+	struct line	*lp, *np;
+	int		 i, status;
+
+	if (macrodef || inmacro)
+		return (dobeep_msg("Not now!"));
+
+	if ((np = lalloc(0)) == NULL)
+		return (FALSE);
+	np->l_fp = np->l_bp = maclcur = np;
+	for (i = 0; i < argc; i++) {
+		if ((lp = lalloc(argl[i])) == NULL) {
+			status = FALSE;
+			goto cleanup;
+		}
+		memcpy(ltext(lp), argv[i], argl[i]);
+		lp->l_fp = np->l_fp;
+		lp->l_bp = np;
+		np->l_fp = lp;
+		np = lp;
+	}
+	inmacro = TRUE;
+	maclcur = maclcur->l_fp;
+	status = (*fp)(f, n);
+	inmacro = FALSE;
+cleanup:
+	lp = maclcur->l_fp;
+	while (lp != maclcur) {
+		np = lp->l_fp;
+		free(lp->l_text);
+		free(lp);
+		lp = np;
+	}
+	free(lp->l_text);
+	free(lp);
+	maclhead = NULL;
+	macrodef = FALSE;
+	return (status);
+}
+
+/*
+ * excescape - decode the backslash escape sequence starting at *sp in a
+ * quoted argument, and advance *sp past it.
+ */
+int
+excescape(char **sp)
+{
+	char	*argp = *sp;
+	int	 c;
+
+	switch (*++argp) {
+	case 't':
+	case 'T':
+		c = CCHR('I');
+		break;
+	case 'n':
+	case 'N':
+		c = CCHR('J');
+		break;
+	case 'r':
+	case 'R':
+		c = CCHR('M');
+		break;
+	case 'e':
+	case 'E':
+		c = CCHR('[');
+		break;
+	case '^':
+		/*
+		 * split into two statements
+		 * due to bug in OSK cpp
+		 */
+		if (*++argp == '\\')
+			++argp;
+		c = CHARMASK(*argp);
+		c = ISLOWER(c) ? CCHR(TOUPPER(c)) : CCHR(c);
+		break;
+	case '0':
+	case '1':
+	case '2':
+	case '3':
+	case '4':
+	case '5':
+	case '6':
+	case '7':
+		c = *argp - '0';
+		if (argp[1] <= '7' && argp[1] >= '0') {
+			c <<= 3;
+			c += *++argp - '0';
+			if (argp[1] <= '7' && argp[1] >= '0') {
+				c <<= 3;
+				c += *++argp - '0';
+			}
+		}
+		break;
+	case 'f':
+	case 'F':
+		c = *++argp - '0';
+		if (ISDIGIT(argp[1])) {
+			c *= 10;
+			c += *++argp - '0';
+		}
+		c += KFIRST;
+		break;
+	default:
+		c = CHARMASK(*argp);
+		break;
+	}
+	*sp = argp + 1;
+	return (c);
+}
+
 /*
  * a pair of utility functions for the above
  */
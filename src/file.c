@@ -19,8 +19,6 @@
 
 static int reqnl = FALSE;  /* Don't enforce final newline by default. */
 
-size_t xdirname(char *, const char *, size_t);
-
 /*
  * Insert a file into the current buffer.  Real easy - just call the
  * insertfile routine with the file name.
@@ -216,7 +214,7 @@ readin(char *fname)
 	}
 
 	for (wp = wheadp; wp != NULL; wp = wp->w_wndp) {
-		if (wp->w_bufp == curbp) {
+		if (wp->w_bufp->b_headp == curbp->b_headp) {
 			wp->w_dotp = wp->w_linep = bfirstlp(curbp);
 			wp->w_doto = 0;
 			wp->w_markp = NULL;
@@ -467,7 +465,7 @@ endoffile:
 	 * as we've accounted for this fencepost in our arithmetic
 	 */
 	if (lforw(curwp->w_dotp) == curwp->w_bufp->b_headp) {
-		curwp->w_bufp->b_lines--;
+		lcount(curwp->w_bufp, -1);
 		curwp->w_markline--;
 	} else
 		(void)ldelnewline();
@@ -496,7 +494,7 @@ endoffile:
 out:		lp2 = NULL;
 	}
 	for (wp = wheadp; wp != NULL; wp = wp->w_wndp) {
-		if (wp->w_bufp == curbp) {
+		if (wp->w_bufp->b_headp == curbp->b_headp) {
 			wp->w_rflag |= WFMODE | WFEDIT;
 			if (wp != curwp && lp2 != NULL) {
 				if (wp->w_dotp == lp1)
@@ -508,7 +506,7 @@ out:		lp2 = NULL;
 			}
 		}
 	}
-	bp->b_lines += nline;
+	lcount(bp, nline);
 cleanup:
 	undo_enable(FFRAND, x);
 	if (pipe)
@@ -571,8 +569,8 @@ filewrite(int f, int n)
 		if ((curbp->b_bname = strdup(bn)) == NULL)
 			return (FALSE);
 		(void)fupdstat(curbp);
-		curbp->b_flag &= ~(BFBAK | BFCHG);
-		upmodes(curbp);
+		curbp->b_flag &= ~BFBAK;
+		bunchanged(curbp);
 		undo_add_boundary(FFRAND, 1);
 		undo_add_modified();
 	}
@@ -640,8 +638,8 @@ buffsave(struct buffer *bp)
 	}
 	if ((s = writeout(&ffp, bp, bp->b_fname)) == TRUE) {
 		(void)fupdstat(bp);
-		bp->b_flag &= ~(BFCHG | BFBAK);
-		upmodes(bp);
+		bp->b_flag &= ~BFBAK;
+		bunchanged(bp);
 		undo_add_boundary(FFRAND, 1);
 		undo_add_modified();
 	}
@@ -722,9 +720,14 @@ writeout(FILE ** ffp, struct buffer *bp, char *fn)
 			return (FIOERR);
 		}
         }
+	/* The end of the file is the end of the whole buffer. */
+	if (bp->b_narrow != NULL)
+		narrowlink(bp, FALSE);
 	lpend = bp->b_headp;
-	eobnl = 0;
-	if (llength(lback(lpend)) != 0) {
+	eobnl = llength(lback(lpend)) != 0;
+	if (bp->b_narrow != NULL)
+		narrowlink(bp, TRUE);
+	if (eobnl) {
 		if (reqnl == 2)
 			eobnl = eyorn("No newline at end of file, add one");
 		else
@@ -739,8 +742,12 @@ writeout(FILE ** ffp, struct buffer *bp, char *fn)
 	if (s == FIOSUC) {
 		/* no write error */
 		s = ffclose(*ffp, bp);
-		if (s == FIOSUC)
+		if (s == FIOSUC) {
 			ewprintf("Wrote %s", fn);
+#ifdef ENABLE_CTAGS
+			cindexsaved(fn);
+#endif
+		}
 	} else {
 		/* print a message indicating write error */
 		(void)ffclose(*ffp, bp);
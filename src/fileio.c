@@ -20,6 +20,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "def.h"
@@ -38,11 +39,31 @@
 #define GUNZIP "gunzip -c"
 #endif
 
+#define NFCACHE	4		/* directories kept for completion */
+
+/*
+ * A directory read for file name completion.  It is used again while
+ * the directory's modification time stays the same.
+ */
+struct fcache {
+	char		  fc_dir[NFILEN];
+	dev_t		  fc_dev;
+	ino_t		  fc_ino;
+	struct timespec	  fc_mtime;
+	char		**fc_names;	/* sorted; directories end in '/' */
+	size_t		  fc_count;
+};
+
 static char *bkuplocation(const char *);
 static int   bkupleavetmp(const char *);
 static int   isgzip(const char *);
+static struct fcache *fcacheget(const char *);
+static void  fcachefree(struct fcache *);
+static int   fcachecmp(const void *, const void *);
 
 static char *bkupdir;
+static struct fcache fcache[NFCACHE];
+static int   fcachenext;
 static int   leavetmp = 0;	/* 1 = leave any '~' files in tmp dir */
 
 /*
@@ -180,23 +201,40 @@ int
 ffputbuf(FILE *ffp, struct buffer *bp, int eobnl)
 {
 	struct line	*lp, *lpend;
+	int		 s = FIOSUC;
 
+	/* Always write the whole of a narrowed buffer. */
+	if (bp->b_narrow != NULL)
+		narrowlink(bp, FALSE);
 	lpend = bp->b_headp;
 
 	for (lp = lforw(lpend); lp != lpend; lp = lforw(lp)) {
 		if ((int)fwrite(ltext(lp), 1, llength(lp), ffp) != llength(lp)) {
 			dobeep();
 			ewprintf("Write I/O error");
-			return (FIOERR);
+			s = FIOERR;
+			break;
 		}
 		if (lforw(lp) != lpend)		/* no implied \n on last line */
 			putc(*bp->b_nlchr, ffp);
 	}
-	if (eobnl) {
-		lnewline_at(lback(lpend), llength(lback(lpend)));
+	if (bp->b_narrow != NULL)
+		narrowlink(bp, TRUE);
+	if (s == FIOSUC && eobnl) {
+		if (bp->b_narrow == NULL ||
+		    bp->b_narrow->n_after == bp->b_narrow->n_wide)
+			lnewline_at(blastlp(bp), llength(blastlp(bp)));
+		else if ((lp = lalloc(0)) != NULL) {
+			/* Past the visible lines; just link it in. */
+			lp->l_bp = lback(lpend);
+			lp->l_fp = lpend;
+			lpend->l_bp->l_fp = lp;
+			lpend->l_bp = lp;
+			bp->b_narrow->n_lines++;
+		}
 		putc(*bp->b_nlchr, ffp);
 	}
-	return (FIOSUC);
+	return (s);
 }
 
 /*
@@ -422,67 +460,16 @@ nohome:
 	return (NULL);
 }
 
-int
-copy(char *frname, char *toname)
-{
-	int	ifd, ofd;
-	char	buf[BUFSIZ];
-	mode_t	fmode = DEFFILEMODE;	/* XXX?? */
-	struct	stat orig;
-	ssize_t	sr;
-
-	if ((ifd = open(frname, O_RDONLY)) == -1)
-		return (FALSE);
-	if (fstat(ifd, &orig) == -1) {
-		dobeep();
-		ewprintf("fstat: %s", strerror(errno));
-		close(ifd);
-		return (FALSE);
-	}
-
-	if ((ofd = open(toname, O_WRONLY|O_CREAT|O_TRUNC, fmode)) == -1) {
-		close(ifd);
-		return (FALSE);
-	}
-	while ((sr = read(ifd, buf, sizeof(buf))) > 0) {
-		if (write(ofd, buf, (size_t)sr) != sr) {
-			ewprintf("write error : %s", strerror(errno));
-			break;
-		}
-	}
-	if (fchmod(ofd, orig.st_mode) == -1)
-		ewprintf("Cannot set original mode : %s", strerror(errno));
-
-	if (sr == -1) {
-		ewprintf("Read error : %s", strerror(errno));
-		close(ifd);
-		close(ofd);
-		return (FALSE);
-	}
-	/*
-	 * It is "normal" for this to fail since we can't guarantee that
-	 * we will be running as root.
-	 */
-	if (fchown(ofd, orig.st_uid, orig.st_gid) && errno != EPERM)
-		ewprintf("Cannot set owner : %s", strerror(errno));
-
-	(void) close(ifd);
-	(void) close(ofd);
-
-	return (TRUE);
-}
-
 /*
- * return list of file names that match the name in buf.
+ * return list of file names that match the name in buf, sorted.
  */
 struct list *
 make_file_list(char *buf)
 {
 	char		*dir, *file, *cp;
-	size_t		 len, preflen;
+	size_t		 len, preflen, lo, hi, mid;
 	int		 ret;
-	DIR		*dirp;
-	struct dirent	*dent;
+	struct fcache	*fc;
 	struct list	*last, *current;
 	char		 fl_name[NFILEN + 2];
 	char		 prefixx[NFILEN + 1];
@@ -550,56 +537,147 @@ make_file_list(char *buf)
 	if (preflen > NFILEN - MAXNAMLEN)
 		return (NULL);
 
-	/* loop over the specified directory, making up the list of files */
-
 	/*
-	 * Note that it is worth our time to filter out names that don't
-	 * match, even though our caller is going to do so again, and to
-	 * avoid doing the stat if completion is being done, because stat'ing
-	 * every file in the directory is relatively expensive.
+	 * The directory is only read when it has changed since the last
+	 * completion in it, and its names are kept sorted, so the ones
+	 * matching what was typed so far are found by binary search.
 	 */
-
-	dirp = opendir(dir);
-	if (dirp == NULL)
+	if ((fc = fcacheget(dir)) == NULL)
 		return (NULL);
-	last = NULL;
-
-	while ((dent = readdir(dirp)) != NULL) {
-		char		statname[NFILEN + 2];
-		struct stat	statbuf;
-		int		isdir = 0;
-
-		if (strncmp(cp, dent->d_name, len) != 0)
-			continue;
+	lo = 0;
+	hi = fc->fc_count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strcmp(fc->fc_names[mid], cp) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (hi = lo; hi < fc->fc_count &&
+	    strncmp(cp, fc->fc_names[hi], len) == 0; hi++)
+		;
 
-		statbuf.st_mode = 0;
-		ret = snprintf(statname, sizeof(statname), "%s/%s",
-		    dir, dent->d_name);
-		if (ret < 0 || ret > (int)sizeof(statname) - 1)
-			continue;
-		if (stat(statname, &statbuf) < 0)
+	/* Build the list backwards so that it comes out sorted. */
+	last = NULL;
+	while (hi > lo) {
+		hi--;
+		ret = snprintf(fl_name, sizeof(fl_name), "%s%s", prefixx,
+		    fc->fc_names[hi]);
+		if (ret < 0 || ret >= (int)sizeof(fl_name))
 			continue;
-		if (S_ISDIR(statbuf.st_mode))
-			isdir = 1;
-
-		if ((current = malloc(sizeof(struct list))) == NULL) {
+		if ((current = malloc(sizeof(struct list))) == NULL ||
+		    (current->l_name = strdup(fl_name)) == NULL) {
+			free(current);
 			free_file_list(last);
-			closedir(dirp);
 			return (NULL);
 		}
-		ret = snprintf(fl_name, sizeof(fl_name),
-		    "%s%s%s", prefixx, dent->d_name, isdir ? "/" : "");
-		if (ret < 0 || ret >= (int)sizeof(fl_name)) {
-			free(current);
-			continue;
-		}
 		current->l_next = last;
-		current->l_name = strdup(fl_name);
 		last = current;
 	}
+	return (last);
+}
+
+/*
+ * Find directory dir in the completion cache, reading it if it is not
+ * there or has changed.  A directory modified in the second it was
+ * read may have changed again unseen, so it is read again next time.
+ */
+static struct fcache *
+fcacheget(const char *dir)
+{
+	struct fcache	*fc;
+	struct dirent	*dent;
+	struct stat	 dsb, sb;
+	DIR		*dirp;
+	char		**names;
+	size_t		 n, sz;
+	time_t		 now;
+	int		 i, isdir;
+
+	if (stat(dir, &dsb) == -1)
+		return (NULL);
+	for (i = 0; i < NFCACHE; i++) {
+		fc = &fcache[i];
+		if (fc->fc_names != NULL && strcmp(fc->fc_dir, dir) == 0) {
+			if (fc->fc_dev == dsb.st_dev &&
+			    fc->fc_ino == dsb.st_ino &&
+			    fc->fc_mtime.tv_sec == dsb.st_mtim.tv_sec &&
+			    fc->fc_mtime.tv_nsec == dsb.st_mtim.tv_nsec)
+				return (fc);
+			fcachefree(fc);
+			break;
+		}
+	}
+	if (i == NFCACHE) {
+		fc = &fcache[fcachenext];
+		fcachenext = (fcachenext + 1) % NFCACHE;
+		fcachefree(fc);
+	}
+
+	now = time(NULL);
+	if ((dirp = opendir(dir)) == NULL)
+		return (NULL);
+	names = NULL;
+	n = sz = 0;
+	while ((dent = readdir(dirp)) != NULL) {
+		/* Only stat when the file system doesn't tell the type. */
+		isdir = 0;
+#ifdef DT_DIR
+		if (dent->d_type == DT_DIR)
+			isdir = 1;
+		else if (dent->d_type == DT_LNK || dent->d_type == DT_UNKNOWN)
+#endif
+			isdir = fstatat(dirfd(dirp), dent->d_name, &sb,
+			    0) == 0 && S_ISDIR(sb.st_mode);
+		if (n == sz) {
+			sz = sz ? sz * 2 : 64;
+			if ((fc->fc_names = reallocarray(names, sz,
+			    sizeof(*names))) == NULL)
+				goto fail;
+			names = fc->fc_names;
+		}
+		if (asprintf(&names[n], "%s%s", dent->d_name,
+		    isdir ? "/" : "") == -1)
+			goto fail;
+		n++;
+	}
 	closedir(dirp);
+	qsort(names, n, sizeof(*names), fcachecmp);
+
+	/* Usable now, but don't trust it later. */
+	if (dsb.st_mtim.tv_sec >= now)
+		dsb.st_mtim.tv_sec = -1;
+	(void)strlcpy(fc->fc_dir, dir, sizeof(fc->fc_dir));
+	fc->fc_dev = dsb.st_dev;
+	fc->fc_ino = dsb.st_ino;
+	fc->fc_mtime = dsb.st_mtim;
+	fc->fc_names = names;
+	fc->fc_count = n;
+	return (fc);
+fail:
+	closedir(dirp);
+	fc->fc_names = names;
+	fc->fc_count = n;
+	fcachefree(fc);
+	return (NULL);
+}
 
-	return (last);
+static void
+fcachefree(struct fcache *fc)
+{
+	size_t	i;
+
+	for (i = 0; i < fc->fc_count; i++)
+		free(fc->fc_names[i]);
+	free(fc->fc_names);
+	fc->fc_names = NULL;
+	fc->fc_count = 0;
+}
+
+static int
+fcachecmp(const void *a, const void *b)
+{
+	return (strcmp(*(char * const *)a, *(char * const *)b));
 }
 
 #ifndef fisdir
@@ -16,6 +16,11 @@
  *
  * If the function is NULL, it must be listed with the same name in the
  * map_table.
+ *
+ * Entries are kept in an array sorted by name, so a name is found with a
+ * binary search and the names completing a prefix are one contiguous run
+ * of it.  Going the other way, from function to name, uses a hash table
+ * chained through fn_next.
  */
 struct funmap {
 	PF		 fn_funct;
@@ -23,7 +28,18 @@ struct funmap {
 	int		 fn_nparams;
 	struct funmap	*fn_next;
 };
-static struct funmap *funs;
+static struct funmap **funs;
+static int	 nfuns;
+static int	 szfuns;
+
+#define NFUNHASH	256
+#define FUNHASH(f)	((((unsigned long)(f)) >> 4) % NFUNHASH)
+static struct funmap *funhash[NFUNHASH];
+
+static int	 fnsearch(const char *, size_t, int *);
+static int	 fncmp(const void *, const void *);
+static void	 fnhash(struct funmap *);
+static void	 fnunhash(struct funmap *);
 
 /*
  * 3rd column in the functnames structure indicates how many parameters the
@@ -64,6 +80,8 @@ static struct funmap functnames[] = {
 	{capword, "capitalize-word", 1, NULL},
 	{changedir, "cd", 0, NULL},
 	{clearmark, "clear-mark", 0, NULL},
+	{clonebuffer, "clone-buffer", 0, NULL},
+	{cloneindirect, "clone-indirect-buffer", 0, NULL},
 	{colnotoggle, "column-number-mode", 0, NULL},
 	{copyregion, "copy-region-as-kill", 0, NULL},
 #ifdef	REGEX
@@ -89,6 +107,7 @@ static struct funmap functnames[] = {
 	{backdel, "delete-backward-char", 1, NULL},
 	{deblank, "delete-blank-lines", 0, NULL},
 	{forwdel, "delete-char", 1, NULL},
+	{deldupelines, "delete-duplicate-lines", 0, NULL},
 	{delwhite, "delete-horizontal-space", 0, NULL},
 	{delleadwhite, "delete-leading-space", 0, NULL},
 #ifdef	REGEX
@@ -167,6 +186,7 @@ static struct funmap functnames[] = {
 	{markpara, "mark-paragraph", 1, NULL},
 	{markbuffer, "mark-whole-buffer", 0, NULL},
 	{do_meta, "meta-key-mode", 0, NULL},	/* better name, anyone? */
+	{narrowregion, "narrow-to-region", 0, NULL},
 	{negative_argument, "negative-argument", 1, NULL},
 	{enewline, "newline", 1, NULL},
 	{lfindent, "newline-and-indent", 1, NULL},
@@ -202,6 +222,7 @@ static struct funmap functnames[] = {
 	{replstr, "replace-string", 2, NULL},
 #endif /* REGEX */
 	{reqnewline, "require-final-newline", 1, NULL},
+	{reverseregion, "reverse-region", 0, NULL},
 	{revertbuffer, "revert-buffer", 0, NULL},
 	{filesave, "save-buffer", 1, NULL},
 	{quit, "save-buffers-kill-emacs", 0, NULL},
@@ -229,6 +250,8 @@ static struct funmap functnames[] = {
 	{shellcommand, "shell-command", 1, NULL},
 	{piperegion, "shell-command-on-region", 1, NULL},
 	{shrinkwind, "shrink-window", 1, NULL},
+	{sortlines, "sort-lines", 0, NULL},
+	{sortnumfields, "sort-numeric-fields", 0, NULL},
 	{space_to_tabstop, "space-to-tabstop", 0, NULL},
 	{splitwind, "split-window-vertically", 0, NULL},
 	{definemacro, "start-kbd-macro", 0, NULL},
@@ -236,11 +259,15 @@ static struct funmap functnames[] = {
 	{spawncli, "suspend", 0, NULL},
 	{usebuffer, "switch-to-buffer", 1, NULL},
 	{poptobuffer, "switch-to-buffer-other-window", 1, NULL},
+	{tabifyregion, "tabify-region", 0, NULL},
 #ifdef TOGGLENL
 	{togglenewlineprompt, "toggle-newline-prompt", 0, NULL},
 #endif /* TOGGLENL */
 	{togglereadonly, "toggle-read-only", 0, NULL},
 	{togglereadonlyall, "toggle-read-only-all", 0, NULL},
+#ifdef TRACE
+	{tracedump, "trace-dump", 1, NULL},
+#endif /* TRACE */
 	{twiddle, "transpose-chars", 0, NULL},
 	{transposepara, "transpose-paragraphs", 0, NULL},
 	{transposeword, "transpose-words", 0, NULL},
@@ -251,6 +278,7 @@ static struct funmap functnames[] = {
 	{undo_enable, "undo-enable", 0, NULL},
 	{undo_dump, "undo-list", 0, NULL},
 	{universal_argument, "universal-argument", 1, NULL},
+	{untabifyregion, "untabify-region", 0, NULL},
 	{upperregion, "upcase-region", 0, NULL},
 	{upperword, "upcase-word", 1, NULL},
 	{togglevisiblebell, "visible-bell", 0, NULL},
@@ -258,6 +286,8 @@ static struct funmap functnames[] = {
 	{tagsvisit, "visit-tags-table", 0, NULL},
 #endif
 	{showcpos, "what-cursor-position", 0, NULL},
+	{cleanwhite, "whitespace-cleanup", 0, NULL},
+	{widen, "widen", 0, NULL},
 	{filewrite, "write-file", 1, NULL},
 	{yank, "yank", 1, NULL},
 	{NULL, NULL, 0, NULL}
@@ -268,16 +298,23 @@ funmap_init(void)
 {
 	struct funmap *fn;
 
+	for (fn = functnames; fn->fn_name != NULL; fn++)
+		;
+	nfuns = szfuns = fn - functnames;
+	if ((funs = calloc(szfuns, sizeof(*funs))) == NULL)
+		panic("funmap_init: Out of memory");
 	for (fn = functnames; fn->fn_name != NULL; fn++) {
-		fn->fn_next = funs;
-		funs = fn;
+		funs[fn - functnames] = fn;
+		fnhash(fn);
 	}
+	qsort(funs, nfuns, sizeof(*funs), fncmp);
 }
 
 int
 funmap_add(PF fun, const char *fname, int fparams)
 {
-	struct funmap *fn;
+	struct funmap **nf, *fn;
+	int	 i;
 
 	if ((fn = malloc(sizeof(*fn))) == NULL)
 		return (FALSE);
@@ -285,9 +322,27 @@ funmap_add(PF fun, const char *fname, int fparams)
 	fn->fn_funct = fun;
 	fn->fn_name = fname;
 	fn->fn_nparams = fparams;
-	fn->fn_next = funs;
 
-	funs = fn;
+	/* A later definition of a name replaces the earlier one. */
+	if (fnsearch(fname, strlen(fname) + 1, &i)) {
+		fnunhash(funs[i]);
+		funs[i] = fn;
+		fnhash(fn);
+		return (TRUE);
+	}
+	if (nfuns == szfuns) {
+		if ((nf = reallocarray(funs, szfuns + 32, sizeof(*nf)))
+		    == NULL) {
+			free(fn);
+			return (FALSE);
+		}
+		funs = nf;
+		szfuns += 32;
+	}
+	memmove(&funs[i + 1], &funs[i], (nfuns - i) * sizeof(*funs));
+	funs[i] = fn;
+	nfuns++;
+	fnhash(fn);
 	return (TRUE);
 }
 
@@ -297,12 +352,10 @@ funmap_add(PF fun, const char *fname, int fparams)
 PF
 name_function(const char *fname)
 {
-	struct funmap *fn;
+	int	 i;
 
-	for (fn = funs; fn != NULL; fn = fn->fn_next) {
-		if (strcmp(fn->fn_name, fname) == 0)
-			return (fn->fn_funct);
-	}
+	if (fnsearch(fname, strlen(fname) + 1, &i))
+		return (funs[i]->fn_funct);
 	return (NULL);
 }
 
@@ -311,7 +364,7 @@ function_name(PF fun)
 {
 	struct funmap *fn;
 
-	for (fn = funs; fn != NULL; fn = fn->fn_next) {
+	for (fn = funhash[FUNHASH(fun)]; fn != NULL; fn = fn->fn_next) {
 		if (fn->fn_funct == fun)
 			return (fn->fn_name);
 	}
@@ -319,27 +372,30 @@ function_name(PF fun)
 }
 
 /*
- * List possible function name completions.
+ * List possible function name completions, in alphabetical order.
  */
 struct list *
 complete_function_list(const char *fname)
 {
-	struct funmap	*fn;
 	struct list	*head, *el;
-	int		 len;
+	size_t		 len;
+	int		 lo, hi;
 
 	len = strlen(fname);
+	(void)fnsearch(fname, len, &lo);
+	for (hi = lo; hi < nfuns; hi++)
+		if (strncmp(funs[hi]->fn_name, fname, len) != 0)
+			break;
+
 	head = NULL;
-	for (fn = funs; fn != NULL; fn = fn->fn_next) {
-		if (memcmp(fname, fn->fn_name, len) == 0) {
-			if ((el = malloc(sizeof(*el))) == NULL) {
-				free_file_list(head);
-				return (NULL);
-			}
-			el->l_name = strdup(fn->fn_name);
-			el->l_next = head;
-			head = el;
+	while (hi-- > lo) {
+		if ((el = malloc(sizeof(*el))) == NULL) {
+			free_file_list(head);
+			return (NULL);
 		}
+		el->l_name = strdup(funs[hi]->fn_name);
+		el->l_next = head;
+		head = el;
 	}
 	return (head);
 }
@@ -352,9 +408,68 @@ numparams_function(PF fun)
 {
 	struct funmap *fn;
 
-	for (fn = funs; fn != NULL; fn = fn->fn_next) {
+	for (fn = funhash[FUNHASH(fun)]; fn != NULL; fn = fn->fn_next) {
 		if (fn->fn_funct == fun)
 			return (fn->fn_nparams);
 	}
 	return (FALSE);
 }
+
+/*
+ * Binary search for the first name whose first len bytes are not less
+ * than those of fname.  Its index is stored in *ip; returns TRUE if
+ * those bytes are equal.  Pass strlen + 1 for an exact match.
+ */
+static int
+fnsearch(const char *fname, size_t len, int *ip)
+{
+	int	 lo, hi, mid;
+
+	lo = 0;
+	hi = nfuns;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (strncmp(funs[mid]->fn_name, fname, len) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*ip = lo;
+	return (lo < nfuns && strncmp(funs[lo]->fn_name, fname, len) == 0);
+}
+
+static int
+fncmp(const void *a, const void *b)
+{
+	return (strcmp((*(struct funmap * const *)a)->fn_name,
+	    (*(struct funmap * const *)b)->fn_name));
+}
+
+/*
+ * Function to name lookups find the most recently added name first, as
+ * they did when all names lived on a single list.
+ */
+static void
+fnhash(struct funmap *fn)
+{
+	if (fn->fn_funct == NULL) {
+		fn->fn_next = NULL;
+		return;
+	}
+	fn->fn_next = funhash[FUNHASH(fn->fn_funct)];
+	funhash[FUNHASH(fn->fn_funct)] = fn;
+}
+
+static void
+fnunhash(struct funmap *fn)
+{
+	struct funmap **fp;
+
+	for (fp = &funhash[FUNHASH(fn->fn_funct)]; *fp != NULL;
+	    fp = &(*fp)->fn_next) {
+		if (*fp == fn) {
+			*fp = fn->fn_next;
+			return;
+		}
+	}
+}
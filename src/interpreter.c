@@ -31,31 +31,42 @@
  * 4. Use the previously defined variable or list:
  * (find-file myfiles)
  *
+ * Expressions may span several lines, they are evaluated once the closing
+ * parenthesis of the outermost expression has been read:
+ * (find-file "g.txt"
+ *            "h.txt")
+ *
+ * 5. Bind variables for the duration of a block:
+ * (let ((myfile "i.txt")
+ *       (myfiles (list "j.txt" "k.txt")))
+ *   (find-file myfile myfiles))
+ *
+ * Variable names are interned in a hash table when an expression is
+ * compiled, and every symbol carries a stack of its bindings: the
+ * innermost 'let' binding on top, the global 'define' at the bottom.
+ * Looking a variable up at run time is then a single pointer access.
+ * Values are kept as arrays, so a list is never re-parsed when used.
+ * A 'define' inside a 'let' body assigns to the innermost binding.
+ *
+ * Evaluation happens in three steps.  The reader turns the text of one or
+ * more s-expressions into a tree of cells.  The compiler walks that tree
+ * once, resolving every command name to its function pointer, and emits a
+ * compact bytecode program.  Finally the program is run by a small stack
+ * machine which hands arguments straight to the commands via excargs().
+ * Compiled programs are cached by their source text, so evaluating the same
+ * expression again skips both the reader and the compiler.
+ *
  * To do:
- * 1. multiline parsing - currently only single lines supported.
- * 2. parsing for '(' and ')' throughout whole string and evaluate correctly.
- * 3. conditional execution.
- * 4. have memory allocated dynamically for variable values.
- * 5. do symbol names need more complex regex patterns? [A-Za-z][.0-9_A-Z+a-z-]
+ * 1. conditional execution.
+ * 2. do symbol names need more complex regex patterns? [A-Za-z][.0-9_A-Z+a-z-]
  *    at the moment.
- * 6. display line numbers with parsing errors.
- * 7. oh so many things....
+ * 3. oh so many things....
  * [...]
  * n. implement user definable functions.
- * 
- * Notes:
- * - Currently calls to excline() from this file have the line length and
- *   line number set to zero.
- *   That's because excline() uses '\0' as the end of line indicator
- *   and only the call to foundparen() within excline() uses excline's 2nd
- *   and 3rd arguments.
- *   Importantly, any lines sent to there from here will not be
- *   coming back here.
  */
 
 #include <ctype.h>
 #include <limits.h>
-#include <regex.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -64,725 +75,1029 @@
 #include "def.h"
 #include "funmap.h"
 
-#ifdef  MGLOG
-#include "kbd.h"
-#include "log.h"
-#endif
-
-static int	 multiarg(char *, char *, int);
-static int	 isvar(char **, char **, int);
-/*static int	 dofunc(char **, char **, int);*/
-static int	 founddef(char *, int, int, int, int);
-static int	 foundlst(char *, int, int, int);
-static int	 expandvals(char *, char *, char *);
-static int	 foundfun(char *, int);
-static int	 doregex(char *, char *);
-static void	 clearexp(void);
-static int	 parse(char *, const char *, const char *, int, int, int, int);
-static int	 parsdef(char *, const char *, const char *, int, int, int);
-static int	 parsval(char *, const char *, const char *, int, int, int);
-static int	 parsexp(char *, const char *, const char *, int, int, int);
-
-static int	 exitinterpreter(char *, char *, int);
+/*
+ * Cell types, as produced by the reader.
+ */
+#define C_LIST		0	/* (...)				*/
+#define C_SYM		1	/* variable or command name		*/
+#define C_STR		2	/* "string", or 'symbol			*/
+#define C_NUM		3	/* integer				*/
+
+struct cell {
+	struct cell	*c_next;	/* Next element of enclosing list */
+	struct cell	*c_list;	/* Elements, if a list		  */
+	char		*c_str;		/* Atom text, strings unescaped	  */
+	int		 c_len;
+	int		 c_type;
+	int		 c_num;		/* Value of a C_NUM		  */
+	int		 c_line;	/* Line the cell starts on	  */
+	const char	*c_beg;		/* Source text between a list's	  */
+	const char	*c_end;		/* parentheses			  */
+};
 
-TAILQ_HEAD(exphead, expentry) ehead;
-struct expentry {
-	TAILQ_ENTRY(expentry) eentry;
-	char	*fun;		/* The 1st string found between parens.   */
-	char	 funbuf[BUFSIZE];
-	const char	*par1;	/* Parenthesis at start of string	  */
-	const char	*par2;	/* Parenthesis at end of string		  */
-	int	 expctr;	/* An incremental counter:+1 for each exp */
-	int	 blkid;		/* Which block are we in?		  */
+struct reader {
+	const char	*r_p;
+	int		 r_line;
 };
 
 /*
- * Structure for scheme keywords. 
+ * Bytecode.  A program is an array of ints: each opcode is followed by
+ * its operand, if any.  Arguments are pushed onto the value stack after
+ * an OP_MARK, and consumed by the OP_CALL or OP_DEFINE that follows.
  */
-#define NUMSCHKEYS	4
-#define MAXLENSCHKEYS	17	/* 17 = longest keyword (16)  + 1 */
-
-char scharkey[NUMSCHKEYS][MAXLENSCHKEYS] =
-	{ 
-		"define",
-	  	"list",
-	  	"if",
-	  	"lambda"
-	};
-
-static const char 	 lp = '(';
-static const char 	 rp = ')';
-static char 		*defnam = NULL;
-static int		 lnm;
+#define OP_END		0	/* end of program			*/
+#define OP_MARK		1	/* start collecting arguments		*/
+#define OP_CONST	2	/* k: push constant k			*/
+#define OP_VAR		3	/* s: push value(s) of variable s	*/
+#define OP_CALL		4	/* f: call function f with arguments	*/
+#define OP_DEFINE	5	/* s: assign arguments to variable s	*/
+#define OP_EXCLINE	6	/* k: hand constant k to excline()	*/
+#define OP_EXIT		7	/* stop evaluating			*/
+#define OP_BIND		8	/* s: new binding of s to the arguments	*/
+#define OP_ENTER	9	/* n: make the last n bindings visible	*/
+#define OP_LEAVE	10	/* n: drop the last n bindings		*/
+
+struct ivalue {
+	char		*iv_str;
+	int		 iv_len;
+	int		 iv_type;	/* C_SYM, C_STR or C_NUM	  */
+	int		 iv_num;
+};
+
+struct ifun {
+	PF		 if_funct;
+	int		 if_nparams;
+};
 
 /*
- * Line has a '(' as the first non-white char.
- * Do some very basic parsing of line.
- * Multi-line not supported at the moment, To do.
+ * Variables.  A binding owns its values and their text in one block.
  */
-int
-foundparen(char *funstr, int llen, int lnum)
-{
-	const char	*lrp = NULL;
-	char		*p, *begp = NULL, *endp = NULL, *prechr = NULL;
-	char		*lastchr = NULL;
-	int     	 i, pctr, expctr, blkid, inquote, esc;
-	int		 ret = FALSE;
-	int		 elen, spc, ns;
+struct binding {
+	struct binding	*b_prev;	/* Binding this one shadows	  */
+	struct ivalue	*b_vals;
+	int		 b_count;
+};
 
-	pctr = expctr = inquote = esc = elen = spc = ns = 0;
-	blkid = 1;
-	lnm = lnum;
+struct symbol {
+	struct symbol	*s_next;	/* Hash chain			  */
+	struct binding	*s_bind;	/* Innermost binding, or NULL	  */
+	char		*s_name;
+};
 
-	/*
-	 * load expressions into a list called 'expentry', to be processd
-	 * when all are obtained.
-	 * Not really live code at the moment. Just part of the process of
-	 * working out what needs to be done.
-	 */
-	TAILQ_INIT(&ehead);
+struct bframe {
+	struct symbol	*bf_sym;
+	struct binding	*bf_bind;
+	int		 bf_entered;	/* Linked into bf_sym yet?	  */
+};
 
-	/*
-	 * Check for blocks of code with opening and closing ().
-	 * One block = (cmd p a r a m)
-	 * Two blocks = (cmd p a r a m s)(hola)
-	 * Two blocks = (cmd p a r (list a m s))(hola)
-	 * Only single line at moment, but more for multiline.
-	 */
-	p = funstr;
-
-	for (i = 0; i < llen; ++i, p++) {
-		if (pctr == 0 && *p != ' ' && *p != '\t' && *p != '(') {
-			if (*p == ')')
-				return(dobeep_num("Extra ')' found on line:",
-				    lnm));
-			return(dobeep_num("Error line:", lnm));
-		}
-		if (begp != NULL)
-			elen++;
-
-		if (*p == '\\') {
-			esc = 1;
-		} else if (*p == '(') {
-			if (lastchr != NULL && *lastchr == '(')
-				return(dobeep_num("Multiple consecutive "\
-				    "left parentheses line", lnm));
-			if (inquote == 0) {
-				if (begp != NULL) {
-					if (*prechr == ' ')
-						ns--;
-					if (endp == NULL)
-						*p = '\0';
-					else
-						*endp = '\0';
-
-					ret = parse(begp, lrp, &lp, blkid,
-					    ++expctr, elen - spc, ns);
-					if (!ret) {
-						cleanup();
-						return(ret);
-					}
-					elen = 0;
-				}
-				lrp = &lp;
-				begp = endp = NULL;
-				pctr++;
-			} else if (inquote != 1) {
-				cleanup();
-				return(dobeep_num("Opening and closing quote "\
-				    "char error line:", lnm));
-			}
-			esc = spc = 0;
-		} else if (*p == ')') {
-			if (lastchr != NULL && *lastchr == '(')
-				return(dobeep_num("Empty parenthesis "\
-				    "not supported line", lnm));
-			if (inquote == 0) {
-				if (begp != NULL) {
-					if (*prechr == ' ')
-						ns--;
-					if (endp == NULL)
-						*p = '\0';
-					else
-						*endp = '\0';
-
-					ret = parse(begp, lrp, &rp, blkid,
-					    ++expctr, elen - spc, ns);
-					if (!ret) {
-						cleanup();
-						return(ret);
-					}
-					elen = 0;
-				}
-				lrp = &rp;
-				begp = endp = NULL;
-				pctr--;
-			} else if (inquote != 1) {
-				cleanup();
-				return(dobeep_num("Opening and closing quote "\
-				    "char error line:", lnm));
-			}
-			esc = spc = 0;
-		} else if (*p != ' ' && *p != '\t') {
-			if (begp == NULL) {
-				begp = p;
-				if (*begp == '"' || isdigit((short)*begp))
-					return(dobeep_num("First char of "\
-					    "expression error line:", lnm));
-			}
-			if (*p == '"') {
-				if (inquote == 0 && esc == 0) {
-					if (*prechr != ' ' && *prechr != '\t')
-						return(dobeep_num("Parse error"\
-						    " line:", lnm));
-					inquote++;
-				} else if (inquote > 0 && esc == 1)
-					esc = 0;
-				else
-					inquote--;
-			} else if (*prechr == '"' && inquote == 0) {
-				return(dobeep_num("Parse error line:", lnm));
-			}
-			endp = NULL;
-			spc = 0;
-		} else if (endp == NULL && (*p == ' ' || *p == '\t')) {
-			if (inquote == 0) {
-				*p = ' ';
-				endp = p;
-				spc++;
-				if (begp != NULL)
-					ns++;
-			}
-			esc = 0;
-		} else if (*p == '\t' || *p == ' ') {
-			if (inquote == 0) {
-				*p = ' ';
-				spc++;
-			}
-			esc = 0;
-		}
-		if (*p != '\t' && *p != ' ' && inquote == 0)
-			lastchr = p;
+struct iprog {
+	char		*ip_src;	/* Source text, the cache key	  */
+	int		*ip_code;
+	int		 ip_ncode;
+	int		 ip_szcode;
+	struct ivalue	*ip_k;		/* Constant pool		  */
+	int		 ip_nk;
+	int		 ip_szk;
+	struct ifun	*ip_fn;		/* Pre-resolved functions	  */
+	int		 ip_nfn;
+	int		 ip_szfn;
+	struct symbol	**ip_sym;	/* Interned variable names	  */
+	int		 ip_nsym;
+	int		 ip_szsym;
+};
 
-		if (pctr == 0) {
-			blkid++;
-			expctr = 0;
-			defnam = NULL;
-		}
-		prechr = p;
-	}
+#define NICACHE		64	/* Compiled programs kept around	*/
+#define NSYMTAB		64	/* Initial symbol table size		*/
+#define MAXPARAMS	8	/* Most arguments a command takes	*/
+
+static int	 readelems(struct reader *, struct cell **, int);
+static int	 readstr(struct reader *, struct cell *);
+static void	 readatom(struct reader *, struct cell *);
+static void	 freecells(struct cell *);
+static struct iprog *icompile(char *, int);
+static int	 compileform(struct iprog *, struct cell *);
+static int	 compiledef(struct iprog *, struct cell *);
+static int	 compilelet(struct iprog *, struct cell *);
+static int	 compilearg(struct iprog *, struct cell *);
+static int	 emit(struct iprog *, int, int);
+static int	 addconst(struct iprog *, int, const char *, int, int);
+static int	 addfun(struct iprog *, PF, int);
+static int	 addsym(struct iprog *, const char *);
+static struct symbol *intern(const char *);
+static void	 freeprog(struct iprog *);
+static int	 execute(struct iprog *);
+static int	 push(struct ivalue *);
+static int	 pushvar(struct symbol *);
+static int	 docall(struct ifun *, struct ivalue *, int);
+static int	 dodefine(struct symbol *, struct ivalue *, int);
+static int	 dobind(struct symbol *, struct ivalue *, int);
+static void	 unbind(int);
+static struct ivalue *copyvals(struct ivalue *, int);
+static int	 addpending(const char *, size_t, int);
+static unsigned int strhash(const char *);
 
-	if (pctr != 0) {
-		cleanup();
-		return(dobeep_num("Opening and closing parentheses error line:",
-		    lnm));
-	}
-	if (ret == FALSE)
-		cleanup();
-	else
-		clearexp();	/* leave lists but remove expressions */
+static int	 exitinterpreter(char *, char *, int);
 
-	return (ret);
-}
+static struct iprog	*icache[NICACHE];
 
+static struct symbol	**symtab;	/* Interned symbols		*/
+static unsigned int	  symsize;
+static unsigned int	  nsyms;
 
-static int
-parse(char *begp, const char *par1, const char *par2, int blkid, int expctr,
-    int elen, int ns)
-{
-	char    *regs;
-	int 	 ret = FALSE;
+static struct ivalue	*vstk;		/* Value stack			*/
+static int		 vsp;
+static int		 vsz;
 
-	if (strncmp(begp, "define", 6) == 0) {
-		ret = parsdef(begp, par1, par2, blkid, expctr, elen);
-		if (ret == TRUE || ret == FALSE)
-			return (ret);
-	} else if (strncmp(begp, "list", 4) == 0)
-		return(parsval(begp, par1, par2, blkid, expctr, elen));
+static struct bframe	*bstk;		/* 'let' bindings, innermost last */
+static int		 bsp;
+static int		 bsz;
 
-	regs = "^exit$";
-	if (doregex(regs, begp))
-		return(exitinterpreter(NULL, NULL, FALSE));
+static char		*pend;		/* Unfinished expression text	*/
+static size_t		 pendlen;
+static size_t		 pendsz;
+static int		 pendline;	/* Line it started on		*/
+static int		 pdepth;	/* Parenthesis depth at its end	*/
+static int		 pinstr;	/* Its end is inside a string	*/
 
-	/* mg function name regex */	
-	regs = "^[A-Za-z-]+$";
-        if (doregex(regs, begp))
-		return(excline(begp, 0, 0));
+/*
+ * Line has a '(' as the first non-white char, or is the continuation of
+ * an expression started on a previous line.  Collect text until the
+ * parentheses balance, then compile and run it.
+ */
+int
+foundparen(char *funstr, int llen, int lnum)
+{
+	struct iprog	*ip;
 
-	/* Corner case 1 */
-	if (strncmp(begp, "global-set-key ", 15) == 0)
-		/* function name as 2nd param screws up multiarg. */
-		return(excline(begp, 0, 0));
+	if (pendlen == 0)
+		pendline = lnum;
+	if (addpending(funstr, strlen(funstr), lnum) == FALSE) {
+		cleanup();
+		return (FALSE);
+	}
+	if (pdepth > 0 || pinstr)
+		return (TRUE);		/* wait for the rest */
 
-	/* Corner case 2 */
-	if (strncmp(begp, "define-key ", 11) == 0)
-		/* function name as 3rd param screws up multiarg. */
-		return(excline(begp, 0, 0));
+	ip = icompile(pend, pendline);
+	cleanup();
+	if (ip == NULL)
+		return (FALSE);
 
-	return (parsexp(begp, par1, par2, blkid, expctr, elen));
+	return (execute(ip));
 }
 
-static int
-parsdef(char *begp, const char *par1, const char *par2, int blkid, int expctr,
-    int elen)
+/*
+ * Is there an expression waiting for its closing parenthesis?
+ */
+int
+parenpending(void)
 {
-	char    *regs;
-
-	if ((defnam == NULL) && (expctr != 1))
-		return(dobeep_num("'define' incorrectly used line:", lnm));
-
-        /* Does the line have a incorrect variable 'define' like: */
-        /* (define i y z) */
-        regs = "^define[ ]+[A-Za-z][.0-9_A-Z+a-z-]*[ ]+.+[ ]+.+$";
-        if (doregex(regs, begp))
-                return(dobeep_num("Invalid use of define line:", lnm));
+	return (pendlen > 0);
+}
 
-        /* Does the line have a single variable 'define' like: */
-        /* (define i 0) */
-        regs = "^define[ ]+[A-Za-z][.0-9_A-Z+a-z-]*[ ]+.*$";
-        if (doregex(regs, begp)) {
-		if (par1 == &lp && par2 == &rp && expctr == 1)
-			return(founddef(begp, blkid, expctr, 1, elen));
-		return(dobeep_num("Invalid use of define line:", lnm));
-	}
-	/* Does the line have  '(define i(' */
-        regs = "^define[ ]+[A-Za-z][.0-9_A-Z+a-z-]*[ ]*$";
-        if (doregex(regs, begp)) {
-		if (par1 == &lp && par2 == &lp && expctr == 1)
-                	return(founddef(begp, blkid, expctr, 0, elen));
-		return(dobeep_num("Invalid use of 'define' line:", lnm));
+/*
+ * Append a line to the pending text, keeping track of how deeply nested
+ * in parentheses its end is.  Strings and comments are skipped the same
+ * way the reader skips them.
+ */
+static int
+addpending(const char *s, size_t len, int lnum)
+{
+	char	*p;
+	size_t	 i, newsz;
+	int	 comment = 0;
+
+	if (pendlen + len + 2 > pendsz) {
+		newsz = pendlen + len + 2 + NLINE;
+		if ((p = realloc(pend, newsz)) == NULL)
+			return (dobeep_msg("malloc Error"));
+		pend = p;
+		pendsz = newsz;
 	}
-	/* Does the line have  '(define (' */
-	regs = "^define$";
-	if (doregex(regs, begp)) {
-		if (par1 == &lp && par2 == &lp && expctr == 1)
-			return(foundfun(begp, expctr));
-		return(dobeep_num("Invalid use of 'define' line:", lnm));
+	memcpy(pend + pendlen, s, len);
+	pend[pendlen + len] = '\n';
+	pend[pendlen + len + 1] = '\0';
+
+	for (i = pendlen, pendlen += len + 1; i < pendlen; i++) {
+		if (comment)
+			break;
+		if (pinstr) {
+			if (pend[i] == '\\')
+				i++;
+			else if (pend[i] == '"')
+				pinstr = 0;
+		} else if (pend[i] == ';')
+			comment = 1;
+		else if (pend[i] == '"')
+			pinstr = 1;
+		else if (pend[i] == '(')
+			pdepth++;
+		else if (pend[i] == ')' && --pdepth < 0)
+			return (dobeep_num("Extra ')' found on line:", lnum));
 	}
+	return (TRUE);
+}
 
-	return (ABORT);
+/*
+ * Read the elements of a list up to its closing parenthesis, or, when
+ * close is 0, everything up to the end of the text.
+ */
+static int
+readelems(struct reader *r, struct cell **head, int close)
+{
+	struct cell	**tail = head, *c;
+	int		 line = r->r_line;
+
+	*head = NULL;
+	for (;;) {
+		for (; *r->r_p != '\0'; r->r_p++) {
+			if (*r->r_p == '\n')
+				r->r_line++;
+			else if (*r->r_p == ';') {
+				while (r->r_p[1] != '\n' && r->r_p[1] != '\0')
+					r->r_p++;
+			} else if (*r->r_p != ' ' && *r->r_p != '\t')
+				break;
+		}
+		if (*r->r_p == '\0') {
+			if (close)
+				return (dobeep_num("Opening and closing "
+				    "parentheses error line:", line));
+			return (TRUE);
+		}
+		if (*r->r_p == ')') {
+			if (!close)
+				return (dobeep_num("Extra ')' found on line:",
+				    r->r_line));
+			r->r_p++;
+			return (TRUE);
+		}
+		if ((c = calloc(1, sizeof(*c))) == NULL)
+			return (dobeep_msg("malloc Error"));
+		*tail = c;
+		tail = &c->c_next;
+		c->c_line = r->r_line;
+
+		if (*r->r_p == '(') {
+			c->c_type = C_LIST;
+			c->c_beg = ++r->r_p;
+			if (readelems(r, &c->c_list, ')') != TRUE)
+				return (FALSE);
+			c->c_end = r->r_p - 1;
+		} else if (*r->r_p == '"') {
+			if (readstr(r, c) != TRUE)
+				return (FALSE);
+		} else
+			readatom(r, c);
+
+		if (c->c_type != C_LIST && c->c_str == NULL)
+			return (dobeep_msg("malloc Error"));
+	}
 }
 
+/*
+ * Read a quoted string, decoding escapes as excline() would.
+ */
 static int
-parsval(char *begp, const char *par1, const char *par2, int blkid, int expctr,
-    int elen)
+readstr(struct reader *r, struct cell *c)
 {
-	char    *regs;
+	const char	*beg, *end;
+	char		*s, *d;
+
+	beg = ++r->r_p;
+	for (; *r->r_p != '"'; r->r_p++) {
+		if (*r->r_p == '\0')
+			return (dobeep_num("Opening and closing quote char "
+			    "error line:", c->c_line));
+		if (*r->r_p == '\\' && r->r_p[1] != '\0')
+			r->r_p++;
+		if (*r->r_p == '\n')
+			r->r_line++;
+	}
+	end = r->r_p++;
+
+	c->c_type = C_STR;
+	if ((c->c_str = malloc(end - beg + 1)) == NULL)
+		return (TRUE);
+	for (s = (char *)beg, d = c->c_str; s < end; ) {
+		if (*s != '\\')
+			*d++ = *s++;
+		else
+			*d++ = excescape(&s);
+	}
+	*d = '\0';
+	c->c_len = d - c->c_str;
+	return (TRUE);
+}
 
-	/* Does the line have 'list' */
-	regs = "^list$";
-	if (doregex(regs, begp))
-		return(dobeep_num("Invalid use of list line:", lnm));
+/*
+ * Read a number or symbol.  A leading quote makes the symbol a literal.
+ */
+static void
+readatom(struct reader *r, struct cell *c)
+{
+	const char	*beg, *errstr;
+
+	beg = r->r_p;
+	while (*r->r_p != '\0' && !isspace((unsigned char)*r->r_p) &&
+	    *r->r_p != '(' && *r->r_p != ')' && *r->r_p != '"' &&
+	    *r->r_p != ';')
+		r->r_p++;
+
+	if (*beg == '\'') {
+		beg++;
+		c->c_type = C_STR;
+	} else
+		c->c_type = C_SYM;
+	c->c_len = r->r_p - beg;
+	if ((c->c_str = strndup(beg, c->c_len)) == NULL)
+		return;
+
+	if (c->c_type == C_SYM && (isdigit((unsigned char)*beg) ||
+	    (*beg == '-' && isdigit((unsigned char)beg[1])))) {
+		c->c_num = strtonum(c->c_str, INT_MIN, INT_MAX, &errstr);
+		if (errstr == NULL)
+			c->c_type = C_NUM;
+	}
+}
 
-        /* Does the line have a 'list' like: */
-        /* (list "a" "b") */
-        regs = "^list[ ]+.*$";
-        if (doregex(regs, begp)) {
-		if (expctr == 1)
-			return(dobeep_num("list with no-where to go.", lnm));
+static void
+freecells(struct cell *c)
+{
+	struct cell	*next;
 
-		if (par1 == &lp && expctr > 1)
-			return(foundlst(begp, blkid, expctr, elen));
+	for (; c != NULL; c = next) {
+		next = c->c_next;
+		freecells(c->c_list);
+		free(c->c_str);
+		free(c);
+	}
+}
 
-		return(dobeep_num("Invalid use of list line:", lnm));
+/*
+ * Find the compiled program for src in the cache, or read and compile it.
+ * On success src belongs to the program.
+ */
+static struct iprog *
+icompile(char *src, int line)
+{
+	struct iprog	*ip, **slot;
+	struct reader	 r;
+	struct cell	*forms, *c;
+
+	slot = &icache[strhash(src) % NICACHE];
+	if (*slot != NULL && strcmp((*slot)->ip_src, src) == 0)
+		return (*slot);
+
+	r.r_p = src;
+	r.r_line = line;
+	if (readelems(&r, &forms, 0) != TRUE) {
+		freecells(forms);
+		return (NULL);
+	}
+	if ((ip = calloc(1, sizeof(*ip))) == NULL) {
+		freecells(forms);
+		(void)dobeep_msg("malloc Error");
+		return (NULL);
+	}
+	for (c = forms; c != NULL; c = c->c_next) {
+		if (compileform(ip, c) != TRUE) {
+			freecells(forms);
+			freeprog(ip);
+			return (NULL);
+		}
 	}
-	return (FALSE);
+	freecells(forms);
+	if (emit(ip, OP_END, -1) != TRUE) {
+		freeprog(ip);
+		return (NULL);
+	}
+
+	ip->ip_src = src;
+	pend = NULL;
+	pendsz = 0;
+	if (*slot != NULL)
+		freeprog(*slot);
+	*slot = ip;
+	return (ip);
 }
 
+/*
+ * Compile one top level expression.
+ */
 static int
-parsexp(char *begp, const char *par1, const char *par2, int blkid, int expctr,
-    int elen)
+compileform(struct iprog *ip, struct cell *c)
 {
-	struct expentry *e1 = NULL;
+	struct cell	*h, *a;
 	PF		 funcp;
-	char		*cmdp, *fendp, *valp, *fname, *funb = NULL;
-	int		 numparams, ret;
-
-	cmdp = begp;
-	fendp = strchr(cmdp, ' ');
-	if (!fendp)
-		return (dobeep_msgs("Failed parsing expression, missing ' ': ", cmdp));
-	*fendp = '\0';
+	int		 numparams, k;
+
+	if (c->c_type != C_LIST)
+		return (dobeep_num("Error line:", c->c_line));
+	if ((h = c->c_list) == NULL)
+		return (dobeep_num("Empty parenthesis not supported line",
+		    c->c_line));
+	if (h->c_type == C_LIST)
+		return (dobeep_num("Multiple consecutive left parentheses line",
+		    c->c_line));
+	if (h->c_type != C_SYM)
+		return (dobeep_num("First char of expression error line:",
+		    c->c_line));
+
+	if (strcmp(h->c_str, "define") == 0)
+		return (compiledef(ip, c));
+	if (strcmp(h->c_str, "let") == 0)
+		return (compilelet(ip, c));
+	if (strcmp(h->c_str, "list") == 0)
+		return (dobeep_num("list with no-where to go.", c->c_line));
+	if (strcmp(h->c_str, "exit") == 0 && h->c_next == NULL)
+		return (emit(ip, OP_EXIT, -1));
+
+	if ((funcp = name_function(h->c_str)) == NULL)
+		return (dobeep_msgs("Unknown command:", h->c_str));
 
 	/*
-	 * If no extant mg command found, just return.
+	 * Key arguments are parsed by excline(), hand the whole
+	 * expression to it.
 	 */
-	if ((funcp = name_function(cmdp)) == NULL)
-		return (dobeep_msgs("Unknown command:", cmdp));
+	if (funcp == bindtokey || funcp == unbindtokey ||
+	    funcp == localbind || funcp == localunbind ||
+	    funcp == redefine_key) {
+		if ((k = addconst(ip, C_STR, c->c_beg, c->c_end - c->c_beg,
+		    0)) < 0)
+			return (FALSE);
+		return (emit(ip, OP_EXCLINE, k));
+	}
 
 	numparams = numparams_function(funcp);
-	if (numparams == 0)
-		return (dobeep_msgs("Command takes no arguments:", cmdp));
-
-	if (numparams == -1)
-		return (dobeep_msgs("Interactive command found:", cmdp));
-
-	if ((e1 = malloc(sizeof(struct expentry))) == NULL) {
-		cleanup();
-		return (dobeep_msg("malloc Error"));
-	}
-	TAILQ_INSERT_HEAD(&ehead, e1, eentry);
-	if ((e1->fun = strndup(cmdp, BUFSIZE)) == NULL) {
-		cleanup();
-		return(dobeep_msg("strndup error"));
+	if (h->c_next != NULL) {
+		if (numparams == 0)
+			return (dobeep_msgs("Command takes no arguments:",
+			    h->c_str));
+		if (numparams == -1)
+			return (dobeep_msgs("Interactive command found:",
+			    h->c_str));
+		if (numparams > MAXPARAMS)
+			return (dobeep_msgs("Too many parameters:", h->c_str));
 	}
-	cmdp = e1->fun;
-	fname = e1->fun;
-	e1->funbuf[0] = '\0';
-	funb = e1->funbuf;
-	e1->expctr = expctr;
-	e1->blkid = blkid;
-	/* need to think about these two */
-	e1->par1 = par1;
-	e1->par2 = par2;
-
-	*fendp = ' ';
-	valp = fendp + 1;
-
-	ret = expandvals(cmdp, valp, funb);
-	if (!ret)
-		return (ret);
-
-	return (multiarg(fname, funb, numparams));
+	if (emit(ip, OP_MARK, -1) != TRUE)
+		return (FALSE);
+	for (a = h->c_next; a != NULL; a = a->c_next)
+		if (compilearg(ip, a) != TRUE)
+			return (FALSE);
+	if ((k = addfun(ip, funcp, numparams)) < 0)
+		return (FALSE);
+	return (emit(ip, OP_CALL, k));
 }
 
 /*
- * Pass a list of arguments to a function.
+ * (define name value) or (define name (list value ...)).
  */
 static int
-multiarg(char *cmdp, char *argbuf, int numparams)
-{
-	char	 excbuf[BUFSIZE];
-	char	*argp, *p, *s = " ";
-	char	*regs;
-	int	 spc, numspc;
-	int	 fin, inquote;
-
-	argp = argbuf;
-	spc = 1; /* initially fake a space so we find first argument */
-	numspc = fin = inquote = 0;
-
-	for (p = argbuf; *p != '\0'; p++) {
-		if (*(p + 1) == '\0')
-			fin = 1;
-
-		if (*p != ' ') {
-			if (*p == '"') {
-				if (inquote == 1)
-					inquote = 0;	
-				else
-					inquote = 1;
-			}
-			if (spc == 1)
-				if ((numspc % numparams) == 0) {
-					argp = p;
-				}
-			spc = 0;
-		}
-		if ((*p == ' ' && inquote == 0) || fin) {
-			if (spc == 1)/* || (numspc % numparams == 0))*/
-				continue;
-			if ((numspc % numparams) != (numparams - 1)) {
-				numspc++;
-				continue;
-			}
-			if (*p == ' ') {
-				*p = '\0';		/* terminate arg string */
-			}
-			excbuf[0] = '\0';
-			regs = "[\"]+.*[\"]+";
+compiledef(struct iprog *ip, struct cell *c)
+{
+	struct cell	*n, *v;
+	int		 k;
 
-       			if (!doregex(regs, argp)) {
-				const char *errstr;
+	n = c->c_list->c_next;
 
-				strtonum(argp, 0, INT_MAX, &errstr);
-				if (errstr != NULL)
-					return (dobeep_msgs("Var not found:",
-					    argp));
-			}
+	/* (define (name ...) ...): user functions are not implemented yet. */
+	if (n != NULL && n->c_type == C_LIST)
+		return (TRUE);
 
-			if (strlcpy(excbuf, cmdp, sizeof(excbuf))
-			    >= sizeof(excbuf))
-				return (dobeep_msg("strlcpy error"));
-			if (strlcat(excbuf, s, sizeof(excbuf))
-			    >= sizeof(excbuf))
-				return (dobeep_msg("strlcat error"));
-			if (strlcat(excbuf, argp, sizeof(excbuf))
-			    >= sizeof(excbuf))
-				return (dobeep_msg("strlcat error"));
+	if (n == NULL || n->c_type != C_SYM || (v = n->c_next) == NULL ||
+	    v->c_next != NULL)
+		return (dobeep_num("Invalid use of define line:", c->c_line));
 
-			excline(excbuf, 0, 0);
+	/*
+	 * Check variable name is not an existing mg function.
+	 */
+	if (name_function(n->c_str) != NULL)
+		return (dobeep_msgs("Variable/function name clash:",
+		    n->c_str));
 
-			if (fin)
-				break;
+	if (emit(ip, OP_MARK, -1) != TRUE || compilearg(ip, v) != TRUE)
+		return (FALSE);
+	if ((k = addsym(ip, n->c_str)) < 0)
+		return (FALSE);
+	return (emit(ip, OP_DEFINE, k));
+}
 
-			*p = ' ';		/* unterminate arg string */
-			numspc++;
-			spc = 1;
-		}
+/*
+ * (let ((name value) ...) body ...).  All values are computed before
+ * any of the names is bound.
+ */
+static int
+compilelet(struct iprog *ip, struct cell *c)
+{
+	struct cell	*b, *e, *n;
+	int		 k, nbind = 0;
+
+	if ((b = c->c_list->c_next) == NULL || b->c_type != C_LIST)
+		return (dobeep_num("Invalid use of let line:", c->c_line));
+
+	for (e = b->c_list; e != NULL; e = e->c_next) {
+		if (e->c_type != C_LIST || (n = e->c_list) == NULL ||
+		    n->c_type != C_SYM || n->c_next == NULL ||
+		    n->c_next->c_next != NULL)
+			return (dobeep_num("Invalid use of let line:",
+			    e->c_line));
+		if (name_function(n->c_str) != NULL)
+			return (dobeep_msgs("Variable/function name clash:",
+			    n->c_str));
+		if (emit(ip, OP_MARK, -1) != TRUE ||
+		    compilearg(ip, n->c_next) != TRUE)
+			return (FALSE);
+		if ((k = addsym(ip, n->c_str)) < 0 ||
+		    emit(ip, OP_BIND, k) != TRUE)
+			return (FALSE);
+		nbind++;
 	}
-	return (TRUE);
+	if (emit(ip, OP_ENTER, nbind) != TRUE)
+		return (FALSE);
+	for (e = b->c_next; e != NULL; e = e->c_next)
+		if (compileform(ip, e) != TRUE)
+			return (FALSE);
+	return (emit(ip, OP_LEAVE, nbind));
 }
 
 /*
- * Is an item a value or a variable?
+ * Compile an argument: a value, a variable reference or a (list ...).
  */
 static int
-isvar(char **argp, char **varbuf, int sizof)
+compilearg(struct iprog *ip, struct cell *a)
 {
-	struct varentry *v1 = NULL;
-
-	if (SLIST_EMPTY(&varhead))
-		return (FALSE);
-#ifdef  MGLOG
-	mglog_isvar(*varbuf, *argp, sizof);
-#endif
-	SLIST_FOREACH(v1, &varhead, entry) {
-		if (strcmp(*argp, v1->v_name) == 0) {
-			(void)((int)strlcpy(*varbuf, v1->v_buf, sizof) >= sizof);
-			return (TRUE);
+	struct cell	*e;
+	int		 k;
+
+	switch (a->c_type) {
+	case C_LIST:
+		if (a->c_list == NULL || a->c_list->c_type != C_SYM ||
+		    strcmp(a->c_list->c_str, "list") != 0)
+			return (dobeep_num("Nested expression not supported "
+			    "line:", a->c_line));
+		if (a->c_list->c_next == NULL)
+			return (dobeep_num("Invalid use of list line:",
+			    a->c_line));
+		for (e = a->c_list->c_next; e != NULL; e = e->c_next) {
+			if (e->c_type == C_LIST)
+				return (dobeep_num("Invalid use of list line:",
+				    e->c_line));
+			if (compilearg(ip, e) != TRUE)
+				return (FALSE);
 		}
+		return (TRUE);
+	case C_SYM:
+		/* Command names are passed on as they are. */
+		if (name_function(a->c_str) == NULL) {
+			if ((k = addsym(ip, a->c_str)) < 0)
+				return (FALSE);
+			return (emit(ip, OP_VAR, k));
+		}
+		/* FALLTHROUGH */
+	default:
+		if ((k = addconst(ip, a->c_type, a->c_str, a->c_len,
+		    a->c_num)) < 0)
+			return (FALSE);
+		return (emit(ip, OP_CONST, k));
 	}
-	return (FALSE);
 }
 
-
+/*
+ * Append an opcode, and its operand unless that is -1.
+ */
 static int
-foundfun(char *defstr, int expctr)
+emit(struct iprog *ip, int op, int operand)
 {
+	int	*p, n;
+
+	if (ip->ip_ncode + 2 > ip->ip_szcode) {
+		n = ip->ip_szcode ? ip->ip_szcode * 2 : 16;
+		if ((p = reallocarray(ip->ip_code, n, sizeof(int))) == NULL)
+			return (dobeep_msg("malloc Error"));
+		ip->ip_code = p;
+		ip->ip_szcode = n;
+	}
+	ip->ip_code[ip->ip_ncode++] = op;
+	if (operand != -1)
+		ip->ip_code[ip->ip_ncode++] = operand;
 	return (TRUE);
 }
 
+/*
+ * Add a constant to the pool, returning its index or -1.
+ */
 static int
-foundlst(char *defstr, int blkid, int expctr, int elen)
+addconst(struct iprog *ip, int type, const char *s, int len, int num)
 {
-	char		*p;
-
-	p = strstr(defstr, " ");
-	p = skipwhite(p);
-	expandvals(NULL, p, defnam);
-
-	return (TRUE);
+	struct ivalue	*p;
+	int		 n;
+
+	if (ip->ip_nk == ip->ip_szk) {
+		n = ip->ip_szk ? ip->ip_szk * 2 : 8;
+		if ((p = reallocarray(ip->ip_k, n, sizeof(*p))) == NULL) {
+			(void)dobeep_msg("malloc Error");
+			return (-1);
+		}
+		ip->ip_k = p;
+		ip->ip_szk = n;
+	}
+	p = &ip->ip_k[ip->ip_nk];
+	if ((p->iv_str = malloc(len + 1)) == NULL) {
+		(void)dobeep_msg("malloc Error");
+		return (-1);
+	}
+	memcpy(p->iv_str, s, len);
+	p->iv_str[len] = '\0';
+	p->iv_len = len;
+	p->iv_type = type;
+	p->iv_num = num;
+	return (ip->ip_nk++);
 }
 
 /*
- * 'define' strings follow the regex in parsdef().
+ * Add a resolved function, returning its index or -1.
  */
 static int
-founddef(char *defstr, int blkid, int expctr, int hasval, int elen)
+addfun(struct iprog *ip, PF funcp, int numparams)
 {
-	struct varentry *vt, *v1 = NULL;
-	char		*p, *vnamep, *vendp = NULL, *valp;
-
-	p = strstr(defstr, " ");        /* move to first ' ' char.    */
-	vnamep = skipwhite(p);		/* find first char of var name. */
-	vendp = vnamep;
+	struct ifun	*p;
+	int		 n;
+
+	for (n = 0; n < ip->ip_nfn; n++)
+		if (ip->ip_fn[n].if_funct == funcp)
+			return (n);
+	if (ip->ip_nfn == ip->ip_szfn) {
+		n = ip->ip_szfn ? ip->ip_szfn * 2 : 4;
+		if ((p = reallocarray(ip->ip_fn, n, sizeof(*p))) == NULL) {
+			(void)dobeep_msg("malloc Error");
+			return (-1);
+		}
+		ip->ip_fn = p;
+		ip->ip_szfn = n;
+	}
+	ip->ip_fn[ip->ip_nfn].if_funct = funcp;
+	ip->ip_fn[ip->ip_nfn].if_nparams = numparams;
+	return (ip->ip_nfn++);
+}
 
-	/* now find the end of the define/list name */
-	while (1) {
-		++vendp;
-		if (*vendp == ' ')
-			break;
+/*
+ * Add an interned symbol, returning its index or -1.
+ */
+static int
+addsym(struct iprog *ip, const char *name)
+{
+	struct symbol	*sym, **p;
+	int		 n;
+
+	if ((sym = intern(name)) == NULL)
+		return (-1);
+	for (n = 0; n < ip->ip_nsym; n++)
+		if (ip->ip_sym[n] == sym)
+			return (n);
+	if (ip->ip_nsym == ip->ip_szsym) {
+		n = ip->ip_szsym ? ip->ip_szsym * 2 : 4;
+		if ((p = reallocarray(ip->ip_sym, n, sizeof(*p))) == NULL) {
+			(void)dobeep_msg("malloc Error");
+			return (-1);
+		}
+		ip->ip_sym = p;
+		ip->ip_szsym = n;
 	}
-	*vendp = '\0';
+	ip->ip_sym[ip->ip_nsym] = sym;
+	return (ip->ip_nsym++);
+}
 
-	/*
-	 * Check list name is not an existing mg function.
-	 */
-	if (name_function(vnamep) != NULL)
-		return(dobeep_msgs("Variable/function name clash:", vnamep));
+/*
+ * Find the symbol for a name, creating it if need be.  Symbols live for
+ * as long as mg does, so compiled programs may keep pointers to them.
+ */
+static struct symbol *
+intern(const char *name)
+{
+	struct symbol	*sym, **nt, *next;
+	unsigned int	 h, i, newsize;
+
+	h = strhash(name);
+	if (symtab != NULL) {
+		for (sym = symtab[h & (symsize - 1)]; sym != NULL;
+		    sym = sym->s_next)
+			if (strcmp(sym->s_name, name) == 0)
+				return (sym);
+	}
 
-	if (!SLIST_EMPTY(&varhead)) {
-		SLIST_FOREACH_SAFE(v1, &varhead, entry, vt) {
-			if (strcmp(vnamep, v1->v_name) == 0)
-				SLIST_REMOVE(&varhead, v1, varentry, entry);
+	if (nsyms >= symsize) {
+		newsize = symsize ? symsize * 2 : NSYMTAB;
+		if ((nt = calloc(newsize, sizeof(*nt))) == NULL) {
+			(void)dobeep_msg("malloc Error");
+			return (NULL);
 		}
+		for (i = 0; i < symsize; i++) {
+			for (sym = symtab[i]; sym != NULL; sym = next) {
+				next = sym->s_next;
+				sym->s_next =
+				    nt[strhash(sym->s_name) & (newsize - 1)];
+				nt[strhash(sym->s_name) & (newsize - 1)] = sym;
+			}
+		}
+		free(symtab);
+		symtab = nt;
+		symsize = newsize;
+	}
+
+	if ((sym = calloc(1, sizeof(*sym))) == NULL ||
+	    (sym->s_name = strdup(name)) == NULL) {
+		free(sym);
+		(void)dobeep_msg("malloc Error");
+		return (NULL);
 	}
-	if ((v1 = malloc(sizeof(struct varentry))) == NULL)
-		return (ABORT);
-	SLIST_INSERT_HEAD(&varhead, v1, entry);
-	if ((v1->v_name = strndup(vnamep, BUFSIZE)) == NULL)
-		return(dobeep_msg("strndup error"));
-	vnamep = v1->v_name;
-	v1->v_count = 0;
-	v1->v_vals = NULL;
-	v1->v_buf[0] = '\0';
+	sym->s_next = symtab[h & (symsize - 1)];
+	symtab[h & (symsize - 1)] = sym;
+	nsyms++;
+	return (sym);
+}
 
-	defnam = v1->v_buf;
+static void
+freeprog(struct iprog *ip)
+{
+	int	 i;
+
+	for (i = 0; i < ip->ip_nk; i++)
+		free(ip->ip_k[i].iv_str);
+	free(ip->ip_k);
+	free(ip->ip_fn);
+	free(ip->ip_sym);
+	free(ip->ip_code);
+	free(ip->ip_src);
+	free(ip);
+}
 
-	if (hasval) {
-		valp = skipwhite(vendp + 1);
+/*
+ * Run a compiled program.
+ */
+static int
+execute(struct iprog *ip)
+{
+	struct bframe	*bf;
+	char		*line;
+	int		*pc, base = 0, bbase = bsp, ret = TRUE;
+	int		 i;
+
+	vsp = 0;
+	for (pc = ip->ip_code; ret == TRUE; ) {
+		switch (*pc++) {
+		case OP_MARK:
+			base = vsp;
+			break;
+		case OP_CONST:
+			ret = push(&ip->ip_k[*pc++]);
+			break;
+		case OP_VAR:
+			ret = pushvar(ip->ip_sym[*pc++]);
+			break;
+		case OP_CALL:
+			ret = docall(&ip->ip_fn[*pc++], &vstk[base],
+			    vsp - base);
+			vsp = base;
+			break;
+		case OP_DEFINE:
+			ret = dodefine(ip->ip_sym[*pc++], &vstk[base],
+			    vsp - base);
+			vsp = base;
+			break;
+		case OP_BIND:
+			ret = dobind(ip->ip_sym[*pc++], &vstk[base],
+			    vsp - base);
+			vsp = base;
+			break;
+		case OP_ENTER:
+			for (i = bsp - *pc++; i < bsp; i++) {
+				bf = &bstk[i];
+				bf->bf_bind->b_prev = bf->bf_sym->s_bind;
+				bf->bf_sym->s_bind = bf->bf_bind;
+				bf->bf_entered = 1;
+			}
+			break;
+		case OP_LEAVE:
+			unbind(bsp - *pc++);
+			break;
+		case OP_EXCLINE:
+			/* excline() scribbles on its argument. */
+			if ((line = strdup(ip->ip_k[*pc].iv_str)) == NULL)
+				ret = dobeep_msg("strdup error");
+			else {
+				ret = excline(line, ip->ip_k[*pc].iv_len, 0);
+				free(line);
+			}
+			pc++;
+			break;
+		case OP_EXIT:
+			ret = exitinterpreter(NULL, NULL, FALSE);
+			break;
+		case OP_END:
+		default:
+			goto out;
+		}
+	}
+out:
+	vsp = 0;
+	unbind(bbase);
+	return (ret);
+}
 
-		expandvals(NULL, valp, defnam);
-		defnam = NULL;
+static int
+push(struct ivalue *iv)
+{
+	struct ivalue	*p;
+	int		 n;
+
+	if (vsp == vsz) {
+		n = vsz ? vsz * 2 : 16;
+		if ((p = reallocarray(vstk, n, sizeof(*p))) == NULL)
+			return (dobeep_msg("malloc Error"));
+		vstk = p;
+		vsz = n;
 	}
-	*vendp = ' ';	
+	vstk[vsp++] = *iv;
 	return (TRUE);
 }
 
+/*
+ * Push the value, or values, of a variable.
+ */
+static int
+pushvar(struct symbol *sym)
+{
+	struct binding	*b;
+	int		 i;
+
+	if ((b = sym->s_bind) == NULL)
+		return (dobeep_msgs("Var not found:", sym->s_name));
+	for (i = 0; i < b->b_count; i++)
+		if (push(&b->b_vals[i]) != TRUE)
+			return (FALSE);
+	return (TRUE);
+}
 
+/*
+ * Pass a list of arguments to a function, numparams at a time.  A number
+ * leading a group becomes the function's numeric argument.
+ */
 static int
-expandvals(char *cmdp, char *valp, char *bp)
-{
-	char	 argbuf[BUFSIZE], contbuf[BUFSIZE], varbuf[BUFSIZE];
-	char	*argp, *regs, *endp, *p, *v, *s = " ";
-	int	 spc, sizof, fin, inquote;
-
-	/* now find the first argument */
-	p = skipwhite(valp);
-
-	if (strlcpy(argbuf, p, sizeof(argbuf)) >= sizeof(argbuf))
-		return (dobeep_msg("strlcpy error"));
-	argp = argbuf;
-	spc = 1; /* initially fake a space so we find first argument */
-	fin = inquote = spc = 0;
-
-	for (p = argbuf; *p != '\0'; p++) {
-		if (*(p + 1) == '\0')
-			fin = 1;
-
-		if (*p != ' ') {
-			if (*p == '"') {
-				if (inquote == 1)
-					inquote = 0;	
-				else
-					inquote = 1;
-			}
-			if (spc == 1)
-				argp = p;
-			spc = 0;
+docall(struct ifun *fn, struct ivalue *vals, int nvals)
+{
+	char	*argv[MAXPARAMS];
+	int	 argl[MAXPARAMS];
+	int	 i, j, k, end, f, n;
+
+	if (nvals == 0)
+		return (excargs(fn->if_funct, 0, 1, NULL, NULL, 0));
+
+	for (i = 0; i < nvals; i = end) {
+		end = i + fn->if_nparams;
+		if (end > nvals)
+			end = nvals;
+		f = 0;
+		n = 1;
+		j = i;
+		if (vals[j].iv_type == C_NUM) {
+			f = FFARG;
+			n = vals[j++].iv_num;
 		}
-		if ((*p == ' ' && inquote == 0) || fin) {
-			if (spc == 1)
-				continue;
-			/* terminate arg string */
-			if (*p == ' ') {
-				*p = '\0';		
-			}
-			endp = p + 1;
-			varbuf[0] = '\0';
-			contbuf[0] = '\0';			
-			sizof = sizeof(varbuf);
-			v = varbuf;
-			regs = "[\"]+.*[\"]+";
-       			if (doregex(regs, argp))
-				;			/* found quotes */
-			else if (isvar(&argp, &v, sizof)) {
-
-				(void)((int)strlcat(varbuf, " ",
-                                    sizof) >= sizof);
-
-				*p = ' ';
-				(void)(strlcpy(contbuf, endp,
-				    sizeof(contbuf)) >= sizeof(contbuf));
-
-				(void)((int)strlcat(varbuf, contbuf,
-				    sizof) >= sizof);
-				
-				argbuf[0] = ' ';
-				argbuf[1] = '\0';
-				(void)((int)strlcat(argbuf, varbuf,
-				    sizof) >= sizof);
-
-				p = argp = argbuf;
-				spc = 1;
-				fin = 0;
-				continue;
-			} else {
-				const char *errstr;
-
-				strtonum(argp, 0, INT_MAX, &errstr);
-				if (errstr != NULL)
-					return (dobeep_msgs("Var not found:",
-					    argp));
-			}
-#ifdef  MGLOG
-        mglog_misc("x|%s|%p|%d|\n", bp, defnam, BUFSIZE);
-#endif
-			if (*bp != '\0') {
-				if (strlcat(bp, s, BUFSIZE) >= BUFSIZE)
-					return (dobeep_msg("strlcat error"));
-			}
-			if (strlcat(bp, argp, BUFSIZE) >= BUFSIZE) {
-				return (dobeep_msg("strlcat error"));
-			}
-/*			v1->v_count++;*/
-			
-			if (fin)
-				break;
-
-			*p = ' ';		/* unterminate arg string */
-			spc = 1;
+		for (k = 0; j < end; j++, k++) {
+			argv[k] = vals[j].iv_str;
+			argl[k] = vals[j].iv_len;
 		}
+		(void)excargs(fn->if_funct, f, n, argv, argl, k);
 	}
 	return (TRUE);
 }
 
 /*
- * Finished with buffer evaluation, so clean up any vars.
- * Perhaps keeps them in mg even after use,...
+ * Assign values to the innermost binding of a variable, or make a new
+ * global binding if it has none.
  */
-/*static int
-clearvars(void)
+static int
+dodefine(struct symbol *sym, struct ivalue *vals, int nvals)
 {
-	struct varentry	*v1 = NULL;
+	struct ivalue	*nv;
 
-	while (!SLIST_EMPTY(&varhead)) {
-		v1 = SLIST_FIRST(&varhead);
-		SLIST_REMOVE_HEAD(&varhead, entry);
-		free(v1->v_name);
-		free(v1);
+	/* Copy first: vals may point into the old values. */
+	if ((nv = copyvals(vals, nvals)) == NULL)
+		return (FALSE);
+	if (sym->s_bind == NULL) {
+		if ((sym->s_bind = calloc(1, sizeof(struct binding))) == NULL) {
+			free(nv);
+			return (dobeep_msg("malloc Error"));
+		}
+	} else
+		free(sym->s_bind->b_vals);
+	sym->s_bind->b_vals = nv;
+	sym->s_bind->b_count = nvals;
+	return (TRUE);
+}
+
+/*
+ * Make a new binding for a 'let', to be entered once all of the block's
+ * values are known.
+ */
+static int
+dobind(struct symbol *sym, struct ivalue *vals, int nvals)
+{
+	struct bframe	*p;
+	struct binding	*b;
+	int		 n;
+
+	if (bsp == bsz) {
+		n = bsz ? bsz * 2 : 8;
+		if ((p = reallocarray(bstk, n, sizeof(*p))) == NULL)
+			return (dobeep_msg("malloc Error"));
+		bstk = p;
+		bsz = n;
+	}
+	if ((b = calloc(1, sizeof(*b))) == NULL)
+		return (dobeep_msg("malloc Error"));
+	if ((b->b_vals = copyvals(vals, nvals)) == NULL) {
+		free(b);
+		return (FALSE);
 	}
-	return (FALSE);
+	b->b_count = nvals;
+	bstk[bsp].bf_sym = sym;
+	bstk[bsp].bf_bind = b;
+	bstk[bsp].bf_entered = 0;
+	bsp++;
+	return (TRUE);
 }
-*/
+
 /*
- * Finished with block evaluation, so clean up any expressions.
+ * Drop 'let' bindings until only depth of them are left.
  */
 static void
-clearexp(void)
+unbind(int depth)
 {
-	struct expentry	*e1 = NULL;
-
-	while (!TAILQ_EMPTY(&ehead)) {
-		e1 = TAILQ_FIRST(&ehead);
-		TAILQ_REMOVE(&ehead, e1, eentry);
-		free(e1->fun);
-		free(e1);
+	struct bframe	*bf;
+
+	while (bsp > depth) {
+		bf = &bstk[--bsp];
+		if (bf->bf_entered)
+			bf->bf_sym->s_bind = bf->bf_bind->b_prev;
+		free(bf->bf_bind->b_vals);
+		free(bf->bf_bind);
 	}
-	return;
 }
 
 /*
- * Cleanup before leaving.
+ * Copy an array of values and their text into a single allocation.
  */
-void
-cleanup(void)
+static struct ivalue *
+copyvals(struct ivalue *vals, int nvals)
+{
+	struct ivalue	*nv;
+	char		*s;
+	size_t		 sz;
+	int		 i;
+
+	sz = nvals * sizeof(*nv);
+	for (i = 0; i < nvals; i++)
+		sz += vals[i].iv_len + 1;
+	if ((nv = malloc(sz ? sz : 1)) == NULL) {
+		(void)dobeep_msg("malloc Error");
+		return (NULL);
+	}
+	s = (char *)&nv[nvals];
+	for (i = 0; i < nvals; i++) {
+		nv[i] = vals[i];
+		nv[i].iv_str = s;
+		memcpy(s, vals[i].iv_str, vals[i].iv_len);
+		s[vals[i].iv_len] = '\0';
+		s += vals[i].iv_len + 1;
+	}
+	return (nv);
+}
+
+static unsigned int
+strhash(const char *s)
 {
-	defnam = NULL;
+	unsigned int	 h = 2166136261U;
 
-	clearexp();
-/*	clearvars();*/
+	while (*s != '\0') {
+		h ^= (unsigned char)*s++;
+		h *= 16777619U;
+	}
+	return (h);
 }
 
 /*
- * Test a string against a regular expression.
+ * Forget any unfinished expression before leaving.  Compiled programs
+ * and variables are kept.
  */
-static int
-doregex(char *r, char *e)
+void
+cleanup(void)
 {
-	regex_t  regex_buff;
-
-	if (regcomp(&regex_buff, r, REG_EXTENDED)) {
-		regfree(&regex_buff);
-		return(dobeep_num("Regex compilation error line:", lnm));
-	}
-	if (!regexec(&regex_buff, e, 0, NULL, 0)) {
-		regfree(&regex_buff);
-		return(TRUE);
-	}
-	regfree(&regex_buff);
-	return(FALSE);
+	free(pend);
+	pend = NULL;
+	pendlen = pendsz = 0;
+	pdepth = pinstr = 0;
 }
 
 /*
@@ -15,17 +15,11 @@
 #include "macro.h"
 #include "mouse.h"
 
-#ifdef  MGLOG
-#include "log.h"
-#endif
-
 #define METABIT 0x80
 
 #define PROMPTL 80
 char	 prompt[PROMPTL] = "", *promptp = prompt;
 
-static int mgwrap(PF, int, int);
-
 static int		 use_metakey = TRUE;
 static int		 pushed = FALSE;
 static int		 pushedc;
@@ -148,6 +142,19 @@ getkey(int flag)
 	return (c);
 }
 
+/*
+ * Wait for the next key at the top level, letting descriptors
+ * registered with ttwatch() update buffers and redisplay meanwhile.
+ */
+void
+keywait(void)
+{
+	if (pushed || pushback_count > 0 || inmacro)
+		return;
+	while (ttidle())
+		update(CMODE);
+}
+
 /*
  * doscan scans a keymap for a keyboard character and returns a pointer
  * to the function associated with that character.  Sets ele to the
@@ -226,15 +233,14 @@ doin(void)
 		key.k_chars[key.k_count++] = getkey(TRUE);
 	}
 
-#ifdef  MGLOG
-	if (!mglog(funct, curmap))
-		ewprintf("Problem with logging");
-#endif
-
 	if (macrodef && macrocount < MAXMACRO)
 		macro[macrocount++].m_funct = funct;
 
+#ifdef TRACE
+	return (tracecmd(funct, 0, 1));
+#else
 	return (mgwrap(funct, 0, 1));
+#endif
 }
 
 int
@@ -450,6 +456,8 @@ selfinsert(int f, int n)
 	/* overwrite mode */
 	if (curbp->b_flag & BFOVERWRITE) {
 		lchange(WFEDIT);
+		if (lwritable(curwp->w_dotp) == FALSE)
+			return (FALSE);
 		while (curwp->w_doto < llength(curwp->w_dotp) && n--)
 			lputc(curwp->w_dotp, curwp->w_doto++, c);
 		if (n <= 0)
@@ -511,7 +519,7 @@ quote(int f, int n)
  * We ignore any function whose sole purpose is to get us
  * to the intended function.
  */
-static int
+int
 mgwrap(PF funct, int f, int n)
 {
 	static	 PF ofp;
@@ -26,6 +26,22 @@
 
 #include "def.h"
 
+/*
+ * Text shared by lines of different buffers, see lclone().  A line
+ * with a negative l_size does not own its text: -l_size - 1 indexes
+ * its entry here, and the text is copied before the line is changed.
+ */
+struct lshare {
+	int	ls_refs;	/* Lines using it, or the next free one */
+	int	ls_size;	/* Allocated size of the text */
+};
+
+static void		 ltextfree(struct line *);
+
+static struct lshare	*lshares;
+static int		 nlshares;
+static int		 lsharefree = -1;
+
 int	casereplace = TRUE;
 
 /*
@@ -66,8 +82,29 @@ lalloc(int used)
 int
 lrealloc(struct line *lp, int newsize)
 {
-	char *tmp;
+	struct lshare	*ls;
+	char		*tmp;
+	int		 i;
 
+	if (lp->l_size < 0) {
+		i = -lp->l_size - 1;
+		ls = &lshares[i];
+		if (ls->ls_refs > 1) {
+			if (newsize < lp->l_used)
+				newsize = lp->l_used;
+			if ((tmp = malloc(newsize)) == NULL)
+				return (FALSE);
+			memcpy(tmp, lp->l_text, lp->l_used);
+			ls->ls_refs--;
+			lp->l_text = tmp;
+			lp->l_size = newsize;
+			return (TRUE);
+		}
+		/* The last user just takes the text over. */
+		lp->l_size = ls->ls_size;
+		ls->ls_refs = lsharefree;
+		lsharefree = i;
+	}
 	if (lp->l_size < newsize) {
 		if ((tmp = realloc(lp->l_text, newsize)) == NULL)
 			return (FALSE);
@@ -77,6 +114,81 @@ lrealloc(struct line *lp, int newsize)
 	return (TRUE);
 }
 
+/*
+ * Make sure line "lp" has text of its own before it is changed in place.
+ */
+int
+lwritable(struct line *lp)
+{
+	if (lp->l_size >= 0)
+		return (TRUE);
+	return (lrealloc(lp, lp->l_used));
+}
+
+/*
+ * Allocate a new line with the same text as "lp".  The text itself is
+ * not copied: both lines refer to it until one of them is changed.
+ */
+struct line *
+lclone(struct line *lp)
+{
+	struct lshare	*ls;
+	struct line	*nlp;
+	int		 i, n;
+
+	if ((nlp = lalloc(0)) == NULL)
+		return (NULL);
+	if (lp->l_used == 0)
+		return (nlp);
+	if (lp->l_size >= 0) {
+		if (lsharefree == -1) {
+			if (nlshares > INT_MAX / 2)
+				goto fail;
+			n = nlshares ? nlshares * 2 : 1024;
+			if ((ls = reallocarray(lshares, n, sizeof(*ls))) ==
+			    NULL)
+				goto fail;
+			for (i = n - 1; i >= nlshares; i--) {
+				ls[i].ls_refs = lsharefree;
+				lsharefree = i;
+			}
+			lshares = ls;
+			nlshares = n;
+		}
+		i = lsharefree;
+		lsharefree = lshares[i].ls_refs;
+		lshares[i].ls_refs = 1;
+		lshares[i].ls_size = lp->l_size;
+		lp->l_size = -i - 1;
+	}
+	lshares[-lp->l_size - 1].ls_refs++;
+	nlp->l_text = lp->l_text;
+	nlp->l_size = lp->l_size;
+	nlp->l_used = lp->l_used;
+	return (nlp);
+fail:
+	free(nlp);
+	return (NULL);
+}
+
+/*
+ * Release the text of line "lp", unless another line still uses it.
+ */
+static void
+ltextfree(struct line *lp)
+{
+	struct lshare	*ls;
+
+	if (lp->l_size < 0) {
+		ls = &lshares[-lp->l_size - 1];
+		if (--ls->ls_refs > 0)
+			return;
+		ls->ls_refs = lsharefree;
+		lsharefree = -lp->l_size - 1;
+	}
+	free(lp->l_text);
+}
+
 /*
  * Delete line "lp".  Fix all of the links that might point to it (they are
  * moved to offset 0 of the next line.  Unlink the line from whatever buffer
@@ -115,7 +227,7 @@ lfree(struct line *lp)
 	}
 	lp->l_bp->l_fp = lp->l_fp;
 	lp->l_fp->l_bp = lp->l_bp;
-	free(lp->l_text);
+	ltextfree(lp);
 	free(lp);
 }
 
@@ -129,15 +241,22 @@ lfree(struct line *lp)
 void
 lchange(int flag)
 {
+	struct buffer	*bp;
 	struct mgwin	*wp;
 
+	/* Changes happen at dot; let the line caches know where. */
+	ledited(curbp, curwp->w_dotline);
+
 	/* update mode lines if this is the first change. */
 	if ((curbp->b_flag & BFCHG) == 0) {
 		flag |= WFMODE;
 		curbp->b_flag |= BFCHG;
+		for (bp = bheadp; bp != NULL; bp = bp->b_bufp)
+			if (bp->b_headp == curbp->b_headp)
+				bp->b_flag |= BFCHG;
 	}
 	for (wp = wheadp; wp != NULL; wp = wp->w_wndp) {
-		if (wp->w_bufp == curbp) {
+		if (wp->w_bufp->b_headp == curbp->b_headp) {
 			wp->w_rflag |= flag;
 			if (wp != curwp)
 				wp->w_rflag |= WFFULL;
@@ -145,6 +264,43 @@ lchange(int flag)
 	}
 }
 
+/*
+ * Note that line "n" of buffer "bp" and the lines after it may have
+ * changed, so what is cached about them can no longer be trusted.
+ */
+void
+ledited(struct buffer *bp, int n)
+{
+	struct buffer	*obp;
+
+	if (bp->b_editline > n)
+		bp->b_editline = n;
+	if (bp->b_lidxvalid > n)
+		bp->b_lidxvalid = n;
+	for (obp = bheadp; obp != NULL; obp = obp->b_bufp) {
+		if (obp->b_headp != bp->b_headp || obp == bp)
+			continue;
+		if (obp->b_editline > n)
+			obp->b_editline = n;
+		if (obp->b_lidxvalid > n)
+			obp->b_lidxvalid = n;
+	}
+}
+
+/*
+ * Add "n" to the line count of "bp" and of the buffers sharing its text.
+ */
+void
+lcount(struct buffer *bp, int n)
+{
+	struct buffer	*obp;
+
+	bp->b_lines += n;
+	for (obp = bheadp; obp != NULL; obp = obp->b_bufp)
+		if (obp->b_headp == bp->b_headp && obp != bp)
+			obp->b_lines = bp->b_lines;
+}
+
 /*
  * Insert "n" copies of the character "c" at the current location of dot.
  * In the easy case all that happens is the text is stored in the line.
@@ -259,7 +415,7 @@ lnewline_at(struct line *lp1, int doto)
 
 	lchange(WFFULL);
 
-	curwp->w_bufp->b_lines++;
+	lcount(curbp, 1);
 	/* Check if mark is past dot (even on current line) */
 	if (curwp->w_markline > curwp->w_dotline  ||
 	   (curwp->w_dotline == curwp->w_markline &&
@@ -281,7 +437,7 @@ lnewline_at(struct line *lp1, int doto)
 			if (wp->w_linep == lp1)
 				wp->w_linep = lp2;
 			if (wp->w_dotline >= tcurwpdotline &&
-			    wp->w_bufp == curwp->w_bufp)
+			    wp->w_bufp->b_headp == curbp->b_headp)
 				wp->w_dotline++;
 		}
 		undo_add_boundary(FFRAND, 1);
@@ -310,7 +466,7 @@ lnewline_at(struct line *lp1, int doto)
 			wp->w_doto -= doto;
 			wp->w_dotline++;
 		} else if (wp->w_dotline > tcurwpdotline &&
-			   wp->w_bufp == curwp->w_bufp)
+			   wp->w_bufp->b_headp == curbp->b_headp)
 			wp->w_dotline++;
 		if (wp->w_markp == lp1 && wp->w_marko >= doto) {
 			wp->w_markp = lp2;
@@ -342,6 +498,356 @@ lnewline(void)
 	return (lnewline_at(curwp->w_dotp, curwp->w_doto));
 }
 
+/*
+ * Insert "len" bytes of text at dot, splitting lines at newlines.  The
+ * result is the same as inserting the text a character at a time with
+ * linsert() and lnewline(), but each new line is built once and the
+ * whole insertion is a single undo record.  Dot is left after the text.
+ */
+int
+linsertblock(const char *buf, int len)
+{
+	struct line	*lp1, *lp2, *lp3, *first, *prev;
+	struct mgwin	*wp;
+	const char	*cp, *nl, *last;
+	int		 doto, dotline, nlines, tlen, s;
+
+	if (len == 0)
+		return (TRUE);
+	if ((s = checkdirty(curbp)) != TRUE)
+		return (s);
+	if (curbp->b_flag & BFREADONLY) {
+		dobeep();
+		ewprintf("Buffer is read only");
+		return (FALSE);
+	}
+
+	lp1 = curwp->w_dotp;
+	doto = curwp->w_doto;
+	dotline = curwp->w_dotline;
+
+	/* special case for the end, as in linsert() */
+	if (lp1 == curbp->b_headp) {
+		if (doto != 0) {
+			dobeep();
+			ewprintf("bug: linsertblock");
+			return (FALSE);
+		}
+		if ((lp2 = lalloc(0)) == NULL)
+			return (FALSE);
+		lp2->l_bp = lp1->l_bp;
+		lp1->l_bp->l_fp = lp2;
+		lp2->l_fp = lp1;
+		lp1->l_bp = lp2;
+		for (wp = wheadp; wp != NULL; wp = wp->w_wndp) {
+			if (wp->w_linep == lp1)
+				wp->w_linep = lp2;
+			if (wp->w_dotp == lp1)
+				wp->w_dotp = lp2;
+			if (wp->w_markp == lp1)
+				wp->w_markp = lp2;
+		}
+		lp1 = lp2;
+	}
+
+	nlines = 0;
+	last = buf;
+	for (cp = buf; (nl = memchr(cp, *curbp->b_nlchr, buf + len - cp)) !=
+	    NULL; cp = nl + 1) {
+		nlines++;
+		last = nl + 1;
+	}
+
+	if (nlines == 0) {
+		if (lrealloc(lp1, lp1->l_used + len) == FALSE)
+			return (FALSE);
+		lchange(WFEDIT);
+		memmove(&lp1->l_text[doto + len], &lp1->l_text[doto],
+		    lp1->l_used - doto);
+		memcpy(&lp1->l_text[doto], buf, len);
+		lp1->l_used += len;
+		for (wp = wheadp; wp != NULL; wp = wp->w_wndp) {
+			if (wp->w_dotp == lp1) {
+				if (wp == curwp || wp->w_doto > doto)
+					wp->w_doto += len;
+			}
+			if (wp->w_markp == lp1) {
+				if (wp->w_marko > doto)
+					wp->w_marko += len;
+			}
+		}
+		undo_add_insert(lp1, doto, len);
+		return (TRUE);
+	}
+
+	/*
+	 * Build the new lines off to the side first, so running out of
+	 * memory leaves the buffer as it was.  The first piece of text
+	 * is appended to dot's line and the last takes the rest of it.
+	 */
+	nl = memchr(buf, *curbp->b_nlchr, len);
+	if (lrealloc(lp1, doto + (nl - buf)) == FALSE)
+		return (FALSE);
+	tlen = buf + len - last;
+	first = prev = NULL;
+	for (cp = nl + 1; cp <= last; cp = nl + 1) {
+		if (cp == last)
+			lp2 = lalloc(tlen + lp1->l_used - doto);
+		else {
+			nl = memchr(cp, *curbp->b_nlchr, last - cp);
+			lp2 = lalloc(nl - cp);
+		}
+		if (lp2 == NULL) {
+			for (; first != NULL; first = lp2) {
+				lp2 = first->l_fp;
+				free(first->l_text);
+				free(first);
+			}
+			return (FALSE);
+		}
+		if (cp == last) {
+			memcpy(lp2->l_text, last, tlen);
+			memcpy(&lp2->l_text[tlen], &lp1->l_text[doto],
+			    lp1->l_used - doto);
+		} else
+			memcpy(lp2->l_text, cp, nl - cp);
+		lp2->l_fp = NULL;
+		lp2->l_bp = prev;
+		if (prev != NULL)
+			prev->l_fp = lp2;
+		else
+			first = lp2;
+		prev = lp2;
+		if (cp == last)
+			break;
+	}
+	lp3 = prev;
+
+	lchange(WFFULL);
+	nl = memchr(buf, *curbp->b_nlchr, len);
+	memcpy(&lp1->l_text[doto], buf, nl - buf);
+	lp1->l_used = doto + (nl - buf);
+	lp3->l_fp = lp1->l_fp;
+	lp1->l_fp->l_bp = lp3;
+	first->l_bp = lp1;
+	lp1->l_fp = first;
+
+	lcount(curbp, nlines);
+	if (curwp->w_markline > dotline ||
+	    (curwp->w_markline == dotline && curwp->w_markp == lp1 &&
+	    curwp->w_marko > doto))
+		curwp->w_markline += nlines;
+	for (wp = wheadp; wp != NULL; wp = wp->w_wndp) {
+		if (wp->w_dotp == lp1 && (wp == curwp || wp->w_doto > doto)) {
+			wp->w_dotp = lp3;
+			wp->w_doto += tlen - doto;
+			wp->w_dotline += nlines;
+		} else if (wp->w_bufp->b_headp == curbp->b_headp &&
+		    wp->w_dotline > dotline)
+			wp->w_dotline += nlines;
+		if (wp->w_markp == lp1 && wp->w_marko > doto) {
+			wp->w_markp = lp3;
+			wp->w_marko += tlen - doto;
+		}
+	}
+	undo_add_insert(lp1, doto, len);
+	return (TRUE);
+}
+
+/*
+ * Rewrite the region a line at a time.  "fn" is handed each line with
+ * the part of it inside the region and writes the replacement, at most
+ * "grow" times as long, to a scratch buffer.  It must depend only on
+ * the line and "arg", as it is run once to find which lines change and
+ * again to change them.  Lines that come out the same are not touched;
+ * the rest are recorded for undo as one change from the first of them
+ * to the last, and the buffer is only marked changed if there are any.
+ */
+int
+ltransform(struct region *rp, int grow, LTF fn, void *arg)
+{
+	struct line	*lp, *flp, *llp;
+	struct mgwin	*wp;
+	char		*buf = NULL, *nbuf;
+	size_t		 bufsize = 0, need;
+	int		 start, end, len, delta, left, lineno, fline;
+	int		 foff, lend, rel, fpos, lpos, nsize, bon, s;
+
+	if (rp->r_size < 0)
+		return (dobeep_msg("Bad region"));
+	if ((s = checkdirty(curbp)) != TRUE)
+		return (s);
+	if (curbp->b_flag & BFREADONLY) {
+		dobeep();
+		ewprintf("Buffer is read only");
+		return (FALSE);
+	}
+
+	/* Find the first and last lines that change. */
+	flp = llp = NULL;
+	foff = lend = fline = fpos = lpos = 0;
+	lp = rp->r_linep;
+	start = rp->r_offset;
+	left = rp->r_size;
+	lineno = rp->r_lineno;
+	for (rel = 0;;) {
+		end = llength(lp) - start > left ? start + left : llength(lp);
+		need = (size_t)(end - start) * grow + 1;
+		if (need > bufsize) {
+			if ((nbuf = realloc(buf, need)) == NULL) {
+				free(buf);
+				return (dobeep_msg("Out of memory"));
+			}
+			buf = nbuf;
+			bufsize = need;
+		}
+		len = (*fn)(buf, lp, start, end, arg);
+		if (len != end - start ||
+		    memcmp(buf, &lp->l_text[start], len) != 0) {
+			if (flp == NULL) {
+				flp = lp;
+				foff = start;
+				fline = lineno;
+				fpos = rel;
+			}
+			llp = lp;
+			lend = end;
+			lpos = rel + end - start;
+		}
+		rel += end - start;
+		left -= end - start;
+		if (left == 0 || (lp = lforw(lp)) == curbp->b_headp)
+			break;
+		left--;
+		rel++;
+		start = 0;
+		lineno++;
+	}
+	if (flp == NULL) {
+		free(buf);
+		return (TRUE);
+	}
+
+	bon = undo_boundary_enable(FFRAND, 0);
+	undo_add_delete(flp, foff, lpos - fpos, 0);
+	lchange(WFFULL);
+	ledited(curbp, fline);
+	nsize = 0;
+	s = TRUE;
+	for (lp = flp, start = foff;; lp = lforw(lp), start = 0) {
+		end = lp == llp ? lend : llength(lp);
+		len = (*fn)(buf, lp, start, end, arg);
+		delta = len - (end - start);
+		if (delta == 0 && memcmp(buf, &lp->l_text[start], len) == 0)
+			;	/* unchanged */
+		else if (lrealloc(lp, llength(lp) + (delta > 0 ? delta : 0)) ==
+		    FALSE) {
+			s = dobeep_msg("Out of memory");
+			len = end - start;
+		} else {
+			memmove(&lp->l_text[end + delta], &lp->l_text[end],
+			    llength(lp) - end);
+			memcpy(&lp->l_text[start], buf, len);
+			lp->l_used += delta;
+			/*
+			 * Dot and mark past the span move with the text
+			 * after it; inside it they keep their offset, as
+			 * far as the line still reaches.
+			 */
+			for (wp = wheadp; wp != NULL; wp = wp->w_wndp) {
+				if (wp->w_dotp == lp) {
+					if (wp->w_doto >= end)
+						wp->w_doto += delta;
+					else if (wp->w_doto > llength(lp))
+						wp->w_doto = llength(lp);
+				}
+				if (wp->w_markp == lp) {
+					if (wp->w_marko >= end)
+						wp->w_marko += delta;
+					else if (wp->w_marko > llength(lp))
+						wp->w_marko = llength(lp);
+				}
+			}
+		}
+		nsize += len;
+		if (lp == llp)
+			break;
+		nsize++;
+	}
+	undo_add_insert(flp, foff, nsize);
+	undo_boundary_enable(FFRAND, bon);
+	free(buf);
+	return (s);
+}
+
+/*
+ * Reorder the "n" lines starting at "lp", which is line number "lineno",
+ * so that line i afterwards is the one that was line perm[i].  No text
+ * is copied; the lines are just relinked.  Dot and mark stay on the same
+ * line numbers, and undo records the permutation that puts them back.
+ */
+int
+lpermute(struct line *lp, int lineno, int n, const int *perm)
+{
+	struct line	**old, *prev, *next;
+	struct mgwin	 *wp;
+	int		 *inv, i, s;
+
+	if ((s = checkdirty(curbp)) != TRUE)
+		return (s);
+	if (curbp->b_flag & BFREADONLY) {
+		dobeep();
+		ewprintf("Buffer is read only");
+		return (FALSE);
+	}
+	for (i = 0; i < n && perm[i] == i; i++)
+		;
+	if (i == n)
+		return (TRUE);
+
+	old = reallocarray(NULL, n, sizeof(*old));
+	inv = reallocarray(NULL, n, sizeof(*inv));
+	if (old == NULL || inv == NULL) {
+		free(old);
+		free(inv);
+		return (dobeep_msg("Out of memory"));
+	}
+	for (i = 0; i < n; i++, lp = lforw(lp))
+		old[i] = lp;
+	next = lp;
+	prev = lback(old[0]);
+	for (i = 0; i < n; i++) {
+		inv[perm[i]] = i;
+		prev->l_fp = old[perm[i]];
+		old[perm[i]]->l_bp = prev;
+		prev = old[perm[i]];
+	}
+	prev->l_fp = next;
+	next->l_bp = prev;
+
+	for (wp = wheadp; wp != NULL; wp = wp->w_wndp) {
+		if (wp->w_bufp->b_headp != curbp->b_headp)
+			continue;
+		if (wp->w_dotline >= lineno && wp->w_dotline < lineno + n) {
+			wp->w_dotp = old[perm[wp->w_dotline - lineno]];
+			if (wp->w_doto > llength(wp->w_dotp))
+				wp->w_doto = llength(wp->w_dotp);
+		}
+		if (wp->w_markp != NULL && wp->w_markline >= lineno &&
+		    wp->w_markline < lineno + n) {
+			wp->w_markp = old[perm[wp->w_markline - lineno]];
+			if (wp->w_marko > llength(wp->w_markp))
+				wp->w_marko = llength(wp->w_markp);
+		}
+	}
+	lchange(WFFULL);
+	ledited(curbp, lineno);
+	undo_add_permute(old[perm[0]], n, inv);
+	free(old);
+	free(inv);
+	return (TRUE);
+}
+
 /*
  * This function deletes "n" bytes, starting at dot. (actually, n+1, as the
  * newline is included) It understands how to deal with end of lines, etc.
@@ -396,11 +902,13 @@ ldelete(RSIZE n, int kflag)
 			lchange(WFFULL);
 			if (ldelnewline() == FALSE)
 				goto out;
-			end = strlcat(sv, curbp->b_nlchr, len + 1);
+			end += strlcpy(&sv[end], curbp->b_nlchr, len + 1 - end);
 			--n;
 			continue;
 		}
 		lchange(WFEDIT);
+		if (lwritable(dotp) == FALSE)
+			goto out;
 		/* Scrunch text */
 		cp1 = &dotp->l_text[doto];
 		memcpy(&sv[end], cp1, chunk);
@@ -464,8 +972,9 @@ ldelnewline(void)
 	/* at the end of the buffer */
 	if (lp2 == curbp->b_headp)
 		return (TRUE);
+	ledited(curbp, curwp->w_dotline);
 	/* Keep line counts in sync */
-	curwp->w_bufp->b_lines--;
+	lcount(curbp, -1);
 	if (curwp->w_markline > curwp->w_dotline)
 		curwp->w_markline--;
 	if (lp2->l_used <= lp1->l_size - lp1->l_used) {
@@ -485,6 +994,7 @@ ldelnewline(void)
 		lp1->l_used += lp2->l_used;
 		lp1->l_fp = lp2->l_fp;
 		lp2->l_fp->l_bp = lp1;
+		ltextfree(lp2);
 		free(lp2);
 		return (TRUE);
 	}
@@ -512,7 +1022,9 @@ ldelnewline(void)
 			wp->w_marko += lp1->l_used;
 		}
 	}
+	ltextfree(lp1);
 	free(lp1);
+	ltextfree(lp2);
 	free(lp2);
 	return (TRUE);
 }
@@ -21,10 +21,6 @@
 #include "funmap.h"
 #include "macro.h"
 
-#ifdef  MGLOG
-#include "log.h"
-#endif
-
 int		 thisflag;			/* flags, this command	*/
 int		 lastflag;			/* flags, last command	*/
 int		 curgoal;			/* goal column		*/
@@ -38,7 +34,6 @@ struct buffer	*curbp;				/* current buffer	*/
 struct buffer	*bheadp;			/* BUFFER list head	*/
 struct mgwin	*curwp;				/* current window	*/
 struct mgwin	*wheadp;			/* MGWIN listhead	*/
-struct vhead	 varhead;			/* Variable list head	*/
 char		 pat[NPAT];			/* pattern		*/
 
 static void	 edinit(struct buffer *);
@@ -48,8 +43,8 @@ extern void	 closetags(void);
 static __dead void
 usage(int code)
 {
-	fprintf(stderr, "usage: %s [-hnR] [-b file] [-f mode] [-u file] "
-	    "[+number] [file ...]\n",
+	fprintf(stderr, "usage: %s [-hnR] [-b file] [-f mode] [-j jobs] "
+	    "[-l list] [-u file]\n\t  [+number] [file ...]\n",
 	    PACKAGE_NAME);
 	exit(code);
 }
@@ -60,10 +55,12 @@ main(int argc, char **argv)
 	FILE		*ffp;
 	char		 file[NFILEN];
 	char		*cp, *conffile = NULL, *init_fcn_name = NULL;
-	char		*batchfile = NULL;
+	char		*batchfile = NULL, *listfile = NULL;
+	const char	*errstr;
 	PF		 init_fcn = NULL;
 	int	 	 o, i, nfiles;
 	int	  	 nobackups = 0;
+	int		 jobs = 0, worker = 0;
 	struct buffer	*bp = NULL;
 
 #ifdef __OpenBSD__
@@ -71,7 +68,7 @@ main(int argc, char **argv)
 		err(1, "pledge");
 #endif
 
-	while ((o = getopt(argc, argv, "hnRb:f:u:")) != -1)
+	while ((o = getopt(argc, argv, "hnRb:f:j:l:u:")) != -1)
 		switch (o) {
 		case 'b':
 			batch = 1;
@@ -92,6 +89,15 @@ main(int argc, char **argv)
 		case 'h':
 			usage(0);
 			break;
+		case 'j':
+			jobs = strtonum(optarg, 1, 1024, &errstr);
+			if (errstr != NULL)
+				errx(1, "number of jobs is %s: %s", errstr,
+				    optarg);
+			break;
+		case 'l':
+			listfile = optarg;
+			break;
 		case 'u':
 			conffile = optarg;
 			break;
@@ -105,28 +111,46 @@ main(int argc, char **argv)
                     PACKAGE_NAME);
                 exit(1);
 	}
+	if (!batch && (jobs != 0 || listfile != NULL)) {
+		fprintf(stderr, "%s: -j and -l require -b.\n", PACKAGE_NAME);
+		exit(1);
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	/*
+	 * With files to edit, batch mode runs the script over each of
+	 * them in a pool of worker processes; see batch.c.
+	 */
+	if (batch && (argc > 0 || listfile != NULL)) {
+		if (access(batchfile, R_OK) == -1)
+			err(1, "%s", batchfile);
+		if (jobs == 0 && (jobs = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+			jobs = 1;
+		worker = batchstart(listfile, argc, argv, jobs);
+		argc = 0;
+	}
 	if (batch) {
 		pty_init();
 		conffile = batchfile;
 	}
-	if ((ffp = startupfile(NULL, conffile, file, sizeof(file))) == NULL &&
-	    conffile != NULL) {
+	if (worker)
+		ffp = NULL;
+	else if ((ffp = startupfile(NULL, conffile, file, sizeof(file))) ==
+	    NULL && conffile != NULL) {
 		fprintf(stderr, "%s: Problem with file: %s\n", PACKAGE_NAME,
 		    conffile);
 		exit(1);
 	}
 
-	argc -= optind;
-	argv += optind;
-
 	setlocale(LC_CTYPE, "");
 
 	maps_init();		/* Keymaps and modes.		*/
 	funmap_init();		/* Functions.			*/
 
-#ifdef  MGLOG
-	if (!mgloginit())
-		errx(1, "Unable to create logging environment.");
+#ifdef TRACE
+	traceinit();		/* Command trace.		*/
 #endif
 
 	/*
@@ -174,8 +198,9 @@ main(int argc, char **argv)
 	}
 
 	if (batch) {
+		i = worker ? batchrun(batchfile) : 0;
 		vttidy();
-		return (0);
+		return (i);
 	}
 
 	/*
@@ -253,6 +278,7 @@ notnum:
 			winch_flag = 0;
 		}
 		update(CMODE);
+		keywait();
 		lastflag = thisflag;
 		thisflag = 0;
 
@@ -16,6 +16,12 @@
 #include "def.h"
 #include "key.h"
 
+/*
+ * How far back balance() looks for a match, in characters, when c-mode
+ * cannot find it.
+ */
+#define MATCHLIMIT	102400
+
 static int	balance(void);
 static void	displaymatch(struct line *, int);
 
@@ -61,6 +67,9 @@ showmatch(int f, int n)
  * This routine does the real work of searching backward
  * for a balancing character.  If such a balancing character
  * is found, it uses displaymatch() to display the match.
+ * C-mode finds brackets in code from its own state; anything
+ * else is searched for at most MATCHLIMIT characters back,
+ * and not shown if it is further away.
  */
 static int
 balance(void)
@@ -69,6 +78,10 @@ balance(void)
 	int	 cbo;
 	int	 c, i, depth;
 	int	 rbal, lbal;
+#ifdef ENABLE_CMODE
+	int	 s;
+#endif /* ENABLE_CMODE */
+	long	 limit = MATCHLIMIT;
 
 	rbal = key.k_chars[key.k_count - 1];
 
@@ -87,10 +100,20 @@ balance(void)
 	clp = curwp->w_dotp;
 	cbo = curwp->w_doto - 1;
 
+#ifdef ENABLE_CMODE
+	if ((s = cc_match(clp, curwp->w_dotline, cbo, &clp, &cbo)) != ABORT) {
+		if (s == TRUE)
+			displaymatch(clp, cbo);
+		return (s);
+	}
+#endif /* ENABLE_CMODE */
+
 	/* init nesting depth */
 	depth = 0;
 
 	for (;;) {
+		if (--limit < 0)
+			return (TRUE);
 		if (cbo == 0) {
 			clp = lback(clp);	/* beginning of line	*/
 			if (clp == curbp->b_headp)
@@ -0,0 +1,198 @@
+/* This file is in the public domain. */
+
+/*
+ * mgtrace: print a command trace written by mg, see trace.c.
+ */
+
+#include <err.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+struct cmdstat {
+	uint32_t	 cs_func;
+	uint32_t	 cs_count;
+	uint32_t	 cs_max;
+	uint64_t	 cs_total;
+};
+
+static void	 usage(void);
+static const char *funcname(uint16_t);
+static char	*keyname(char *, size_t, int);
+static void	 list(const struct trace_rec *);
+static void	 summary(const struct trace_rec *);
+static int	 statcmp(const void *, const void *);
+
+static struct trace_hdr	 th;
+static char		(*names)[TRACE_NAMELEN];
+
+int
+main(int argc, char *argv[])
+{
+	struct trace_rec	*recs;
+	FILE			*fp;
+	time_t			 t;
+	int			 ch, sflag = 0;
+
+	while ((ch = getopt(argc, argv, "s")) != -1)
+		switch (ch) {
+		case 's':
+			sflag = 1;
+			break;
+		default:
+			usage();
+		}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1)
+		usage();
+
+	if ((fp = fopen(argv[0], "r")) == NULL)
+		err(1, "%s", argv[0]);
+	if (fread(&th, sizeof(th), 1, fp) != 1 ||
+	    memcmp(th.th_magic, TRACE_MAGIC, sizeof(th.th_magic)) != 0)
+		errx(1, "%s: not an mg trace", argv[0]);
+	if ((names = calloc(th.th_nfuncs + 1, sizeof(*names))) == NULL ||
+	    (recs = calloc(th.th_nrecs + 1, sizeof(*recs))) == NULL)
+		err(1, NULL);
+	if (fread(names, sizeof(*names), th.th_nfuncs, fp) != th.th_nfuncs ||
+	    fread(recs, sizeof(*recs), th.th_nrecs, fp) != th.th_nrecs)
+		errx(1, "%s: truncated trace", argv[0]);
+	(void)fclose(fp);
+
+	t = th.th_start;
+	printf("# %" PRIu32 " of %" PRIu32 " commands, mg started %s",
+	    th.th_nrecs, th.th_seq, ctime(&t));
+	if (th.th_signo != 0)
+		printf("# written on signal %d (%s)\n", (int)th.th_signo,
+		    strsignal(th.th_signo));
+
+	if (sflag)
+		summary(recs);
+	else
+		list(recs);
+	return (0);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: mgtrace [-s] file\n");
+	exit(1);
+}
+
+static const char *
+funcname(uint16_t func)
+{
+	if (func >= th.th_nfuncs)
+		return ("?");
+	names[func][TRACE_NAMELEN - 1] = '\0';
+	return (names[func]);
+}
+
+/*
+ * Name a key the way the mg help functions do, more or less.
+ */
+static char *
+keyname(char *buf, size_t len, int c)
+{
+	if (c == ' ')
+		(void)snprintf(buf, len, "SPC");
+	else if (c == '\t')
+		(void)snprintf(buf, len, "TAB");
+	else if (c == '\r')
+		(void)snprintf(buf, len, "RET");
+	else if (c == 0x1b)
+		(void)snprintf(buf, len, "ESC");
+	else if (c == 0x7f)
+		(void)snprintf(buf, len, "DEL");
+	else if (c < ' ')
+		(void)snprintf(buf, len, "C-%c", c >= 1 && c <= 26 ?
+		    c + '`' : c + '@');
+	else if (c < 0x7f)
+		(void)snprintf(buf, len, "%c", c);
+	else
+		(void)snprintf(buf, len, "\\%o", c);
+	return (buf);
+}
+
+static void
+list(const struct trace_rec *recs)
+{
+	const struct trace_rec	*tr;
+	char			 keys[32], k0[8], k1[8];
+	uint32_t		 i;
+
+	printf("%8s %12s %9s %2s %6s %5s %-12s %s\n", "seq", "time",
+	    "usec", "st", "lines", "undo", "keys", "command");
+	for (i = 0; i < th.th_nrecs; i++) {
+		tr = &recs[i];
+		(void)keyname(k0, sizeof(k0), tr->tr_keys[0]);
+		(void)keyname(k1, sizeof(k1), tr->tr_keys[1]);
+		if (tr->tr_nkeys <= 1)
+			(void)snprintf(keys, sizeof(keys), "%s", k0);
+		else
+			(void)snprintf(keys, sizeof(keys), "%s %s%s", k0,
+			    tr->tr_nkeys > 2 ? "... " : "", k1);
+		printf("%8" PRIu32 " %12.6f %9" PRIu32 " %c%c %+6" PRId32
+		    " %5" PRId32 " %-12s %s%s\n",
+		    th.th_seq - th.th_nrecs + i, tr->tr_time / 1e9,
+		    tr->tr_usec, "FTA?"[tr->tr_status & 3],
+		    tr->tr_flags & TRF_MACRO ? 'M' : ' ', tr->tr_lines,
+		    tr->tr_undo, keys, funcname(tr->tr_func),
+		    tr->tr_flags & TRF_SWITCH ? " (switched buffer)" : "");
+	}
+}
+
+/*
+ * Per command counts and times, the most expensive first.
+ */
+static void
+summary(const struct trace_rec *recs)
+{
+	struct cmdstat	*st;
+	uint32_t	 i, n;
+
+	n = th.th_nfuncs + 1;
+	if ((st = calloc(n, sizeof(*st))) == NULL)
+		err(1, NULL);
+	for (i = 0; i < n; i++)
+		st[i].cs_func = i < th.th_nfuncs ? i : TRACE_NOFUNC;
+	for (i = 0; i < th.th_nrecs; i++) {
+		struct cmdstat *sp;
+
+		sp = &st[recs[i].tr_func < th.th_nfuncs ?
+		    recs[i].tr_func : th.th_nfuncs];
+		sp->cs_count++;
+		sp->cs_total += recs[i].tr_usec;
+		if (recs[i].tr_usec > sp->cs_max)
+			sp->cs_max = recs[i].tr_usec;
+	}
+	qsort(st, n, sizeof(*st), statcmp);
+
+	printf("%8s %12s %9s %9s %s\n", "count", "usec", "mean", "max",
+	    "command");
+	for (i = 0; i < n && st[i].cs_count != 0; i++)
+		printf("%8" PRIu32 " %12" PRIu64 " %9" PRIu64 " %9" PRIu32
+		    " %s\n", st[i].cs_count, st[i].cs_total,
+		    st[i].cs_total / st[i].cs_count, st[i].cs_max,
+		    funcname(st[i].cs_func));
+	free(st);
+}
+
+static int
+statcmp(const void *a, const void *b)
+{
+	const struct cmdstat *sa = a, *sb = b;
+
+	if (sa->cs_total != sb->cs_total)
+		return (sa->cs_total < sb->cs_total ? 1 : -1);
+	if (sa->cs_count != sb->cs_count)
+		return (sa->cs_count < sb->cs_count ? 1 : -1);
+	return (0);
+}
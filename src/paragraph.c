@@ -12,12 +12,14 @@
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "def.h"
 
 static int	fillcol = 70;
 
-#define MAXWORD 256
+/* Characters that separate words when filling. */
+#define ISFILLSEP(c, nl)	((c) == ' ' || (c) == '\t' || (c) == (nl))
 
 static int	findpara(void);
 static int 	do_gotoeop(int, int, int *);
@@ -121,22 +123,23 @@ do_gotoeop(int f, int n, int *i)
 
 /*
  * Justify a paragraph.  Fill the current paragraph according to the current
- * fill column.
+ * fill column.  The filled text is built in one pass over the paragraph and
+ * then replaces it as a single edit, so filling is linear in the size of the
+ * paragraph and one undo puts it back.
  */
 int
 fillpara(int f, int n)
 {
-	int	 c;		/* current char during scan		*/
-	int	 wordlen;	/* length of current word		*/
-	int	 clength;	/* position on line during fill		*/
-	int	 i;		/* index during word copy		*/
-	int	 eopflag;	/* Are we at the End-Of-Paragraph?	*/
-	int	 firstflag;	/* first word? (needs no space)		*/
-	int	 newlength;	/* tentative new line length		*/
-	int	 eolflag;	/* was at end of line			*/
-	int	 retval;	/* return value				*/
-	struct line	*eopline;	/* pointer to line just past EOP	*/
-	char	 wbuf[MAXWORD];	/* buffer for current word		*/
+	struct region	 reg;
+	struct line	*lp, *eopline;
+	char		*obuf = NULL;	/* paragraph as it is		*/
+	char		*nbuf = NULL;	/* and as it will be		*/
+	char		 nl;
+	int		 olen, nlen;	/* lengths of the above		*/
+	int		 i, j;		/* start and end of a word	*/
+	int		 clength;	/* position on line during fill	*/
+	int		 gap;		/* spaces after the last word	*/
+	int		 retval = TRUE;
 
 	if (n == 0)
 		return (TRUE);
@@ -145,112 +148,111 @@ fillpara(int f, int n)
 
 	/* record the pointer to the line just past the EOP */
 	(void)gotoeop(FFRAND, 1);
-	if (curwp->w_doto != 0) {
-		/* paragraph ends at end of buffer */
-		(void)lnewline();
-		eopline = lforw(curwp->w_dotp);
-	} else
-		eopline = curwp->w_dotp;
+	eopline = curwp->w_dotp;
+	if (lforw(curwp->w_dotp) == curbp->b_headp) {
+		/* paragraph ends at end of buffer? */
+		for (i = 0; i < llength(curwp->w_dotp); i++)
+			if (!isspace(lgetc(curwp->w_dotp, i)))
+				break;
+		if (i == llength(curwp->w_dotp))
+			;
+		else if (curbp->b_narrow != NULL &&
+		    curbp->b_narrow->n_after != curbp->b_narrow->n_wide)
+			/* more text follows; don't add a line before it */
+			eopline = curbp->b_headp;
+		else {
+			(void)gotoeol(FFRAND, 1);
+			(void)lnewline();
+			eopline = curwp->w_dotp;
+		}
+	}
 
-	/* and back top the beginning of the paragraph */
+	/* back to the first word; anything before it is left alone */
 	(void)gotobop(FFRAND, 1);
+	while (inword() == 0 && curwp->w_dotp != eopline &&
+	    forwchar(FFRAND, 1))
+		;
+	if (curwp->w_dotp == eopline)
+		goto cleanup;
+
+	olen = llength(curwp->w_dotp) - curwp->w_doto;
+	for (lp = lforw(curwp->w_dotp); lp != eopline; lp = lforw(lp))
+		olen += llength(lp) + 1;
+
+	/* every word gains at most one extra space */
+	if ((obuf = malloc(olen + 1)) == NULL ||
+	    (nbuf = malloc(2 * olen + 1)) == NULL) {
+		dobeep();
+		ewprintf("Out of memory");
+		retval = FALSE;
+		goto cleanup;
+	}
+	memset(&reg, 0, sizeof(reg));
+	reg.r_linep = curwp->w_dotp;
+	reg.r_offset = curwp->w_doto;
+	reg.r_size = olen;
+	(void)region_get_data(&reg, obuf, olen);
 
-	/* initialize various info */
-	while (inword() == 0 && forwchar(FFRAND, 1));
-
+	nl = *curbp->b_nlchr;
 	clength = curwp->w_doto;
-	wordlen = 0;
-
-	/* scan through lines, filling words */
-	firstflag = TRUE;
-	eopflag = FALSE;
-	while (!eopflag) {
-
-		/* get the next character in the paragraph */
-		if ((eolflag = (curwp->w_doto == llength(curwp->w_dotp)))) {
-			c = ' ';
-			if (lforw(curwp->w_dotp) == eopline)
-				eopflag = TRUE;
-		} else
-			c = lgetc(curwp->w_dotp, curwp->w_doto);
-
-		/* and then delete it */
-		if (ldelete((RSIZE) 1, KNONE) == FALSE && !eopflag) {
-			retval = FALSE;
-			goto cleanup;
+	nlen = gap = 0;
+	for (i = 0; i < olen; i = j) {
+		if (ISFILLSEP(obuf[i], nl)) {
+			j = i + 1;
+			continue;
 		}
-
-		/* if not a separator, just add it in */
-		if (c != ' ' && c != '\t') {
-			if (wordlen < MAXWORD - 1)
-				wbuf[wordlen++] = c;
-			else {
-				/*
-				 * You lose chars beyond MAXWORD if the word
-				 * is too long. I'm too lazy to fix it now; it
-				 * just silently truncated the word before,
-				 * so I get to feel smug.
-				 */
-				ewprintf("Word too long!");
-			}
-		} else if (wordlen) {
-
-			/* calculate tentative new length with word added */
-			newlength = clength + 1 + wordlen;
-
-			/*
-			 * if at end of line or at doublespace and previous
-			 * character was one of '.','?','!' doublespace here.
-			 * behave the same way if a ')' is preceded by a
-			 * [.?!] and followed by a doublespace.
-			 */
-			if (dblspace && (!eopflag && ((eolflag ||
-			    curwp->w_doto == llength(curwp->w_dotp) ||
-			    (c = lgetc(curwp->w_dotp, curwp->w_doto)) == ' '
-			    || c == '\t') && (ISEOSP(wbuf[wordlen - 1]) ||
-			    (wbuf[wordlen - 1] == ')' && wordlen >= 2 &&
-			    ISEOSP(wbuf[wordlen - 2])))) &&
-			    wordlen < MAXWORD - 1))
-				wbuf[wordlen++] = ' ';
-
-			/* at a word break with a word waiting */
-			if (newlength <= fillcol) {
-				/* add word to current line */
-				if (!firstflag) {
-					(void)linsert(1, ' ');
-					++clength;
-				}
-				firstflag = FALSE;
-			} else {
-				if (curwp->w_doto > 0 &&
-				    lgetc(curwp->w_dotp, curwp->w_doto - 1) == ' ') {
-					curwp->w_doto -= 1;
-					(void)ldelete((RSIZE) 1, KNONE);
-				}
-				/* start a new line */
-				(void)lnewline();
-				clength = 0;
-			}
-
-			/* and add the word in in either case */
-			for (i = 0; i < wordlen; i++) {
-				(void)linsert(1, wbuf[i]);
-				++clength;
-			}
-			wordlen = 0;
+		for (j = i; j < olen && !ISFILLSEP(obuf[j], nl); j++)
+			;
+
+		/* the first word stays on the first line */
+		if (nlen == 0)
+			;
+		else if (clength + gap + (j - i) <= fillcol) {
+			memset(&nbuf[nlen], ' ', gap);
+			nlen += gap;
+			clength += gap;
+		} else {
+			nbuf[nlen++] = nl;
+			clength = 0;
 		}
+		memcpy(&nbuf[nlen], &obuf[i], j - i);
+		nlen += j - i;
+		clength += j - i;
+
+		/*
+		 * if at end of line or at doublespace and previous
+		 * character was one of '.','?','!' doublespace here.
+		 * behave the same way if a ')' is preceded by a
+		 * [.?!] and followed by a doublespace.
+		 */
+		gap = 1;
+		if (dblspace && j < olen && (obuf[j] == nl || j + 1 == olen ||
+		    ISFILLSEP(obuf[j + 1], nl)) && (ISEOSP(obuf[j - 1]) ||
+		    (obuf[j - 1] == ')' && j - i >= 2 && ISEOSP(obuf[j - 2]))))
+			gap = 2;
 	}
-	/* and add a last newline for the end of our new paragraph */
-	(void)lnewline();
 
 	/*
 	 * We really should wind up where we started, (which is hard to keep
 	 * track of) but I think the end of the last line is better than the
 	 * beginning of the blank line.
 	 */
-	(void)backchar(FFRAND, 1);
-	retval = TRUE;
+	if (nlen != olen || memcmp(nbuf, obuf, olen) != 0) {
+		if (ldelete((RSIZE)olen, KNONE) == FALSE ||
+		    linsertblock(nbuf, nlen) == FALSE)
+			retval = FALSE;
+	} else {
+		/* already filled; leave the buffer alone */
+		for (i = 0; i < olen; i++)
+			if (obuf[i] == nl)
+				curwp->w_dotline++;
+		curwp->w_dotp = lback(eopline);
+		curwp->w_doto = llength(curwp->w_dotp);
+		curwp->w_rflag |= WFMOVE;
+	}
 cleanup:
+	free(obuf);
+	free(nbuf);
 	undo_boundary_enable(FFRAND, 1);
 	return (retval);
 }
@@ -9,3 +9,4 @@
 #define	_PATH_MG_DIR		"~/.mg.d"
 #define	_PATH_MG_STARTUP	"%s/.mg"
 #define	_PATH_MG_TERM		"%s/.mg-%s"
+#define	_PATH_MG_TRACE		"%s/trace.%ld"
@@ -12,8 +12,10 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <paths.h>
 #include <poll.h>
 #include <signal.h>
@@ -27,7 +29,15 @@
 #define TIMEOUT 10000
 
 static	int	getregion(struct region *);
+static	int	regionlines(struct line ***, int *, int *);
+static	int	sortregion(int, int (*)(const void *, const void *));
+static	int	sortcmp(const void *, const void *);
+static	int	numcmp(const void *, const void *);
+static	struct lineidx *lineindex(int);
 static	int	iomux(int, char * const, int);
+static	int	lt_tabify(char *, const struct line *, int, int, void *);
+static	int	lt_untabify(char *, const struct line *, int, int, void *);
+static	int	nextcol(int, int, int);
 static	int	preadin(int);
 static	void	pwriteout(int, char **, int *);
 static	int	setsize(struct region *, RSIZE);
@@ -67,9 +77,7 @@ killregion(int f, int n)
 int
 copyregion(int f, int n)
 {
-	struct line	*linep;
 	struct region	 region;
-	int	 loffs;
 	int	 s;
 
 	if ((s = getregion(&region)) != TRUE)
@@ -80,24 +88,8 @@ copyregion(int f, int n)
 		kdelete();
 	thisflag |= CFKILL;
 
-	/* current line */
-	linep = region.r_linep;
-
-	/* current offset */
-	loffs = region.r_offset;
-
-	while (region.r_size--) {
-		if (loffs == llength(linep)) {	/* End of line.		 */
-			if ((s = kinsert(*curbp->b_nlchr, KFORW)) != TRUE)
-				return (s);
-			linep = lforw(linep);
-			loffs = 0;
-		} else {			/* Middle of line.	 */
-			if ((s = kinsert(lgetc(linep, loffs), KFORW)) != TRUE)
-				return (s);
-			++loffs;
-		}
-	}
+	if ((s = kregion(&region)) != TRUE)
+		return (s);
 
 	/* Also copy to system clipboard via OSC 52 */
 	region_to_clipboard();
@@ -109,16 +101,14 @@ copyregion(int f, int n)
 
 /*
  * Lower case region.  Zap all of the upper case characters in the region to
- * lower case. Use the region code to set the limits. Scan the buffer, doing
- * the changes. Call "lchange" to ensure that redisplay is done in all
- * buffers.
+ * lower case. Use the region code to set the limits, and let ltransform()
+ * do the changes a line at a time.
  */
 int
 lowerregion(int f, int n)
 {
-	struct line	*linep;
 	struct region	 region;
-	int	 loffs, c, s;
+	int	 s;
 
 	if ((s = checkdirty(curbp)) != TRUE)
 		return (s);
@@ -131,37 +121,398 @@ lowerregion(int f, int n)
 	if ((s = getregion(&region)) != TRUE)
 		return (s);
 
-	undo_add_change(region.r_linep, region.r_offset, region.r_size);
+	return (ltransform(&region, 1, lt_downcase, NULL));
+}
+
+/*
+ * Upper case region.  Zap all of the lower case characters in the region to
+ * upper case.  Use the region code to set the limits, and let ltransform()
+ * do the changes a line at a time.
+ */
+int
+upperregion(int f, int n)
+{
+	struct region	  region;
+	int	  s;
+
+	if ((s = checkdirty(curbp)) != TRUE)
+		return (s);
+	if (curbp->b_flag & BFREADONLY) {
+		dobeep();
+		ewprintf("Buffer is read-only");
+		return (FALSE);
+	}
+	if ((s = getregion(&region)) != TRUE)
+		return (s);
+
+	return (ltransform(&region, 1, lt_upcase, NULL));
+}
+
+/*
+ * Line transforms for the case commands.
+ */
+int
+lt_downcase(char *dst, const struct line *lp, int start, int end, void *arg)
+{
+	const char	*cp = &lp->l_text[start];
+	int		 i, c;
+
+	for (i = 0; i < end - start; i++) {
+		c = CHARMASK(cp[i]);
+		dst[i] = ISUPPER(c) ? TOLOWER(c) : c;
+	}
+	return (end - start);
+}
+
+int
+lt_upcase(char *dst, const struct line *lp, int start, int end, void *arg)
+{
+	const char	*cp = &lp->l_text[start];
+	int		 i, c;
+
+	for (i = 0; i < end - start; i++) {
+		c = CHARMASK(cp[i]);
+		dst[i] = ISLOWER(c) ? TOUPPER(c) : c;
+	}
+	return (end - start);
+}
+
+/*
+ * Replace runs of spaces and tabs in the region with as many tabs as
+ * will fit and then spaces, keeping every character in its column.
+ * Lone spaces are left alone.
+ */
+int
+tabifyregion(int f, int n)
+{
+	struct region	 region;
+	int		 s;
+
+	if ((s = getregion(&region)) != TRUE)
+		return (s);
+	return (ltransform(&region, 1, lt_tabify, curbp));
+}
+
+/*
+ * Replace tabs in the region with spaces, keeping every character in
+ * its column.
+ */
+int
+untabifyregion(int f, int n)
+{
+	struct region	 region;
+	int		 s;
+
+	if ((s = getregion(&region)) != TRUE)
+		return (s);
+	return (ltransform(&region, curbp->b_tabw, lt_untabify, curbp));
+}
 
-	lchange(WFFULL);
-	linep = region.r_linep;
-	loffs = region.r_offset;
-	while (region.r_size--) {
-		if (loffs == llength(linep)) {
-			linep = lforw(linep);
-			loffs = 0;
+static int
+lt_tabify(char *dst, const struct line *lp, int start, int end, void *arg)
+{
+	const char	*cp = lp->l_text;
+	int		 tabw = ((struct buffer *)arg)->b_tabw;
+	int		 i, j, col, ecol, len;
+
+	for (i = col = 0; i < start; i++)
+		col = nextcol(col, CHARMASK(cp[i]), tabw);
+	len = 0;
+	while (i < end) {
+		if (cp[i] != ' ' && cp[i] != '\t') {
+			col = nextcol(col, CHARMASK(cp[i]), tabw);
+			dst[len++] = cp[i++];
+			continue;
+		}
+		for (j = i, ecol = col; j < end && (cp[j] == ' ' ||
+		    cp[j] == '\t'); j++)
+			ecol = nextcol(ecol, cp[j], tabw);
+		if (j - i == 1) {
+			dst[len++] = cp[i];
 		} else {
-			c = lgetc(linep, loffs);
-			if (ISUPPER(c) != FALSE)
-				lputc(linep, loffs, TOLOWER(c));
-			++loffs;
+			for (; ntabstop(col, tabw) <= ecol;
+			    col = ntabstop(col, tabw))
+				dst[len++] = '\t';
+			for (; col < ecol; col++)
+				dst[len++] = ' ';
 		}
+		col = ecol;
+		i = j;
 	}
-	return (TRUE);
+	return (len);
+}
+
+static int
+lt_untabify(char *dst, const struct line *lp, int start, int end, void *arg)
+{
+	const char	*cp = lp->l_text;
+	int		 tabw = ((struct buffer *)arg)->b_tabw;
+	int		 i, col, ncol, len;
+
+	for (i = col = 0; i < start; i++)
+		col = nextcol(col, CHARMASK(cp[i]), tabw);
+	for (len = 0; i < end; i++, col = ncol) {
+		ncol = nextcol(col, CHARMASK(cp[i]), tabw);
+		if (cp[i] != '\t')
+			dst[len++] = cp[i];
+		else
+			for (; col < ncol; col++)
+				dst[len++] = ' ';
+	}
+	return (len);
 }
 
 /*
- * Upper case region.  Zap all of the lower case characters in the region to
- * upper case.  Use the region code to set the limits.  Scan the buffer,
- * doing the changes.  Call "lchange" to ensure that redisplay is done in all
- * buffers.
+ * The column after character "c" at column "col", as shown on the
+ * screen.  See getcolpos().
+ */
+static int
+nextcol(int col, int c, int tabw)
+{
+	char	tmp[5];
+
+	if (c == '\t')
+		return (ntabstop(col, tabw));
+	if (ISCTRL(c) != FALSE)
+		return (col + 2);
+	if (isprint(c))
+		return (col + 1);
+	return (col + snprintf(tmp, sizeof(tmp), "\\%o", c));
+}
+
+/*
+ * State for the qsort() comparison functions below.  Ties are broken
+ * on the original line number so the sorts are stable.
+ */
+static struct line	**sortlp;	/* the lines, in buffer order	*/
+static long long	 *sortkey;	/* numeric keys, for numcmp()	*/
+static int		  sortrev;	/* sort in reverse order	*/
+
+/*
+ * Sort the lines in the region.  With an argument, sort in reverse
+ * order.
  */
 int
-upperregion(int f, int n)
+sortlines(int f, int n)
+{
+	sortrev = (f & FFARG) != 0;
+	return (sortregion(0, sortcmp));
+}
+
+/*
+ * Sort the lines in the region by the number in field "n" (1 by
+ * default), counting whitespace separated fields from the start of
+ * the line, or from the end if "n" is negative.  Lines without a
+ * number there sort as 0.
+ */
+int
+sortnumfields(int f, int n)
+{
+	if (!(f & FFARG))
+		n = 1;
+	if (n == 0)
+		return (dobeep_msg("Invalid field"));
+	return (sortregion(n, numcmp));
+}
+
+/*
+ * Reverse the order of the lines in the region.
+ */
+int
+reverseregion(int f, int n)
+{
+	struct line	**lines;
+	int		 *perm, nlines, lineno, i, s;
+
+	if ((s = regionlines(&lines, &nlines, &lineno)) != TRUE)
+		return (s);
+	if ((perm = reallocarray(NULL, nlines, sizeof(*perm))) == NULL) {
+		free(lines);
+		return (dobeep_msg("Out of memory"));
+	}
+	for (i = 0; i < nlines; i++)
+		perm[i] = nlines - 1 - i;
+	s = lpermute(lines[0], lineno, nlines, perm);
+	free(perm);
+	free(lines);
+	return (s);
+}
+
+/*
+ * Delete all but the first of each set of identical lines in the
+ * region.  The lines to go are first moved to the end of the region
+ * with lpermute() and then deleted in one piece.
+ */
+int
+deldupelines(int f, int n)
+{
+	struct line	**lines, *lp;
+	RSIZE		  size;
+	char		 *dup;
+	int		 *perm, nlines, lineno, ndup, i, j, s;
+
+	if ((s = regionlines(&lines, &nlines, &lineno)) != TRUE)
+		return (s);
+	perm = reallocarray(NULL, nlines, sizeof(*perm));
+	dup = calloc(nlines, 1);
+	if (perm == NULL || dup == NULL) {
+		free(perm);
+		free(dup);
+		free(lines);
+		return (dobeep_msg("Out of memory"));
+	}
+	for (i = 0; i < nlines; i++)
+		perm[i] = i;
+	sortlp = lines;
+	sortrev = FALSE;
+	qsort(perm, nlines, sizeof(*perm), sortcmp);
+	for (i = 1; i < nlines; i++) {
+		lp = lines[perm[i]];
+		if (llength(lp) == llength(lines[perm[i - 1]]) &&
+		    memcmp(ltext(lp), ltext(lines[perm[i - 1]]),
+		    llength(lp)) == 0)
+			dup[perm[i]] = 1;
+	}
+
+	/* Keep the first of each in order, then the duplicates. */
+	size = 0;
+	for (i = j = 0; i < nlines; i++)
+		if (!dup[i])
+			perm[j++] = i;
+	ndup = nlines - j;
+	for (i = 0; i < nlines; i++)
+		if (dup[i]) {
+			perm[j++] = i;
+			size += llength(lines[i]) + 1;
+		}
+	free(dup);
+
+	if (ndup > 0) {
+		undo_boundary_enable(FFRAND, 0);
+		if ((s = lpermute(lines[0], lineno, nlines, perm)) == TRUE) {
+			lp = lines[perm[nlines - ndup - 1]];
+			curwp->w_dotp = lp;
+			curwp->w_doto = llength(lp);
+			curwp->w_dotline = lineno + nlines - ndup - 1;
+			curwp->w_rflag |= WFMOVE;
+			s = ldelete(size, KNONE);
+		}
+		undo_boundary_enable(FFRAND, 1);
+	}
+	free(perm);
+	free(lines);
+	if (s == TRUE)
+		ewprintf("Deleted %d duplicate line%s", ndup,
+		    ndup == 1 ? "" : "s");
+	return (s);
+}
+
+/*
+ * Common code for the sort commands: get a sort key for each line if
+ * "field" is set, sort, and put the lines in their new order.
+ */
+static int
+sortregion(int field, int (*cmp)(const void *, const void *))
+{
+	struct line	**lines;
+	const char	 *cp, *ep;
+	char		  num[32];
+	int		 *perm, nlines, lineno, i, k, s;
+
+	if ((s = regionlines(&lines, &nlines, &lineno)) != TRUE)
+		return (s);
+	perm = reallocarray(NULL, nlines, sizeof(*perm));
+	sortkey = NULL;
+	if (field != 0)
+		sortkey = reallocarray(NULL, nlines, sizeof(*sortkey));
+	if (perm == NULL || (field != 0 && sortkey == NULL)) {
+		free(perm);
+		free(sortkey);
+		free(lines);
+		return (dobeep_msg("Out of memory"));
+	}
+	for (i = 0; i < nlines; i++) {
+		perm[i] = i;
+		if (field == 0)
+			continue;
+		cp = ltext(lines[i]);
+		ep = cp + llength(lines[i]);
+		if (field > 0) {
+			for (k = field; cp < ep; k--) {
+				while (cp < ep && isspace(CHARMASK(*cp)))
+					cp++;
+				if (k == 1)
+					break;
+				while (cp < ep && !isspace(CHARMASK(*cp)))
+					cp++;
+			}
+		} else {
+			for (k = field; ep > cp; k++) {
+				while (ep > cp && isspace(CHARMASK(ep[-1])))
+					ep--;
+				if (k == -1)
+					break;
+				while (ep > cp && !isspace(CHARMASK(ep[-1])))
+					ep--;
+			}
+			for (cp = ep; cp > ltext(lines[i]) &&
+			    !isspace(CHARMASK(cp[-1])); cp--)
+				;
+		}
+		k = ep - cp < (int)sizeof(num) ? ep - cp : (int)sizeof(num) - 1;
+		memcpy(num, cp, k);
+		num[k] = '\0';
+		sortkey[i] = strtoll(num, NULL, 10);
+	}
+	sortlp = lines;
+	qsort(perm, nlines, sizeof(*perm), cmp);
+	s = lpermute(lines[0], lineno, nlines, perm);
+	free(sortkey);
+	free(perm);
+	free(lines);
+	return (s);
+}
+
+static int
+sortcmp(const void *a, const void *b)
+{
+	const struct line	*la = sortlp[*(const int *)a];
+	const struct line	*lb = sortlp[*(const int *)b];
+	int			 r;
+
+	r = memcmp(ltext(la), ltext(lb),
+	    llength(la) < llength(lb) ? llength(la) : llength(lb));
+	if (r == 0)
+		r = llength(la) - llength(lb);
+	if (sortrev)
+		r = -r;
+	if (r == 0)
+		r = *(const int *)a - *(const int *)b;
+	return (r);
+}
+
+static int
+numcmp(const void *a, const void *b)
+{
+	long long	ka = sortkey[*(const int *)a];
+	long long	kb = sortkey[*(const int *)b];
+
+	if (ka != kb)
+		return (ka < kb ? -1 : 1);
+	return (*(const int *)a - *(const int *)b);
+}
+
+/*
+ * Collect the lines the region touches, for the sort commands.  A region
+ * that ends at the start of a line does not include that line.
+ */
+static int
+regionlines(struct line ***linesp, int *np, int *linenop)
 {
-	struct line	 *linep;
 	struct region	  region;
-	int	  loffs, c, s;
+	struct line	**lines = NULL, **nlines, *lp;
+	long		  left;
+	int		  n, size, s;
 
 	if ((s = checkdirty(curbp)) != TRUE)
 		return (s);
@@ -173,25 +524,206 @@ upperregion(int f, int n)
 	if ((s = getregion(&region)) != TRUE)
 		return (s);
 
-	undo_add_change(region.r_linep, region.r_offset, region.r_size);
+	lp = region.r_linep;
+	left = (long)region.r_offset + region.r_size;
+	for (n = size = 0;;) {
+		if (n == size) {
+			size = size ? size * 2 : 64;
+			if ((nlines = reallocarray(lines, size,
+			    sizeof(*lines))) == NULL) {
+				free(lines);
+				return (dobeep_msg("Out of memory"));
+			}
+			lines = nlines;
+		}
+		lines[n++] = lp;
+		left -= llength(lp) + 1;
+		if (left <= 0 || (lp = lforw(lp)) == curbp->b_headp)
+			break;
+	}
+	*linesp = lines;
+	*np = n;
+	*linenop = region.r_lineno;
+	return (TRUE);
+}
 
-	lchange(WFFULL);
-	linep = region.r_linep;
-	loffs = region.r_offset;
-	while (region.r_size--) {
-		if (loffs == llength(linep)) {
-			linep = lforw(linep);
-			loffs = 0;
-		} else {
-			c = lgetc(linep, loffs);
-			if (ISLOWER(c) != FALSE)
-				lputc(linep, loffs, TOUPPER(c));
-			++loffs;
+/*
+ * Narrow the buffer to the lines the region covers.  The lines are
+ * unhooked from the rest of the buffer and hung off a header of their
+ * own, so everything that walks the buffer sees only them, and
+ * getting in and out takes the same time however big the buffer is.
+ */
+int
+narrowregion(int f, int n)
+{
+	struct region	 region;
+	struct narrow	*np;
+	struct lineidx	*li;
+	struct line	*first, *last, *lp;
+	struct mgwin	*wp;
+	long		 pos;
+	int		 lastno, nlines, s;
+
+	/* Unhooking shared lines would hide them from the others too. */
+	if (bsharing(curbp))
+		return (dobeep_msg("Can't narrow a buffer sharing its text"));
+	if ((s = getregion(&region)) != TRUE)
+		return (s);
+	first = region.r_linep;
+	if (first == curbp->b_headp)
+		return (TRUE);
+	if (first == curwp->w_dotp && region.r_offset == curwp->w_doto) {
+		last = curwp->w_markp;
+		lastno = curwp->w_markline;
+		s = curwp->w_marko;
+	} else {
+		last = curwp->w_dotp;
+		lastno = curwp->w_dotline;
+		s = curwp->w_doto;
+	}
+	if (s == 0 && lastno > region.r_lineno) {
+		last = lback(last);
+		lastno--;
+	}
+	nlines = lastno - region.r_lineno + 1;
+
+	if ((li = lineindex(region.r_lineno)) != NULL && li->li_lp == first)
+		pos = li->li_off;
+	else
+		for (pos = 0, lp = bfirstlp(curbp); lp != first; lp = lforw(lp))
+			pos += llength(lp) + 1;
+
+	if ((np = curbp->b_narrow) == NULL) {
+		if ((np = calloc(1, sizeof(*np))) == NULL ||
+		    (np->n_headp = lalloc(0)) == NULL) {
+			free(np);
+			return (dobeep_msg("Out of memory"));
 		}
+		np->n_wide = curbp->b_headp;
+	} else {
+		/* Narrowing again: go back to the whole buffer first. */
+		narrowlink(curbp, FALSE);
+		curbp->b_lines += np->n_lines;
+	}
+	np->n_lineno += region.r_lineno - 1;
+	np->n_pos += pos;
+	np->n_lines = curbp->b_lines - nlines;
+	np->n_before = lback(first);
+	np->n_after = lforw(last);
+	np->n_headp->l_fp = first;
+	np->n_headp->l_bp = last;
+	curbp->b_narrow = np;
+	narrowlink(curbp, TRUE);
+	curbp->b_lines = nlines;
+	ledited(curbp, 1);
+
+	/* Put dot and mark in the visible part, renumbered. */
+	for (wp = wheadp; wp != NULL; wp = wp->w_wndp) {
+		if (wp->w_bufp != curbp)
+			continue;
+		wp->w_dotline -= region.r_lineno - 1;
+		if (wp->w_dotline < 1) {
+			wp->w_dotp = first;
+			wp->w_doto = 0;
+			wp->w_dotline = 1;
+		} else if (wp->w_dotline > nlines) {
+			wp->w_dotp = last;
+			wp->w_doto = llength(last);
+			wp->w_dotline = nlines;
+		}
+		if (wp->w_markp != NULL) {
+			wp->w_markline -= region.r_lineno - 1;
+			if (wp->w_markline < 1) {
+				wp->w_markp = first;
+				wp->w_marko = 0;
+				wp->w_markline = 1;
+			} else if (wp->w_markline > nlines) {
+				wp->w_markp = last;
+				wp->w_marko = llength(last);
+				wp->w_markline = nlines;
+			}
+		}
+		wp->w_linep = wp->w_dotp;
+		wp->w_rflag |= WFFRAME | WFFULL | WFMODE;
 	}
 	return (TRUE);
 }
 
+/*
+ * Make the whole buffer visible again.
+ */
+int
+widen(int f, int n)
+{
+	struct mgwin	*wp;
+	int		 lineno;
+
+	if (curbp->b_narrow == NULL)
+		return (TRUE);
+	lineno = curbp->b_narrow->n_lineno;
+	bwiden(curbp);
+	for (wp = wheadp; wp != NULL; wp = wp->w_wndp) {
+		if (wp->w_bufp != curbp)
+			continue;
+		wp->w_dotline += lineno;
+		if (wp->w_markp != NULL)
+			wp->w_markline += lineno;
+		wp->w_rflag |= WFFULL | WFMODE;
+	}
+	return (TRUE);
+}
+
+/*
+ * Drop a buffer's narrowing.  Line numbers held elsewhere are left to
+ * the caller.
+ */
+void
+bwiden(struct buffer *bp)
+{
+	struct narrow	*np;
+
+	if ((np = bp->b_narrow) == NULL)
+		return;
+	narrowlink(bp, FALSE);
+	bp->b_lines += np->n_lines;
+	bp->b_narrow = NULL;
+	ledited(bp, 1);
+	free(np->n_headp);
+	free(np);
+}
+
+/*
+ * Hook the visible lines of a narrowed buffer back into the rest of
+ * it, or unhook them again.  Used to see the whole buffer for a
+ * moment, to write it out.
+ */
+void
+narrowlink(struct buffer *bp, int narrow)
+{
+	struct narrow	*np = bp->b_narrow;
+	struct line	*first, *last;
+
+	first = lforw(np->n_headp);
+	last = lback(np->n_headp);
+	if (narrow) {
+		if (first != np->n_headp) {
+			np->n_before->l_fp = np->n_after;
+			np->n_after->l_bp = np->n_before;
+			first->l_bp = np->n_headp;
+			last->l_fp = np->n_headp;
+		}
+		bp->b_headp = np->n_headp;
+	} else {
+		if (first != np->n_headp) {
+			np->n_before->l_fp = first;
+			first->l_bp = np->n_before;
+			last->l_fp = np->n_after;
+			np->n_after->l_bp = last;
+		}
+		bp->b_headp = np->n_wide;
+	}
+}
+
 /*
  * This routine figures out the bound of the region in the current window,
  * and stores the results into the fields of the REGION structure. Dot and
@@ -206,6 +738,7 @@ upperregion(int f, int n)
 static int
 getregion(struct region *rp)
 {
+	struct lineidx	*dli, *mli;
 	struct line	*flp, *blp;
 	long	 fsize, bsize;
 
@@ -228,6 +761,33 @@ getregion(struct region *rp)
 		}
 		return (TRUE);
 	}
+
+	/*
+	 * The line numbers say which end comes first and the line index
+	 * gives the size.  Both are checked against the line pointers,
+	 * and if either is out of step fall back to walking the lines.
+	 */
+	if (lineindex(curwp->w_dotline > curwp->w_markline ?
+	    curwp->w_dotline : curwp->w_markline) != NULL) {
+		dli = &curbp->b_lidx[curwp->w_dotline];
+		mli = &curbp->b_lidx[curwp->w_markline];
+		if (dli->li_lp == curwp->w_dotp &&
+		    mli->li_lp == curwp->w_markp) {
+			fsize = dli->li_off + curwp->w_doto;
+			bsize = mli->li_off + curwp->w_marko;
+			if (curwp->w_dotline < curwp->w_markline) {
+				rp->r_linep = curwp->w_dotp;
+				rp->r_offset = curwp->w_doto;
+				rp->r_lineno = curwp->w_dotline;
+				return (setsize(rp, (RSIZE)(bsize - fsize)));
+			}
+			rp->r_linep = curwp->w_markp;
+			rp->r_offset = curwp->w_marko;
+			rp->r_lineno = curwp->w_markline;
+			return (setsize(rp, (RSIZE)(fsize - bsize)));
+		}
+	}
+
 	/* get region size */
 	flp = blp = curwp->w_dotp;
 	bsize = curwp->w_doto;
@@ -276,6 +836,50 @@ setsize(struct region *rp, RSIZE size)
 	return (TRUE);
 }
 
+/*
+ * Return the index entry for line n of the current buffer, extending
+ * the index that far.  Entries stay good until something changes at
+ * or above their line (see ledited()), so after an edit only the lines
+ * from there on are walked again.  Returns NULL if there is no line n
+ * or no memory.
+ */
+static struct lineidx *
+lineindex(int n)
+{
+	struct lineidx	*li;
+	struct line	*lp;
+	int		 i, nsize;
+
+	if (n < 1 || n == INT_MAX)
+		return (NULL);
+	if (n >= curbp->b_lidxsize) {
+		nsize = curbp->b_lidxsize ? curbp->b_lidxsize : 1024;
+		while (nsize <= n && nsize < INT_MAX / 2)
+			nsize *= 2;
+		if (nsize <= n || (li = reallocarray(curbp->b_lidx, nsize,
+		    sizeof(*li))) == NULL)
+			return (NULL);
+		curbp->b_lidx = li;
+		curbp->b_lidxsize = nsize;
+	}
+	if (curbp->b_lidxvalid < 2) {
+		if ((lp = bfirstlp(curbp)) == curbp->b_headp)
+			return (NULL);
+		curbp->b_lidx[1].li_lp = lp;
+		curbp->b_lidx[1].li_off = 0;
+		curbp->b_lidxvalid = 2;
+	}
+	for (i = curbp->b_lidxvalid; i <= n; i++) {
+		li = &curbp->b_lidx[i - 1];
+		if ((lp = lforw(li->li_lp)) == curbp->b_headp)
+			return (NULL);
+		li[1].li_lp = lp;
+		li[1].li_off = li->li_off + llength(li->li_lp) + 1;
+		curbp->b_lidxvalid = i + 1;
+	}
+	return (&curbp->b_lidx[n]);
+}
+
 #define PREFIXLENGTH 40
 static char	prefix_string[PREFIXLENGTH] = {'>', '\0'};
 
@@ -358,21 +962,25 @@ setprefix(int f, int n)
 int
 region_get_data(struct region *reg, char *buf, int len)
 {
-	int	 i, off;
+	int	 i, n, off;
 	struct line	*lp;
 
 	off = reg->r_offset;
 	lp = reg->r_linep;
-	for (i = 0; i < len; i++) {
+	for (i = 0; i < len;) {
 		if (off == llength(lp)) {
 			lp = lforw(lp);
 			if (lp == curbp->b_headp)
 				break;
 			off = 0;
-			buf[i] = *curbp->b_nlchr;
+			buf[i++] = *curbp->b_nlchr;
 		} else {
-			buf[i] = lgetc(lp, off);
-			off++;
+			n = llength(lp) - off;
+			if (n > len - i)
+				n = len - i;
+			memcpy(&buf[i], &lp->l_text[off], n);
+			i += n;
+			off += n;
 		}
 	}
 	buf[i] = '\0';
@@ -382,14 +990,11 @@ region_get_data(struct region *reg, char *buf, int len)
 void
 region_put_data(const char *buf, int len)
 {
-	int i;
+	const char *cp;
 
-	for (i = 0; buf[i] != '\0' && i < len; i++) {
-		if (buf[i] == *curbp->b_nlchr)
-			lnewline();
-		else
-			linsert(1, buf[i]);
-	}
+	if ((cp = memchr(buf, '\0', len)) != NULL)
+		len = cp - buf;
+	(void)linsertblock(buf, len);
 }
 
 /*
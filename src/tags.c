@@ -6,12 +6,16 @@
  * Author: Sunil Nimmagadda <sunil@openbsd.org>
  */
 
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <ctype.h>
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -20,30 +24,64 @@
 #include "def.h"
 
 struct ctag;
+struct tagfile;
 
-static int               addctag(char *);
 static int               atbow(void);
 void                     closetags(void);
-static int               ctagcmp(struct ctag *, struct ctag *);
+static int               idxcmp(const void *, const void *);
+static int               linecmp(const char *, const char *, const char *);
 static int               loadbuffer(char *);
 static int               loadtags(const char *);
+static int               matchpat(struct line *, const char *, size_t);
+static int               parsetag(const char *, size_t, struct ctag *);
 static int               pushtag(char *);
-static int               searchpat(char *);
-static struct ctag       *searchtag(char *);
+static int               searchpat(char *, int);
+static int               searchtag(char *, struct ctag *);
 static char              *strip(char *, size_t);
+static int               tagline(const char *);
+static int               tagcmp(const char *, const char *, const char *);
+static int               tagfresh(struct tagfile *);
+static int               tagindex(struct tagfile *);
+static const char        *taglookup(struct tagfile *, const char *);
+static int               tagmap(struct tagfile *);
+static int               tagsorted(struct tagfile *);
+static void              tagunmap(struct tagfile *);
 static void              unloadtags(void);
 
 #define DEFAULTFN "tags"
 
-/* ctags(1) entries are parsed and maintained in a tree. */
+/* A tags(5) line split into its fields; tag points to the whole copy. */
 struct ctag {
-	RB_ENTRY(ctag) entry;
 	char *tag;
 	char *fname;
-	char *pat;
+	char *pat;		/* NULL if only a line number was given */
+	int   line;		/* 0 if unknown */
+	char  path[NFILEN];	/* fname, resolved for the index */
 };
-RB_HEAD(tagtree, ctag) tags = RB_INITIALIZER(&tags);
-RB_GENERATE(tagtree, ctag, entry, ctagcmp);
+
+/*
+ * Tags files are mapped rather than parsed.  A file sorted by ctags(1)
+ * is binary searched in place; anything else gets an index of line
+ * offsets sorted by tag, built once.  Either way no tag is copied
+ * until it is looked up.  A file that changes on disk is mapped again
+ * before the next lookup.
+ */
+struct tagfile {
+	SLIST_ENTRY(tagfile) tf_entry;
+	char		*tf_map;
+	size_t		 tf_len;
+	size_t		*tf_index;	/* line offsets, NULL if sorted */
+	size_t		 tf_count;
+	dev_t		 tf_dev;
+	ino_t		 tf_ino;
+	off_t		 tf_size;
+	struct timespec	 tf_mtime;
+	char		 tf_name[NFILEN];
+};
+SLIST_HEAD(tagfiles, tagfile) tfhead = SLIST_HEAD_INITIALIZER(tfhead);
+
+/* The file being indexed, for idxcmp(). */
+static const char *idxmap, *idxend;
 
 struct tagpos {
 	SLIST_ENTRY(tagpos) entry;
@@ -53,12 +91,6 @@ struct tagpos {
 };
 SLIST_HEAD(tagstack, tagpos) shead = SLIST_HEAD_INITIALIZER(shead);
 
-int
-ctagcmp(struct ctag *s, struct ctag *t)
-{
-	return strcmp(s->tag, t->tag);
-}
-
 /*
  * Load a tags file.  If a tags file is already loaded, ask the user to
  * retain loaded tags (i any) and unload them if the user chooses not to.
@@ -82,7 +114,7 @@ tagsvisit(int f, int n)
 	if (bufp == NULL)
 		return (ABORT);
 
-	if (!RB_EMPTY(&tags)) {
+	if (!SLIST_EMPTY(&tfhead)) {
 		if (eyorn("Keep current list of tags table also") == FALSE) {
 			ewprintf("Starting a new list of tags table");
 			unloadtags();
@@ -103,7 +135,7 @@ tagsvisit(int f, int n)
 int
 findtag(int f, int n)
 {
-	char utok[MAX_TOKEN], dtok[MAX_TOKEN];
+	char utok[MAX_TOKEN], dtok[MAX_TOKEN], idx[NFILEN];
 	char *tok, *bufp;
 	int  ret;
 
@@ -127,44 +159,51 @@ findtag(int f, int n)
 		return (FALSE);
 	}
 
-	if (RB_EMPTY(&tags))
-		if ((ret = tagsvisit(f, n)) != TRUE)
+	if (SLIST_EMPTY(&tfhead)) {
+		/* Without a tags file here, index the project ourselves. */
+		if (getbufcwd(idx, sizeof(idx)) == FALSE ||
+		    strlcat(idx, DEFAULTFN, sizeof(idx)) >= sizeof(idx) ||
+		    access(idx, F_OK) == 0)
+			ret = tagsvisit(f, n);
+		else if ((ret = cindex(idx, sizeof(idx))) == TRUE)
+			ret = loadtags(idx);
+		if (ret != TRUE)
 			return (ret);
+	}
 	return pushtag(tok);
 }
 
 /*
- * Free tags tree.
+ * Unmap all tags files.
  */
 void
 unloadtags(void)
 {
-	struct ctag *var, *nxt;
-	
-	for (var = RB_MIN(tagtree, &tags); var != NULL; var = nxt) {
-		nxt = RB_NEXT(tagtree, &tags, var);
-		RB_REMOVE(tagtree, &tags, var);
-		/* line parsed with fparseln needs to be freed */
-		free(var->tag);
-		free(var);
+	struct tagfile *tf;
+
+	while (!SLIST_EMPTY(&tfhead)) {
+		tf = SLIST_FIRST(&tfhead);
+		SLIST_REMOVE_HEAD(&tfhead, tf_entry);
+		tagunmap(tf);
+		free(tf);
 	}
 }
 
 /*
- * Lookup tag passed in tree and if found, push current location and 
- * buffername onto stack, load the file with tag definition into a new
- * buffer and position dot at the pattern.
+ * Lookup tag passed in tags files and if found, push current location
+ * and buffername onto stack, load the file with tag definition into a
+ * new buffer and position dot at the pattern.
  */
 /*ARGSUSED */
 int
 pushtag(char *tok)
 {
-	struct ctag *res;
+	struct ctag res;
 	struct tagpos *s;
 	char bname[NFILEN];
-	int doto, dotline;
+	int doto, dotline, ret = FALSE;
 	
-	if ((res = searchtag(tok)) == NULL)
+	if (searchtag(tok, &res) == FALSE)
 		return (FALSE);
 		
 	doto = curwp->w_doto;
@@ -175,40 +214,40 @@ pushtag(char *tok)
 	if (strlcpy(bname, curbp->b_cwd, sizeof(bname)) >= sizeof(bname)) {
 		dobeep();
 		ewprintf("filename too long");
-		return (FALSE);
+		goto out;
 	}
 	if (strlcat(bname, curbp->b_bname, sizeof(bname)) >= sizeof(bname)) {
 		dobeep();
 		ewprintf("filename too long");
-		return (FALSE);
+		goto out;
 	}	
 
-	if (loadbuffer(res->fname) == FALSE)
-		return (FALSE);
+	if (loadbuffer(res.path) == FALSE)
+		goto out;
 	
-	if (searchpat(res->pat) == TRUE) {
+	if (searchpat(res.pat, res.line) == TRUE) {
 		if ((s = malloc(sizeof(struct tagpos))) == NULL) {
 			dobeep();
 			ewprintf("Out of memory");
-			return (FALSE);
+			goto out;
 		}
 		if ((s->bname = strdup(bname)) == NULL) {
 			dobeep();
 			ewprintf("Out of memory");
 			free(s);
-			return (FALSE);
+			goto out;
 		}
 		s->doto = doto;
 		s->dotline = dotline;
 		SLIST_INSERT_HEAD(&shead, s, entry);
-		return (TRUE);
+		ret = TRUE;
 	} else {
 		dobeep();
-		ewprintf("%s: pattern not found", res->tag);
-		return (FALSE);
+		ewprintf("%s: pattern not found", res.tag);
 	}
-	/* NOTREACHED */
-	return (FALSE);
+out:
+	free(res.tag);
+	return (ret);
 }
 
 /*
@@ -250,44 +289,291 @@ poptag(int f, int n)
 }
 
 /*
- * Parse the tags file and construct the tags tree. Remove escape 
- * characters while parsing the file.
+ * Add a tags file to the list, or map it again if it is already there.
  */
 int
 loadtags(const char *fn)
+{
+	struct tagfile *tf, *last = NULL;
+	char *adjf;
+
+	if ((adjf = adjustname(fn, TRUE)) == NULL)
+		return (FALSE);
+	SLIST_FOREACH(tf, &tfhead, tf_entry) {
+		if (strcmp(tf->tf_name, adjf) == 0)
+			return (tagfresh(tf));
+		last = tf;
+	}
+	if ((tf = calloc(1, sizeof(*tf))) == NULL)
+		return (dobeep_msg("Out of memory"));
+	(void)strlcpy(tf->tf_name, adjf, sizeof(tf->tf_name));
+	if (tagmap(tf) == FALSE) {
+		free(tf);
+		return (FALSE);
+	}
+	/* Earlier files take precedence, so keep them in load order. */
+	if (last == NULL)
+		SLIST_INSERT_HEAD(&tfhead, tf, tf_entry);
+	else
+		SLIST_INSERT_AFTER(last, tf, tf_entry);
+	return (TRUE);
+}
+
+/*
+ * Map a tags file and work out how to search it.
+ */
+int
+tagmap(struct tagfile *tf)
 {
 	struct stat sb;
-	char *l;
-	FILE *fd;
-	
-	if ((fd = fopen(fn, "r")) == NULL) {
+	int fd, ret;
+
+	if ((fd = open(tf->tf_name, O_RDONLY | O_CLOEXEC)) == -1) {
 		dobeep();
-		ewprintf("Unable to open tags file: %s", fn);
+		ewprintf("Unable to open tags file: %s", tf->tf_name);
 		return (FALSE);
 	}
-	if (fstat(fileno(fd), &sb) == -1) {
+	if (fstat(fd, &sb) == -1) {
 		dobeep();
 		ewprintf("fstat: %s", strerror(errno));
-		fclose(fd);
+		close(fd);
 		return (FALSE);
 	}
 	if (!S_ISREG(sb.st_mode)) {
 		dobeep();
 		ewprintf("Not a regular file");
-		fclose(fd);
+		close(fd);
 		return (FALSE);
 	}
-	while ((l = fparseln(fd, NULL, NULL, "\\\\\0",
-	    FPARSELN_UNESCCONT | FPARSELN_UNESCREST)) != NULL) {
-		if (addctag(l) == FALSE) {
-			fclose(fd);
+	if ((uintmax_t)sb.st_size > SIZE_MAX) {
+		dobeep();
+		ewprintf("Tags file too large");
+		close(fd);
+		return (FALSE);
+	}
+	tf->tf_len = sb.st_size;
+	if (tf->tf_len > 0) {
+		tf->tf_map = mmap(NULL, tf->tf_len, PROT_READ, MAP_PRIVATE,
+		    fd, 0);
+		if (tf->tf_map == MAP_FAILED) {
+			tf->tf_map = NULL;
+			dobeep();
+			ewprintf("mmap: %s", strerror(errno));
+			close(fd);
 			return (FALSE);
 		}
 	}
-	fclose(fd);
+	close(fd);
+	tf->tf_dev = sb.st_dev;
+	tf->tf_ino = sb.st_ino;
+	tf->tf_size = sb.st_size;
+	tf->tf_mtime = sb.st_mtim;
+
+	if (tagsorted(tf) == TRUE) {
+		/* Binary search touches a handful of pages per lookup. */
+		if (tf->tf_len > 0)
+			(void)madvise(tf->tf_map, tf->tf_len, MADV_RANDOM);
+		ret = TRUE;
+	} else
+		ret = tagindex(tf);
+	if (ret == FALSE)
+		tagunmap(tf);
+	return (ret);
+}
+
+void
+tagunmap(struct tagfile *tf)
+{
+	if (tf->tf_map != NULL)
+		(void)munmap(tf->tf_map, tf->tf_len);
+	free(tf->tf_index);
+	tf->tf_map = NULL;
+	tf->tf_len = 0;
+	tf->tf_index = NULL;
+	tf->tf_count = 0;
+	/* Make sure the next tagfresh() tries again. */
+	tf->tf_ino = 0;
+}
+
+/*
+ * Map the file again if it has been rewritten since it was mapped.
+ */
+int
+tagfresh(struct tagfile *tf)
+{
+	struct stat sb;
+
+	/* A removed file can still be searched through the old mapping. */
+	if (stat(tf->tf_name, &sb) == -1)
+		return (TRUE);
+	if (sb.st_dev == tf->tf_dev && sb.st_ino == tf->tf_ino &&
+	    sb.st_size == tf->tf_size &&
+	    sb.st_mtim.tv_sec == tf->tf_mtime.tv_sec &&
+	    sb.st_mtim.tv_nsec == tf->tf_mtime.tv_nsec)
+		return (TRUE);
+	tagunmap(tf);
+	return (tagmap(tf));
+}
+
+/*
+ * Decide whether the file is in byte order of tag.  Exuberant and
+ * Universal ctags say so in a !_TAG_FILE_SORTED pseudo-tag at the top;
+ * sorted without folding case is "1".  Otherwise check every line.
+ */
+int
+tagsorted(struct tagfile *tf)
+{
+	static const char hdr[] = "!_TAG_FILE_SORTED\t";
+	const char *p, *q, *end;
+
+	end = tf->tf_map + tf->tf_len;
+	for (p = tf->tf_map; p < end && *p == '!'; p = q + 1) {
+		if ((q = memchr(p, '\n', end - p)) == NULL)
+			q = end;
+		if ((size_t)(q - p) > sizeof(hdr) - 1 &&
+		    memcmp(p, hdr, sizeof(hdr) - 1) == 0)
+			return (p[sizeof(hdr) - 1] == '1');
+	}
+	for (p = tf->tf_map; p < end; p = q) {
+		if ((q = memchr(p, '\n', end - p)) == NULL)
+			break;
+		if (++q < end && linecmp(p, q, end) > 0)
+			return (FALSE);
+	}
 	return (TRUE);
 }
 
+/*
+ * Build the sorted index of line offsets for an unsorted file.  Ties
+ * are broken by offset, so the first definition in the file wins as
+ * it does for a sorted file.
+ */
+int
+tagindex(struct tagfile *tf)
+{
+	const char *p, *q, *end;
+	size_t n;
+
+	end = tf->tf_map + tf->tf_len;
+	for (n = 0, p = tf->tf_map; p < end; p = q + 1) {
+		if (*p != '\n')
+			n++;
+		if ((q = memchr(p, '\n', end - p)) == NULL)
+			break;
+	}
+	if ((tf->tf_index = calloc(n, sizeof(size_t))) == NULL && n > 0)
+		return (dobeep_msg("Out of memory"));
+	for (n = 0, p = tf->tf_map; p < end; p = q + 1) {
+		if (*p != '\n')
+			tf->tf_index[n++] = p - tf->tf_map;
+		if ((q = memchr(p, '\n', end - p)) == NULL)
+			break;
+	}
+	tf->tf_count = n;
+	idxmap = tf->tf_map;
+	idxend = end;
+	qsort(tf->tf_index, n, sizeof(size_t), idxcmp);
+	return (TRUE);
+}
+
+int
+idxcmp(const void *a, const void *b)
+{
+	size_t oa = *(const size_t *)a, ob = *(const size_t *)b;
+	int r;
+
+	if ((r = linecmp(idxmap + oa, idxmap + ob, idxend)) != 0)
+		return (r);
+	return (oa < ob ? -1 : oa > ob);
+}
+
+/*
+ * Compare the tags at the start of two lines.  A tag ends at a tab,
+ * a newline or the end of the file.
+ */
+int
+linecmp(const char *a, const char *b, const char *end)
+{
+	int ca, cb;
+
+	for (;; a++, b++) {
+		ca = a < end && *a != '\t' && *a != '\n' ? (u_char)*a : 0;
+		cb = b < end && *b != '\t' && *b != '\n' ? (u_char)*b : 0;
+		if (ca != cb || ca == 0)
+			return (ca - cb);
+	}
+}
+
+/*
+ * Compare the tag at the start of line p with tok, like strcmp(3).
+ */
+int
+tagcmp(const char *p, const char *end, const char *tok)
+{
+	const u_char *t = (const u_char *)tok;
+
+	for (; p < end && *p != '\t' && *p != '\n'; p++, t++)
+		if ((u_char)*p != *t)
+			return ((u_char)*p - *t);
+	return (-*t);
+}
+
+/*
+ * Return the first line defining tok, or NULL.
+ */
+const char *
+taglookup(struct tagfile *tf, const char *tok)
+{
+	const char *map = tf->tf_map, *end = tf->tf_map + tf->tf_len;
+	const char *p;
+	size_t lo, hi, mid;
+
+	if (tf->tf_index != NULL) {
+		lo = 0;
+		hi = tf->tf_count;
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (tagcmp(map + tf->tf_index[mid], end, tok) < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo == tf->tf_count)
+			return (NULL);
+		p = map + tf->tf_index[lo];
+		return (tagcmp(p, end, tok) == 0 ? p : NULL);
+	}
+
+	/*
+	 * Binary search over byte offsets.  lo is always the start of a
+	 * line and every line starting before it sorts before tok; no
+	 * line starting at or after hi does.
+	 */
+	lo = 0;
+	hi = tf->tf_len;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (mid > lo && map[mid - 1] != '\n') {
+			p = memchr(map + mid, '\n', hi - mid);
+			if (p == NULL || (size_t)(p + 1 - map) >= hi) {
+				/* No line starts between mid and hi. */
+				hi = mid;
+				continue;
+			}
+			mid = p + 1 - map;
+		}
+		if (tagcmp(map + mid, end, tok) >= 0)
+			hi = mid;
+		else if ((p = memchr(map + mid, '\n', end - map - mid)) != NULL)
+			lo = p + 1 - map;
+		else
+			return (NULL);
+	}
+	if (lo >= tf->tf_len || tagcmp(map + lo, end, tok) != 0)
+		return (NULL);
+	return (map + lo);
+}
+
 /*
  * Cleanup and destroy tree and stack.
  */
@@ -311,7 +597,7 @@ closetags(void)
  * /^xxx$/ or ?^xxx$? and in some cases the "$" would be missing. Strip 
  * the leading and trailing special characters so the pattern matching
  * would be a simple string compare. Escape character is taken care by 
- * fparseln.
+ * parsetag.
  */
 char *
 strip(char *s, size_t len)
@@ -330,22 +616,25 @@ strip(char *s, size_t len)
 }
 
 /*
- * tags line is of the format "<tag>\t<filename>\t<pattern>". Split them
- * by replacing '\t' with '\0'. This wouldn't alter the size of malloc'ed
- * l, and can be freed during cleanup.
+ * tags line is of the format "<tag>\t<filename>\t<pattern>".  Copy the
+ * line, removing escape characters, and split the copy by replacing
+ * '\t' with '\0'.  t->tag points to the start of the malloc'ed copy.
  */
 int
-addctag(char *s)
+parsetag(const char *p, size_t len, struct ctag *t)
 {
-	struct ctag *t;
-	char *l, *m;
-	
-	if ((t = malloc(sizeof(struct ctag))) == NULL) {
-		dobeep();
-		ewprintf("Out of memory");
-		free(s);
-		return (FALSE);
+	char *s, *l, *m, *e;
+	size_t i, n;
+
+	if ((s = malloc(len + 1)) == NULL)
+		return (dobeep_msg("Out of memory"));
+	for (i = n = 0; i < len; i++) {
+		if (p[i] == '\\' && i + 1 < len)
+			i++;
+		s[n++] = p[i];
 	}
+	s[n] = '\0';
+
 	t->tag = s;
 	if ((l = strchr(s, '\t')) == NULL)
 		goto cleanup;
@@ -354,52 +643,128 @@ addctag(char *s)
 	if ((l = strchr(l, '\t')) == NULL)
 		goto cleanup;
 	*l++ = '\0';
-	if (*l == '\0')
-		goto cleanup;
 
-	/* compat with newer exuberant ctags format */
-	if ((m = strstr(l, ";\"")))
+	/*
+	 * compat with newer exuberant ctags format, whose extension
+	 * fields may include the line number of the definition.
+	 */
+	t->line = 0;
+	if ((m = strstr(l, ";\""))) {
 		*m = '\0';
+		if ((e = strstr(m + 1, "\tline:")) != NULL)
+			t->line = tagline(e + 6);
+	}
 
-	t->pat = strip(l, strlen(l));
-	if (RB_INSERT(tagtree, &tags, t) != NULL) {
-		/* ignore duplicates */
-		free(t);
-		free(s);
+	/* ctags -n writes a line number instead of a pattern. */
+	if (isdigit((unsigned char)*l)) {
+		if ((t->line = tagline(l)) == 0)
+			goto cleanup;
+		t->pat = NULL;
+		return (TRUE);
 	}
+	if (strlen(l) < 2)
+		goto cleanup;
+
+	t->pat = strip(l, strlen(l));
 	return (TRUE);
 cleanup:
-	free(t);
+	(void)dobeep_msgs("Malformed tags entry for", s);
 	free(s);
 	return (FALSE);
 }
 
 /*
- * Search through each line of buffer for pattern.
+ * Parse the line number at s, ending at a tab or the end of string.
+ * Return 0 if it is not a valid line number.
  */
 int
-searchpat(char *s_pat)
+tagline(const char *s)
 {
-	struct line *lp;
-	int dotline;
+	long n;
+	char *ep;
+
+	errno = 0;
+	n = strtol(s, &ep, 10);
+	if (ep == s || (*ep != '\0' && *ep != '\t') || errno == ERANGE ||
+	    n < 1 || n > INT_MAX)
+		return (0);
+	return ((int)n);
+}
+
+/*
+ * Put dot on the line starting with pattern.  If the tags file gave a
+ * line number, look there first and then alternately above and below
+ * it, so a tag in a large file is found at once and slightly stale
+ * tags are still found nearby.  Otherwise search from the top.  With
+ * no pattern, just go to the line.
+ */
+int
+searchpat(char *s_pat, int line)
+{
+	struct line *lp, *fp, *bp;
+	int n, fline, bline;
 	size_t plen;
 
-	plen = strlen(s_pat);
-	dotline = 1;
-	lp = lforw(curbp->b_headp);
-	while (lp != curbp->b_headp) {
-		if (ltext(lp) != NULL && (int)plen <= llength(lp) &&
-		    (strncmp(s_pat, ltext(lp), plen) == 0)) {
-			curwp->w_doto = 0;
-			curwp->w_dotp = lp;
-			curwp->w_dotline = dotline;
-			return (TRUE);
-		} else {
+	if (line < 1)
+		line = 1;
+	else if (line > curbp->b_lines)
+		line = curbp->b_lines;
+
+	/* Walk to the line from whichever end of the buffer is nearer. */
+	if (line <= curbp->b_lines / 2) {
+		lp = lforw(curbp->b_headp);
+		for (n = 1; n < line && lforw(lp) != curbp->b_headp; n++)
 			lp = lforw(lp);
-			dotline++;
+	} else {
+		lp = lback(curbp->b_headp);
+		for (n = curbp->b_lines; n > line &&
+		    lback(lp) != curbp->b_headp; n--)
+			lp = lback(lp);
+	}
+	if (s_pat == NULL)
+		goto found;
+
+	plen = strlen(s_pat);
+	fp = lp;
+	fline = n;
+	bp = lback(lp);
+	bline = n - 1;
+	while (fp != curbp->b_headp || bp != curbp->b_headp) {
+		if (fp != curbp->b_headp) {
+			if (matchpat(fp, s_pat, plen)) {
+				lp = fp;
+				n = fline;
+				goto found;
+			}
+			fp = lforw(fp);
+			fline++;
+		}
+		if (bp != curbp->b_headp) {
+			if (matchpat(bp, s_pat, plen)) {
+				lp = bp;
+				n = bline;
+				goto found;
+			}
+			bp = lback(bp);
+			bline--;
 		}
 	}
 	return (FALSE);
+found:
+	curwp->w_doto = 0;
+	curwp->w_dotp = lp;
+	curwp->w_dotline = n;
+	return (TRUE);
+}
+
+/*
+ * Does line lp start with the pattern?
+ */
+int
+matchpat(struct line *lp, const char *s_pat, size_t plen)
+{
+	return (ltext(lp) != NULL && (int)plen <= llength(lp) &&
+	    strncmp(s_pat, ltext(lp), plen) == 0);
 }
 
 /*
@@ -475,20 +840,54 @@ cleanup:
 }
 
 /*
- * Search tagstree for a given token.
+ * Search the tags files for a given token, in the order they were
+ * loaded.  The caller frees t->tag.
  */
-struct ctag *
-searchtag(char *tok)
+int
+searchtag(char *tok, struct ctag *t)
 {
-	struct ctag t, *res;
+	struct tagfile *tf;
+	const char *p, *end, *base;
 
-	t.tag = tok;
-	if ((res = RB_FIND(tagtree, &tags, &t)) == NULL) {
-		dobeep();
-		ewprintf("No tag containing %s", tok);
-		return (NULL);
+	t->tag = t->fname = t->pat = NULL;
+	t->line = 0;
+	SLIST_FOREACH(tf, &tfhead, tf_entry) {
+		if (tagfresh(tf) == FALSE)
+			return (FALSE);
+		if ((p = taglookup(tf, tok)) == NULL)
+			continue;
+		end = tf->tf_map + tf->tf_len;
+		if ((end = memchr(p, '\n', end - p)) == NULL)
+			end = tf->tf_map + tf->tf_len;
+		if (parsetag(p, end - p, t) == FALSE)
+			return (FALSE);
+		/*
+		 * Names in the index are relative to the project root;
+		 * those in other tags files are used as they are.
+		 */
+		base = strrchr(tf->tf_name, '/');
+		if (t->fname[0] != '/' && base != NULL &&
+		    strcmp(base + 1, CIDXFN) == 0) {
+			if (xdirname(t->path, tf->tf_name, sizeof(t->path)) >=
+			    sizeof(t->path) ||
+			    strlcat(t->path, "/", sizeof(t->path)) >=
+			    sizeof(t->path) ||
+			    strlcat(t->path, t->fname, sizeof(t->path)) >=
+			    sizeof(t->path)) {
+				free(t->tag);
+				return (dobeep_msgs("Path too long:",
+				    t->fname));
+			}
+		} else if (strlcpy(t->path, t->fname, sizeof(t->path)) >=
+		    sizeof(t->path)) {
+			free(t->tag);
+			return (dobeep_msgs("Path too long:", t->fname));
+		}
+		return (TRUE);
 	}
-	return res;
+	dobeep();
+	ewprintf("No tag containing %s", tok);
+	return (FALSE);
 }
 
 /*
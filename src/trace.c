@@ -0,0 +1,279 @@
+/* This file is in the public domain. */
+
+/*
+ * Command trace.
+ *
+ * Every command read from the keyboard leaves a fixed size record in a
+ * ring held in memory: which command ran, the keys that invoked it, how
+ * long it took and how much it changed the buffer and the undo list.
+ * Nothing is formatted or written while editing.  The ring is written
+ * out by trace-dump, or by a fatal signal, and read back by mgtrace(1).
+ */
+
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "def.h"
+#include "funmap.h"
+#include "key.h"
+#include "macro.h"
+#include "pathnames.h"
+#include "trace.h"
+
+#define NTRACE		4096		/* Records kept, a power of 2	*/
+#define NTRACEFN	512		/* Function slots, a power of 2	*/
+#define TRACEFNHASH(f)	((((unsigned long)(f)) >> 4) & (NTRACEFN - 1))
+
+static int	 traceid(PF);
+static int	 tracewrite(int, int);
+static int	 writeall(int, const void *, size_t);
+static void	 tracefatal(int);
+
+static struct trace_rec	 ring[NTRACE];
+static uint32_t		 seq;
+static struct timespec	 start;
+static int64_t		 startwall;
+static char		 tracedir[NFILEN];
+static char		 tracepath[NFILEN];
+
+/*
+ * Functions are numbered in the order they are first run, and their
+ * names are copied then, so writing the trace needs no lookups.
+ */
+static PF		 tracefns[NTRACEFN / 2];
+static char		 tracenames[NTRACEFN / 2][TRACE_NAMELEN];
+static int		 ntracefns;
+static uint16_t		 fnslot[NTRACEFN];	/* Index + 1, 0 if free	*/
+
+static const int	 fatalsigs[] = { SIGABRT, SIGBUS, SIGFPE, SIGILL,
+			     SIGSEGV };
+
+void
+traceinit(void)
+{
+	struct sigaction	 sa;
+	size_t			 i;
+	char			*dir;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &start);
+	startwall = time(NULL);
+	/* Kept in the user's own directory, not a shared one like /tmp. */
+	if ((dir = expandtilde(_PATH_MG_DIR)) != NULL) {
+		(void)strlcpy(tracedir, dir, sizeof(tracedir));
+		if (snprintf(tracepath, sizeof(tracepath), _PATH_MG_TRACE,
+		    tracedir, (long)getpid()) >= (int)sizeof(tracepath))
+			tracepath[0] = '\0';
+		free(dir);
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = tracefatal;
+	sa.sa_flags = SA_RESETHAND;
+	(void)sigemptyset(&sa.sa_mask);
+	for (i = 0; i < sizeof(fatalsigs) / sizeof(fatalsigs[0]); i++)
+		(void)sigaction(fatalsigs[i], &sa, NULL);
+}
+
+/*
+ * Run a command on behalf of the keyboard and record it.
+ */
+int
+tracecmd(PF funct, int f, int n)
+{
+	struct trace_rec	*tr;
+	struct timespec		 t0, t1;
+	struct buffer		*bp = curbp;
+	unsigned int		 undos;
+	int64_t			 usec;
+	int			 lines, s;
+
+	lines = bp->b_lines;
+	undos = undo_count();
+	(void)clock_gettime(CLOCK_MONOTONIC, &t0);
+	s = mgwrap(funct, f, n);
+	(void)clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	tr = &ring[seq++ & (NTRACE - 1)];
+	tr->tr_time = (t0.tv_sec - start.tv_sec) * 1000000000LL +
+	    (t0.tv_nsec - start.tv_nsec);
+	usec = (t1.tv_sec - t0.tv_sec) * 1000000LL +
+	    (t1.tv_nsec - t0.tv_nsec) / 1000;
+	tr->tr_usec = usec > UINT32_MAX ? UINT32_MAX : usec;
+	tr->tr_undo = undo_count() - undos;
+	tr->tr_func = traceid(funct);
+	tr->tr_keys[0] = key.k_chars[0];
+	tr->tr_keys[1] = key.k_chars[key.k_count - 1];
+	tr->tr_nkeys = key.k_count;
+	tr->tr_status = s;
+	tr->tr_flags = macrodef ? TRF_MACRO : 0;
+	/* The buffer may be gone; only look at it if it is still current. */
+	if (curbp == bp)
+		tr->tr_lines = curbp->b_lines - lines;
+	else {
+		tr->tr_lines = 0;
+		tr->tr_flags |= TRF_SWITCH;
+	}
+	return (s);
+}
+
+/*
+ * Write the trace to a file.
+ */
+int
+tracedump(int f, int n)
+{
+	struct stat	 sb;
+	char		 fname[NFILEN], tmp[NFILEN + 25], *adjfname, *bufp;
+	int		 fd, s;
+
+	(void)strlcpy(fname, tracepath, sizeof(fname));
+	if ((bufp = eread("Write trace to: ", fname, NFILEN,
+	    EFDEF | EFNEW | EFCR | EFFILE)) == NULL)
+		return (ABORT);
+	else if (bufp[0] == '\0')
+		return (FALSE);
+	/* Not adjustname(), which would resolve a link in the file's place. */
+	if ((adjfname = expandtilde(fname)) == NULL)
+		return (FALSE);
+
+	if (strcmp(adjfname, tracepath) == 0)
+		(void)mkdir(tracedir, 0700);
+	if (lstat(adjfname, &sb) == 0) {
+		(void)snprintf(tmp, sizeof(tmp), "File `%s' exists; overwrite",
+		    adjfname);
+		if ((s = eyorn(tmp)) != TRUE) {
+			free(adjfname);
+			return (s);
+		}
+		(void)unlink(adjfname);
+	}
+	if ((fd = open(adjfname, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW,
+	    0600)) == -1 || tracewrite(fd, 0) == -1) {
+		dobeep();
+		ewprintf("Cannot write %s: %s", adjfname, strerror(errno));
+		if (fd != -1)
+			(void)close(fd);
+		free(adjfname);
+		return (FALSE);
+	}
+	(void)close(fd);
+	ewprintf("Wrote %d trace record%s to %s", (int)(seq < NTRACE ?
+	    seq : NTRACE), seq == 1 ? "" : "s", adjfname);
+	free(adjfname);
+	return (TRUE);
+}
+
+/*
+ * Look up, or hand out, the index of a function.  Past half the slots
+ * new functions share TRACE_NOFUNC, which keeps the probes short.
+ */
+static int
+traceid(PF funct)
+{
+	const char	*fn;
+	unsigned int	 h;
+
+	for (h = TRACEFNHASH(funct); fnslot[h] != 0;
+	    h = (h + 1) & (NTRACEFN - 1))
+		if (tracefns[fnslot[h] - 1] == funct)
+			return (fnslot[h] - 1);
+	if (ntracefns == NTRACEFN / 2)
+		return (TRACE_NOFUNC);
+	if ((fn = function_name(funct)) == NULL)
+		fn = "?";
+	(void)strncpy(tracenames[ntracefns], fn, TRACE_NAMELEN - 1);
+	tracefns[ntracefns++] = funct;
+	fnslot[h] = ntracefns;
+	return (ntracefns - 1);
+}
+
+/*
+ * Write the header, the function names and the ring, oldest record
+ * first.  This also runs from tracefatal(), so it only reads the
+ * tables here and makes async-signal-safe calls.
+ */
+static int
+tracewrite(int fd, int signo)
+{
+	struct trace_hdr	 th;
+	uint32_t		 first, nrecs;
+
+	nrecs = seq < NTRACE ? seq : NTRACE;
+	first = seq & (NTRACE - 1);
+
+	memset(&th, 0, sizeof(th));
+	memcpy(th.th_magic, TRACE_MAGIC, sizeof(th.th_magic));
+	th.th_nrecs = nrecs;
+	th.th_nfuncs = ntracefns;
+	th.th_seq = seq;
+	th.th_signo = signo;
+	th.th_start = startwall;
+	if (writeall(fd, &th, sizeof(th)) == -1)
+		return (-1);
+
+	if (writeall(fd, tracenames, ntracefns * sizeof(tracenames[0])) == -1)
+		return (-1);
+	if (nrecs == NTRACE && writeall(fd, &ring[first],
+	    (NTRACE - first) * sizeof(ring[0])) == -1)
+		return (-1);
+	if (writeall(fd, ring, (nrecs == NTRACE ? first : nrecs) *
+	    sizeof(ring[0])) == -1)
+		return (-1);
+	return (0);
+}
+
+static int
+writeall(int fd, const void *buf, size_t len)
+{
+	const char	*p = buf;
+	ssize_t		 w;
+
+	while (len > 0) {
+		if ((w = write(fd, p, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		p += w;
+		len -= w;
+	}
+	return (0);
+}
+
+/*
+ * Save the trace on the way down.  The handler is reset on entry, so
+ * returning, or the raise(), ends in the default action.
+ */
+static void
+tracefatal(int signo)
+{
+	static const char	 msg[] = "mg: trace written to ";
+	int			 fd, save_errno = errno;
+
+	if (tracepath[0] == '\0') {
+		(void)raise(signo);
+		return;
+	}
+	(void)mkdir(tracedir, 0700);
+	(void)unlink(tracepath);
+	if ((fd = open(tracepath, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW,
+	    0600)) != -1) {
+		if (tracewrite(fd, signo) == 0) {
+			(void)write(STDERR_FILENO, msg, sizeof(msg) - 1);
+			(void)write(STDERR_FILENO, tracepath,
+			    strlen(tracepath));
+			(void)write(STDERR_FILENO, "\n", 1);
+		}
+		(void)close(fd);
+	}
+	errno = save_errno;
+	(void)raise(signo);
+}
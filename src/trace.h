@@ -0,0 +1,42 @@
+/* This file is in the public domain. */
+
+/*
+ * Command trace file format, shared by mg and mgtrace(1).
+ *
+ * A trace file is a struct trace_hdr, then th_nfuncs command names of
+ * TRACE_NAMELEN bytes each, then th_nrecs records, oldest first.  All
+ * fields are in the byte order of the machine that wrote the file.
+ */
+#include <stdint.h>
+
+#define TRACE_MAGIC	"MGTRACE1"
+#define TRACE_NAMELEN	32		/* Names are NUL padded		*/
+#define TRACE_NOFUNC	0xffff		/* Function without a name slot	*/
+
+struct trace_hdr {
+	char		 th_magic[8];
+	uint32_t	 th_nrecs;	/* Records in the file		*/
+	uint32_t	 th_nfuncs;	/* Names in the file		*/
+	uint32_t	 th_seq;	/* Records made since start	*/
+	int32_t		 th_signo;	/* Fatal signal, 0 on demand	*/
+	int64_t		 th_start;	/* Wall clock time at start	*/
+};
+
+/*
+ * One record per command read from the keyboard.
+ */
+struct trace_rec {
+	uint64_t	 tr_time;	/* Start, ns since th_start	*/
+	uint32_t	 tr_usec;	/* Time spent in the command	*/
+	int32_t		 tr_lines;	/* Change in the buffer's lines	*/
+	int32_t		 tr_undo;	/* Undo records added		*/
+	uint16_t	 tr_func;	/* Index of the command name	*/
+	uint16_t	 tr_keys[2];	/* First and last key		*/
+	uint8_t		 tr_nkeys;	/* Length of the key sequence	*/
+	int8_t		 tr_status;	/* TRUE, FALSE or ABORT		*/
+	uint8_t		 tr_flags;
+	uint8_t		 tr_pad[3];
+};
+
+#define TRF_SWITCH	0x01		/* Ended in another buffer	*/
+#define TRF_MACRO	0x02		/* Defining a keyboard macro	*/
@@ -27,6 +27,7 @@
 #include "def.h"
 
 #define NOBUF	512			/* Output buffer size. */
+#define NWATCH	4			/* Descriptors ttidle() watches. */
 
 int	ttstarted;
 char	obuf[NOBUF];			/* Output buffer. */
@@ -36,6 +37,12 @@ struct	termios	newtty;
 int	nrow;				/* Terminal size, rows. */
 int	ncol;				/* Terminal size, columns. */
 
+static struct {
+	int	  fd;
+	void	(*fn)(int);
+} watch[NWATCH];			/* See ttwatch(). */
+static int	nwatch;
+
 /*
  * This function gets called once, to set up the terminal.
  * On systems w/o TCSASOFT we turn off off flow control,
@@ -139,8 +146,12 @@ ttflush(void)
 	ssize_t	 written;
 	char	*buf = obuf;
 
-	if (nobuf == 0 || batch == 1)
+	if (nobuf == 0)
+		return;
+	if (batch == 1) {		/* nobody is looking */
+		nobuf = 0;
 		return;
+	}
 
 	while ((written = write(fileno(stdout), buf, nobuf)) != (ssize_t)nobuf) {
 		if (written == -1) {
@@ -225,3 +236,77 @@ ttwait(int msec)
 		return (TRUE);
 	return (FALSE);
 }
+
+/*
+ * Have fn(fd) called whenever fd becomes readable while the editor is
+ * idle, waiting for a key at the top level.  Passing a NULL fn stops
+ * watching fd.
+ */
+int
+ttwatch(int fd, void (*fn)(int))
+{
+	int	i;
+
+	for (i = 0; i < nwatch; i++)
+		if (watch[i].fd == fd)
+			break;
+	if (fn == NULL) {
+		if (i < nwatch)
+			watch[i] = watch[--nwatch];
+		return (TRUE);
+	}
+	if (i == NWATCH)
+		return (FALSE);
+	watch[i].fd = fd;
+	watch[i].fn = fn;
+	if (i == nwatch)
+		nwatch++;
+	return (TRUE);
+}
+
+/*
+ * Wait for a key or a watched descriptor.  Returns TRUE after calling
+ * the functions of any descriptors that became readable, so the caller
+ * can redisplay and wait again, and FALSE once a key is ready or if
+ * nothing is watched.
+ */
+int
+ttidle(void)
+{
+	struct pollfd	  pfd[NWATCH + 1];
+	void		(*fn[NWATCH])(int);
+	int		  i, n, s = FALSE;
+
+	if (nwatch == 0)
+		return (FALSE);
+	pfd[0].fd = STDIN_FILENO;
+	pfd[0].events = POLLIN;
+	for (i = 0; i < nwatch; i++) {
+		pfd[i + 1].fd = watch[i].fd;
+		pfd[i + 1].events = POLLIN;
+		fn[i] = watch[i].fn;	/* in case a function changes watch */
+	}
+	n = nwatch;
+	while (poll(pfd, n + 1, -1) == -1) {
+		if (errno != EINTR)
+			return (FALSE);
+		if (winch_flag) {
+			redraw(0, 0);
+			winch_flag = 0;
+		}
+	}
+	if (pfd[0].revents != 0)
+		return (FALSE);
+	for (i = 1; i <= n; i++) {
+		/* A closed pipe shows only POLLHUP; reading finds the EOF. */
+		if (pfd[i].revents & (POLLIN | POLLHUP)) {
+			(*fn[i - 1])(pfd[i].fd);
+			s = TRUE;
+		} else if (pfd[i].revents & (POLLERR | POLLNVAL)) {
+			/* Don't spin on a descriptor nobody can read. */
+			(void)ttwatch(pfd[i].fd, NULL);
+			s = TRUE;
+		}
+	}
+	return (s);
+}
@@ -20,6 +20,7 @@ static struct undoq		 undo_free;
 static int			 undo_free_num;
 static int			 boundary_flag = TRUE;
 static int			 undo_enable_flag = TRUE;
+static unsigned int		 undo_made;
 
 /*
  * Local functions
@@ -28,6 +29,7 @@ static int find_dot(struct line *, int);
 static int find_lo(int, struct line **, int *, int *);
 static struct undo_rec *new_undo_record(void);
 static int drop_oldest_undo_record(void);
+static struct buffer *undobuf(void);
 
 /*
  * find_dot, find_lo()
@@ -55,6 +57,8 @@ find_dot(struct line *lp, int off)
 		count += llength(p) + 1;
 	}
 	count += off;
+	if (curbp->b_narrow != NULL)
+		count += curbp->b_narrow->n_pos;
 
 	return (count);
 }
@@ -65,6 +69,11 @@ find_lo(int pos, struct line **olp, int *offset, int *lnum)
 	struct line *p;
 	int lineno;
 
+	if (curbp->b_narrow != NULL && (pos -= curbp->b_narrow->n_pos) < 1) {
+		*olp = NULL;
+		*offset = 0;
+		return (FALSE);
+	}
 	p = curbp->b_headp;
 	lineno = 0;
 	while (pos > llength(p)) {
@@ -98,6 +107,7 @@ new_undo_record(void)
 			panic("Out of memory in undo code (record)");
 	}
 	memset(rec, 0, sizeof(struct undo_rec));
+	undo_made++;
 
 	return (rec);
 }
@@ -125,6 +135,16 @@ free_undo_record(struct undo_rec *rec)
 	TAILQ_INSERT_HEAD(&undo_free, rec, next);
 }
 
+/*
+ * An indirect buffer records its changes in the undo list of the
+ * buffer whose text it shows, where the positions mean the same.
+ */
+static struct buffer *
+undobuf(void)
+{
+	return (curbp->b_base != NULL ? curbp->b_base : curbp);
+}
+
 /*
  * Drop the oldest undo record in our list. Return 1 if we could remove it,
  * 0 if the undo list was empty.
@@ -134,10 +154,10 @@ drop_oldest_undo_record(void)
 {
 	struct undo_rec *rec;
 
-	rec = TAILQ_LAST(&curbp->b_undo, undoq);
+	rec = TAILQ_LAST(&undobuf()->b_undo, undoq);
 	if (rec != NULL) {
 		undo_free_num--;
-		TAILQ_REMOVE(&curbp->b_undo, rec, next);
+		TAILQ_REMOVE(&undobuf()->b_undo, rec, next);
 		free_undo_record(rec);
 		return (1);
 	}
@@ -149,11 +169,20 @@ lastrectype(void)
 {
 	struct undo_rec *rec;
 
-	if ((rec = TAILQ_FIRST(&curbp->b_undo)) != NULL)
+	if ((rec = TAILQ_FIRST(&undobuf()->b_undo)) != NULL)
 		return (rec->type);
 	return (0);
 }
 
+/*
+ * Returns the number of undo records made so far, in any buffer.
+ */
+unsigned int
+undo_count(void)
+{
+	return (undo_made);
+}
+
 /*
  * Returns TRUE if undo is enabled, FALSE otherwise.
  */
@@ -232,7 +261,7 @@ undo_add_boundary(int f, int n)
 	rec = new_undo_record();
 	rec->type = BOUNDARY;
 
-	TAILQ_INSERT_HEAD(&curbp->b_undo, rec, next);
+	TAILQ_INSERT_HEAD(&undobuf()->b_undo, rec, next);
 
 	return (TRUE);
 }
@@ -245,16 +274,16 @@ undo_add_modified(void)
 {
 	struct undo_rec *rec, *trec;
 
-	TAILQ_FOREACH_SAFE(rec, &curbp->b_undo, next, trec)
+	TAILQ_FOREACH_SAFE(rec, &undobuf()->b_undo, next, trec)
 		if (rec->type == MODIFIED) {
-			TAILQ_REMOVE(&curbp->b_undo, rec, next);
+			TAILQ_REMOVE(&undobuf()->b_undo, rec, next);
 			free_undo_record(rec);
 		}
 
 	rec = new_undo_record();
 	rec->type = MODIFIED;
 
-	TAILQ_INSERT_HEAD(&curbp->b_undo, rec, next);
+	TAILQ_INSERT_HEAD(&undobuf()->b_undo, rec, next);
 
 	return;
 }
@@ -279,7 +308,7 @@ undo_add_insert(struct line *lp, int offset, int size)
 	/*
 	 * We try to reuse the last undo record to `compress' things.
 	 */
-	rec = TAILQ_FIRST(&curbp->b_undo);
+	rec = TAILQ_FIRST(&undobuf()->b_undo);
 	if (rec != NULL && rec->type == INSERT) {
 		if (rec->pos + rec->region.r_size == pos) {
 			rec->region.r_size += reg.r_size;
@@ -298,7 +327,7 @@ undo_add_insert(struct line *lp, int offset, int size)
 
 	undo_add_boundary(FFRAND, 1);
 
-	TAILQ_INSERT_HEAD(&curbp->b_undo, rec, next);
+	TAILQ_INSERT_HEAD(&undobuf()->b_undo, rec, next);
 
 	return (TRUE);
 }
@@ -325,7 +354,7 @@ undo_add_delete(struct line *lp, int offset, int size, int isreg)
 
 	if (offset == llength(lp))	/* if it's a newline... */
 		undo_add_boundary(FFRAND, 1);
-	else if ((rec = TAILQ_FIRST(&curbp->b_undo)) != NULL) {
+	else if ((rec = TAILQ_FIRST(&undobuf()->b_undo)) != NULL) {
 		/*
 		 * Separate this command from the previous one if we're not
 		 * just before the previous record...
@@ -354,7 +383,7 @@ undo_add_delete(struct line *lp, int offset, int size, int isreg)
 	if (isreg || lastrectype() != DELETE)
 		undo_add_boundary(FFRAND, 1);
 
-	TAILQ_INSERT_HEAD(&curbp->b_undo, rec, next);
+	TAILQ_INSERT_HEAD(&undobuf()->b_undo, rec, next);
 
 	return (TRUE);
 }
@@ -377,6 +406,37 @@ undo_add_change(struct line *lp, int offset, int size)
 	return (TRUE);
 }
 
+/*
+ * Record that lines starting at "lp" were reordered; "perm" is passed
+ * to lpermute() to put them back.
+ */
+int
+undo_add_permute(struct line *lp, int n, const int *perm)
+{
+	struct undo_rec	*rec;
+
+	if (!undo_enable_flag)
+		return (TRUE);
+
+	rec = new_undo_record();
+	rec->pos = find_dot(lp, 0);
+	rec->type = PERMUTE;
+	rec->region.r_size = n;
+	do {
+		rec->content = reallocarray(NULL, n, sizeof(*perm));
+	} while ((rec->content == NULL) && drop_oldest_undo_record());
+
+	if (rec->content == NULL)
+		panic("Out of memory");
+	memcpy(rec->content, perm, n * sizeof(*perm));
+
+	undo_add_boundary(FFRAND, 1);
+
+	TAILQ_INSERT_HEAD(&undobuf()->b_undo, rec, next);
+
+	return (TRUE);
+}
+
 /*
  * Show the undo records for the current buffer in a new buffer.
  */
@@ -407,7 +467,7 @@ undo_dump(int f, int n)
 	}
 
 	num = 0;
-	TAILQ_FOREACH(rec, &curbp->b_undo, next) {
+	TAILQ_FOREACH(rec, &undobuf()->b_undo, next) {
 		num++;
 		snprintf(buf, sizeof(buf),
 		    "%d:\t %s at %d ", num,
@@ -415,10 +475,11 @@ undo_dump(int f, int n)
 		    (rec->type == DELREG) ? "DELREGION":
 		    (rec->type == INSERT) ? "INSERT":
 		    (rec->type == BOUNDARY) ? "----" :
-		    (rec->type == MODIFIED) ? "MODIFIED": "UNKNOWN",
+		    (rec->type == MODIFIED) ? "MODIFIED":
+		    (rec->type == PERMUTE) ? "PERMUTE": "UNKNOWN",
 		    rec->pos);
 
-		if (rec->content) {
+		if (rec->content && rec->type != PERMUTE) {
 			(void)strlcat(buf, "\"", sizeof(buf));
 			snprintf(tmp, sizeof(tmp), "%.*s", rec->region.r_size,
 			    rec->content);
@@ -485,16 +546,16 @@ undo(int f, int n)
 	struct line	*lp;
 	int		 offset, save;
 	static int	 nulled = FALSE;
-	int		 lineno;
+	int		 lineno = 0;
 
 	if (n < 0)
 		return (FALSE);
 
-	ptr = curbp->b_undoptr;
+	ptr = undobuf()->b_undoptr;
 
 	/* first invocation, make ptr point back to the top of the list */
 	if ((ptr == NULL && nulled == TRUE) ||  rptcount == 0) {
-		ptr = TAILQ_FIRST(&curbp->b_undo);
+		ptr = TAILQ_FIRST(&undobuf()->b_undo);
 		nulled = TRUE;
 	}
 
@@ -503,7 +564,7 @@ undo(int f, int n)
 		/* if we have a spurious boundary, free it and move on.... */
 		while (ptr && ptr->type == BOUNDARY) {
 			nptr = TAILQ_NEXT(ptr, next);
-			TAILQ_REMOVE(&curbp->b_undo, ptr, next);
+			TAILQ_REMOVE(&undobuf()->b_undo, ptr, next);
 			free_undo_record(ptr);
 			ptr = nptr;
 		}
@@ -544,7 +605,10 @@ undo(int f, int n)
 				if (find_lo(ptr->pos, &lp,
 				    &offset, &lineno) == FALSE) {
 					dobeep();
-					ewprintf("Internal error in Undo!");
+					ewprintf(curbp->b_narrow != NULL ?
+					    "Changes to be undone are outside "
+					    "the narrowed region" :
+					    "Internal error in Undo!");
 					rval = FALSE;
 					break;
 				}
@@ -573,11 +637,15 @@ undo(int f, int n)
 				region_put_data(ptr->content,
 				    ptr->region.r_size);
 				break;
+			case PERMUTE:
+				lpermute(curwp->w_dotp, lineno,
+				    ptr->region.r_size, (int *)ptr->content);
+				break;
 			case BOUNDARY:
 				done = 1;
 				break;
 			case MODIFIED:
-				curbp->b_flag &= ~BFCHG;
+				bunchanged(curbp);
 				break;
 			default:
 				break;
@@ -593,7 +661,7 @@ undo(int f, int n)
 		ewprintf("Undo!");
 	}
 
-	curbp->b_undoptr = ptr;
+	undobuf()->b_undoptr = ptr;
 
 	return (rval);
 }
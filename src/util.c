@@ -12,9 +12,12 @@
 #include <ctype.h>
 #include <signal.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "def.h"
 
+static int	lt_cleanwhite(char *, const struct line *, int, int, void *);
+
 /*
  * Compute next tab stop, with `col' being the a column number and
  * `tabw' the tab width.
@@ -340,6 +343,110 @@ deltrailwhite(int f, int n)
 	return (TRUE);
 }
 
+/*
+ * Clean up whitespace in the whole buffer: delete trailing whitespace,
+ * redo each line's indentation with tabs or spaces to suit no-tab-mode,
+ * and leave exactly one newline at the end of the buffer.  Lines that
+ * are already clean are left alone, and the lot is undone as one.
+ */
+int
+cleanwhite(int f, int n)
+{
+	struct region	 region;
+	struct line	*lp, *odotp;
+	int		 odoto, odotline, nlines, k, s;
+
+	if ((s = checkdirty(curbp)) != TRUE)
+		return (s);
+	if (curbp->b_flag & BFREADONLY) {
+		dobeep();
+		ewprintf("Buffer is read only");
+		return (FALSE);
+	}
+	if (bfirstlp(curbp) == curbp->b_headp)
+		return (TRUE);
+
+	region.r_linep = bfirstlp(curbp);
+	region.r_offset = 0;
+	region.r_lineno = 1;
+	region.r_size = -1;
+	nlines = 0;
+	for (lp = region.r_linep; lp != curbp->b_headp; lp = lforw(lp)) {
+		region.r_size += llength(lp) + 1;
+		nlines++;
+	}
+
+	undo_boundary_enable(FFRAND, 0);
+	if ((s = ltransform(&region, curbp->b_tabw, lt_cleanwhite,
+	    curbp)) != TRUE)
+		goto out;
+
+	/* Past a narrowing short of the end, the file goes on. */
+	if (curbp->b_narrow != NULL &&
+	    curbp->b_narrow->n_after != curbp->b_narrow->n_wide)
+		goto out;
+
+	/* Count the empty lines at the end. */
+	k = 0;
+	for (lp = blastlp(curbp); lp != curbp->b_headp && llength(lp) == 0;
+	    lp = lback(lp))
+		k++;
+	if (lp == curbp->b_headp || k == 1)
+		goto out;
+
+	odotp = curwp->w_dotp;
+	odoto = curwp->w_doto;
+	odotline = curwp->w_dotline;
+	if (k == 0) {
+		curwp->w_dotp = lp;
+		curwp->w_doto = llength(lp);
+		curwp->w_dotline = nlines;
+		s = lnewline();
+	} else {
+		curwp->w_dotp = lforw(lp);
+		curwp->w_doto = 0;
+		curwp->w_dotline = nlines - k + 1;
+		if (odotline > curwp->w_dotline) {
+			odotp = curwp->w_dotp;
+			odoto = 0;
+			odotline = curwp->w_dotline;
+		}
+		s = ldelete((RSIZE)(k - 1), KNONE);
+	}
+	curwp->w_dotp = odotp;
+	curwp->w_doto = odoto;
+	curwp->w_dotline = odotline;
+	curwp->w_rflag |= WFMOVE;
+out:
+	undo_boundary_enable(FFRAND, 1);
+	return (s);
+}
+
+/*
+ * Line transform for cleanwhite().
+ */
+static int
+lt_cleanwhite(char *dst, const struct line *lp, int start, int end, void *arg)
+{
+	struct buffer	*bp = arg;
+	const char	*cp = lp->l_text;
+	int		 i, col, len;
+
+	while (end > start && (cp[end - 1] == ' ' || cp[end - 1] == '\t'))
+		end--;
+	col = 0;
+	for (i = start; i < end && (cp[i] == ' ' || cp[i] == '\t'); i++)
+		col = cp[i] == '\t' ? ntabstop(col, bp->b_tabw) : col + 1;
+	len = 0;
+	if (!(bp->b_flag & BFNOTAB))
+		for (; col >= bp->b_tabw; col -= bp->b_tabw)
+			dst[len++] = '\t';
+	for (; col > 0; col--)
+		dst[len++] = ' ';
+	memcpy(&dst[len], &cp[i], end - i);
+	return (len + end - i);
+}
+
 /*
  * Raw indent routine.  Use spaces and tabs to fill the given number of
  * cols, but respect no-tab-mode.
@@ -16,9 +16,11 @@
 
 #include "def.h"
 
-RSIZE	countfword(void);
 int	grabword(char **);
 
+static int	caseword(int, LTF);
+static int	lt_capword(char *, const struct line *, int, int, void *);
+
 /*
  * Move the cursor backward by "n" words. All of the details of motion are
  * performed by the "backchar" and "forwchar" routines.
@@ -227,39 +229,7 @@ grabword(char **word)
 int
 upperword(int f, int n)
 {
-	int	c, s;
-	RSIZE	size;
-
-	if ((s = checkdirty(curbp)) != TRUE)
-		return (s);
-	if (curbp->b_flag & BFREADONLY) {
-		dobeep();
-		ewprintf("Buffer is read-only");
-		return (FALSE);
-	}
-
-	if (n < 0)
-		return (FALSE);
-	while (n--) {
-		while (inword() == FALSE) {
-			if (forwchar(FFRAND, 1) == FALSE)
-				return (TRUE);
-		}
-		size = countfword();
-		undo_add_change(curwp->w_dotp, curwp->w_doto, size);
-
-		while (inword() != FALSE) {
-			c = lgetc(curwp->w_dotp, curwp->w_doto);
-			if (ISLOWER(c) != FALSE) {
-				c = TOUPPER(c);
-				lputc(curwp->w_dotp, curwp->w_doto, c);
-				lchange(WFFULL);
-			}
-			if (forwchar(FFRAND, 1) == FALSE)
-				return (TRUE);
-		}
-	}
-	return (TRUE);
+	return (caseword(n, lt_upcase));
 }
 
 /*
@@ -269,38 +239,7 @@ upperword(int f, int n)
 int
 lowerword(int f, int n)
 {
-	int	c, s;
-	RSIZE	size;
-
-	if ((s = checkdirty(curbp)) != TRUE)
-		return (s);
-	if (curbp->b_flag & BFREADONLY) {
-		dobeep();
-		ewprintf("Buffer is read-only");
-		return (FALSE);
-	}
-	if (n < 0)
-		return (FALSE);
-	while (n--) {
-		while (inword() == FALSE) {
-			if (forwchar(FFRAND, 1) == FALSE)
-				return (TRUE);
-		}
-		size = countfword();
-		undo_add_change(curwp->w_dotp, curwp->w_doto, size);
-
-		while (inword() != FALSE) {
-			c = lgetc(curwp->w_dotp, curwp->w_doto);
-			if (ISUPPER(c) != FALSE) {
-				c = TOLOWER(c);
-				lputc(curwp->w_dotp, curwp->w_doto, c);
-				lchange(WFFULL);
-			}
-			if (forwchar(FFRAND, 1) == FALSE)
-				return (TRUE);
-		}
-	}
-	return (TRUE);
+	return (caseword(n, lt_downcase));
 }
 
 /*
@@ -312,8 +251,19 @@ lowerword(int f, int n)
 int
 capword(int f, int n)
 {
-	int	c, s;
-	RSIZE	size;
+	return (caseword(n, lt_capword));
+}
+
+/*
+ * Common code for the word case commands.  Move over the words first,
+ * then convert everything from the start of the first word to the end
+ * of the last as one region, so the change is a single undo record.
+ */
+static int
+caseword(int n, LTF fn)
+{
+	struct region	 region;
+	int		 s;
 
 	if ((s = checkdirty(curbp)) != TRUE)
 		return (s);
@@ -325,65 +275,56 @@ capword(int f, int n)
 
 	if (n < 0)
 		return (FALSE);
+	region.r_linep = NULL;
+	region.r_size = 0;
 	while (n--) {
 		while (inword() == FALSE) {
 			if (forwchar(FFRAND, 1) == FALSE)
-				return (TRUE);
+				goto out;
+			if (region.r_linep != NULL)
+				region.r_size++;
 		}
-		size = countfword();
-		undo_add_change(curwp->w_dotp, curwp->w_doto, size);
-
-		if (inword() != FALSE) {
-			c = lgetc(curwp->w_dotp, curwp->w_doto);
-			if (ISLOWER(c) != FALSE) {
-				c = TOUPPER(c);
-				lputc(curwp->w_dotp, curwp->w_doto, c);
-				lchange(WFFULL);
-			}
+		if (region.r_linep == NULL) {
+			region.r_linep = curwp->w_dotp;
+			region.r_offset = curwp->w_doto;
+			region.r_lineno = curwp->w_dotline;
+		}
+		while (inword() != FALSE) {
+			region.r_size++;
 			if (forwchar(FFRAND, 1) == FALSE)
-				return (TRUE);
-			while (inword() != FALSE) {
-				c = lgetc(curwp->w_dotp, curwp->w_doto);
-				if (ISUPPER(c) != FALSE) {
-					c = TOLOWER(c);
-					lputc(curwp->w_dotp, curwp->w_doto, c);
-					lchange(WFFULL);
-				}
-				if (forwchar(FFRAND, 1) == FALSE)
-					return (TRUE);
-			}
+				goto out;
 		}
 	}
-	return (TRUE);
+out:
+	if (region.r_linep == NULL)
+		return (TRUE);
+	return (ltransform(&region, 1, fn, &region));
 }
 
 /*
- * Count characters in word, from current position
+ * Line transform for capword().  A word starts where the region does,
+ * at the beginning of a line, or after a non-word character.
  */
-RSIZE
-countfword()
+static int
+lt_capword(char *dst, const struct line *lp, int start, int end, void *arg)
 {
-	RSIZE		 size;
-	struct line	*dotp;
-	int		 doto;
-
-	dotp = curwp->w_dotp;
-	doto = curwp->w_doto;
-	size = 0;
-
-	while (inword() != FALSE) {
-		if (forwchar(FFRAND, 1) == FALSE)
-			/* hit the end of the buffer */
-			goto out;
-		++size;
+	struct region	*rp = arg;
+	const char	*cp = lp->l_text;
+	int		 i, c, first;
+
+	for (i = start; i < end; i++) {
+		c = CHARMASK(cp[i]);
+		first = (lp == rp->r_linep && i == rp->r_offset) || i == 0 ||
+		    !ISWORD(cp[i - 1]);
+		if (first && ISLOWER(c))
+			c = TOUPPER(c);
+		else if (!first && ISUPPER(c))
+			c = TOLOWER(c);
+		*dst++ = c;
 	}
-out:
-	curwp->w_dotp = dotp;
-	curwp->w_doto = doto;
-	return (size);
+	return (end - start);
 }
 
-
 /*
  * Kill forward by "n" words.
  */
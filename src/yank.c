@@ -6,6 +6,7 @@
  *	kill ring functions
  */
 
+#include <limits.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -20,7 +21,7 @@ static RSIZE	 kused = 0;	/* # of bytes used in KB.	 */
 static RSIZE	 ksize = 0;	/* # of bytes allocated in KB.	 */
 static RSIZE	 kstart = 0;	/* # of first used byte in KB.	 */
 
-static int	 kgrow(int);
+static int	 kgrow(int, RSIZE);
 
 /*
  * Delete all of the text saved in the kill buffer.  Called by commands when
@@ -50,9 +51,9 @@ kinsert(int c, int dir)
 {
 	if (dir == KNONE)
 		return (TRUE);
-	if (kused == ksize && dir == KFORW && kgrow(dir) == FALSE)
+	if (kused == ksize && dir == KFORW && kgrow(dir, 1) == FALSE)
 		return (FALSE);
-	if (kstart == 0 && dir == KBACK && kgrow(dir) == FALSE)
+	if (kstart == 0 && dir == KBACK && kgrow(dir, 1) == FALSE)
 		return (FALSE);
 	if (dir == KFORW)
 		kbufp[kused++] = c;
@@ -64,31 +65,35 @@ kinsert(int c, int dir)
 }
 
 /*
- * kgrow - just get more kill buffer for the callee. If dir = KBACK
- * we are trying to get space at the beginning of the kill buffer.
+ * kgrow - just get more kill buffer for the callee, with room for at
+ * least "need" more bytes. If dir = KBACK we are trying to get space at
+ * the beginning of the kill buffer.  The buffer at least doubles each
+ * time, so building a kill a piece at a time stays linear.
  */
 static int
-kgrow(int dir)
+kgrow(int dir, RSIZE need)
 {
-	int	 nstart;
+	RSIZE	 grow, nstart;
 	char	*nbufp;
 
-	if ((unsigned)(ksize + KBLOCK) <= (unsigned)ksize) {
-		/* probably 16 bit unsigned */
+	grow = ksize > KBLOCK ? ksize : KBLOCK;
+	if (grow - KBLOCK / 4 < need)
+		grow = need + KBLOCK / 4;
+	if (need < 0 || grow > INT_MAX - ksize) {
 		dobeep();
 		ewprintf("Kill buffer size at maximum");
 		return (FALSE);
 	}
-	if ((nbufp = malloc((unsigned)(ksize + KBLOCK))) == NULL) {
+	if ((nbufp = malloc((unsigned)(ksize + grow))) == NULL) {
 		dobeep();
-		ewprintf("Can't get %ld bytes", (long)(ksize + KBLOCK));
+		ewprintf("Can't get %ld bytes", (long)(ksize + grow));
 		return (FALSE);
 	}
-	nstart = (dir == KBACK) ? (kstart + KBLOCK) : (KBLOCK / 4);
+	nstart = (dir == KBACK) ? (kstart + grow) : (KBLOCK / 4);
 	bcopy(&(kbufp[kstart]), &(nbufp[nstart]), (int)(kused - kstart));
 	free(kbufp);
 	kbufp = nbufp;
-	ksize += KBLOCK;
+	ksize += grow;
 	kused = kused - kstart + nstart;
 	kstart = nstart;
 	return (TRUE);
@@ -122,15 +127,13 @@ kchunk(char *cp1, RSIZE chunk, int kflag)
 		kflag = KFORW;
 
 	if (kflag & KFORW) {
-		while (ksize - kused < chunk)
-			if (kgrow(kflag) == FALSE)
-				return (FALSE);
+		if (ksize - kused < chunk && kgrow(KFORW, chunk) == FALSE)
+			return (FALSE);
 		bcopy(cp1, &(kbufp[kused]), (int)chunk);
 		kused += chunk;
 	} else if (kflag & KBACK) {
-		while (kstart < chunk)
-			if (kgrow(kflag) == FALSE)
-				return (FALSE);
+		if (kstart < chunk && kgrow(KBACK, chunk) == FALSE)
+			return (FALSE);
 		bcopy(cp1, &(kbufp[kstart - chunk]), (int)chunk);
 		kstart -= chunk;
 	}
@@ -138,6 +141,20 @@ kchunk(char *cp1, RSIZE chunk, int kflag)
 	return (TRUE);
 }
 
+/*
+ * Append the text of a region to the kill buffer, making room for all
+ * of it at once.
+ */
+int
+kregion(struct region *rp)
+{
+	if (ksize - kused <= rp->r_size &&
+	    kgrow(KFORW, rp->r_size + 1) == FALSE)
+		return (FALSE);
+	kused += region_get_data(rp, &kbufp[kused], rp->r_size);
+	return (TRUE);
+}
+
 /*
  * Kill line.  If called without an argument, it kills from dot to the end
  * of the line, unless it is at the end of the line, when it kills the
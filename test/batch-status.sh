@@ -0,0 +1,25 @@
+#!/bin/sh
+# A file is reported modified whether the script leaves the buffer
+# changed or saves it itself.
+
+MG=${MG:-../src/mg}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+
+check()
+{
+	printf '%s\n' "$1" > script
+	printf 'a\n' > file
+	status=$("$MG" -b script file 2>/dev/null | cut -f1)
+	if [ "$status" != "$2" ]; then
+		printf '%s\n' "batch-status: '$1' reported '$status', not '$2'"
+		exit 1
+	fi
+}
+
+check 'forward-char' unchanged
+check 'insert "x"' modified
+check 'insert "x"
+save-buffer' modified
+exit 0
@@ -0,0 +1,44 @@
+#!/bin/sh
+# Lines removed through one buffer sharing text with a hidden clone must
+# not leave the clone's line numbers, and the line index, out of step.
+
+MG=${MG:-../src/mg}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+
+cat > script <<EOF2
+clone-indirect-buffer
+goto-line 15
+switch-to-buffer file
+delete-other-windows
+kill-line 5
+beginning-of-buffer
+set-mark-command
+end-of-buffer
+copy-region-as-kill
+switch-to-buffer file<2>
+insert "XXXX"
+switch-to-buffer file
+goto-line 9
+set-mark-command
+goto-line 12
+kill-region
+save-buffer
+EOF2
+
+i=1
+while [ $i -le 20 ]; do
+	printf 'line%d\n' $i
+	i=$((i + 1))
+done > file
+"$MG" -b script file >/dev/null 2>&1
+for i in 6 7 8 9 10 11 12 13 17 18 19 20; do
+	printf 'line%d\n' $i
+done > expected
+if ! cmp -s file expected; then
+	printf '%s\n' "clone-lines: got:"
+	cat file
+	exit 1
+fi
+exit 0
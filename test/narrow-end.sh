@@ -0,0 +1,41 @@
+#!/bin/sh
+# whitespace-cleanup and fill-paragraph only touch the end of the file
+# when the narrowing reaches it.
+
+MG=${MG:-../src/mg}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+
+check()
+{
+	printf '%s\nwiden\nsave-buffer\n' "$1" > script
+	printf "$2" > file
+	"$MG" -b script file >/dev/null 2>&1
+	printf "$3" > expected
+	if ! cmp -s file expected; then
+		printf '%s\n' "narrow-end: from '$2' expected '$3', got:"
+		od -c file
+		exit 1
+	fi
+}
+
+middle='goto-line 2
+set-mark-command
+goto-line 4
+narrow-to-region'
+check "$middle
+whitespace-cleanup" 'a\nb\nc\nd\n' 'a\nb\nc\nd\n'
+check "$middle
+whitespace-cleanup" 'a\nb\n\n\nc\n' 'a\nb\n\n\nc\n'
+check "$middle
+beginning-of-buffer
+fill-paragraph" 'a\nb\nc\nd\n' 'a\nb c\nd\n'
+
+toend='goto-line 2
+set-mark-command
+end-of-buffer
+narrow-to-region
+whitespace-cleanup'
+check "$toend" 'a\nb\nc   ' 'a\nb\nc\n'
+exit 0
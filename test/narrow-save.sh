@@ -0,0 +1,35 @@
+#!/bin/sh
+# Saving a narrowed buffer writes the whole file, and require-final-newline
+# looks at the end of the file, not at the end of the visible lines.
+
+MG=${MG:-../src/mg}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+
+cat > script <<EOF
+require-final-newline t
+goto-line 2
+set-mark-command
+goto-line 3
+narrow-to-region
+beginning-of-buffer
+insert "X"
+save-buffer
+EOF
+
+check()
+{
+	printf "$1" > file
+	"$MG" -b script file >/dev/null 2>&1
+	printf "$2" > expected
+	if ! cmp -s file expected; then
+		printf '%s\n' "narrow-save: from '$1' expected '$2', got:"
+		od -c file
+		exit 1
+	fi
+}
+
+check 'one\ntwo\nthree\n' 'one\nXtwo\nthree\n'
+check 'one\ntwo\nthree' 'one\nXtwo\nthree\n'
+exit 0